@@ -1,5 +1,14 @@
 #include <iostream>
 #include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <sstream>
+#include <vector>
+#include <algorithm>
+#include <random>
+#include <cmath>
+#include <atomic>
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
 #define STB_IMAGE_IMPLEMENTATION
@@ -8,6 +17,31 @@
 #include <glm/gtx/transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
 #include "camera.h"
+#include "instancing.h"
+#include "culling.h"
+#include "bvh.h"
+#include "occlusion.h"
+#include "lighting.h"
+#include "deferred.h"
+#include "gputimer.h"
+#include "shadows.h"
+#include "commands.h"
+#include "parallel.h"
+#include "pacing.h"
+#include "resolution.h"
+#include "headless.h"
+#include "rasterizer.h"
+#include "pathtracer.h"
+#include "lightmap.h"
+#include "ambientocclusion.h"
+#include "probes.h"
+#include "programcache.h"
+#include "programbuilder.h"
+#include "programpipeline.h"
+#include "permutations.h"
+#include "filewatch.h"
+#include "shaderpreprocessor.h"
+#include "benchmarks.h"
 
 using namespace std;
 
@@ -16,6 +50,11 @@ using namespace std;
 #define GLSL(Version, Source) "#version " #Version " core \n" #Source
 #endif
 
+// GLSL without a #version line, for the sources that are included, and an #include between
+// two parts of a source, on a line of its own for the ShaderPreprocessor
+#define GLSL_CHUNK(Source) #Source
+#define GLSL_INCLUDE(Filename) "\n#include \"" Filename "\"\n"
+
 
 namespace
 {
@@ -25,6 +64,10 @@ namespace
     const int WINDOW_WIDTH = 800;
     const int WINDOW_HEIGHT = 600;
 
+    // size the scene is rendered at, the window size unless --size says otherwise
+    int gFrameWidth = WINDOW_WIDTH;
+    int gFrameHeight = WINDOW_HEIGHT;
+
     
     struct GLMesh
     {
@@ -42,9 +85,41 @@ namespace
     glm::vec2 gUVScale(1.0f, 1.0f);
     GLint gTexWrapMode = GL_REPEAT;
 
-    // Shader programs
-    GLuint gObjectsProgramId;
+    // Shader programs; the objects program has a variant per set of ShaderFeature bits, and it and
+    // the G-buffer program are pipelines of separate stages that share the objects vertex stage
+    ShaderPermutations gObjectsPrograms;
     GLuint gLampProgramId;
+    GLuint gGBufferProgramId;       // the fragment stage of gGBufferPipeline
+    ProgramPipeline gGBufferPipeline;
+    GLuint gDeferredLightingProgramId;
+    GLuint gShadowProgramId;
+
+    // Program binaries of earlier runs, restored instead of compiling the GLSL again
+    // (--no-program-cache to always compile)
+    ProgramCache gProgramCache;
+    bool gIsProgramCaching = true;
+    const char* const PROGRAM_CACHE_FILENAME = "programs.cache";
+
+    // The programs are built in the background while the first frames are drawn. Until the
+    // objects have theirs they are drawn unlit with the fallback program, which is built
+    // right away. The compile window only holds the context of the compile thread, for
+    // drivers that cannot compile in parallel themselves (--shader-thread to use it anyway).
+    ProgramBuilder gProgramBuilder;
+    GLFWwindow* gCompileWindow = NULL;
+    GLuint gFallbackProgramId;
+    bool gIsShaderThread = false;
+    double gProgramStart = 0.0;
+    bool gIsFirstFrameDrawn = false;
+    bool gIsStartupReported = false;
+
+    // Shader hot reload (--shader-dir <dir>): the shaders are read from files in the directory,
+    // which get the built-in source where they do not exist yet, and the programs that take in
+    // a file are rebuilt in the background when it is saved. A program that fails keeps the old one.
+    const char* gShaderDirectory = NULL;
+    FileWatcher gShaderWatcher;
+
+    // Every shader source by file name, with its #includes expanded
+    ShaderPreprocessor gShaderPreprocessor;
 
     // camera
     Camera gCamera(glm::vec3(0.0f, 0.0f, 3.0f));
@@ -55,6 +130,28 @@ namespace
     // timing
     float gDeltaTime = 0.0f;
     float gLastFrame = 0.0f;
+    float gAnimationTime = 0.0f;    // sum of the frame times, what the point lights move with
+
+    // Headless benchmark runs (--headless): a fixed number of frames rendered offscreen without
+    // a visible window, the camera following a path file, and the frame timings written as JSON
+    bool gIsHeadless = false;
+    int gHeadlessFrameCount = 300;
+    int gHeadlessFrame = 0;
+    const float HEADLESS_FRAME_STEP = 1.0f / 60.0f;     // animation time per frame, for repeatable frames
+    CameraPath gCameraPath;
+    FrameTimingLog gFrameTimingLog;
+    const char* gTimingFilename = "frame_timing.json";
+    const char* gImageFilename = nullptr;               // last frame of the run as an image (--image)
+    double gLastFrameEnd = 0.0;
+
+    // Render on demand (--on-demand): frames are only drawn after something changed,
+    // otherwise the loop sleeps in glfwWaitEventsTimeout
+    bool gIsRenderingOnDemand = false;
+    int gPendingRedraws = 2;                        // frames still to draw for the last change
+    const double ON_DEMAND_WAIT_SECONDS = 0.5;      // upper bound on a sleep, events end it earlier
+
+    // Frame rate limit, GPU queue depth and input latency (--fps, --frames-in-flight, --swap-interval)
+    FramePacer gFramePacer;
 
     // Subject position and scale
     glm::vec3 gObjectsPosition(0.0f, 0.0f, 0.0f);
@@ -70,6 +167,225 @@ namespace
 
     // Lamp animation
     bool gIsLampOrbiting = false;
+
+    // Lighting parameters selected per instance by material id
+    struct GLMaterial
+    {
+        float ambientStrength;
+        float specularIntensity;
+        float highlightSize;
+    };
+
+    const GLMaterial gMaterials[] = {
+        { 0.5f, 0.8f, 16.0f },  // default
+        { 0.5f, 0.2f, 4.0f },   // matte
+        { 0.5f, 0.0f, 1.0f },   // chalk, no highlights, drawn with the variants without specular
+    };
+    const int MATERIAL_COUNT = sizeof(gMaterials) / sizeof(gMaterials[0]);
+
+    // Scene object: a range of gMesh drawn with one texture
+    struct GLObject
+    {
+        const char* name;
+        GLint first;
+        GLsizei count;
+        const GLuint* textureId;
+        int batch;
+        bool isOccluder;    // rasterized into the software occlusion buffer
+        bool isDynamic;     // shadow drawn on top of the cached static shadow map
+        AABB bounds = {};   // model space, computed in UCreateMesh
+    };
+
+    GLObject gObjects[] = {
+        { "monitor", 0, 96, &gTextureIdBlack, -1, true, false },
+        { "screen", 96, 6, &gTextureIdScreen, -1, false, false },
+        { "desk", 102, 6, &gTextureIdWood, -1, true, false },
+        { "keyboard", 108, 30, &gTextureIdBlack, -1, false, false },
+        { "keys", 138, 6, &gTextureIdKeyboard, -1, false, false },
+        { "photo frame", 144, 36, &gTextureIdPhoto, -1, false, true },
+    };
+    const int OBJECT_COUNT = sizeof(gObjects) / sizeof(gObjects[0]);
+
+    // Instances of every object, drawn with glDrawArraysInstancedBaseInstance
+    InstanceBuffer gInstances;
+    const GLuint INSTANCE_ATTRIB_LOCATION = 3;
+
+    // Office floor: a grid of identical workstations
+    bool gIsOfficeFloor = false;
+    bool gInstancesDirty = true;
+    const int OFFICE_ROWS = 10;
+    const int OFFICE_COLUMNS = 20;
+    const glm::vec2 OFFICE_SPACING(3.5f, 2.5f);
+
+    // Frustum culling of every instance plus the lamp
+    FrustumCuller gCuller;
+    vector<unsigned char> gInstanceVisibility;
+    AABB gLampBounds;
+
+    // Scene BVH over every instance and the lamp, used for picking, proximity
+    // queries and optionally for culling (B to enable, N to go back to the SIMD culler)
+    struct ScenePrimitive
+    {
+        int object;     // index into gObjects, -1 for the lamp
+        size_t instance;
+    };
+    BVH gSceneBVH;
+    vector<ScenePrimitive> gScenePrimitives;
+    int gLampPrimitive = -1;
+    bool gIsBVHCulling = false;
+    vector<int> gQueryResult;
+    const float PROXIMITY_RADIUS = 1.5f;
+
+    // Software occlusion culling against the occluder objects (C to enable, V to disable)
+    OcclusionCuller gOcclusionCuller;
+    bool gIsOcclusionCulling = true;
+    const int OCCLUSION_WIDTH = 256;
+    const int OCCLUSION_HEIGHT = 192;
+    vector<glm::vec3> gMeshPositions;   // model space position of every vertex of gMesh
+
+    // Clustered point lights on top of the lamp (L to toggle, = and - to double or halve the count)
+    ClusteredLights gClusteredLights;
+    bool gIsClusteredLighting = false;
+    bool gPointLightsDirty = true;
+    int gPointLightCount = 1024;
+    const int MAX_POINT_LIGHTS = 65536;
+    vector<glm::vec3> gPointLightCenters;   // the lights circle slowly around these
+    float gClusterZoom = 0.0f;              // camera zoom the cluster grid was built for
+
+    // Deferred shading: the objects go to a G-buffer and are lit by a compute pass (G to switch)
+    GBuffer gGBuffer;
+    bool gIsDeferredShading = false;
+    const GLuint DEFERRED_TILE_SIZE = 16;   // local size of the lighting compute shader
+    GpuTimer gShadingTimer;                 // GPU time of the objects and lamp, forward or deferred
+
+    // Dynamic resolution (--dynamic-resolution <ms>): the scene is drawn into the lit image
+    // at a scale that keeps the shading GPU time at the target, then scaled up to the window
+    DynamicResolution gDynamicResolution;
+    bool gIsDynamicResolution = false;
+
+    // CPU rendering backend (--software): the frame is drawn by the software rasterizer and
+    // only shown with GL. The mesh and the decoded textures are kept on the CPU for it and
+    // for the path tracer.
+    SoftwareRasterizer gSoftwareRasterizer;
+    bool gIsSoftwareRendering = false;
+    vector<RasterVertex> gMeshVertices;
+    vector<GLuint> gSoftwareTextureIds;
+    vector<RasterTexture> gSoftwareTextures;    // same order as gSoftwareTextureIds
+
+    // Reference renderer (--path-trace): the scene path traced on the CPU. Samples accumulate
+    // while the camera and the lamp stay put, so a still view converges to the ground truth.
+    PathTracer gPathTracer;
+    bool gIsPathTracing = false;
+    vector<RasterDraw> gPathTracerDraws;        // every instance, culled or not, as of the last scene rebuild
+
+    // The scene as the lightmap and probe bakers trace it: every instance without the lamp,
+    // so that only the lighting changes when the lamp moves
+    PathTracer gBakeTracer;
+
+    // Lightmap of the static objects (M to toggle, --lightmap to start with it): the lamp light
+    // baked on the CPU, used while the lamp is where it was baked. The bake is redone when the
+    // scene changes or the lamp comes to rest somewhere new, and kept in a cache file.
+    Lightmap gLightmap;
+    bool gIsLightmapping = false;
+    bool gIsLightmapBaked = false;
+    bool gLightmapDirty = true;
+    glm::vec3 gLightmapLightPosition;
+    GLuint gLightmapTexture = 0;
+    GLuint gLightmapRectsBuffer = 0;
+    GLuint gLightmapRectsTexture = 0;
+    const GLuint LIGHTMAP_TEXTURE_UNIT = 4;
+    const GLuint LIGHTMAP_RECTS_TEXTURE_UNIT = 5;
+    const uint32_t LIGHTMAP_SEED = 1;
+    const char* const LIGHTMAP_CACHE_FILENAME = "lightmap.cache";
+
+    // Ambient occlusion baked into the vertices of gMesh at startup (U to toggle). It is baked
+    // against the objects of one workstation; those of the office floor are further apart
+    // than the occlusion rays reach.
+    bool gIsAmbientOcclusion = true;
+    const float AMBIENT_OCCLUSION_DISTANCE = 0.3f;
+
+    // Vertex data baked on the CPU, a vertex buffer of its own next to that of gMesh:
+    // the lightmap uv in xy and the ambient occlusion in z
+    vector<glm::vec3> gBakedVertices;
+    GLuint gBakedVertexVbo = 0;
+    const GLuint BAKED_VERTEX_ATTRIB_LOCATION = 15;
+
+    // Irradiance probes for the ambient light of the objects that are not lightmapped (T to
+    // toggle, --probes to start with them). A new grid is baked in full, after that the lamp
+    // moving rebakes a budget of probes per frame.
+    IrradianceProbes gProbes;
+    bool gIsProbeLighting = false;
+    bool gProbeGridDirty = true;
+    glm::vec3 gProbeLightPosition;
+    const float PROBE_SPACING = 0.5f;
+    const int PROBE_UPDATE_BUDGET = 64;
+    const GLuint PROBE_TEXTURE_UNIT = 6;
+
+    // Cascaded shadow maps for the lamp (H to toggle). Every instance casts, culled or not,
+    // so the casters have an instance buffer and a vao of their own.
+    CascadedShadowMaps gShadowMaps;
+    bool gIsShadowing = true;
+    bool gDynamicShadowsDirty = true;   // dynamic casters moved since they were last drawn
+    InstanceBuffer gShadowInstances;
+    GLuint gShadowVao;
+    const float SHADOW_DISTANCE = 20.0f;
+    const GLuint SHADOW_TEXTURE_UNIT = 3;
+
+    // Per-frame statistics, shown in the window title once per second
+    struct FrameStats
+    {
+        size_t visibleObjects;
+        size_t culledObjects;
+        size_t occludedObjects;
+        double cullingMs;
+        double occlusionMs;
+        double lightBinningMs;
+        double shadingGpuMs;
+        double softwareMs;
+        size_t softwareTriangles;
+        int pathSamples;
+        double pathRaysPerSecond;
+        float resolutionScale;
+        double buildMs;
+        double submitMs;
+        double latencyMs;
+        double maxLatencyMs;
+    };
+    FrameStats gFrameStats = {};
+    int gStatsFrameCount = 0;
+    double gStatsLastTime = 0.0;
+
+    // Everything the GL thread needs to draw a frame. Frames are built on the frame
+    // worker without touching GL, one frame ahead of the one being submitted.
+    struct FramePacket
+    {
+        glm::mat4 view;
+        glm::mat4 projection;
+        glm::mat4 viewCorrection;                   // built view projection to the late latched one
+        glm::vec3 cameraPosition;
+        float zoom;
+        glm::vec3 lightPosition;
+        glm::mat4 lampModel;
+        bool isLampVisible;
+        bool isClusteredLighting;
+        glm::vec2 clusterDepthScaleBias;
+        bool isSceneRebuilt;                        // instances changed, the shadow casters follow on upload
+        vector<InstanceData> instances;             // visible instances grouped by object, with transforms
+        vector<vector<DrawCommand>> jobCommands;    // recorded by every building job
+        vector<DrawCommand> commands;               // sorted and merged, replayed on submit
+    };
+    FramePacket gFramePackets[2];
+    BackgroundWorker gFrameWorker;
+
+    // Image file decoded on the job system, waiting for its texture to be created
+    struct DecodedImage
+    {
+        unsigned char* pixels;
+        int width;
+        int height;
+        int channels;
+    };
+    const size_t INSTANCES_PER_JOB = 4096;  // fewer instances than this are not worth another thread
 }
 
 /* User-defined Function prototypes to:
@@ -78,18 +394,69 @@ namespace
  * and render graphics on the screen
  */
 bool UInitialize(int, char* [], GLFWwindow** window);
+GLFWwindow* UCreateWindow();
 void UResizeWindow(GLFWwindow* window, int width, int height);
 void UProcessInput(GLFWwindow* window);
 void UMousePositionCallback(GLFWwindow* window, double xpos, double ypos);
 void UMouseScrollCallback(GLFWwindow* window, double xoffset, double yoffset);
 void UMouseButtonCallback(GLFWwindow* window, int button, int action, int mods);
+void UKeyCallback(GLFWwindow* window, int key, int scancode, int action, int mods);
+void UWindowRefreshCallback(GLFWwindow* window);
+void URequestRedraw();
+bool UIsAnimating();
+void UFollowCameraPath();
+void URecordFrameTiming();
 void UCreateMesh(GLMesh& mesh);
 void UDestroyMesh(GLMesh& mesh);
-bool UCreateTexture(const char* filename, GLuint& textureId);
+void UCreateInstances();
+void UBuildShadowCasters();
+void UUpdateShadows(const FramePacket& frame);
+void UBuildInstances();
+void UUpdateInstanceBounds();
+void UCullInstances(const glm::mat4& viewProjection);
+size_t UOcclusionCullInstances(const glm::mat4& viewProjection);
+void UShowFrameStats();
+void UCreatePointLights();
+void UUpdatePointLights(const glm::mat4& view);
+bool UKeyPressed(GLFWwindow* window, int key);
+void UPrintPrimitive(int primitive);
+void USetMaterials(GLuint programId);
+void USetLightingUniforms(GLuint programId, const FramePacket& frame, int screenWidth, int screenHeight);
+void UDeferredLighting(const FramePacket& frame);
+void UCompareShading();
+bool UDecodeImage(const char* filename, DecodedImage& image);
+bool UCreateTexture(DecodedImage& decoded, GLuint& textureId);
 void UDestroyTexture(GLuint textureId);
+void UBuildFrame(FramePacket& frame);
+void UBuildDrawCommands(FramePacket& frame, const glm::mat4& viewProjection);
+void UUploadFrame(const FramePacket& frame);
+void ULatchCamera(FramePacket& frame);
+void USubmitFrame(const FramePacket& frame);
 void URender();
+void USoftwareRender(const FramePacket& frame);
+void UPathTrace(const FramePacket& frame);
+void UBuildPathTracerDraws();
+void UBakeLightmap(const FramePacket& frame);
+void UBakeVertexOcclusion();
+void UUpdateBakeScene(const FramePacket& frame);
+void UUpdateProbes(const FramePacket& frame);
+bool UWriteImage(const char* filename);
+const RasterTexture* USoftwareTexture(GLuint textureId);
 bool UCreateShaderProgram(const char* vtxShaderSource, const char* fragShaderSource, GLuint& programId);
+void USetupProgramBuilder();
+bool UUpdatePrograms(bool isWaiting);
+uint32_t UDrawFeatures(int object, GLuint material);
+void UPrepareObjectsPrograms();
+const ProgramPipeline* UObjectsPipeline(uint32_t features);
+void USetObjectsUniforms(GLuint programId, const FramePacket& frame, bool isOffscreen);
 void UDestroyShaderProgram(GLuint programId);
+void UAddPrograms(const std::vector<std::string>& staleShaders);
+bool UIsProgramStale(const std::vector<std::string>& staleShaders, const char* first, const char* second = NULL);
+const char* UShaderSource(const char* filename);
+std::vector<std::string> UExpandStaleShaders();
+void ULoadShaderSources();
+void UReloadChangedShaders();
+std::string UFormatShaderSource(const char* source);
 
 
 /* Obejcts Vertex Shader Source Code*/
@@ -98,24 +465,122 @@ const GLchar* objectsVertexShaderSource = GLSL(440,
     layout(location = 0) in vec3 position; // VAP position 0 for vertex position data
     layout(location = 1) in vec3 normal; // VAP position 1 for normals
     layout(location = 2) in vec2 textureCoordinate;
-    
-    out vec3 vertexNormal; // For outgoing normals to fragment shader
-    out vec3 vertexFragmentPos; // For outgoing color to fragment shader
-    out vec2 vertexTextureCoordinate;
-    
-    //Global variables for the  transform matrices
-    uniform mat4 model;
-    uniform mat4 view;
-    uniform mat4 projection;
-    
+    layout(location = 3) in mat4 instanceModel; // per-instance model matrix, uses locations 3 to 6
+    layout(location = 7) in uvec2 instanceMaterial; // per-instance material id and instance id
+    layout(location = 8) in mat4 instanceMVP; // projection * view * model from the CPU, uses locations 8 to 11
+    layout(location = 12) in mat3 instanceNormalMatrix; // inverse transpose of the model, uses locations 12 to 14
+    layout(location = 15) in vec3 bakedVertex; // lightmap uv within the rectangle of the instance, ambient occlusion
+
+    uniform mat4 viewCorrection; // moves the clip position to the camera latched just before the draw
+    uniform samplerBuffer lightmapRects; // atlas offset and size of every instance id, negative if not baked
+    uniform bool isAmbientOccluded;
+
+    // this stage is a separable program, the fragment stages find the outputs by location
+    out gl_PerVertex { vec4 gl_Position; };
+    layout(location = 0) out vec3 vertexNormal; // For outgoing normals to fragment shader
+    layout(location = 1) out vec3 vertexFragmentPos; // For outgoing color to fragment shader
+    layout(location = 2) out vec2 vertexTextureCoordinate;
+    layout(location = 3) flat out uint vertexMaterial;
+    layout(location = 4) out float vertexViewDepth; // distance along the view direction, selects the light cluster
+    layout(location = 5) out vec2 vertexLightmapCoordinate; // negative when the fragment is lit at run time
+    layout(location = 6) out float vertexOcclusion; // fraction of the ambient light that reaches the vertex
+
     void main()
     {
-        gl_Position = projection * view * model * vec4(position, 1.0f); // transforms vertices into clip coordinates
-    
-        vertexFragmentPos = vec3(model * vec4(position, 1.0f)); // Gets fragment / pixel position in world space only
-    
-        vertexNormal = mat3(transpose(inverse(model))) * normal; // get normal vectors in world space only
+        gl_Position = viewCorrection * instanceMVP * vec4(position, 1.0f); // transforms vertices into clip coordinates
+
+        vertexFragmentPos = vec3(instanceModel * vec4(position, 1.0f)); // Gets fragment / pixel position in world space only
+
+        vertexNormal = instanceNormalMatrix * normal; // get normal vectors in world space only
         vertexTextureCoordinate = textureCoordinate;
+        vertexMaterial = instanceMaterial.x;
+        vertexViewDepth = gl_Position.w; // clip w of a perspective projection is the view depth
+
+        vec4 lightmapRect = HAS_LIGHTMAP ? texelFetch(lightmapRects, int(instanceMaterial.y)) : vec4(-1.0);
+        vertexLightmapCoordinate = lightmapRect.z > 0.0 ? lightmapRect.xy + bakedVertex.xy * lightmapRect.zw : vec2(-1.0);
+        vertexOcclusion = isAmbientOccluded ? bakedVertex.z : 1.0;
+    }
+);
+
+
+/* Lighting of the lamp and the point lights, shared by the objects fragment shader and the
+   deferred lighting compute shader, which both include it as lighting.glsl*/
+const GLchar* lightingShaderSource = GLSL_CHUNK(
+
+    struct Material
+    {
+        float ambientStrength;
+        float specularIntensity;
+        float highlightSize;
+    };
+
+    struct PointLight
+    {
+        vec4 positionRadius;
+        vec4 color;
+    };
+
+    // clustered lights: every cluster holds an offset and a count into lightIndices
+    layout(std430, binding = 0) readonly buffer PointLights { PointLight pointLights[]; };
+    layout(std430, binding = 1) readonly buffer LightClusters { uvec2 lightClusters[]; };
+    layout(std430, binding = 2) readonly buffer LightIndices { uint lightIndices[]; };
+
+    // Global variables for light color, light position, and camera/view position
+    uniform vec3 lightColor;
+    uniform vec3 lightPos;
+    uniform vec3 viewPosition;
+    uniform Material materials[4];
+    uniform uvec3 clusterGrid;
+    uniform vec2 clusterDepthScaleBias; // slice = log(depth) * x + y
+    uniform vec2 screenSize;
+    uniform sampler2DArrayShadow shadowMap;
+    uniform mat4 shadowMatrices[3];
+    uniform vec4 shadowSplits; // far end of every cascade
+
+    // fraction of the lamp that reaches the fragment
+    float lampVisibility(vec3 fragmentPos, vec3 norm, float viewDepth)
+    {
+        if (viewDepth >= shadowSplits.z)
+            return 1.0;
+
+        int cascade = viewDepth < shadowSplits.x ? 0 : (viewDepth < shadowSplits.y ? 1 : 2);
+        vec4 shadowPos = shadowMatrices[cascade] * vec4(fragmentPos + norm * 0.01, 1.0);
+        shadowPos.xyz /= shadowPos.w;
+        if (any(lessThan(shadowPos.xyz, vec3(0.0))) || any(greaterThan(shadowPos.xyz, vec3(1.0))))
+            return 1.0;
+
+        // 4 bilinear comparisons, 4x4 texels of filtering
+        vec2 texel = 1.0 / vec2(textureSize(shadowMap, 0).xy);
+        float lit = 0.0;
+        for (int i = 0; i < 4; ++i)
+            lit += texture(shadowMap, vec4(shadowPos.xy + (vec2(i & 1, i >> 1) - 0.5) * texel, float(cascade), shadowPos.z));
+        return lit * 0.25;
+    }
+
+    // adds the point lights of the cluster a fragment is in to its diffuse and specular light
+    void addPointLights(vec2 pixelCenter, float viewDepth, vec3 fragmentPos, vec3 norm, vec3 viewDir, Material material,
+        bool isSpecular, inout vec3 diffuse, inout vec3 specular)
+    {
+        uvec2 tile = min(uvec2(pixelCenter / screenSize * vec2(clusterGrid.xy)), clusterGrid.xy - 1u);
+        uint slice = uint(clamp(log(viewDepth) * clusterDepthScaleBias.x + clusterDepthScaleBias.y, 0.0, float(clusterGrid.z - 1u)));
+        uvec2 cluster = lightClusters[(slice * clusterGrid.y + tile.y) * clusterGrid.x + tile.x];
+
+        for (uint i = 0u; i < cluster.y; ++i)
+        {
+            PointLight light = pointLights[lightIndices[cluster.x + i]];
+            vec3 toLight = light.positionRadius.xyz - fragmentPos;
+            float distance = length(toLight);
+            float falloff = clamp(1.0 - distance * distance / (light.positionRadius.w * light.positionRadius.w), 0.0, 1.0);
+            falloff *= falloff;
+
+            vec3 pointDirection = toLight / max(distance, 0.0001);
+            diffuse += max(dot(norm, pointDirection), 0.0) * falloff * light.color.rgb;
+            if (isSpecular)
+            {
+                float pointSpecular = pow(max(dot(viewDir, reflect(-pointDirection, norm)), 0.0), material.highlightSize);
+                specular += material.specularIntensity * pointSpecular * falloff * light.color.rgb;
+            }
+        }
     }
 );
 
@@ -123,43 +588,94 @@ const GLchar* objectsVertexShaderSource = GLSL(440,
 /* Objects Fragment Shader Source Code*/
 const GLchar* objectsFragmentShaderSource = GLSL(440,
 
-    in vec3 vertexNormal; // For incoming normals
-    in vec3 vertexFragmentPos; // For incoming fragment position
-    in vec2 vertexTextureCoordinate;
-    
+    layout(location = 0) in vec3 vertexNormal; // For incoming normals
+    layout(location = 1) in vec3 vertexFragmentPos; // For incoming fragment position
+    layout(location = 2) in vec2 vertexTextureCoordinate;
+    layout(location = 3) flat in uint vertexMaterial;
+    layout(location = 4) in float vertexViewDepth;
+    layout(location = 5) in vec2 vertexLightmapCoordinate;
+    layout(location = 6) in float vertexOcclusion;
+
     out vec4 fragmentColor;
-    
-    // Global variables for object color, light color, light position, and camera/view position
+
+    // Global variables for object color and texture, the ones of the lights are in lighting.glsl
     uniform vec3 objectColor;
-    uniform vec3 lightColor;
-    uniform vec3 lightPos;
-    uniform vec3 viewPosition;
     uniform sampler2D uTexture;
     uniform vec2 uvScale;
-    
+    uniform sampler2D lightmap;
+    uniform sampler3D probes; // 7 RGBA texels per probe, in 7 blocks of the grid width along x
+    uniform vec3 probeGridMin;
+    uniform float probeSpacing;
+    uniform ivec3 probeGridSize;
+) GLSL_INCLUDE("lighting.glsl") GLSL_CHUNK(
+
+    // irradiance over pi from the order 2 spherical harmonics of the probes around a point,
+    // blended by the trilinear filtering within each block
+    vec3 probeIrradiance(vec3 position, vec3 n)
+    {
+        vec3 cell = clamp((position - probeGridMin) / probeSpacing, vec3(0.0), vec3(probeGridSize - 1)) + 0.5;
+        vec3 textureSize = vec3(probeGridSize) * vec3(7.0, 1.0, 1.0);
+        vec4 t[7];
+        for (int i = 0; i < 7; ++i)
+            t[i] = texture(probes, (cell + vec3(float(i * probeGridSize.x), 0.0, 0.0)) / textureSize);
+
+        vec3 irradiance = t[0].xyz * 0.282095
+            + vec3(t[0].w, t[1].xy) * 0.488603 * n.y
+            + vec3(t[1].zw, t[2].x) * 0.488603 * n.z
+            + t[2].yzw * 0.488603 * n.x
+            + t[3].xyz * 1.092548 * n.x * n.y
+            + vec3(t[3].w, t[4].xy) * 1.092548 * n.y * n.z
+            + vec3(t[4].zw, t[5].x) * 0.315392 * (3.0 * n.z * n.z - 1.0)
+            + t[5].yzw * 1.092548 * n.x * n.z
+            + t[6].xyz * 0.546274 * (n.x * n.x - n.y * n.y);
+        return max(irradiance, vec3(0.0));
+    }
+
+    // the HAS_ defines of the variant select what is computed, see ShaderPermutations
     void main()
     {
-    
+        Material material = materials[vertexMaterial];
+
         // Ambient lighting
-        float ambientStrength = 0.5f; // Set ambient or global lighting strength
-        vec3 ambient = ambientStrength * lightColor; // Generate ambient light color
+        float ambientStrength = material.ambientStrength; // Set ambient or global lighting strength
+        vec3 ambient = ambientStrength * vertexOcclusion * lightColor; // Generate ambient light color, less in creases and contacts
     
         // Diffuse lighting
         vec3 norm = normalize(vertexNormal); // Normalize vectors to 1 unit
+
+        // bounced light from the probes in place of the constant, unless the lightmap has it
+        if (HAS_PROBES && vertexLightmapCoordinate.x < 0.0)
+            ambient = probeIrradiance(vertexFragmentPos, norm) * vertexOcclusion;
         vec3 lightDirection = normalize(lightPos - vertexFragmentPos); // Calculate distance (light direction) between light source and fragments/pixels on objects
         float impact = max(dot(norm, lightDirection), 0.0);// Calculate diffuse impact by generating dot product of normal and light
-        vec3 diffuse = impact * lightColor; // Generate diffuse light color
+        float visibility = HAS_SHADOWS ? lampVisibility(vertexFragmentPos, norm, vertexViewDepth) : 1.0;
+        vec3 diffuse = impact * visibility * lightColor; // Generate diffuse light color
     
         // Specular lighting
-        float specularIntensity = 0.8f; 
-        float highlightSize = 16.0f; 
+        float specularIntensity = material.specularIntensity;
+        float highlightSize = material.highlightSize;
         vec3 viewDir = normalize(viewPosition - vertexFragmentPos);
-        vec3 reflectDir = reflect(-lightDirection, norm);
-        float specularComponent = pow(max(dot(viewDir, reflectDir), 0.0), highlightSize);
-        vec3 specular = specularIntensity * specularComponent * lightColor;
+        vec3 specular = vec3(0.0);
+        if (HAS_SPECULAR)
+        {
+            vec3 reflectDir = reflect(-lightDirection, norm);
+            float specularComponent = pow(max(dot(viewDir, reflectDir), 0.0), highlightSize);
+            specular = specularIntensity * specularComponent * visibility * lightColor;
+        }
+
+        // baked lamp light, direct and bounced; the highlight depends on the view and is not baked
+        if (HAS_LIGHTMAP && vertexLightmapCoordinate.x >= 0.0)
+        {
+            diffuse = texture(lightmap, vertexLightmapCoordinate).rgb;
+            specular = vec3(0.0);
+        }
+
+        // point lights of the cluster this fragment is in
+        if (HAS_POINT_LIGHTS)
+            addPointLights(gl_FragCoord.xy, vertexViewDepth, vertexFragmentPos, norm, viewDir, material, HAS_SPECULAR, diffuse, specular);
     
         // Texture holds the color to be used for all three components
-        vec4 textureColor = texture(uTexture, vertexTextureCoordinate * uvScale);
+        vec4 textureColor = HAS_TEXTURE ? texture(uTexture, vertexTextureCoordinate * uvScale) : vec4(1.0);
     
         // Calculate phong result
         vec3 phong = (ambient + diffuse + specular) * textureColor.xyz;
@@ -169,6 +685,131 @@ const GLchar* objectsFragmentShaderSource = GLSL(440,
 );
 
 
+/* G-buffer Fragment Shader Source Code, geometry pass of the deferred path*/
+const GLchar* gBufferFragmentShaderSource = GLSL(440,
+
+    // the outputs of the objects vertex stage this one takes
+    layout(location = 0) in vec3 vertexNormal;
+    layout(location = 2) in vec2 vertexTextureCoordinate;
+    layout(location = 3) flat in uint vertexMaterial;
+
+    layout(location = 0) out vec4 albedoMaterial;
+    layout(location = 1) out vec2 octahedralNormal;
+
+    uniform sampler2D uTexture;
+    uniform vec2 uvScale;
+
+    // projects a unit vector onto the octahedron and unfolds it into the [-1, 1] square
+    vec2 encodeNormal(vec3 n)
+    {
+        n /= abs(n.x) + abs(n.y) + abs(n.z);
+        vec2 signs = vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+        return n.z >= 0.0 ? n.xy : (1.0 - abs(n.yx)) * signs;
+    }
+
+    void main()
+    {
+        albedoMaterial = vec4(texture(uTexture, vertexTextureCoordinate * uvScale).rgb, float(vertexMaterial) / 255.0);
+        octahedralNormal = encodeNormal(normalize(vertexNormal));
+    }
+);
+
+
+/* Deferred Lighting Compute Shader Source Code, one invocation per pixel*/
+const GLchar* deferredLightingComputeShaderSource = GLSL(440,
+
+    layout(local_size_x = 16, local_size_y = 16) in;
+
+    layout(binding = 0) uniform sampler2D albedoMaterialTexture;
+    layout(binding = 1) uniform sampler2D normalTexture;
+    layout(binding = 2) uniform sampler2D depthTexture;
+    layout(rgba8, binding = 0) writeonly uniform image2D litImage;
+
+    uniform mat4 inverseViewProjection;
+    uniform mat4 view;
+    uniform ivec2 renderSize;   // area of the G-buffer in use, at most the image size
+    uniform bool isClusteredLighting;
+    uniform bool isShadowed;
+) GLSL_INCLUDE("lighting.glsl") GLSL_CHUNK(
+
+    vec3 decodeNormal(vec2 e)
+    {
+        vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+        if (n.z < 0.0)
+            n.xy = (1.0 - abs(n.yx)) * vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+        return normalize(n);
+    }
+
+    void main()
+    {
+        ivec2 pixel = ivec2(gl_GlobalInvocationID.xy);
+        ivec2 size = renderSize;
+        if (pixel.x >= size.x || pixel.y >= size.y)
+            return;
+
+        // nothing was drawn here, keep the clear color
+        float depth = texelFetch(depthTexture, pixel, 0).r;
+        if (depth >= 1.0)
+        {
+            imageStore(litImage, pixel, vec4(0.0, 0.0, 0.0, 1.0));
+            return;
+        }
+
+        // world position reconstructed from the depth buffer
+        vec2 pixelCenter = vec2(pixel) + 0.5;
+        vec4 world = inverseViewProjection * vec4(pixelCenter / vec2(size) * 2.0 - 1.0, depth * 2.0 - 1.0, 1.0);
+        vec3 fragmentPos = world.xyz / world.w;
+        float viewDepth = -(view * vec4(fragmentPos, 1.0)).z;
+
+        vec4 albedoMaterial = texelFetch(albedoMaterialTexture, pixel, 0);
+        Material material = materials[uint(albedoMaterial.a * 255.0 + 0.5)];
+        vec3 norm = decodeNormal(texelFetch(normalTexture, pixel, 0).xy);
+
+        // Phong lighting as in the objects fragment shader
+        vec3 ambient = material.ambientStrength * lightColor;
+
+        vec3 lightDirection = normalize(lightPos - fragmentPos);
+        float visibility = isShadowed ? lampVisibility(fragmentPos, norm, viewDepth) : 1.0;
+        vec3 diffuse = max(dot(norm, lightDirection), 0.0) * visibility * lightColor;
+
+        float specularIntensity = material.specularIntensity;
+        float highlightSize = material.highlightSize;
+        vec3 viewDir = normalize(viewPosition - fragmentPos);
+        float specularComponent = pow(max(dot(viewDir, reflect(-lightDirection, norm)), 0.0), highlightSize);
+        vec3 specular = specularIntensity * specularComponent * visibility * lightColor;
+
+        if (isClusteredLighting)
+            addPointLights(pixelCenter, viewDepth, fragmentPos, norm, viewDir, material, true, diffuse, specular);
+
+        vec3 phong = (ambient + diffuse + specular) * albedoMaterial.rgb;
+        imageStore(litImage, pixel, vec4(phong, 1.0));
+    }
+);
+
+
+/* Shadow Caster Shader Source Code, depth only*/
+const GLchar* shadowVertexShaderSource = GLSL(440,
+
+    layout(location = 0) in vec3 position;
+    layout(location = 3) in mat4 instanceModel;
+
+    uniform mat4 lightViewProjection;
+
+    void main()
+    {
+        gl_Position = lightViewProjection * instanceModel * vec4(position, 1.0f);
+    }
+);
+
+
+const GLchar* shadowFragmentShaderSource = GLSL(440,
+
+    void main()
+    {
+    }
+);
+
+
 /* Lamp Shader Source Code*/
 const GLchar* lampVertexShaderSource = GLSL(440,
 
@@ -198,6 +839,62 @@ const GLchar* lampFragmentShaderSource = GLSL(440,
 );
 
 
+/* Fallback Shader Source Code, unlit objects while their real program builds*/
+const GLchar* fallbackVertexShaderSource = GLSL(440,
+
+    layout(location = 0) in vec3 position;
+    layout(location = 2) in vec2 textureCoordinate;
+    layout(location = 8) in mat4 instanceMVP;
+
+    uniform mat4 viewCorrection;
+
+    out vec2 vertexTextureCoordinate;
+
+    void main()
+    {
+        gl_Position = viewCorrection * instanceMVP * vec4(position, 1.0f);
+        vertexTextureCoordinate = textureCoordinate;
+    }
+);
+
+
+const GLchar* fallbackFragmentShaderSource = GLSL(440,
+
+    in vec2 vertexTextureCoordinate;
+
+    out vec4 fragmentColor;
+
+    uniform sampler2D uTexture;
+    uniform vec2 uvScale;
+
+    void main()
+    {
+        fragmentColor = vec4(texture(uTexture, vertexTextureCoordinate * uvScale).rgb, 1.0);
+    }
+);
+
+
+// The built-in shader sources by the file names that #include and --shader-dir know them by
+struct ShaderFile
+{
+    const char* filename;
+    const GLchar* source;
+};
+const ShaderFile gShaderFiles[] = {
+    { "lighting.glsl", lightingShaderSource },
+    { "objects.vert", objectsVertexShaderSource },
+    { "objects.frag", objectsFragmentShaderSource },
+    { "gbuffer.frag", gBufferFragmentShaderSource },
+    { "deferred.comp", deferredLightingComputeShaderSource },
+    { "shadow.vert", shadowVertexShaderSource },
+    { "shadow.frag", shadowFragmentShaderSource },
+    { "lamp.vert", lampVertexShaderSource },
+    { "lamp.frag", lampFragmentShaderSource },
+    { "fallback.vert", fallbackVertexShaderSource },
+    { "fallback.frag", fallbackFragmentShaderSource },
+};
+
+
 // flip images
 void flipImageVertically(unsigned char* image, int width, int height, int channels)
 {
@@ -220,89 +917,302 @@ void flipImageVertically(unsigned char* image, int width, int height, int channe
 
 int main(int argc, char* argv[])
 {
-    if (!UInitialize(argc, argv, &gWindow))
-        return EXIT_FAILURE;
-
-    UCreateMesh(gMesh);
-
-    // Create the shader programs
-    if (!UCreateShaderProgram(objectsVertexShaderSource, objectsFragmentShaderSource, gObjectsProgramId))
-        return EXIT_FAILURE;
-    if (!UCreateShaderProgram(lampVertexShaderSource, lampFragmentShaderSource, gLampProgramId))
-        return EXIT_FAILURE;
-
-    // Computer Body texture
-    const char* texFilename = "blackPlastic.jpg";
-    if (!UCreateTexture(texFilename, gTextureIdBlack))
+    // CPU benchmarks do not need a window
+    if (argc > 2 && strcmp(argv[1], "--bench") == 0)
     {
-        cout << "Failed to load texture " << texFilename << endl;
-        return EXIT_FAILURE;
+        if (!benchmarks::run(argv[2]))
+        {
+            cout << "Unknown benchmark " << argv[2] << endl;
+            return EXIT_FAILURE;
+        }
+        return EXIT_SUCCESS;
     }
 
-    // Computer screen texture
-    const char* texFilename2 = "screen.jpg";
-    if (!UCreateTexture(texFilename2, gTextureIdScreen))
+    // headless runs render a number of frames offscreen and write their timings; these
+    // options are read first because the frame size must be known before the window is
+    // made, and the CPU renderers must be known before the textures are loaded
+    for (int i = 1; i < argc; ++i)
     {
-        cout << "Failed to load texture " << texFilename2 << endl;
-        return EXIT_FAILURE;
+        if (strcmp(argv[i], "--headless") == 0)
+            gIsHeadless = true;
+        else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc)
+            gHeadlessFrameCount = std::max(1, atoi(argv[++i]));
+        else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc)
+        {
+            int width = 0, height = 0;
+            std::istringstream size(argv[++i]);
+            char separator = 0;
+            if (size >> width >> separator >> height && width > 0 && height > 0)
+            {
+                gFrameWidth = width;
+                gFrameHeight = height;
+            }
+        }
+        else if (strcmp(argv[i], "--camera-path") == 0 && i + 1 < argc)
+        {
+            if (!gCameraPath.load(argv[++i]))
+            {
+                cout << "Failed to load camera path " << argv[i] << endl;
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp(argv[i], "--timing") == 0 && i + 1 < argc)
+            gTimingFilename = argv[++i];
+        else if (strcmp(argv[i], "--image") == 0 && i + 1 < argc)
+            gImageFilename = argv[++i];
+        else if (strcmp(argv[i], "--software") == 0)
+            gIsSoftwareRendering = true;
+        else if (strcmp(argv[i], "--path-trace") == 0)
+            gIsPathTracing = true;
+        else if (strcmp(argv[i], "--lightmap") == 0)
+            gIsLightmapping = true;
+        else if (strcmp(argv[i], "--probes") == 0)
+            gIsProbeLighting = true;
+        else if (strcmp(argv[i], "--no-program-cache") == 0)
+            gIsProgramCaching = false;
+        else if (strcmp(argv[i], "--shader-thread") == 0)
+            gIsShaderThread = true;
+        else if (strcmp(argv[i], "--shader-dir") == 0 && i + 1 < argc)
+            gShaderDirectory = argv[++i];
+        else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc)
+            gPathTracer.setSeed((uint32_t)strtoul(argv[++i], NULL, 10));
     }
 
-    // Desk texture
-    const char* texFilename3 = "wood.jpg";
-    if (!UCreateTexture(texFilename3, gTextureIdWood))
-    {
-        cout << "Failed to load texture " << texFilename3 << endl;
+    if (!UInitialize(argc, argv, &gWindow))
         return EXIT_FAILURE;
-    }
 
-    // Keyboard texture
-    const char* texFilename4 = "keyboard.jpg";
-    if (!UCreateTexture(texFilename4, gTextureIdKeyboard))
+    // Submit the shader programs first, so that they build while the scene loads; they are
+    // handed out as they finish, and set their samplers and materials once they are ready
+    gProgramStart = glfwGetTime();
+    gProgramCache.setup();
+    if (!gIsProgramCaching)
+        gProgramCache.disable();
+    gProgramCache.load(PROGRAM_CACHE_FILENAME);
+    ULoadShaderSources();
+    std::vector<std::string> shaders = UExpandStaleShaders();
+    if (!UCreateShaderProgram(UShaderSource("fallback.vert"), UShaderSource("fallback.frag"), gFallbackProgramId))
+        return EXIT_FAILURE;
+    USetupProgramBuilder();
+    gObjectsPrograms.setup(&gProgramBuilder, UShaderSource("objects.vert"), UShaderSource("objects.frag"), FEATURE_LIGHTMAP, [](GLuint program)
     {
-        cout << "Failed to load texture " << texFilename4 << endl;
+        glUseProgram(program);
+        glUniform1i(glGetUniformLocation(program, "uTexture"), 0);
+        USetMaterials(program);
+        glUniform1i(glGetUniformLocation(program, "shadowMap"), SHADOW_TEXTURE_UNIT);
+        glUniform1i(glGetUniformLocation(program, "lightmap"), LIGHTMAP_TEXTURE_UNIT);
+        glUniform1i(glGetUniformLocation(program, "lightmapRects"), LIGHTMAP_RECTS_TEXTURE_UNIT);
+        glUniform1i(glGetUniformLocation(program, "probes"), PROBE_TEXTURE_UNIT);
+    });
+    UPrepareObjectsPrograms();
+    UAddPrograms(shaders);
+
+    // a program that fails to build from here on, on first use or on a reload, is drawn
+    // without rather than ending the run
+    gProgramBuilder.endStartup();
+    if (!UUpdatePrograms(false))
         return EXIT_FAILURE;
-    }
 
-    // Glass Photo texture
-    const char* texFilename5 = "photo.png";
-    if (!UCreateTexture(texFilename5, gTextureIdPhoto))
+    UCreateMesh(gMesh);
+    UBakeVertexOcclusion();
+    UCreateInstances();
+
+    gOcclusionCuller.resize(OCCLUSION_WIDTH, OCCLUSION_HEIGHT);
+    gOcclusionCuller.setThreadCount(hardwareThreadCount());
+
+    gClusteredLights.setup();
+    gClusteredLights.setThreadCount(hardwareThreadCount());
+
+    int framebufferWidth, framebufferHeight;
+    glfwGetFramebufferSize(gWindow, &framebufferWidth, &framebufferHeight);
+    gGBuffer.setup(framebufferWidth, framebufferHeight);
+    gShadingTimer.setup();
+    gShadowMaps.setup();
+    gProbes.setup();
+
+    // Computer body, computer screen, desk, keyboard and glass photo textures. The
+    // files are decoded in parallel on the job system, the textures are created here.
+    const char* texFilenames[] = { "blackPlastic.jpg", "screen.jpg", "wood.jpg", "keyboard.jpg", "photo.png" };
+    GLuint* textureIds[] = { &gTextureIdBlack, &gTextureIdScreen, &gTextureIdWood, &gTextureIdKeyboard, &gTextureIdPhoto };
+    const int textureCount = sizeof(texFilenames) / sizeof(texFilenames[0]);
+
+    vector<DecodedImage> images(textureCount);
+    sharedJobSystem().parallelFor(textureCount, 1, [&](size_t begin, size_t end)
     {
-        cout << "Failed to load texture " << texFilename5 << endl;
-        return EXIT_FAILURE;
+        for (size_t i = begin; i < end; ++i)
+            UDecodeImage(texFilenames[i], images[i]);
+    });
+
+    for (int i = 0; i < textureCount; ++i)
+    {
+        // the CPU renderers and the lightmap baker sample their own copy, UCreateTexture frees the image
+        if (images[i].pixels)
+        {
+            gSoftwareTextures.emplace_back();
+            gSoftwareTextures.back().assign(images[i].pixels, images[i].width, images[i].height, images[i].channels);
+        }
+
+        if (!UCreateTexture(images[i], *textureIds[i]))
+        {
+            cout << "Failed to load texture " << texFilenames[i] << endl;
+            return EXIT_FAILURE;
+        }
+        gSoftwareTextureIds.push_back(*textureIds[i]);
     }
 
-    // tell each sampler which texture unit it belongs to
-    glUseProgram(gObjectsProgramId);
-    glUniform1i(glGetUniformLocation(gObjectsProgramId, "uTexture"), 0);
+    RasterMaterial rasterMaterials[MATERIAL_COUNT];
+    for (int i = 0; i < MATERIAL_COUNT; ++i)
+        rasterMaterials[i] = { gMaterials[i].ambientStrength, gMaterials[i].specularIntensity, gMaterials[i].highlightSize };
+    gSoftwareRasterizer.setMaterials(rasterMaterials, MATERIAL_COUNT);
+    gSoftwareRasterizer.setThreadCount(hardwareThreadCount());
+    gPathTracer.setMaterials(rasterMaterials, MATERIAL_COUNT);
+    gPathTracer.setThreadCount(hardwareThreadCount());
+    gBakeTracer.setMaterials(rasterMaterials, MATERIAL_COUNT);
 
     // Sets the background color of the window to black
     glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
 
+    // forward against deferred frame times instead of the interactive scene
+    bool isComparingShading = argc > 1 && strcmp(argv[1], "--compare-shading") == 0;
+
+    // headless runs and the comparison measure the real programs from the first frame on
+    if ((gIsHeadless || isComparingShading) && !gProgramBuilder.isFinished() && !UUpdatePrograms(true))
+        return EXIT_FAILURE;
+    if (isComparingShading)
+        UCompareShading();
+
+    // only redraw when something changed, for displays that sit idle most of the day;
+    // frame pacing, by default no frame limit and at most two frames queued on the GPU;
+    // dynamic resolution to a GPU time target, by default down to half the window size
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--on-demand") == 0)
+            gIsRenderingOnDemand = true;
+        else if (strcmp(argv[i], "--fps") == 0 && i + 1 < argc)
+            gFramePacer.setTargetFrameRate(atof(argv[++i]));
+        else if (strcmp(argv[i], "--frames-in-flight") == 0 && i + 1 < argc)
+            gFramePacer.setMaxFramesInFlight(atoi(argv[++i]));
+        else if (strcmp(argv[i], "--swap-interval") == 0 && i + 1 < argc)
+            glfwSwapInterval(atoi(argv[++i]));
+        else if (strcmp(argv[i], "--dynamic-resolution") == 0 && i + 1 < argc)
+        {
+            gIsDynamicResolution = true;
+            gDynamicResolution.setTargetMs(atof(argv[++i]));
+        }
+        else if (strcmp(argv[i], "--min-scale") == 0 && i + 1 < argc)
+            gDynamicResolution.setLimits((float)atof(argv[++i]), 1.0f);
+    }
+
+    // frame N is submitted while frame N + 1 is built on the frame worker;
+    // the first frame is built up front
+    FramePacket* submitPacket = &gFramePackets[0];
+    FramePacket* buildPacket = &gFramePackets[1];
+    if (!isComparingShading)
+        UBuildFrame(*submitPacket);
+    gLastFrameEnd = glfwGetTime();
+
     // render loop
-    while (!glfwWindowShouldClose(gWindow))
+    while (!isComparingShading && !glfwWindowShouldClose(gWindow))
     {
-        // per-frame timing
+        // wait for the frame limit and for room in the GPU queue before input is sampled
+        gFramePacer.beginFrame();
+
+        // per-frame timing; headless runs step the animations by a fixed amount so that
+        // every run draws the same frames
         float currentFrame = glfwGetTime();
-        gDeltaTime = currentFrame - gLastFrame;
+        gDeltaTime = gIsHeadless ? HEADLESS_FRAME_STEP : currentFrame - gLastFrame;
         gLastFrame = currentFrame;
+        gAnimationTime += gDeltaTime;
 
-        // input
-        UProcessInput(gWindow);
-
-        // Render this frame
-        URender();
+        // input, or the camera path when headless
         glfwPollEvents();
+        if (gIsHeadless)
+            UFollowCameraPath();
+        else
+            UProcessInput(gWindow);
+        gFramePacer.markInput();
+
+        // shaders saved since the last frame, and programs that finished building
+        if (gShaderDirectory)
+            UReloadChangedShaders();
+        if (!gProgramBuilder.isFinished() && !UUpdatePrograms(false))
+            glfwSetWindowShouldClose(gWindow, true);
+
+        // nothing changed since the last frame, sleep until an event arrives
+        if (gIsRenderingOnDemand && !gIsHeadless && gPendingRedraws == 0 && !UIsAnimating())
+        {
+            glfwWaitEventsTimeout(ON_DEMAND_WAIT_SECONDS);
+
+            // the time spent asleep must not move the camera or the lamp
+            gLastFrame = glfwGetTime();
+            continue;
+        }
+
+        // Render this frame, the worker only touches the scene between run and wait
+        UUploadFrame(*submitPacket);
+        gFrameWorker.run([buildPacket]() { UBuildFrame(*buildPacket); });
+        ULatchCamera(*submitPacket);
+        USubmitFrame(*submitPacket);
+        gFramePacer.endFrame();
+        if (!gIsFirstFrameDrawn)
+        {
+            cout << "First frame after " << (glfwGetTime() - gProgramStart) * 1000.0 << " ms, "
+                << gProgramBuilder.pendingCount() << " shader programs still building" << endl;
+            gIsFirstFrameDrawn = true;
+        }
+        gFrameWorker.wait();
+        if (gPendingRedraws > 0)
+            gPendingRedraws--;
+
+        UShowFrameStats();
+        if (gIsHeadless)
+            URecordFrameTiming();
+        std::swap(submitPacket, buildPacket);
+    }
+
+    if (gIsHeadless)
+    {
+        if (!gFrameTimingLog.writeJson(gTimingFilename, (const char*)glGetString(GL_RENDERER), gFrameWidth, gFrameHeight))
+            cout << "Failed to write " << gTimingFilename << endl;
+        else
+            cout << gFrameTimingLog.size() << " frames, median " << gFrameTimingLog.medianFrameMs() << " ms, timings in " << gTimingFilename << endl;
+
+        if (gImageFilename && !UWriteImage(gImageFilename))
+            cout << "Failed to write " << gImageFilename << endl;
+        else if (gImageFilename && gIsPathTracing)
+            cout << gPathTracer.getSampleCount() << " path traced samples in " << gImageFilename << endl;
     }
 
     // Release mesh data, textures, and shader program
+    gFramePacer.destroy();
+    gProgramBuilder.destroy();
+    gShaderWatcher.destroy();
+    if (gCompileWindow)
+        glfwDestroyWindow(gCompileWindow);
     UDestroyMesh(gMesh);
+    gInstances.destroy();
+    gClusteredLights.destroy();
+    gGBuffer.destroy();
+    gShadingTimer.destroy();
+    gShadowMaps.destroy();
+    gProbes.destroy();
+    gShadowInstances.destroy();
+    glDeleteVertexArrays(1, &gShadowVao);
+    glDeleteTextures(1, &gLightmapTexture);
+    glDeleteTextures(1, &gLightmapRectsTexture);
+    glDeleteBuffers(1, &gLightmapRectsBuffer);
+    glDeleteBuffers(1, &gBakedVertexVbo);
     UDestroyTexture(gTextureIdBlack);
     UDestroyTexture(gTextureIdScreen);
     UDestroyTexture(gTextureIdWood);
     UDestroyTexture(gTextureIdKeyboard);
     UDestroyTexture(gTextureIdPhoto);
-    UDestroyShaderProgram(gObjectsProgramId);
+    gObjectsPrograms.destroy();
+    gGBufferPipeline.destroy();
     UDestroyShaderProgram(gLampProgramId);
+    UDestroyShaderProgram(gGBufferProgramId);
+    UDestroyShaderProgram(gDeferredLightingProgramId);
+    UDestroyShaderProgram(gShadowProgramId);
+    UDestroyShaderProgram(gFallbackProgramId);
 
     exit(EXIT_SUCCESS); // Terminates the program
 }
@@ -311,17 +1221,25 @@ int main(int argc, char* argv[])
 // Initialize GLFW, GLEW, and create a window
 bool UInitialize(int argc, char* argv[], GLFWwindow** window)
 {
-    glfwInit();
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 4);
-    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
-
-#ifdef __APPLE__
-    glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+#ifdef GLFW_PLATFORM_NULL
+    // headless: the null platform of GLFW 3.4 needs no display, its contexts come from OSMesa
+    if (gIsHeadless)
+        glfwInitHint(GLFW_PLATFORM, GLFW_PLATFORM_NULL);
 #endif
+    glfwInit();
 
     // GLFW: window creation
-    * window = glfwCreateWindow(WINDOW_WIDTH, WINDOW_HEIGHT, WINDOW_TITLE, NULL, NULL);
+    * window = UCreateWindow();
+#ifdef GLFW_PLATFORM_NULL
+    // without OSMesa, fall back to an invisible window on the regular platform
+    if (*window == NULL && gIsHeadless)
+    {
+        glfwTerminate();
+        glfwInitHint(GLFW_PLATFORM, GLFW_ANY_PLATFORM);
+        glfwInit();
+        *window = UCreateWindow();
+    }
+#endif
     if (*window == NULL)
     {
         std::cout << "Failed to create GLFW window" << std::endl;
@@ -333,9 +1251,12 @@ bool UInitialize(int argc, char* argv[], GLFWwindow** window)
     glfwSetCursorPosCallback(*window, UMousePositionCallback);
     glfwSetScrollCallback(*window, UMouseScrollCallback);
     glfwSetMouseButtonCallback(*window, UMouseButtonCallback);
+    glfwSetKeyCallback(*window, UKeyCallback);
+    glfwSetWindowRefreshCallback(*window, UWindowRefreshCallback);
 
     // capture mouse movement
-    glfwSetInputMode(*window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
+    if (!gIsHeadless)
+        glfwSetInputMode(*window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
 
     // GLEW: initialize
     glewExperimental = GL_TRUE;
@@ -353,10 +1274,29 @@ bool UInitialize(int argc, char* argv[], GLFWwindow** window)
 }
 
 
+// Create the window and its OpenGL 4.4 context; headless runs keep it hidden
+GLFWwindow* UCreateWindow()
+{
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 4);
+    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+
+#ifdef __APPLE__
+    glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+#endif
+
+    if (gIsHeadless)
+        glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+
+    return glfwCreateWindow(gFrameWidth, gFrameHeight, WINDOW_TITLE, NULL, NULL);
+}
+
+
 // process input
 void UProcessInput(GLFWwindow* window)
 {
     static const float cameraSpeed = 2.0f;
+    const glm::vec3 lastCameraPosition = gCamera.Position;
 
     if (glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS)
         glfwSetWindowShouldClose(window, true);
@@ -379,24 +1319,160 @@ void UProcessInput(GLFWwindow* window)
     if (glfwGetKey(window, GLFW_KEY_E) == GLFW_PRESS)
         gCamera.ProcessKeyboard(DOWN, gDeltaTime);
 
+    // held movement keys send no events, so the camera itself says whether it moved
+    if (gCamera.Position != lastCameraPosition)
+        URequestRedraw();
+
     static bool isJKeyDown = false;
     if (glfwGetKey(window, GLFW_KEY_J) == GLFW_PRESS && !gIsLampOrbiting)
         gIsLampOrbiting = true;
     else if (glfwGetKey(window, GLFW_KEY_K) == GLFW_PRESS && gIsLampOrbiting)
         gIsLampOrbiting = false;
 
-}
+    // O shows the office floor, P goes back to the single desk
+    if (glfwGetKey(window, GLFW_KEY_O) == GLFW_PRESS && !gIsOfficeFloor)
+    {
+        gIsOfficeFloor = true;
+        gInstancesDirty = true;
+    }
+    else if (glfwGetKey(window, GLFW_KEY_P) == GLFW_PRESS && gIsOfficeFloor)
+    {
+        gIsOfficeFloor = false;
+        gInstancesDirty = true;
+    }
 
+    if (glfwGetKey(window, GLFW_KEY_B) == GLFW_PRESS && !gIsBVHCulling)
+        gIsBVHCulling = true;
+    else if (glfwGetKey(window, GLFW_KEY_N) == GLFW_PRESS && gIsBVHCulling)
+        gIsBVHCulling = false;
 
-void UResizeWindow(GLFWwindow* window, int width, int height)
-{
-    glViewport(0, 0, width, height);
-}
+    if (glfwGetKey(window, GLFW_KEY_C) == GLFW_PRESS && !gIsOcclusionCulling)
+        gIsOcclusionCulling = true;
+    else if (glfwGetKey(window, GLFW_KEY_V) == GLFW_PRESS && gIsOcclusionCulling)
+        gIsOcclusionCulling = false;
 
+    if (UKeyPressed(window, GLFW_KEY_L))
+        gIsClusteredLighting = !gIsClusteredLighting;
 
-// whenever the mouse moves, this callback is called
-void UMousePositionCallback(GLFWwindow* window, double xpos, double ypos)
-{
+    if (UKeyPressed(window, GLFW_KEY_G))
+        gIsDeferredShading = !gIsDeferredShading;
+
+    if (UKeyPressed(window, GLFW_KEY_H))
+        gIsShadowing = !gIsShadowing;
+
+    if (UKeyPressed(window, GLFW_KEY_M))
+        gIsLightmapping = !gIsLightmapping;
+
+    if (UKeyPressed(window, GLFW_KEY_U))
+        gIsAmbientOcclusion = !gIsAmbientOcclusion;
+
+    if (UKeyPressed(window, GLFW_KEY_T))
+        gIsProbeLighting = !gIsProbeLighting;
+
+    if (UKeyPressed(window, GLFW_KEY_EQUAL) && gPointLightCount < MAX_POINT_LIGHTS)
+    {
+        gPointLightCount *= 2;
+        gPointLightsDirty = true;
+    }
+    else if (UKeyPressed(window, GLFW_KEY_MINUS) && gPointLightCount > 1)
+    {
+        gPointLightCount /= 2;
+        gPointLightsDirty = true;
+    }
+
+}
+
+
+// true only on the frame a key goes down
+bool UKeyPressed(GLFWwindow* window, int key)
+{
+    static bool wasDown[GLFW_KEY_LAST + 1] = {};
+
+    bool isDown = glfwGetKey(window, key) == GLFW_PRESS;
+    bool isPressed = isDown && !wasDown[key];
+    wasDown[key] = isDown;
+    return isPressed;
+}
+
+
+// Every key press or release may toggle something, so it is redrawn for
+void UKeyCallback(GLFWwindow* window, int key, int scancode, int action, int mods)
+{
+    URequestRedraw();
+}
+
+
+// the window was uncovered or otherwise lost its contents
+void UWindowRefreshCallback(GLFWwindow* window)
+{
+    URequestRedraw();
+}
+
+
+// Draw the next frames even in on demand mode; called for anything that changes what is
+// on screen outside of the animations, such as input, resizing or newly loaded resources
+void URequestRedraw()
+{
+    // two frames: the one already built on the frame worker predates the change
+    gPendingRedraws = 2;
+}
+
+
+// true while something moves on its own, which needs every frame drawn
+bool UIsAnimating()
+{
+    // the point lights circle around their centers
+    return gIsLampOrbiting || gIsClusteredLighting;
+}
+
+
+// Place the camera where the path is at the current headless frame; without a path it stays put
+void UFollowCameraPath()
+{
+    if (gCameraPath.empty())
+        return;
+
+    float t = gHeadlessFrameCount > 1 ? (float)gHeadlessFrame / (gHeadlessFrameCount - 1) : 0.0f;
+    CameraKey key = gCameraPath.sample(t);
+    gCamera.Position = key.position;
+    gCamera.Yaw = key.yaw;
+    gCamera.Pitch = key.pitch;
+    gCamera.Zoom = key.zoom;
+
+    // recomputes the camera vectors from the new angles
+    gCamera.ProcessMouseMovement(0.0f, 0.0f);
+}
+
+
+// Log the timings of the frame just submitted, and close the window after the last headless frame
+void URecordFrameTiming()
+{
+    double now = glfwGetTime();
+
+    FrameTiming timing;
+    timing.frameMs = (now - gLastFrameEnd) * 1000.0;
+    timing.buildMs = gFrameStats.buildMs;
+    timing.submitMs = gFrameStats.submitMs;
+    timing.gpuMs = gFrameStats.shadingGpuMs;
+    gFrameTimingLog.add(timing);
+    gLastFrameEnd = now;
+
+    if (++gHeadlessFrame >= gHeadlessFrameCount)
+        glfwSetWindowShouldClose(gWindow, GLFW_TRUE);
+}
+
+
+void UResizeWindow(GLFWwindow* window, int width, int height)
+{
+    glViewport(0, 0, width, height);
+    gGBuffer.resize(width, height);
+    URequestRedraw();
+}
+
+
+// whenever the mouse moves, this callback is called
+void UMousePositionCallback(GLFWwindow* window, double xpos, double ypos)
+{
     if (gFirstMouse)
     {
         gLastX = xpos;
@@ -411,6 +1487,7 @@ void UMousePositionCallback(GLFWwindow* window, double xpos, double ypos)
     gLastY = ypos;
 
     gCamera.ProcessMouseMovement(xoffset, yoffset);
+    URequestRedraw();
 }
 
 
@@ -418,6 +1495,7 @@ void UMousePositionCallback(GLFWwindow* window, double xpos, double ypos)
 void UMouseScrollCallback(GLFWwindow* window, double xoffset, double yoffset)
 {
     gCamera.ProcessMouseScroll(yoffset);
+    URequestRedraw();
 }
 
 // handle mouse button events
@@ -428,7 +1506,18 @@ void UMouseButtonCallback(GLFWwindow* window, int button, int action, int mods)
     case GLFW_MOUSE_BUTTON_LEFT:
     {
         if (action == GLFW_PRESS)
+        {
             cout << "Left mouse button pressed" << endl;
+
+            // pick the object in the center of the view
+            float distance = 100.0f;
+            int primitive = gSceneBVH.raycast(gCamera.Position, gCamera.Front, distance);
+            if (primitive >= 0)
+            {
+                UPrintPrimitive(primitive);
+                cout << " at distance " << distance << endl;
+            }
+        }
         else
             cout << "Left mouse button released" << endl;
     }
@@ -437,7 +1526,19 @@ void UMouseButtonCallback(GLFWwindow* window, int button, int action, int mods)
     case GLFW_MOUSE_BUTTON_MIDDLE:
     {
         if (action == GLFW_PRESS)
+        {
             cout << "Middle mouse button pressed" << endl;
+
+            // list everything near the camera
+            gQueryResult.clear();
+            gSceneBVH.queryProximity(gCamera.Position, PROXIMITY_RADIUS, gQueryResult);
+            cout << gQueryResult.size() << " objects within " << PROXIMITY_RADIUS << " units" << endl;
+            for (size_t i = 0; i < gQueryResult.size(); ++i)
+            {
+                UPrintPrimitive(gQueryResult[i]);
+                cout << endl;
+            }
+        }
         else
             cout << "Middle mouse button released" << endl;
     }
@@ -459,10 +1560,12 @@ void UMouseButtonCallback(GLFWwindow* window, int button, int action, int mods)
 }
 
 
-// render function
-void URender()
+// Simulate the lamp, cull the instances and record the draw commands of a frame.
+// No GL calls in here, so that it can run on the frame worker.
+void UBuildFrame(FramePacket& frame)
 {
-    
+    double start = glfwGetTime();
+
     const float angularVelocity = glm::radians(45.0f);
 
     if (gIsLampOrbiting)
@@ -473,89 +1576,676 @@ void URender()
         gLightPosition.z = newPosition.z;
     }
 
-    glEnable(GL_DEPTH_TEST);
+    // the lamp is the only moving object, refit its path in the scene BVH
+    glm::mat4 model = glm::translate(gLightPosition) * glm::scale(gLightScale);
+    if (gIsLampOrbiting && gLampPrimitive >= 0)
+        gSceneBVH.update(gLampPrimitive, transformBounds(gLampBounds, model));
+
+    frame.view = gCamera.GetViewMatrix();
+    frame.projection = glm::perspective(glm::radians(gCamera.Zoom), (GLfloat)gFrameWidth / (GLfloat)gFrameHeight, 0.1f, 100.0f);
+    frame.viewCorrection = glm::mat4(1.0f);
+    frame.cameraPosition = gCamera.Position;
+    frame.zoom = gCamera.Zoom;
+    frame.lightPosition = gLightPosition;
+    frame.lampModel = model;
+
+    frame.isSceneRebuilt = gInstancesDirty;
+    if (gInstancesDirty)
+    {
+        UBuildInstances();
+        UUpdateInstanceBounds();
+        gInstancesDirty = false;
+    }
 
-    glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    // only instances inside the view frustum go to the instance buffer, with their
+    // transforms for this view computed in one batch
+    glm::mat4 viewProjection = frame.projection * frame.view;
+    UCullInstances(viewProjection);
+    UBuildDrawCommands(frame, viewProjection);
+
+    AABB lampBounds = transformBounds(gLampBounds, model);
+    frame.isLampVisible = isVisible(extractFrustum(viewProjection), lampBounds);
+    if (!frame.isLampVisible)
+        gFrameStats.culledObjects++;
+    else if (gIsOcclusionCulling && gOcclusionCuller.isOccluded(lampBounds))
+    {
+        frame.isLampVisible = false;
+        gFrameStats.occludedObjects++;
+    }
+    else
+        gFrameStats.visibleObjects++;
 
-    glBindVertexArray(gMesh.vao);
+    // bin the point lights into the clusters of this view
+    frame.isClusteredLighting = gIsClusteredLighting;
+    gFrameStats.lightBinningMs = 0.0;
+    if (gIsClusteredLighting)
+    {
+        UUpdatePointLights(frame.view);
+        frame.clusterDepthScaleBias = gClusteredLights.depthScaleBias();
+    }
+
+    gFrameStats.buildMs = (glfwGetTime() - start) * 1000.0;
+}
+
+
+// Pack the visible instances object by object and record one draw per object and job.
+// Every job takes a contiguous range of instances; the visible instances are counted
+// first so that each job writes its own straight to their place in the frame.
+void UBuildDrawCommands(FramePacket& frame, const glm::mat4& viewProjection)
+{
+    size_t instanceCount = gInstanceVisibility.size();
+    int jobCount = jobCountFor(instanceCount, INSTANCES_PER_JOB);
+    size_t jobSize = (instanceCount + jobCount - 1) / jobCount;
+
+    // first culler index of every object
+    size_t objectStart[OBJECT_COUNT + 1];
+    objectStart[0] = 0;
+    for (int i = 0; i < OBJECT_COUNT; ++i)
+        objectStart[i + 1] = objectStart[i] + gInstances.batches[gObjects[i].batch].instances.size();
+
+    // visible instances of every object within the range of every job
+    vector<size_t> counts(jobCount * OBJECT_COUNT);
+    parallelFor(jobCount, jobCount, [&](size_t firstJob, size_t lastJob)
+    {
+        for (size_t job = firstJob; job < lastJob; ++job)
+        {
+            for (int i = 0; i < OBJECT_COUNT; ++i)
+            {
+                size_t begin = max(job * jobSize, objectStart[i]);
+                size_t end = min((job + 1) * jobSize, objectStart[i + 1]);
+                size_t count = 0;
+                for (size_t k = begin; k < end; ++k)
+                    count += gInstanceVisibility[k];
+                counts[job * OBJECT_COUNT + i] = count;
+            }
+        }
+    });
+
+    // object major, so that the instances of an object stay contiguous over the jobs
+    vector<size_t> offsets(counts.size());
+    size_t visibleCount = 0;
+    for (int i = 0; i < OBJECT_COUNT; ++i)
+    {
+        for (int job = 0; job < jobCount; ++job)
+        {
+            offsets[job * OBJECT_COUNT + i] = visibleCount;
+            visibleCount += counts[job * OBJECT_COUNT + i];
+        }
+    }
+    frame.instances.resize(visibleCount);
+    frame.jobCommands.resize(jobCount);
+
+    parallelFor(jobCount, jobCount, [&](size_t firstJob, size_t lastJob)
+    {
+        for (size_t job = firstJob; job < lastJob; ++job)
+        {
+            vector<DrawCommand>& commands = frame.jobCommands[job];
+            commands.clear();
+            for (int i = 0; i < OBJECT_COUNT; ++i)
+            {
+                size_t count = counts[job * OBJECT_COUNT + i];
+                if (count == 0)
+                    continue;
+
+                const InstanceBatch& batch = gInstances.batches[gObjects[i].batch];
+                size_t offset = offsets[job * OBJECT_COUNT + i];
+                size_t begin = max(job * jobSize, objectStart[i]);
+                size_t end = min((job + 1) * jobSize, objectStart[i + 1]);
+
+                InstanceData* instances = &frame.instances[offset];
+                size_t written = 0;
+                for (size_t k = begin; k < end; ++k)
+                {
+                    if (gInstanceVisibility[k])
+                        instances[written++] = batch.instances[k - objectStart[i]];
+                }
+                computeMVPs(viewProjection, instances, count);
+
+                // a draw per run of instances whose materials use the same shader variant
+                GLuint texture = *gObjects[i].textureId;
+                for (size_t runStart = 0, runEnd = 0; runStart < count; runStart = runEnd)
+                {
+                    uint32_t features = UDrawFeatures(i, instances[runStart].materialId);
+                    for (runEnd = runStart + 1; runEnd < count; ++runEnd)
+                    {
+                        if (UDrawFeatures(i, instances[runEnd].materialId) != features)
+                            break;
+                    }
+
+                    DrawCommand command = { drawSortKey(ShaderPermutations::variantId(features), texture, i), texture, features,
+                        gObjects[i].first, gObjects[i].count, (GLuint)(offset + runStart), (GLsizei)(runEnd - runStart) };
+                    commands.push_back(command);
+                }
+            }
+        }
+    });
+
+    mergeCommandLists(frame.jobCommands, frame.commands);
+}
+
+
+// Send what was built for a frame to the GPU, while the frame worker is idle
+void UUploadFrame(const FramePacket& frame)
+{
+    // the lightmap and the probes follow the scene as well
+    if (frame.isSceneRebuilt)
+    {
+        UBuildShadowCasters();
+        UBuildPathTracerDraws();
+        gLightmapDirty = true;
+        gProbeGridDirty = true;
+    }
+
+    // the lightmap follows the lamp once it stops somewhere new
+    bool isLightmapStale = gLightmapDirty || frame.lightPosition != gLightmapLightPosition;
+    if (gIsLightmapping && isLightmapStale && !gIsLampOrbiting && !gIsSoftwareRendering && !gIsPathTracing)
+        UBakeLightmap(frame);
+
+    // the probes follow the lamp even while it moves
+    if (gIsProbeLighting && !gIsSoftwareRendering && !gIsPathTracing)
+        UUpdateProbes(frame);
 
-    glUseProgram(gObjectsProgramId);
+    gInstances.upload(frame.instances.data(), frame.instances.size());
 
-    glm::mat4 model = glm::translate(gObjectsPosition) * glm::scale(gObjectsScale);
+    if (frame.isClusteredLighting)
+        gClusteredLights.upload();
+}
+
+
+// Late latch: move a frame that was built a frame ago to the camera as it is now, right
+// before it is drawn. The instance transforms stay as built; the objects shader applies
+// the difference as a clip space correction. Culling and light binning keep the built
+// view, which only shows at the screen edges during fast turns.
+void ULatchCamera(FramePacket& frame)
+{
     glm::mat4 view = gCamera.GetViewMatrix();
-    glm::mat4 projection = glm::perspective(glm::radians(gCamera.Zoom), (GLfloat)WINDOW_WIDTH / (GLfloat)WINDOW_HEIGHT, 0.1f, 100.0f);
+    glm::mat4 projection = glm::perspective(glm::radians(gCamera.Zoom), (GLfloat)gFrameWidth / (GLfloat)gFrameHeight, 0.1f, 100.0f);
 
-    // passes transform matrices to the Shader program
-    GLint modelLoc = glGetUniformLocation(gObjectsProgramId, "model");
-    GLint viewLoc = glGetUniformLocation(gObjectsProgramId, "view");
-    GLint projLoc = glGetUniformLocation(gObjectsProgramId, "projection");
+    // a still camera keeps the exact built transforms
+    if (view == frame.view && projection == frame.projection)
+        return;
 
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
-    glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
-    glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projection));
+    frame.viewCorrection = projection * view * glm::inverse(frame.projection * frame.view);
+    frame.view = view;
+    frame.projection = projection;
+    frame.cameraPosition = gCamera.Position;
+    frame.zoom = gCamera.Zoom;
+}
 
-    // uniform location from the object color, light color, light position, and camera position
-    GLint objectColorLoc = glGetUniformLocation(gObjectsProgramId, "objectColor");
-    GLint lightColorLoc = glGetUniformLocation(gObjectsProgramId, "lightColor");
-    GLint lightPositionLoc = glGetUniformLocation(gObjectsProgramId, "lightPos");
-    GLint viewPositionLoc = glGetUniformLocation(gObjectsProgramId, "viewPosition");
 
-    // Pass color, light, and camera data
-    glUniform3f(objectColorLoc, gObjectColor.r, gObjectColor.g, gObjectColor.b);
-    glUniform3f(lightColorLoc, gLightColor.r, gLightColor.g, gLightColor.b);
-    glUniform3f(lightPositionLoc, gLightPosition.x, gLightPosition.y, gLightPosition.z);
-    const glm::vec3 cameraPosition = gCamera.Position;
-    glUniform3f(viewPositionLoc, cameraPosition.x, cameraPosition.y, cameraPosition.z);
+// Draw an uploaded frame and present it
+void USubmitFrame(const FramePacket& frame)
+{
+    double start = glfwGetTime();
 
-    GLint UVScaleLoc = glGetUniformLocation(gObjectsProgramId, "uvScale");
-    glUniform2fv(UVScaleLoc, 1, glm::value_ptr(gUVScale));
+    // the CPU backends draw the whole frame, GL only shows it
+    if (gIsSoftwareRendering || gIsPathTracing)
+    {
+        if (gIsPathTracing)
+            UPathTrace(frame);
+        else
+            USoftwareRender(frame);
+        gFrameStats.submitMs = (glfwGetTime() - start) * 1000.0;
+        if (!gIsHeadless)
+            glfwSwapBuffers(gWindow);
+        return;
+    }
 
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, gTextureIdBlack);
-    glDrawArrays(GL_TRIANGLES, 0, 96);
+    glEnable(GL_DEPTH_TEST);
 
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, gTextureIdScreen);
-    glDrawArrays(GL_TRIANGLES, 96, 6);
+    glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, gTextureIdWood);
-    glDrawArrays(GL_TRIANGLES, 102, 6);
+    UUpdateShadows(frame);
+
+    gShadingTimer.begin();
+
+    // with dynamic resolution the scene goes to the lit image, forward or deferred,
+    // and is scaled up to the window at the end
+    if (gIsDynamicResolution)
+        gGBuffer.setRenderSize(gDynamicResolution.scaledSize(gGBuffer.getWidth()), gDynamicResolution.scaledSize(gGBuffer.getHeight()));
+    else
+        gGBuffer.setRenderSize(gGBuffer.getWidth(), gGBuffer.getHeight());
+    // each path waits for all of its programs, the shadow maps included; until the forward
+    // path has them the objects are drawn forward with the unlit fallback
+    bool isGBufferReady = gGBufferPipeline.update(gObjectsPrograms.vertexStage(0), gGBufferProgramId, gProgramBuilder.rebuildCount());
+    bool isDeferred = gIsDeferredShading && isGBufferReady && gDeferredLightingProgramId != 0 && gShadowProgramId != 0;
+    bool isFallback = !isDeferred && gShadowProgramId == 0;
+    bool isOffscreen = isDeferred || gIsDynamicResolution || gIsHeadless;
+
+    // the deferred path draws the objects into the G-buffer and lights them afterwards
+    if (isDeferred)
+        gGBuffer.bindGeometry();
+    else if (isOffscreen)
+        gGBuffer.bindForward();
 
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, gTextureIdBlack);
-    glDrawArrays(GL_TRIANGLES, 108, 30);
+    glBindVertexArray(gMesh.vao);
 
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, gTextureIdKeyboard);
-    glDrawArrays(GL_TRIANGLES, 138, 6);
+    // the baked light only holds for the lamp position it was baked at
+    bool isLightmapped = gIsLightmapping && gIsLightmapBaked && frame.lightPosition == gLightmapLightPosition;
+    if (!isDeferred && gIsProbeLighting)
+        gProbes.bind(PROBE_TEXTURE_UNIT);
+    if (!isDeferred && isLightmapped)
+    {
+        glActiveTexture(GL_TEXTURE0 + LIGHTMAP_TEXTURE_UNIT);
+        glBindTexture(GL_TEXTURE_2D, gLightmapTexture);
+        glActiveTexture(GL_TEXTURE0 + LIGHTMAP_RECTS_TEXTURE_UNIT);
+        glBindTexture(GL_TEXTURE_BUFFER, gLightmapRectsTexture);
+        glActiveTexture(GL_TEXTURE0);
+    }
+
+    // draw every visible instance of each object; forward, the commands of each shader
+    // variant follow each other and are drawn with its pipeline
+    uint32_t frameFeatures = (isLightmapped ? FEATURE_LIGHTMAP : 0) | (gIsShadowing ? FEATURE_SHADOWS : 0) |
+        (frame.isClusteredLighting ? FEATURE_POINT_LIGHTS : 0) | (gIsProbeLighting ? FEATURE_PROBES : 0);
+    const vector<DrawCommand>& commands = frame.commands;
+    for (size_t begin = 0, end = 0; begin < commands.size(); begin = end)
+    {
+        for (end = begin + 1; end < commands.size() && !isDeferred; ++end)
+        {
+            if (commands[end].features != commands[begin].features)
+                break;
+        }
+        if (isDeferred)
+            end = commands.size();
+
+        const ProgramPipeline* pipeline = &gGBufferPipeline;
+        if (!isDeferred)
+            pipeline = isFallback ? NULL : UObjectsPipeline(commands[begin].features | frameFeatures);
+
+        // the fallback is a whole program; the uniforms of a pipeline go to the stage that has them
+        if (pipeline == NULL)
+        {
+            glUseProgram(gFallbackProgramId);
+            glUniform2fv(glGetUniformLocation(gFallbackProgramId, "uvScale"), 1, glm::value_ptr(gUVScale));
+            glUniformMatrix4fv(glGetUniformLocation(gFallbackProgramId, "viewCorrection"), 1, GL_FALSE, glm::value_ptr(frame.viewCorrection));
+        }
+        else
+        {
+            glUseProgram(0);
+            glBindProgramPipeline(pipeline->getId());
+            GLuint vertexStage = pipeline->getVertexProgram();
+            glActiveShaderProgram(pipeline->getId(), vertexStage);
+            glUniformMatrix4fv(glGetUniformLocation(vertexStage, "viewCorrection"), 1, GL_FALSE, glm::value_ptr(frame.viewCorrection));
+            glUniform1i(glGetUniformLocation(vertexStage, "isAmbientOccluded"), gIsAmbientOcclusion);
+
+            GLuint fragmentStage = pipeline->getFragmentProgram();
+            glActiveShaderProgram(pipeline->getId(), fragmentStage);
+            glUniform2fv(glGetUniformLocation(fragmentStage, "uvScale"), 1, glm::value_ptr(gUVScale));
+            if (!isDeferred)
+                USetObjectsUniforms(fragmentStage, frame, isOffscreen);
+        }
+
+        replayCommands(&commands[begin], end - begin);
+    }
+    glBindProgramPipeline(0);
+
+    if (isDeferred)
+    {
+        UDeferredLighting(frame);
+
+        // the lamp is drawn forward on top of the lit image
+        gGBuffer.bindLit();
+        glBindVertexArray(gMesh.vao);
+    }
 
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, gTextureIdPhoto);
-    glDrawArrays(GL_TRIANGLES, 144, 36);
-    
     // draw lamp
     glUseProgram(gLampProgramId);
 
-    model = glm::translate(gLightPosition) * glm::scale(gLightScale);
-
     // uniforms from the lamp shader program
-    modelLoc = glGetUniformLocation(gLampProgramId, "model");
-    viewLoc = glGetUniformLocation(gLampProgramId, "view");
-    projLoc = glGetUniformLocation(gLampProgramId, "projection");
+    GLint modelLoc = glGetUniformLocation(gLampProgramId, "model");
+    GLint viewLoc = glGetUniformLocation(gLampProgramId, "view");
+    GLint projLoc = glGetUniformLocation(gLampProgramId, "projection");
 
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
-    glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
-    glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projection));
+    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(frame.lampModel));
+    glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(frame.view));
+    glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(frame.projection));
 
     // Draws the triangles
-    glDrawArrays(GL_TRIANGLES, 60, 36);
+    if (frame.isLampVisible && gLampProgramId != 0)
+        glDrawArrays(GL_TRIANGLES, 60, 36);
 
     glBindVertexArray(0);
     glUseProgram(0);
-    
-    glfwSwapBuffers(gWindow);
+
+    // headless frames stay in the lit image, there is nothing to present them on
+    if (isOffscreen && !gIsHeadless)
+        gGBuffer.blitToScreen();
+
+    gShadingTimer.end();
+    gFrameStats.shadingGpuMs = gShadingTimer.milliseconds();
+
+    // the timer results arrive as many frames late as it has queries
+    if (gIsDynamicResolution)
+        gDynamicResolution.update(gFrameStats.shadingGpuMs, GpuTimer::QUERY_COUNT);
+    gFrameStats.resolutionScale = gDynamicResolution.getScale();
+    gFrameStats.submitMs = (glfwGetTime() - start) * 1000.0;
+
+    if (!gIsHeadless)
+        glfwSwapBuffers(gWindow);
+}
+
+
+// Draw a frame with the software rasterizer and copy it to the window through the lit image
+void USoftwareRender(const FramePacket& frame)
+{
+    double start = glfwGetTime();
+
+    // the same size as the GL path renders at, the window framebuffer
+    gSoftwareRasterizer.resize(gGBuffer.getWidth(), gGBuffer.getHeight());
+    RasterLighting lighting = { frame.lightPosition, gLightColor, frame.cameraPosition, gUVScale };
+    gSoftwareRasterizer.beginFrame(lighting);
+
+    // every instance of the draw commands, in replay order
+    for (const DrawCommand& command : frame.commands)
+    {
+        const RasterTexture* texture = USoftwareTexture(command.texture);
+        for (GLsizei i = 0; i < command.instanceCount; ++i)
+        {
+            const InstanceData& instance = frame.instances[command.baseInstance + i];
+            RasterDraw draw;
+            draw.vertices = gMeshVertices.data();
+            draw.first = command.first;
+            draw.count = command.count;
+            draw.texture = texture;
+            draw.mvp = frame.viewCorrection * instance.mvp;
+            draw.model = instance.model;
+            draw.normalMatrix = glm::mat3(glm::vec3(instance.normalMatrix[0]), glm::vec3(instance.normalMatrix[1]), glm::vec3(instance.normalMatrix[2]));
+            draw.material = instance.materialId;
+            gSoftwareRasterizer.addDraw(draw);
+        }
+    }
+
+    // the lamp, unlit
+    if (frame.isLampVisible)
+    {
+        RasterDraw lamp;
+        lamp.vertices = gMeshVertices.data();
+        lamp.first = 60;
+        lamp.count = 36;
+        lamp.texture = nullptr;
+        lamp.mvp = frame.projection * frame.view * frame.lampModel;
+        lamp.model = frame.lampModel;
+        lamp.normalMatrix = glm::mat3(1.0f);
+        lamp.material = 0;
+        gSoftwareRasterizer.addDraw(lamp);
+    }
+
+    gSoftwareRasterizer.render();
+    gFrameStats.softwareMs = (glfwGetTime() - start) * 1000.0;
+    gFrameStats.softwareTriangles = gSoftwareRasterizer.triangleCount();
+
+    gGBuffer.uploadLit(gSoftwareRasterizer.pixels());
+    gGBuffer.setRenderSize(gGBuffer.getWidth(), gGBuffer.getHeight());
+    if (!gIsHeadless)
+        gGBuffer.blitToScreen();
+}
+
+
+// Add a path traced sample to the accumulated image and show it through the lit image
+void UPathTrace(const FramePacket& frame)
+{
+    double start = glfwGetTime();
+
+    gPathTracer.resize(gGBuffer.getWidth(), gGBuffer.getHeight());
+    RasterLighting lighting = { frame.lightPosition, gLightColor, frame.cameraPosition, gUVScale };
+    gPathTracer.beginScene(lighting, frame.projection * frame.view);
+    for (const RasterDraw& draw : gPathTracerDraws)
+        gPathTracer.addDraw(draw);
+
+    // the lamp whether it was culled or not, the rays find out what is visible
+    RasterDraw lamp;
+    lamp.vertices = gMeshVertices.data();
+    lamp.first = 60;
+    lamp.count = 36;
+    lamp.texture = nullptr;
+    lamp.mvp = frame.projection * frame.view * frame.lampModel;
+    lamp.model = frame.lampModel;
+    lamp.normalMatrix = glm::mat3(1.0f);
+    lamp.material = 0;
+    gPathTracer.addDraw(lamp);
+    gPathTracer.endScene();
+
+    gPathTracer.renderSample();
+    double seconds = glfwGetTime() - start;
+    gFrameStats.softwareMs = seconds * 1000.0;
+    gFrameStats.softwareTriangles = gPathTracer.triangleCount();
+    gFrameStats.pathSamples = gPathTracer.getSampleCount();
+    gFrameStats.pathRaysPerSecond = seconds > 0.0 ? gPathTracer.rayCount() / seconds : 0.0;
+
+    gGBuffer.uploadLit(gPathTracer.pixels());
+    gGBuffer.setRenderSize(gGBuffer.getWidth(), gGBuffer.getHeight());
+    if (!gIsHeadless)
+        gGBuffer.blitToScreen();
+}
+
+
+// Every instance of the scene as draws for the path tracer, which needs the geometry outside the view as well
+void UBuildPathTracerDraws()
+{
+    gPathTracerDraws.clear();
+    for (int i = 0; i < OBJECT_COUNT; ++i)
+    {
+        const RasterTexture* texture = USoftwareTexture(*gObjects[i].textureId);
+        for (const InstanceData& instance : gInstances.batches[gObjects[i].batch].instances)
+        {
+            RasterDraw draw;
+            draw.vertices = gMeshVertices.data();
+            draw.first = gObjects[i].first;
+            draw.count = gObjects[i].count;
+            draw.texture = texture;
+            draw.mvp = instance.mvp;
+            draw.model = instance.model;
+            draw.normalMatrix = glm::mat3(glm::vec3(instance.normalMatrix[0]), glm::vec3(instance.normalMatrix[1]), glm::vec3(instance.normalMatrix[2]));
+            draw.material = instance.materialId;
+            gPathTracerDraws.push_back(draw);
+        }
+    }
+}
+
+
+// Bake the lamp light of the static instances into the lightmap, or load it from the cache
+// file if that holds a bake of the same scene, and upload it with the lightmap uvs
+void UBakeLightmap(const FramePacket& frame)
+{
+    double start = glfwGetTime();
+
+    vector<LightmapObject> objects(OBJECT_COUNT);
+    for (int i = 0; i < OBJECT_COUNT; ++i)
+        objects[i] = { gObjects[i].first, gObjects[i].count };
+
+    // by instance id; the dynamic objects are left out and keep their run time lighting
+    vector<LightmapInstance> instances(gInstances.instanceCount());
+    for (int i = 0; i < OBJECT_COUNT; ++i)
+    {
+        for (const InstanceData& instance : gInstances.batches[gObjects[i].batch].instances)
+        {
+            LightmapInstance& baked = instances[instance.instanceId];
+            baked.object = gObjects[i].isDynamic ? -1 : i;
+            baked.model = instance.model;
+            baked.normalMatrix = glm::mat3(glm::vec3(instance.normalMatrix[0]), glm::vec3(instance.normalMatrix[1]), glm::vec3(instance.normalMatrix[2]));
+        }
+    }
+    if (!gLightmap.build(gMeshVertices.data(), gMeshVertices.size(), objects, instances))
+    {
+        // the instances keep their run time lighting until the scene or the lamp changes
+        cout << "The instances do not fit in a lightmap of " << Lightmap::MAX_SIZE << "x" << Lightmap::MAX_SIZE << endl;
+        gLightmapLightPosition = frame.lightPosition;
+        gLightmapDirty = false;
+        gIsLightmapBaked = false;
+        return;
+    }
+
+    // the cached bake is only good for the same mesh, instances, textures and lamp
+    uint64_t key = hashBytes(gMeshVertices.data(), gMeshVertices.size() * sizeof(RasterVertex));
+    for (const LightmapInstance& instance : instances)
+    {
+        key = hashBytes(&instance.object, sizeof(instance.object), key);
+        key = hashBytes(glm::value_ptr(instance.model), sizeof(instance.model), key);
+    }
+    for (const RasterTexture& texture : gSoftwareTextures)
+        key = hashBytes(texture.texels.data(), texture.texels.size() * sizeof(uint32_t), key);
+    key = hashBytes(glm::value_ptr(frame.lightPosition), sizeof(glm::vec3), key);
+    key = hashBytes(glm::value_ptr(gLightColor), sizeof(glm::vec3), key);
+    key = hashBytes(glm::value_ptr(gUVScale), sizeof(glm::vec2), key);
+
+    bool isCached = gLightmap.load(LIGHTMAP_CACHE_FILENAME, key);
+    if (!isCached)
+    {
+        UUpdateBakeScene(frame);
+        gLightmap.bake(gBakeTracer, LIGHTMAP_SEED, hardwareThreadCount());
+        if (!gLightmap.save(LIGHTMAP_CACHE_FILENAME, key))
+            cout << "Failed to write " << LIGHTMAP_CACHE_FILENAME << endl;
+    }
+
+    if (gLightmapTexture == 0)
+    {
+        glGenTextures(1, &gLightmapTexture);
+        glGenTextures(1, &gLightmapRectsTexture);
+        glGenBuffers(1, &gLightmapRectsBuffer);
+    }
+
+    // the uvs go next to the ambient occlusion
+    const vector<glm::vec2>& uvs = gLightmap.getUvs();
+    for (size_t i = 0; i < uvs.size(); ++i)
+    {
+        gBakedVertices[i].x = uvs[i].x;
+        gBakedVertices[i].y = uvs[i].y;
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, gBakedVertexVbo);
+    glBufferSubData(GL_ARRAY_BUFFER, 0, gBakedVertices.size() * sizeof(glm::vec3), gBakedVertices.data());
+
+    const vector<glm::vec4>& rects = gLightmap.getRects();
+    glBindBuffer(GL_TEXTURE_BUFFER, gLightmapRectsBuffer);
+    glBufferData(GL_TEXTURE_BUFFER, rects.size() * sizeof(glm::vec4), rects.data(), GL_STATIC_DRAW);
+    glBindTexture(GL_TEXTURE_BUFFER, gLightmapRectsTexture);
+    glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, gLightmapRectsBuffer);
+    glBindTexture(GL_TEXTURE_BUFFER, 0);
+
+    glBindTexture(GL_TEXTURE_2D, gLightmapTexture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB16F, gLightmap.getWidth(), gLightmap.getHeight(), 0, GL_RGB, GL_FLOAT, gLightmap.data());
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    gLightmapLightPosition = frame.lightPosition;
+    gLightmapDirty = false;
+    gIsLightmapBaked = true;
+
+    cout << "Lightmap " << gLightmap.getWidth() << "x" << gLightmap.getHeight() << " at " << gLightmap.getTexelsPerUnit() << " texels per unit, "
+        << (isCached ? "loaded from the cache in " : "baked in ") << (glfwGetTime() - start) * 1000.0 << " ms" << endl;
+}
+
+
+// Give the bake tracer the scene and the lamp light of a frame. The BVH is only rebuilt
+// when the instances changed.
+void UUpdateBakeScene(const FramePacket& frame)
+{
+    RasterLighting lighting = { frame.lightPosition, gLightColor, frame.cameraPosition, gUVScale };
+    gBakeTracer.beginScene(lighting, glm::mat4(1.0f));
+    for (const RasterDraw& draw : gPathTracerDraws)
+        gBakeTracer.addDraw(draw);
+    gBakeTracer.endScene();
+}
+
+
+// Lay the probe grid over the instances when they changed and rebake the probes the lamp
+// or the new grid left out of date, a budget of them per frame
+void UUpdateProbes(const FramePacket& frame)
+{
+    int budget = PROBE_UPDATE_BUDGET;
+    if (gProbeGridDirty)
+    {
+        AABB bounds = { glm::vec3(FLT_MAX), glm::vec3(-FLT_MAX) };
+        for (size_t i = 0; i < gScenePrimitives.size(); ++i)
+        {
+            if (gScenePrimitives[i].object < 0)
+                continue;
+            bounds.min = glm::min(bounds.min, gSceneBVH.primitiveBounds[i].min);
+            bounds.max = glm::max(bounds.max, gSceneBVH.primitiveBounds[i].max);
+        }
+        gProbes.place(bounds, PROBE_SPACING);
+        gProbeLightPosition = frame.lightPosition;
+        gProbeGridDirty = false;
+
+        // a grid that is not baked yet would show no ambient light at all
+        budget = (int)gProbes.probeCount();
+    }
+    else if (frame.lightPosition != gProbeLightPosition)
+    {
+        gProbes.markAllDirty();
+        gProbeLightPosition = frame.lightPosition;
+    }
+
+    if (gProbes.dirtyCount() == 0)
+        return;
+
+    UUpdateBakeScene(frame);
+    gProbes.update(gBakeTracer, budget, hardwareThreadCount());
+}
+
+
+// Bake the ambient occlusion of every vertex of gMesh against the objects of one workstation
+// and create the baked vertex buffer with it
+void UBakeVertexOcclusion()
+{
+    glm::mat4 objectsModel = glm::translate(gObjectsPosition) * glm::scale(gObjectsScale);
+    const float* vertices = &gMeshVertices[0].position.x;
+    const size_t stride = sizeof(RasterVertex) / sizeof(float);
+
+    VertexOcclusionBaker baker;
+    baker.setMaxDistance(AMBIENT_OCCLUSION_DISTANCE);
+    baker.setThreadCount(hardwareThreadCount());
+    for (int i = 0; i < OBJECT_COUNT; ++i)
+        baker.addTriangles(vertices + gObjects[i].first * stride, stride, gObjects[i].count, nullptr, 0, objectsModel);
+    baker.build();
+
+    vector<float> occlusion(gMeshVertices.size());
+    baker.bake(vertices, stride, offsetof(RasterVertex, normal) / sizeof(float), gMeshVertices.size(), objectsModel, occlusion.data());
+
+    gBakedVertices.resize(gMeshVertices.size());
+    for (size_t i = 0; i < gBakedVertices.size(); ++i)
+        gBakedVertices[i] = glm::vec3(0.0f, 0.0f, occlusion[i]);
+
+    glGenBuffers(1, &gBakedVertexVbo);
+    glBindVertexArray(gMesh.vao);
+    glBindBuffer(GL_ARRAY_BUFFER, gBakedVertexVbo);
+    glBufferData(GL_ARRAY_BUFFER, gBakedVertices.size() * sizeof(glm::vec3), gBakedVertices.data(), GL_STATIC_DRAW);
+    glVertexAttribPointer(BAKED_VERTEX_ATTRIB_LOCATION, 3, GL_FLOAT, GL_FALSE, sizeof(glm::vec3), 0);
+    glEnableVertexAttribArray(BAKED_VERTEX_ATTRIB_LOCATION);
+    glBindVertexArray(0);
+}
+
+
+// Write the lit image of the last headless frame to a binary PPM file
+bool UWriteImage(const char* filename)
+{
+    vector<uint32_t> pixels;
+    gGBuffer.readLit(pixels);
+    return writePpm(filename, pixels.data(), gGBuffer.getRenderWidth(), gGBuffer.getRenderHeight());
+}
+
+
+// CPU copy of a texture, null for one the software renderer does not have
+const RasterTexture* USoftwareTexture(GLuint textureId)
+{
+    for (size_t i = 0; i < gSoftwareTextureIds.size(); ++i)
+    {
+        if (gSoftwareTextureIds[i] == textureId)
+            return &gSoftwareTextures[i];
+    }
+    return nullptr;
+}
+
+
+// Build, upload and draw a frame in one go, with nothing overlapped
+void URender()
+{
+    UBuildFrame(gFramePackets[0]);
+    UUploadFrame(gFramePackets[0]);
+    USubmitFrame(gFramePackets[0]);
 }
 
 
@@ -848,6 +2538,23 @@ void UCreateMesh(GLMesh& mesh)
 
     mesh.nVertices = sizeof(verts) / (sizeof(verts[0]) * (floatsPerVertex + floatsPerNormal + floatsPerUV));
 
+    // model space bounds of every object range and of the lamp
+    for (int i = 0; i < OBJECT_COUNT; ++i)
+        gObjects[i].bounds = computeBounds(verts, gObjects[i].first, gObjects[i].count, floatsPerVertex + floatsPerNormal + floatsPerUV);
+    gLampBounds = computeBounds(verts, 60, 36, floatsPerVertex + floatsPerNormal + floatsPerUV);
+
+    // positions are kept on the CPU for the occlusion rasterizer, whole vertices for the software renderer
+    gMeshPositions.resize(mesh.nVertices);
+    gMeshVertices.resize(mesh.nVertices);
+    for (GLuint i = 0; i < mesh.nVertices; ++i)
+    {
+        const GLfloat* vertex = &verts[i * (floatsPerVertex + floatsPerNormal + floatsPerUV)];
+        gMeshPositions[i] = glm::vec3(vertex[0], vertex[1], vertex[2]);
+        gMeshVertices[i].position = gMeshPositions[i];
+        gMeshVertices[i].normal = glm::vec3(vertex[3], vertex[4], vertex[5]);
+        gMeshVertices[i].uv = glm::vec2(vertex[6], vertex[7]);
+    }
+
     glGenVertexArrays(1, &mesh.vao);
     glBindVertexArray(mesh.vao);
 
@@ -876,15 +2583,485 @@ void UDestroyMesh(GLMesh& mesh)
 }
 
 
-// Generate and load textures
-bool UCreateTexture(const char* filename, GLuint& textureId)
+// Create the instance buffer and one batch per scene object
+void UCreateInstances()
 {
-    int width, height, channels;
-    unsigned char* image = stbi_load(filename, &width, &height, &channels, 0);
-    if (image)
+    gInstances.setup(gMesh.vao, INSTANCE_ATTRIB_LOCATION);
+
+    for (int i = 0; i < OBJECT_COUNT; ++i)
+        gObjects[i].batch = gInstances.addBatch();
+
+    // shadow casters only need positions; their batches use the same ids as gInstances
+    glGenVertexArrays(1, &gShadowVao);
+    glBindVertexArray(gShadowVao);
+    glBindBuffer(GL_ARRAY_BUFFER, gMesh.vbo);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(float) * 8, 0);
+    glEnableVertexAttribArray(0);
+    glBindVertexArray(0);
+
+    gShadowInstances.setup(gShadowVao, INSTANCE_ATTRIB_LOCATION);
+    for (int i = 0; i < OBJECT_COUNT; ++i)
+        gShadowInstances.addBatch();
+}
+
+
+// Copy every instance into the shadow caster buffer, none of them culled
+void UBuildShadowCasters()
+{
+    for (int i = 0; i < OBJECT_COUNT; ++i)
+    {
+        int batch = gObjects[i].batch;
+        gShadowInstances.batches[batch].instances = gInstances.batches[batch].instances;
+        gShadowInstances.batches[batch].visible.assign(gInstances.batches[batch].instances.size(), 1);
+    }
+    gShadowInstances.compactAndUpload();
+
+    gShadowMaps.invalidate();
+    gDynamicShadowsDirty = true;
+}
+
+
+// Redraw the cascades whose cached static casters are out of date, then draw the
+// dynamic casters on top if anything under them changed
+void UUpdateShadows(const FramePacket& frame)
+{
+    // the maps stay dirty until the program is built
+    if (!gIsShadowing || gShadowProgramId == 0)
+        return;
+
+    int dirtyMask = gShadowMaps.update(frame.view, glm::radians(frame.zoom), (GLfloat)gFrameWidth / (GLfloat)gFrameHeight, 0.1f,
+        SHADOW_DISTANCE, frame.lightPosition);
+    if (dirtyMask == 0 && !gDynamicShadowsDirty)
+        return;
+
+    glUseProgram(gShadowProgramId);
+    glBindVertexArray(gShadowVao);
+    GLint lightViewProjectionLoc = glGetUniformLocation(gShadowProgramId, "lightViewProjection");
+
+    for (int c = 0; c < CascadedShadowMaps::CASCADE_COUNT; ++c)
     {
-        flipImageVertically(image, width, height, channels);
+        if (!(dirtyMask & (1 << c)))
+            continue;
 
+        gShadowMaps.beginStatic(c);
+        glUniformMatrix4fv(lightViewProjectionLoc, 1, GL_FALSE, glm::value_ptr(gShadowMaps.viewProjection(c)));
+        for (int i = 0; i < OBJECT_COUNT; ++i)
+        {
+            if (!gObjects[i].isDynamic)
+                gShadowInstances.draw(gObjects[i].batch, gObjects[i].first, gObjects[i].count);
+        }
+    }
+
+    gShadowMaps.copyStatic();
+    for (int c = 0; c < CascadedShadowMaps::CASCADE_COUNT; ++c)
+    {
+        gShadowMaps.beginDynamic(c);
+        glUniformMatrix4fv(lightViewProjectionLoc, 1, GL_FALSE, glm::value_ptr(gShadowMaps.viewProjection(c)));
+        for (int i = 0; i < OBJECT_COUNT; ++i)
+        {
+            if (gObjects[i].isDynamic)
+                gShadowInstances.draw(gObjects[i].batch, gObjects[i].first, gObjects[i].count);
+        }
+    }
+
+    gShadowMaps.end();
+    gDynamicShadowsDirty = false;
+}
+
+
+// Fill the batches with either the single desk or the office floor
+void UBuildInstances()
+{
+    gInstances.clearInstances();
+
+    glm::mat4 objectsModel = glm::translate(gObjectsPosition) * glm::scale(gObjectsScale);
+
+    if (!gIsOfficeFloor)
+    {
+        for (int i = 0; i < OBJECT_COUNT; ++i)
+            gInstances.addInstance(gObjects[i].batch, objectsModel, 0);
+        return;
+    }
+
+    // workstations spread out in front of the camera, alternating materials per row
+    for (int row = 0; row < OFFICE_ROWS; ++row)
+    {
+        for (int column = 0; column < OFFICE_COLUMNS; ++column)
+        {
+            glm::vec3 offset((column - OFFICE_COLUMNS / 2) * OFFICE_SPACING.x, 0.0f, -row * OFFICE_SPACING.y);
+            glm::mat4 model = glm::translate(offset) * objectsModel;
+            GLuint materialId = row % MATERIAL_COUNT;
+
+            for (int i = 0; i < OBJECT_COUNT; ++i)
+                gInstances.addInstance(gObjects[i].batch, model, materialId);
+        }
+    }
+}
+
+
+// Transform the object bounds by every instance model matrix and rebuild the scene BVH
+void UUpdateInstanceBounds()
+{
+    size_t instanceCount = gInstances.instanceCount();
+    gCuller.resize(instanceCount);
+    gInstanceVisibility.resize(instanceCount);
+    gScenePrimitives.clear();
+
+    for (int i = 0; i < OBJECT_COUNT; ++i)
+    {
+        const InstanceBatch& batch = gInstances.batches[gObjects[i].batch];
+        for (size_t j = 0; j < batch.instances.size(); ++j)
+            gScenePrimitives.push_back({ i, j });
+    }
+
+    // every instance is transformed on its own, in jobs
+    vector<AABB> bounds(instanceCount);
+    sharedJobSystem().parallelFor(instanceCount, 256, [&](size_t begin, size_t end)
+    {
+        for (size_t k = begin; k < end; ++k)
+        {
+            const GLObject& object = gObjects[gScenePrimitives[k].object];
+            bounds[k] = transformBounds(object.bounds, gInstances.batches[object.batch].instances[gScenePrimitives[k].instance].model);
+            gCuller.setBounds(k, bounds[k]);
+        }
+    });
+
+    // the lamp goes last so that primitive ids match the culler indices
+    gLampPrimitive = (int)bounds.size();
+    bounds.push_back(transformBounds(gLampBounds, glm::translate(gLightPosition) * glm::scale(gLightScale)));
+    gScenePrimitives.push_back({ -1, 0 });
+
+    gSceneBVH.build(bounds);
+}
+
+
+// Test every instance against the view frustum and flag the visible ones in gInstanceVisibility
+void UCullInstances(const glm::mat4& viewProjection)
+{
+    double start = glfwGetTime();
+
+    size_t visibleCount = 0;
+    if (gIsBVHCulling)
+    {
+        // hierarchical query, whole subtrees are accepted or rejected at once
+        gQueryResult.clear();
+        gSceneBVH.queryFrustum(extractFrustum(viewProjection), gQueryResult);
+        std::fill(gInstanceVisibility.begin(), gInstanceVisibility.end(), 0);
+        for (size_t i = 0; i < gQueryResult.size(); ++i)
+        {
+            if (gQueryResult[i] == gLampPrimitive)
+                continue;
+            gInstanceVisibility[gQueryResult[i]] = 1;
+            visibleCount++;
+        }
+    }
+    else
+    {
+        // the SIMD test runs as jobs over ranges of instances
+        Frustum frustum = extractFrustum(viewProjection);
+        atomic<size_t> jobVisibleCount(0);
+        sharedJobSystem().parallelFor(gCuller.size(), INSTANCES_PER_JOB, [&](size_t begin, size_t end)
+        {
+            jobVisibleCount += gCuller.cull(frustum, gInstanceVisibility.data(), begin, end);
+        });
+        visibleCount = jobVisibleCount;
+    }
+
+    gFrameStats.culledObjects = gCuller.size() - visibleCount;
+    gFrameStats.cullingMs = (glfwGetTime() - start) * 1000.0;
+
+    // hidden instances are removed from the frustum culling result
+    gFrameStats.occludedObjects = 0;
+    gFrameStats.occlusionMs = 0.0;
+    if (gIsOcclusionCulling)
+    {
+        start = glfwGetTime();
+        gFrameStats.occludedObjects = UOcclusionCullInstances(viewProjection);
+        visibleCount -= gFrameStats.occludedObjects;
+        gFrameStats.occlusionMs = (glfwGetTime() - start) * 1000.0;
+    }
+
+    gFrameStats.visibleObjects = visibleCount;
+}
+
+
+// Rasterize the visible occluder instances and hide the instances behind them; returns the hidden count
+size_t UOcclusionCullInstances(const glm::mat4& viewProjection)
+{
+    gOcclusionCuller.beginFrame(viewProjection);
+
+    size_t index = 0;
+    for (int i = 0; i < OBJECT_COUNT; ++i)
+    {
+        const InstanceBatch& batch = gInstances.batches[gObjects[i].batch];
+        for (size_t j = 0; j < batch.instances.size(); ++j, ++index)
+        {
+            if (gObjects[i].isOccluder && gInstanceVisibility[index])
+                gOcclusionCuller.addOccluder(&gMeshPositions[gObjects[i].first], gObjects[i].count, batch.instances[j].model);
+        }
+    }
+    gOcclusionCuller.render();
+
+    // the scene BVH primitives share their indices with the instances
+    return gOcclusionCuller.cull(gSceneBVH.primitiveBounds.data(), gInstanceVisibility.size(), gInstanceVisibility.data());
+}
+
+
+// Show frame rate and culling statistics in the window title once per second
+void UShowFrameStats()
+{
+    gStatsFrameCount++;
+
+    double now = glfwGetTime();
+    if (now - gStatsLastTime < 1.0)
+        return;
+
+    double fps = gStatsFrameCount / (now - gStatsLastTime);
+    double shadowRendersPerSecond = gShadowMaps.takeRenderCount() / (now - gStatsLastTime);
+    gStatsFrameCount = 0;
+    gStatsLastTime = now;
+
+    char title[512];
+    int length = snprintf(title, sizeof(title), "%s | %.0f fps | %zu visible, %zu culled, %zu occluded | culling %.3f ms (%s), occlusion %.3f ms",
+        WINDOW_TITLE, fps, gFrameStats.visibleObjects, gFrameStats.culledObjects, gFrameStats.occludedObjects,
+        gFrameStats.cullingMs, gIsBVHCulling ? "bvh" : "simd", gFrameStats.occlusionMs);
+    if (gIsClusteredLighting && length > 0 && length < (int)sizeof(title))
+        length += snprintf(title + length, sizeof(title) - length, " | %d lights, binning %.3f ms", gPointLightCount, gFrameStats.lightBinningMs);
+    if (gIsPathTracing && length > 0 && length < (int)sizeof(title))
+        length += snprintf(title + length, sizeof(title) - length, " | path traced %.2f ms, %d samples, %.2f Mrays/s", gFrameStats.softwareMs,
+            gFrameStats.pathSamples, gFrameStats.pathRaysPerSecond / 1e6);
+    else if (gIsSoftwareRendering && length > 0 && length < (int)sizeof(title))
+        length += snprintf(title + length, sizeof(title) - length, " | software %.2f ms, %zu triangles", gFrameStats.softwareMs, gFrameStats.softwareTriangles);
+    else if (length > 0 && length < (int)sizeof(title))
+        length += snprintf(title + length, sizeof(title) - length, " | %s %.2f ms gpu", gIsDeferredShading ? "deferred" : "forward", gFrameStats.shadingGpuMs);
+    if (gIsLightmapping && gIsLightmapBaked && length > 0 && length < (int)sizeof(title))
+        length += snprintf(title + length, sizeof(title) - length, " | lightmap %dx%d", gLightmap.getWidth(), gLightmap.getHeight());
+    if (gIsDynamicResolution && length > 0 && length < (int)sizeof(title))
+        length += snprintf(title + length, sizeof(title) - length, " | scale %.0f%% (%dx%d)",
+            gFrameStats.resolutionScale * 100.0f, gGBuffer.getRenderWidth(), gGBuffer.getRenderHeight());
+    if (gIsShadowing && length > 0 && length < (int)sizeof(title))
+        length += snprintf(title + length, sizeof(title) - length, " | shadow maps %.0f/s", shadowRendersPerSecond);
+    if (length > 0 && length < (int)sizeof(title))
+        length += snprintf(title + length, sizeof(title) - length, " | build %.2f ms, submit %.2f ms", gFrameStats.buildMs, gFrameStats.submitMs);
+    gFramePacer.takeLatency(gFrameStats.latencyMs, gFrameStats.maxLatencyMs);
+    if (length > 0 && length < (int)sizeof(title))
+        snprintf(title + length, sizeof(title) - length, " | latency %.1f ms, max %.1f ms", gFrameStats.latencyMs, gFrameStats.maxLatencyMs);
+    glfwSetWindowTitle(gWindow, title);
+}
+
+
+// Scatter the point lights over the bounds of the scene
+void UCreatePointLights()
+{
+    glm::vec3 sceneMin = gSceneBVH.nodes[0].boundsMin - glm::vec3(0.5f, 0.0f, 0.5f);
+    glm::vec3 sceneMax = gSceneBVH.nodes[0].boundsMax + glm::vec3(0.5f, 0.5f, 0.5f);
+    glm::vec3 size = sceneMax - sceneMin;
+
+    // the radius keeps roughly the same number of lights around every point
+    // whatever the count, so shading cost does not grow with it
+    float spacing = cbrt(size.x * size.y * size.z / gPointLightCount);
+    float radius = min(3.0f, max(0.15f, 1.5f * spacing));
+
+    mt19937 random(7);
+    uniform_real_distribution<float> unit(0.0f, 1.0f);
+
+    gPointLightCenters.resize(gPointLightCount);
+    gClusteredLights.lights.resize(gPointLightCount);
+    for (int i = 0; i < gPointLightCount; ++i)
+    {
+        gPointLightCenters[i] = sceneMin + glm::vec3(unit(random), unit(random), unit(random)) * size;
+
+        // saturated colors, dimmed so that overlapping lights do not wash out the scene
+        glm::vec3 color(unit(random), unit(random), unit(random));
+        color /= max(color.r, max(color.g, color.b));
+        gClusteredLights.lights[i].positionRadius = glm::vec4(gPointLightCenters[i], radius);
+        gClusteredLights.lights[i].color = glm::vec4(color * 0.3f, 1.0f);
+    }
+    gPointLightsDirty = false;
+}
+
+
+// Move the point lights and assign them to the clusters of the current view; the
+// result goes to the GPU with the frame it was built for
+void UUpdatePointLights(const glm::mat4& view)
+{
+    double start = glfwGetTime();
+
+    if (gPointLightsDirty)
+        UCreatePointLights();
+
+    if (gClusterZoom != gCamera.Zoom)
+    {
+        gClusteredLights.setProjection(glm::radians(gCamera.Zoom), (GLfloat)gFrameWidth / (GLfloat)gFrameHeight, 0.1f, 100.0f);
+        gClusterZoom = gCamera.Zoom;
+    }
+
+    float time = gAnimationTime;
+    sharedJobSystem().parallelFor(gPointLightCenters.size(), 1024, [&](size_t begin, size_t end)
+    {
+        for (size_t i = begin; i < end; ++i)
+        {
+            float angle = time * 0.5f + i * 0.37f;
+            glm::vec3 offset(cos(angle), 0.0f, sin(angle));
+            gClusteredLights.lights[i].positionRadius = glm::vec4(gPointLightCenters[i] + offset * 0.3f, gClusteredLights.lights[i].positionRadius.w);
+        }
+    });
+
+    gClusteredLights.assign(view);
+
+    gFrameStats.lightBinningMs = (glfwGetTime() - start) * 1000.0;
+}
+
+
+// Light color, position and camera position plus the clustered lights of the view, for
+// the objects shader and the deferred lighting pass
+void USetLightingUniforms(GLuint programId, const FramePacket& frame, int screenWidth, int screenHeight)
+{
+    // uniform location from the light color, light position, and camera position
+    GLint lightColorLoc = glGetUniformLocation(programId, "lightColor");
+    GLint lightPositionLoc = glGetUniformLocation(programId, "lightPos");
+    GLint viewPositionLoc = glGetUniformLocation(programId, "viewPosition");
+
+    // Pass light and camera data
+    glUniform3f(lightColorLoc, gLightColor.r, gLightColor.g, gLightColor.b);
+    glUniform3f(lightPositionLoc, frame.lightPosition.x, frame.lightPosition.y, frame.lightPosition.z);
+    const glm::vec3 cameraPosition = frame.cameraPosition;
+    glUniform3f(viewPositionLoc, cameraPosition.x, cameraPosition.y, cameraPosition.z);
+
+    if (frame.isClusteredLighting)
+    {
+        glm::vec2 depthScaleBias = frame.clusterDepthScaleBias;
+        glUniform3ui(glGetUniformLocation(programId, "clusterGrid"), ClusteredLights::GRID_X, ClusteredLights::GRID_Y, ClusteredLights::GRID_Z);
+        glUniform2f(glGetUniformLocation(programId, "clusterDepthScaleBias"), depthScaleBias.x, depthScaleBias.y);
+        glUniform2f(glGetUniformLocation(programId, "screenSize"), (GLfloat)screenWidth, (GLfloat)screenHeight);
+    }
+    glUniform1i(glGetUniformLocation(programId, "isClusteredLighting"), frame.isClusteredLighting);
+
+    if (gIsShadowing)
+    {
+        glm::mat4 shadowMatrices[CascadedShadowMaps::CASCADE_COUNT];
+        for (int c = 0; c < CascadedShadowMaps::CASCADE_COUNT; ++c)
+            shadowMatrices[c] = gShadowMaps.shadowMatrix(c);
+        glUniformMatrix4fv(glGetUniformLocation(programId, "shadowMatrices"), CascadedShadowMaps::CASCADE_COUNT, GL_FALSE, glm::value_ptr(shadowMatrices[0]));
+        glUniform4fv(glGetUniformLocation(programId, "shadowSplits"), 1, glm::value_ptr(gShadowMaps.splits()));
+        gShadowMaps.bindForSampling(SHADOW_TEXTURE_UNIT);
+    }
+    glUniform1i(glGetUniformLocation(programId, "isShadowed"), gIsShadowing);
+}
+
+
+// Light the G-buffer into the lit image, one compute invocation per pixel
+void UDeferredLighting(const FramePacket& frame)
+{
+    glUseProgram(gDeferredLightingProgramId);
+
+    glm::mat4 inverseViewProjection = glm::inverse(frame.projection * frame.view);
+    glUniformMatrix4fv(glGetUniformLocation(gDeferredLightingProgramId, "inverseViewProjection"), 1, GL_FALSE, glm::value_ptr(inverseViewProjection));
+    glUniformMatrix4fv(glGetUniformLocation(gDeferredLightingProgramId, "view"), 1, GL_FALSE, glm::value_ptr(frame.view));
+    int renderWidth = gGBuffer.getRenderWidth();
+    int renderHeight = gGBuffer.getRenderHeight();
+    glUniform2i(glGetUniformLocation(gDeferredLightingProgramId, "renderSize"), renderWidth, renderHeight);
+    USetLightingUniforms(gDeferredLightingProgramId, frame, renderWidth, renderHeight);
+
+    // the G-buffer must be complete before it is read
+    glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+    gGBuffer.bindLighting();
+    glDispatchCompute((renderWidth + DEFERRED_TILE_SIZE - 1) / DEFERRED_TILE_SIZE,
+        (renderHeight + DEFERRED_TILE_SIZE - 1) / DEFERRED_TILE_SIZE, 1);
+}
+
+
+// Frame times of forward and deferred shading as point lights and objects are added.
+// Frames are timed on the CPU with glFinish so that the numbers also hold on drivers
+// where timer queries do not cover the rasterization, like llvmpipe.
+void UCompareShading()
+{
+    const int FRAMES = 10;
+    const int lightCounts[] = { 0, 256, 4096, 65536 };
+
+    printf("%12s %8s %8s %12s %12s\n", "scene", "objects", "lights", "forward ms", "deferred ms");
+    for (int office = 0; office < 2; ++office)
+    {
+        gIsOfficeFloor = office == 1;
+        gInstancesDirty = true;
+
+        for (int lights : lightCounts)
+        {
+            gIsClusteredLighting = lights > 0;
+            if (gIsClusteredLighting)
+            {
+                gPointLightCount = lights;
+                gPointLightsDirty = true;
+            }
+
+            double frameMs[2];
+            for (int deferred = 0; deferred < 2; ++deferred)
+            {
+                gIsDeferredShading = deferred == 1;
+
+                // one frame to build instances and lights outside the timing
+                URender();
+                glFinish();
+
+                double start = glfwGetTime();
+                for (int i = 0; i < FRAMES; ++i)
+                    URender();
+                glFinish();
+                frameMs[deferred] = (glfwGetTime() - start) * 1000.0 / FRAMES;
+            }
+
+            printf("%12s %8zu %8d %12.2f %12.2f\n", gIsOfficeFloor ? "office floor" : "desk", gInstances.instanceCount(), lights,
+                frameMs[0], frameMs[1]);
+        }
+    }
+}
+
+
+// Print the object name of a scene BVH primitive
+void UPrintPrimitive(int primitive)
+{
+    const ScenePrimitive& p = gScenePrimitives[primitive];
+    if (p.object < 0)
+        cout << "lamp";
+    else
+        cout << gObjects[p.object].name << " #" << p.instance;
+}
+
+
+// Upload the material table to the objects program
+void USetMaterials(GLuint programId)
+{
+    glUseProgram(programId);
+    for (int i = 0; i < MATERIAL_COUNT; ++i)
+    {
+        string prefix = "materials[" + to_string(i) + "].";
+        glUniform1f(glGetUniformLocation(programId, (prefix + "ambientStrength").c_str()), gMaterials[i].ambientStrength);
+        glUniform1f(glGetUniformLocation(programId, (prefix + "specularIntensity").c_str()), gMaterials[i].specularIntensity);
+        glUniform1f(glGetUniformLocation(programId, (prefix + "highlightSize").c_str()), gMaterials[i].highlightSize);
+    }
+}
+
+
+// Load and flip an image file, no GL calls so that files can be decoded in parallel
+bool UDecodeImage(const char* filename, DecodedImage& image)
+{
+    image.pixels = stbi_load(filename, &image.width, &image.height, &image.channels, 0);
+    if (!image.pixels)
+        return false;
+
+    flipImageVertically(image.pixels, image.width, image.height, image.channels);
+    return true;
+}
+
+
+// Generate a texture from a decoded image and free the image
+bool UCreateTexture(DecodedImage& decoded, GLuint& textureId)
+{
+    int width = decoded.width, height = decoded.height, channels = decoded.channels;
+    unsigned char* image = decoded.pixels;
+    decoded.pixels = nullptr;
+    if (image)
+    {
         glGenTextures(1, &textureId);
         glBindTexture(GL_TEXTURE_2D, textureId);
 
@@ -903,6 +3080,7 @@ bool UCreateTexture(const char* filename, GLuint& textureId)
         else
         {
             cout << "Not implemented to handle image with " << channels << " channels" << endl;
+            stbi_image_free(image);
             return false;
         }
 
@@ -927,12 +3105,23 @@ void UDestroyTexture(GLuint textureId)
 // shader program
 bool UCreateShaderProgram(const char* vtxShaderSource, const char* fragShaderSource, GLuint& programId)
 {
+    // the binary of an earlier run when the sources and the driver are the same
+    const char* sources[] = { vtxShaderSource, fragShaderSource };
+    uint64_t cacheKey = gProgramCache.key(sources, 2);
+    programId = gProgramCache.restore(cacheKey);
+    if (programId != 0)
+    {
+        glUseProgram(programId);
+        return true;
+    }
+    double start = glfwGetTime();
 
     int success = 0;
     char infoLog[512];
 
     // Create a Shader program object.
     programId = glCreateProgram();
+    gProgramCache.prepare(programId);
 
     // Create the vertex and fragment shader objects
     GLuint vertexShaderId = glCreateShader(GL_VERTEX_SHADER);
@@ -981,6 +3170,7 @@ bool UCreateShaderProgram(const char* vtxShaderSource, const char* fragShaderSou
         return false;
     }
 
+    gProgramCache.store(cacheKey, programId, (glfwGetTime() - start) * 1000.0);
     glUseProgram(programId);
 
     return true;
@@ -991,3 +3181,321 @@ void UDestroyShaderProgram(GLuint programId)
 {
     glDeleteProgram(programId);
 }
+
+
+// Build the programs on the driver's compile threads where it has them, otherwise on a
+// thread of our own with a context that shares objects with the window's
+void USetupProgramBuilder()
+{
+    ProgramBuilder::Mode mode = ProgramBuilder::BLOCKING;
+    if (ProgramBuilder::isParallelCompileSupported() && !gIsShaderThread)
+        mode = ProgramBuilder::PARALLEL_COMPILE;
+    else
+    {
+        glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+        gCompileWindow = glfwCreateWindow(1, 1, WINDOW_TITLE, NULL, gWindow);
+        if (gCompileWindow)
+            mode = ProgramBuilder::WORKER_THREAD;
+    }
+
+    gProgramBuilder.setup(&gProgramCache, mode, [](bool isBinding)
+    {
+        glfwMakeContextCurrent(isBinding ? gCompileWindow : NULL);
+    });
+}
+
+
+// Hand out the programs that finished building, or wait for all of them; false if one failed.
+// Once the last is in, the new binaries go to the cache and the startup cost is reported.
+bool UUpdatePrograms(bool isWaiting)
+{
+    size_t pending = gProgramBuilder.pendingCount();
+    bool isOk = isWaiting ? gProgramBuilder.finish() : gProgramBuilder.poll();
+    if (!isOk)
+    {
+        std::cout << gShaderPreprocessor.annotate(gProgramBuilder.errors()) << std::endl;
+        return false;
+    }
+    std::string rebuildErrors = gProgramBuilder.takeRebuildErrors();
+    if (!rebuildErrors.empty())
+        cout << gShaderPreprocessor.annotate(rebuildErrors) << "Keeping the programs that were there" << endl;
+    if (gProgramBuilder.pendingCount() != pending)
+        URequestRedraw();
+    if (!gProgramBuilder.isFinished())
+        return true;
+
+    if (!gProgramCache.save(PROGRAM_CACHE_FILENAME))
+        cout << "Failed to write " << PROGRAM_CACHE_FILENAME << endl;
+
+    // variants built on first use later on only go to the cache
+    if (gIsStartupReported)
+        return true;
+    gIsStartupReported = true;
+
+    const char* modeNames[] = { "blocking", "parallel compile", "compile thread" };
+    int programCount = gProgramCache.hits() + gProgramCache.misses();
+    cout << "Shader programs: all ready after " << (glfwGetTime() - gProgramStart) * 1000.0 << " ms (" << modeNames[gProgramBuilder.getMode()]
+        << "), " << gProgramCache.hits() << " of " << programCount << " from the cache ("
+        << (programCount > 0 ? 100 * gProgramCache.hits() / programCount : 0) << "%), "
+        << gProgramCache.compileMilliseconds() << " ms compiling, about " << gProgramCache.savedMilliseconds() << " ms saved";
+    if (!gProgramCache.enabled())
+        cout << " (cache off)";
+    cout << endl;
+    return true;
+}
+
+
+// The lamp, G-buffer, deferred lighting and shadow programs whose shaders are stale: all of them
+// at startup, on a reload those that take in a file that changed
+void UAddPrograms(const std::vector<std::string>& staleShaders)
+{
+    if (UIsProgramStale(staleShaders, "lamp.vert", "lamp.frag"))
+        gProgramBuilder.add(UShaderSource("lamp.vert"), UShaderSource("lamp.frag"), gLampProgramId);
+    // the vertex stage of the G-buffer pipeline is that of the objects
+    if (UIsProgramStale(staleShaders, "gbuffer.frag"))
+    {
+        gProgramBuilder.addStage(GL_FRAGMENT_SHADER, UShaderSource("gbuffer.frag"), gGBufferProgramId, [](GLuint program)
+        {
+            glUseProgram(program);
+            glUniform1i(glGetUniformLocation(program, "uTexture"), 0);
+        }, ShaderPermutations::defines(FEATURE_TEXTURE).c_str());
+    }
+    if (UIsProgramStale(staleShaders, "deferred.comp"))
+    {
+        gProgramBuilder.addCompute(UShaderSource("deferred.comp"), gDeferredLightingProgramId, [](GLuint program)
+        {
+            USetMaterials(program);
+            glUniform1i(glGetUniformLocation(program, "shadowMap"), SHADOW_TEXTURE_UNIT);
+        });
+    }
+    if (UIsProgramStale(staleShaders, "shadow.vert", "shadow.frag"))
+        gProgramBuilder.add(UShaderSource("shadow.vert"), UShaderSource("shadow.frag"), gShadowProgramId);
+}
+
+
+bool UIsProgramStale(const std::vector<std::string>& staleShaders, const char* first, const char* second)
+{
+    auto isStale = [&](const char* filename) { return std::find(staleShaders.begin(), staleShaders.end(), filename) != staleShaders.end(); };
+    return isStale(first) || (second && isStale(second));
+}
+
+
+// A shader with its includes expanded, which stays in place until it is expanded again
+const char* UShaderSource(const char* filename)
+{
+    return gShaderPreprocessor.expand(filename).text.c_str();
+}
+
+
+// Expands the shaders that are new or take in a source that changed, and returns their names;
+// one with an include that cannot be found is left out, so its programs keep what they have
+std::vector<std::string> UExpandStaleShaders()
+{
+    std::vector<std::string> expanded;
+    for (const std::string& filename : gShaderPreprocessor.staleSources())
+    {
+        const ShaderPreprocessor::Expansion& expansion = gShaderPreprocessor.expand(filename);
+        if (expansion.error.empty())
+            expanded.push_back(filename);
+        else
+            cout << expansion.error;
+    }
+    return expanded;
+}
+
+
+// The built-in shaders, or with --shader-dir the files of the directory, which are then
+// watched for changes; a file that does not exist yet is written with the built-in source
+void ULoadShaderSources()
+{
+    if (gShaderDirectory && !gShaderWatcher.watch(gShaderDirectory))
+    {
+        cout << "Cannot watch the shader directory " << gShaderDirectory << endl;
+        gShaderDirectory = NULL;
+    }
+    for (const ShaderFile& file : gShaderFiles)
+    {
+        std::string text;
+        if (!gShaderDirectory || !gShaderWatcher.read(file.filename, text))
+        {
+            text = file.source;
+            if (gShaderDirectory && !gShaderWatcher.write(file.filename, UFormatShaderSource(file.source)))
+                cout << "Failed to write " << gShaderWatcher.path(file.filename) << endl;
+        }
+        gShaderPreprocessor.setSource(file.filename, text);
+        if (gShaderDirectory)
+            gShaderWatcher.addFile(file.filename);
+    }
+    if (!gShaderDirectory)
+        return;
+    gShaderWatcher.changedFiles();  // not the files just written
+    cout << "Reloading shaders from " << gShaderDirectory << " when they change" << endl;
+}
+
+
+// Rebuilds the programs that take in a shader file that changed. The builds run in the
+// background like the ones at startup, and the new programs take the place of the old
+// ones between frames, running their ready functions again to set up their uniforms.
+void UReloadChangedShaders()
+{
+    bool isChanged = false;
+    for (const std::string& filename : gShaderWatcher.changedFiles())
+    {
+        std::string text;
+        if (gShaderWatcher.read(filename, text))
+        {
+            gShaderPreprocessor.setSource(filename, text);
+            isChanged = true;
+            cout << "Reloading " << filename << endl;
+        }
+    }
+    if (!isChanged)
+        return;
+
+    // the sources given to the builder before are copies, the old expansions can go
+    std::vector<std::string> staleShaders = UExpandStaleShaders();
+    if (!staleShaders.empty())
+    {
+        cout << "Rebuilding the shader programs that take in";
+        for (const std::string& filename : staleShaders)
+            cout << " " << filename;
+        cout << endl;
+    }
+    if (UIsProgramStale(staleShaders, "objects.vert", "objects.frag"))
+        gObjectsPrograms.rebuild(UShaderSource("objects.vert"), UShaderSource("objects.frag"));
+    UAddPrograms(staleShaders);
+    if (UIsProgramStale(staleShaders, "fallback.vert", "fallback.frag"))
+        gProgramBuilder.add(UShaderSource("fallback.vert"), UShaderSource("fallback.frag"), gFallbackProgramId);
+    if (!UUpdatePrograms(false))
+        glfwSetWindowShouldClose(gWindow, true);
+    URequestRedraw();
+}
+
+
+// The GLSL macro leaves a shader on one line; this breaks it up after every statement and
+// brace and indents the blocks, for the files --shader-dir writes out to be edited
+std::string UFormatShaderSource(const char* source)
+{
+    std::string text;
+    int depth = 0;
+    int parentheses = 0;
+    bool isLineStart = true;
+    for (const char* c = source; *c; ++c)
+    {
+        if (isLineStart && (*c == ' ' || *c == '\n'))
+            continue;
+        if (*c == '}')
+        {
+            depth = std::max(0, depth - 1);
+            if (!isLineStart)
+                text += '\n';
+            isLineStart = true;
+        }
+        if (isLineStart)
+        {
+            text.append(depth * 4, ' ');
+            isLineStart = false;
+        }
+        text += *c;
+
+        if (*c == '(')
+            parentheses++;
+        else if (*c == ')')
+            parentheses--;
+        else if (*c == '{')
+            depth++;
+
+        // a closing brace keeps the semicolon of a struct or block declaration on its line
+        const char* next = c + 1;
+        while (*next == ' ')
+            next++;
+        bool isLineEnd = *c == '{' || (*c == '}' && *next != ';') || (*c == ';' && parentheses == 0);
+        if (*c == '\n')
+            isLineStart = true;
+        else if (isLineEnd)
+        {
+            text += '\n';
+            isLineStart = true;
+        }
+    }
+    return text;
+}
+
+
+// Shader features a draw of an object needs with the material of an instance
+uint32_t UDrawFeatures(int object, GLuint material)
+{
+    uint32_t features = 0;
+    if (*gObjects[object].textureId != 0)
+        features |= FEATURE_TEXTURE;
+    if (gMaterials[material].specularIntensity > 0.0f)
+        features |= FEATURE_SPECULAR;
+    return features;
+}
+
+
+// Start building the objects variants of every draw: those of the startup state first, so
+// that they are ready first, then those of every other state the keys can switch to. When
+// every build blocks, the others are left to be built on first use.
+void UPrepareObjectsPrograms()
+{
+    const uint32_t FRAME_FEATURES = FEATURE_LIGHTMAP | FEATURE_SHADOWS | FEATURE_POINT_LIGHTS | FEATURE_PROBES;
+    uint32_t startup = (gIsShadowing ? FEATURE_SHADOWS : 0) | (gIsClusteredLighting ? FEATURE_POINT_LIGHTS : 0) |
+        (gIsProbeLighting ? FEATURE_PROBES : 0);
+
+    vector<uint32_t> frameStates(1, startup);
+    if (gProgramBuilder.getMode() != ProgramBuilder::BLOCKING)
+    {
+        // every subset of the frame features
+        for (uint32_t state = FRAME_FEATURES; ; state = (state - 1) & FRAME_FEATURES)
+        {
+            frameStates.push_back(state);
+            if (state == 0)
+                break;
+        }
+    }
+
+    for (uint32_t state : frameStates)
+    {
+        for (int i = 0; i < OBJECT_COUNT; ++i)
+        {
+            for (int m = 0; m < MATERIAL_COUNT; ++m)
+                gObjectsPrograms.prepare(UDrawFeatures(i, m) | state);
+        }
+    }
+}
+
+
+// The objects pipeline of a variant, NULL for the fallback while it builds; headless runs
+// wait for it instead, so that their frames do not depend on the compile times
+const ProgramPipeline* UObjectsPipeline(uint32_t features)
+{
+    const ProgramPipeline* pipeline = gObjectsPrograms.pipeline(features);
+    if (pipeline == NULL && gIsHeadless && UUpdatePrograms(true))
+        pipeline = gObjectsPrograms.pipeline(features);
+    return pipeline;
+}
+
+
+// Per-frame uniforms of the fragment stage program of an objects variant, with the program active
+void USetObjectsUniforms(GLuint programId, const FramePacket& frame, bool isOffscreen)
+{
+    // uniform location from the object color
+    GLint objectColorLoc = glGetUniformLocation(programId, "objectColor");
+    glUniform3f(objectColorLoc, gObjectColor.r, gObjectColor.g, gObjectColor.b);
+
+    if (gIsProbeLighting)
+    {
+        glm::ivec3 probeGridSize = gProbes.getSize();
+        glUniform3fv(glGetUniformLocation(programId, "probeGridMin"), 1, glm::value_ptr(gProbes.getGridMin()));
+        glUniform1f(glGetUniformLocation(programId, "probeSpacing"), gProbes.getSpacing());
+        glUniform3i(glGetUniformLocation(programId, "probeGridSize"), probeGridSize.x, probeGridSize.y, probeGridSize.z);
+    }
+
+    // on screen, the default framebuffer, which the G-buffer is kept the size of; it is
+    // larger than the window on HiDPI displays and follows every resize
+    if (isOffscreen)
+        USetLightingUniforms(programId, frame, gGBuffer.getRenderWidth(), gGBuffer.getRenderHeight());
+    else
+        USetLightingUniforms(programId, frame, gGBuffer.getWidth(), gGBuffer.getHeight());
+}
@@ -0,0 +1,146 @@
+#ifndef AMBIENTOCCLUSION_H
+#define AMBIENTOCCLUSION_H
+
+#include "bvh.h"
+#include "parallel.h"
+#include "pathtracer.h"
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <vector>
+
+// Ambient occlusion baked into the vertices of a mesh.
+//
+// The occluders are triangles taken from interleaved float vertices that start
+// with the position: indexed like Mesh and the Cylinder outputs, or a plain
+// triangle list like the scene mesh. They go into a BVH, and every vertex to
+// bake casts cosine weighted rays over the hemisphere around its normal. The
+// fraction of rays that get to the maximum distance without a hit is stored:
+// 1 for a vertex in the open, 0 for one covered on every side. The rays are
+// short so that only contact shading is baked; the lamp does the rest.
+class VertexOcclusionBaker
+{
+public:
+    static const size_t VERTICES_PER_JOB = 16;
+
+    VertexOcclusionBaker() : raysPerVertex(128), maxDistance(0.5f), threadCount(1), seed(1) {}
+
+    void setRaysPerVertex(int rays)
+    {
+        raysPerVertex = std::max(1, rays);
+    }
+
+    // model space of the baked vertices, after their model matrix
+    void setMaxDistance(float distance)
+    {
+        maxDistance = distance;
+    }
+
+    void setThreadCount(int count)
+    {
+        threadCount = std::max(1, count);
+    }
+
+    void setSeed(uint32_t newSeed)
+    {
+        seed = newSeed;
+    }
+
+    void clear()
+    {
+        triangles.clear();
+    }
+
+    // stride is in floats; indices is null for vertices that are a triangle list already
+    void addTriangles(const float* vertices, size_t stride, size_t vertexCount, const unsigned int* indices, size_t indexCount, const glm::mat4& model)
+    {
+        size_t count = indices ? indexCount : vertexCount;
+        for (size_t i = 0; i + 2 < count; i += 3)
+        {
+            glm::vec3 p[3];
+            for (int k = 0; k < 3; ++k)
+            {
+                const float* v = vertices + (indices ? indices[i + k] : i + k) * stride;
+                p[k] = glm::vec3(model * glm::vec4(v[0], v[1], v[2], 1.0f));
+            }
+
+            RayTriangle triangle = { p[0], p[1] - p[0], p[2] - p[0] };
+            triangles.push_back(triangle);
+        }
+    }
+
+    // builds the BVH over the occluders; call after the last addTriangles
+    void build()
+    {
+        std::vector<AABB> bounds(triangles.size());
+        for (size_t i = 0; i < triangles.size(); ++i)
+        {
+            const RayTriangle& t = triangles[i];
+            bounds[i].min = glm::min(t.v0, glm::min(t.v0 + t.edge1, t.v0 + t.edge2));
+            bounds[i].max = glm::max(t.v0, glm::max(t.v0 + t.edge1, t.v0 + t.edge2));
+        }
+        bvh.build(bounds);
+    }
+
+    size_t triangleCount() const
+    {
+        return triangles.size();
+    }
+
+    // one value per vertex into occlusion; normalOffset is where the normal starts in a vertex, in floats
+    void bake(const float* vertices, size_t stride, size_t normalOffset, size_t vertexCount, const glm::mat4& model, float* occlusion) const
+    {
+        glm::mat3 normalMatrix = glm::transpose(glm::inverse(glm::mat3(model)));
+        int jobCount = std::min(threadCount, jobCountFor(vertexCount, VERTICES_PER_JOB));
+        parallelFor(vertexCount, jobCount, [&](size_t begin, size_t end)
+        {
+            for (size_t i = begin; i < end; ++i)
+            {
+                const float* v = vertices + i * stride;
+                glm::vec3 position = glm::vec3(model * glm::vec4(v[0], v[1], v[2], 1.0f));
+                glm::vec3 normal = normalMatrix * glm::vec3(v[normalOffset], v[normalOffset + 1], v[normalOffset + 2]);
+                float length = glm::length(normal);
+                if (length == 0.0f)
+                {
+                    occlusion[i] = 1.0f;
+                    continue;
+                }
+                normal /= length;
+
+                // the same rays for a vertex however the work is split
+                PathRandom random(seed, (uint32_t)i, 0);
+                glm::vec3 origin = position + normal * RAY_OFFSET;
+                int open = 0;
+                for (int r = 0; r < raysPerVertex; ++r)
+                {
+                    if (!isOccluded(origin, cosineDirection(normal, random.next(), random.next())))
+                        open++;
+                }
+                occlusion[i] = (float)open / raysPerVertex;
+            }
+        });
+    }
+
+private:
+    static constexpr float MIN_DISTANCE = 1e-4f;    // hits closer than this are the surface the ray left
+    static constexpr float RAY_OFFSET = 1e-4f;
+
+    std::vector<RayTriangle> triangles;
+    BVH bvh;
+    int raysPerVertex;
+    float maxDistance;
+    int threadCount;
+    uint32_t seed;
+
+    // any hit within the maximum distance
+    bool isOccluded(const glm::vec3& origin, const glm::vec3& direction) const
+    {
+        return bvh.raycastAny(origin, direction, maxDistance, [this](int primitive, const glm::vec3& o, const glm::vec3& d, float tMax) {
+            float u, v;
+            return intersectTriangle(triangles[primitive], o, d, MIN_DISTANCE, tMax, u, v) >= 0.0f;
+        });
+    }
+};
+
+#endif
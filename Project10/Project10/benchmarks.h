@@ -0,0 +1,729 @@
+#ifndef BENCHMARKS_H
+#define BENCHMARKS_H
+
+// CPU-only benchmarks, run with "Project10 --bench <name>". None of these need
+// an OpenGL context, so they run on machines without a GPU.
+
+#include "bvh.h"
+#include "culling.h"
+#include "occlusion.h"
+#include "lighting.h"
+#include "instancing.h"
+#include "jobs.h"
+#include "rasterizer.h"
+#include "pathtracer.h"
+
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <vector>
+
+namespace benchmarks
+{
+    inline double nowMs()
+    {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // boxes of office furniture size scattered over a floor that grows with the count
+    inline std::vector<AABB> randomBoxes(size_t count, unsigned seed)
+    {
+        std::mt19937 random(seed);
+        float side = std::sqrt((float)count) * 1.5f;
+        std::uniform_real_distribution<float> position(-side * 0.5f, side * 0.5f);
+        std::uniform_real_distribution<float> height(0.0f, 3.0f);
+        std::uniform_real_distribution<float> size(0.05f, 1.5f);
+
+        std::vector<AABB> boxes(count);
+        for (size_t i = 0; i < count; ++i)
+        {
+            glm::vec3 center(position(random), height(random), position(random));
+            glm::vec3 extent(size(random), size(random) * 0.5f, size(random));
+            boxes[i].min = center - extent * 0.5f;
+            boxes[i].max = center + extent * 0.5f;
+        }
+        return boxes;
+    }
+
+    inline void benchmarkBVH()
+    {
+        printf("%10s %10s %10s %10s %10s %12s %12s %12s\n", "objects", "build ms", "refit ms", "update us", "SAH cost",
+            "frustum us", "ray us", "proximity us");
+
+        const size_t counts[] = { 10000, 100000, 1000000 };
+        for (size_t count : counts)
+        {
+            std::vector<AABB> boxes = randomBoxes(count, 1);
+            BVH bvh;
+
+            double start = nowMs();
+            bvh.build(boxes);
+            double buildMs = nowMs() - start;
+
+            // move every object a little and refit the whole tree
+            for (size_t i = 0; i < count; ++i)
+            {
+                bvh.primitiveBounds[i].min += glm::vec3(0.01f);
+                bvh.primitiveBounds[i].max += glm::vec3(0.01f);
+            }
+            start = nowMs();
+            bvh.refit();
+            double refitMs = nowMs() - start;
+
+            // orbit 1% of the objects with incremental refit and rotations
+            std::mt19937 random(2);
+            std::uniform_int_distribution<size_t> pick(0, count - 1);
+            std::uniform_real_distribution<float> offset(-2.0f, 2.0f);
+            size_t updates = count / 100;
+            start = nowMs();
+            for (size_t i = 0; i < updates; ++i)
+            {
+                size_t primitive = pick(random);
+                AABB box = bvh.primitiveBounds[primitive];
+                glm::vec3 delta(offset(random), 0.0f, offset(random));
+                box.min += delta;
+                box.max += delta;
+                bvh.update((int)primitive, box);
+            }
+            double updateUs = (nowMs() - start) * 1000.0 / updates;
+
+            // frustum queries from random cameras above the floor
+            float side = std::sqrt((float)count) * 1.5f;
+            std::uniform_real_distribution<float> position(-side * 0.5f, side * 0.5f);
+            std::uniform_real_distribution<float> angle(0.0f, 6.2831853f);
+            glm::mat4 projection = glm::perspective(glm::radians(45.0f), 800.0f / 600.0f, 0.1f, 100.0f);
+            const int frustumQueries = 200;
+            std::vector<int> result;
+            size_t found = 0;
+            start = nowMs();
+            for (int i = 0; i < frustumQueries; ++i)
+            {
+                glm::vec3 eye(position(random), 1.5f, position(random));
+                float a = angle(random);
+                glm::mat4 view = glm::lookAt(eye, eye + glm::vec3(std::cos(a), -0.2f, std::sin(a)), glm::vec3(0.0f, 1.0f, 0.0f));
+                result.clear();
+                bvh.queryFrustum(extractFrustum(projection * view), result);
+                found += result.size();
+            }
+            double frustumUs = (nowMs() - start) * 1000.0 / frustumQueries;
+
+            // picking rays
+            const int rays = 100000;
+            start = nowMs();
+            for (int i = 0; i < rays; ++i)
+            {
+                glm::vec3 origin(position(random), 1.5f, position(random));
+                float a = angle(random);
+                float t = 1000.0f;
+                found += bvh.raycast(origin, glm::normalize(glm::vec3(std::cos(a), -0.3f, std::sin(a))), t) >= 0;
+            }
+            double rayUs = (nowMs() - start) * 1000.0 / rays;
+
+            // neighbours within 2 units
+            const int proximityQueries = 100000;
+            start = nowMs();
+            for (int i = 0; i < proximityQueries; ++i)
+            {
+                result.clear();
+                bvh.queryProximity(glm::vec3(position(random), 1.0f, position(random)), 2.0f, result);
+                found += result.size();
+            }
+            double proximityUs = (nowMs() - start) * 1000.0 / proximityQueries;
+
+            printf("%10zu %10.2f %10.2f %10.3f %10.1f %12.2f %12.3f %12.3f\n", count, buildMs, refitMs, updateUs, bvh.cost(),
+                frustumUs, rayUs, proximityUs);
+            if (found == 0)
+                printf("warning: no query results\n");
+        }
+    }
+
+    inline void benchmarkCulling()
+    {
+        printf("%10s %12s %12s %12s %10s\n", "objects", "scalar ms", "SIMD ms", "jobs ms", "visible");
+
+        const size_t counts[] = { 10000, 100000, 1000000 };
+        for (size_t count : counts)
+        {
+            std::vector<AABB> boxes = randomBoxes(count, 6);
+            FrustumCuller culler;
+            culler.resize(count);
+            for (size_t i = 0; i < count; ++i)
+                culler.setBounds(i, boxes[i]);
+
+            // random cameras above the floor, the same for every variant
+            float side = std::sqrt((float)count) * 1.5f;
+            std::mt19937 random(7);
+            std::uniform_real_distribution<float> position(-side * 0.5f, side * 0.5f);
+            std::uniform_real_distribution<float> angle(0.0f, 6.2831853f);
+            glm::mat4 projection = glm::perspective(glm::radians(45.0f), 800.0f / 600.0f, 0.1f, 100.0f);
+            const int views = 20;
+            std::vector<Frustum> frustums(views);
+            for (Frustum& frustum : frustums)
+            {
+                glm::vec3 eye(position(random), 1.5f, position(random));
+                float a = angle(random);
+                frustum = extractFrustum(projection * glm::lookAt(eye, eye + glm::vec3(std::cos(a), -0.2f, std::sin(a)), glm::vec3(0.0f, 1.0f, 0.0f)));
+            }
+
+            std::vector<unsigned char> visible(count);
+            size_t scalarVisible = 0;
+            double start = nowMs();
+            for (const Frustum& frustum : frustums)
+            {
+                for (size_t i = 0; i < count; ++i)
+                {
+                    visible[i] = isVisible(frustum, boxes[i]) ? 1 : 0;
+                    scalarVisible += visible[i];
+                }
+            }
+            double scalarMs = (nowMs() - start) / views;
+
+            size_t simdVisible = 0;
+            start = nowMs();
+            for (const Frustum& frustum : frustums)
+                simdVisible += culler.cull(frustum, visible.data());
+            double simdMs = (nowMs() - start) / views;
+
+            // in ranges on the job system, as the scene culls its instances
+            std::atomic<size_t> jobsVisible(0);
+            start = nowMs();
+            for (const Frustum& frustum : frustums)
+            {
+                sharedJobSystem().parallelFor(count, 4096, [&](size_t begin, size_t end)
+                {
+                    jobsVisible += culler.cull(frustum, visible.data(), begin, end);
+                });
+            }
+            double jobsMs = (nowMs() - start) / views;
+
+            printf("%10zu %12.3f %12.3f %12.3f %10zu\n", count, scalarMs, simdMs, jobsMs, simdVisible / views);
+            if (scalarVisible != simdVisible || jobsVisible != simdVisible)
+                printf("warning: the scalar, SIMD and job results differ\n");
+        }
+    }
+
+    // unit cube as a triangle list
+    inline std::vector<glm::vec3> cubeTriangles()
+    {
+        const int faces[6][4] = { { 0, 1, 3, 2 }, { 4, 6, 7, 5 }, { 0, 4, 5, 1 }, { 2, 3, 7, 6 }, { 0, 2, 6, 4 }, { 1, 5, 7, 3 } };
+        std::vector<glm::vec3> vertices;
+        for (int f = 0; f < 6; ++f)
+        {
+            glm::vec3 corner[4];
+            for (int i = 0; i < 4; ++i)
+            {
+                int c = faces[f][i];
+                corner[i] = glm::vec3(c & 1 ? 0.5f : -0.5f, c & 2 ? 0.5f : -0.5f, c & 4 ? 0.5f : -0.5f);
+            }
+            vertices.push_back(corner[0]);
+            vertices.push_back(corner[1]);
+            vertices.push_back(corner[2]);
+            vertices.push_back(corner[0]);
+            vertices.push_back(corner[2]);
+            vertices.push_back(corner[3]);
+        }
+        return vertices;
+    }
+
+    inline void benchmarkOcclusion()
+    {
+        // an office floor seen from eye height: rows of desk sized walls in
+        // front of a large number of small objects
+        std::vector<glm::vec3> cube = cubeTriangles();
+        std::vector<glm::mat4> occluders;
+        std::mt19937 random(3);
+        std::uniform_real_distribution<float> jitter(-0.5f, 0.5f);
+        for (int row = 0; row < 8; ++row)
+        {
+            for (int column = -20; column <= 20; ++column)
+            {
+                glm::vec3 position(column * 3.0f + jitter(random), 0.0f, -3.0f - row * 2.5f);
+                occluders.push_back(glm::translate(glm::mat4(1.0f), position) * glm::scale(glm::mat4(1.0f), glm::vec3(2.0f, 1.2f, 0.1f)));
+            }
+        }
+
+        // small objects spread between and behind the walls
+        std::uniform_real_distribution<float> x(-60.0f, 60.0f), y(-0.8f, 2.0f), z(-100.0f, -3.0f), size(0.05f, 0.4f);
+        std::vector<AABB> boxes(100000);
+        for (size_t i = 0; i < boxes.size(); ++i)
+        {
+            glm::vec3 center(x(random), y(random), z(random));
+            glm::vec3 extent(size(random), size(random), size(random));
+            boxes[i].min = center - extent;
+            boxes[i].max = center + extent;
+        }
+
+        glm::mat4 projection = glm::perspective(glm::radians(45.0f), 800.0f / 600.0f, 0.1f, 100.0f);
+        glm::mat4 view = glm::lookAt(glm::vec3(0.0f, 0.2f, 0.0f), glm::vec3(0.0f, 0.0f, -10.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+        Frustum frustum = extractFrustum(projection * view);
+        std::vector<unsigned char> inFrustum(boxes.size());
+        size_t frustumCount = 0;
+        for (size_t i = 0; i < boxes.size(); ++i)
+        {
+            inFrustum[i] = isVisible(frustum, boxes[i]) ? 1 : 0;
+            frustumCount += inFrustum[i];
+        }
+
+        printf("%zu occluder triangles, %zu boxes in the frustum, 256x192 buffer\n", occluders.size() * cube.size() / 3, frustumCount);
+        printf("%8s %12s %12s %10s\n", "threads", "raster ms", "test ms", "occluded");
+
+        int hardwareThreads = hardwareThreadCount();
+        std::vector<int> threadCounts = { 1, 2, 4 };
+        if (hardwareThreads > 4)
+            threadCounts.push_back(hardwareThreads);
+
+        const int repeats = 20;
+        for (int threads : threadCounts)
+        {
+            OcclusionCuller culler;
+            culler.resize(256, 192);
+            culler.setThreadCount(threads);
+
+            double start = nowMs();
+            for (int r = 0; r < repeats; ++r)
+            {
+                culler.beginFrame(projection * view);
+                for (size_t i = 0; i < occluders.size(); ++i)
+                    culler.addOccluder(cube.data(), (int)cube.size(), occluders[i]);
+                culler.render();
+            }
+            double rasterMs = (nowMs() - start) / repeats;
+
+            std::vector<unsigned char> visible;
+            size_t occluded = 0;
+            start = nowMs();
+            for (int r = 0; r < repeats; ++r)
+            {
+                visible = inFrustum;
+                occluded = culler.cull(boxes.data(), boxes.size(), visible.data());
+            }
+            double testMs = (nowMs() - start) / repeats;
+
+            printf("%8d %12.3f %12.3f %10zu\n", threads, rasterMs, testMs, occluded);
+        }
+    }
+
+    inline void benchmarkLights()
+    {
+        // lights spread through a 40 x 4 x 40 office floor, seen from its center
+        glm::mat4 view = glm::lookAt(glm::vec3(0.0f, 1.5f, 0.0f), glm::vec3(0.0f, 1.0f, -10.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+
+        printf("%zux%zux%zu clusters, %d threads\n", (size_t)ClusteredLights::GRID_X, (size_t)ClusteredLights::GRID_Y,
+            (size_t)ClusteredLights::GRID_Z, hardwareThreadCount());
+        printf("%10s %12s %14s\n", "lights", "binning ms", "assignments");
+
+        const size_t counts[] = { 1000, 10000, 100000 };
+        for (size_t count : counts)
+        {
+            ClusteredLights clustered;
+            clustered.setThreadCount(hardwareThreadCount());
+            clustered.setProjection(glm::radians(45.0f), 800.0f / 600.0f, 0.1f, 100.0f);
+
+            // same density rule as the scene: a roughly constant number of lights per point
+            float radius = std::min(3.0f, std::max(0.15f, 1.5f * std::cbrt(40.0f * 4.0f * 40.0f / count)));
+            std::mt19937 random(4);
+            std::uniform_real_distribution<float> x(-20.0f, 20.0f), y(0.0f, 4.0f);
+            clustered.lights.resize(count);
+            for (size_t i = 0; i < count; ++i)
+            {
+                clustered.lights[i].positionRadius = glm::vec4(x(random), y(random), x(random), radius);
+                clustered.lights[i].color = glm::vec4(1.0f);
+            }
+
+            const int repeats = 20;
+            double start = nowMs();
+            for (int r = 0; r < repeats; ++r)
+                clustered.assign(view);
+            double binningMs = (nowMs() - start) / repeats;
+
+            printf("%10zu %12.3f %14zu\n", count, binningMs, clustered.assignmentCount());
+        }
+    }
+
+    inline void benchmarkTransforms()
+    {
+        printf("%10s %12s %12s %10s\n", "instances", "scalar ms", "batched ms", "max error");
+
+        const size_t counts[] = { 1000, 100000, 1000000 };
+        for (size_t count : counts)
+        {
+            std::vector<AABB> boxes = randomBoxes(count, 5);
+            std::vector<InstanceData> instances(count);
+            for (size_t i = 0; i < count; ++i)
+                instances[i].model = glm::translate(glm::mat4(1.0f), boxes[i].min) * glm::scale(glm::mat4(1.0f), boxes[i].max - boxes[i].min);
+
+            glm::mat4 projection = glm::perspective(glm::radians(45.0f), 800.0f / 600.0f, 0.1f, 100.0f);
+            glm::mat4 viewProjection = projection * glm::lookAt(glm::vec3(0.0f, 1.5f, 3.0f), glm::vec3(0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+
+            const int repeats = 10;
+            std::vector<glm::mat4> reference(count);
+            double start = nowMs();
+            for (int r = 0; r < repeats; ++r)
+            {
+                for (size_t i = 0; i < count; ++i)
+                    reference[i] = viewProjection * instances[i].model;
+            }
+            double scalarMs = (nowMs() - start) / repeats;
+
+            start = nowMs();
+            for (int r = 0; r < repeats; ++r)
+                computeMVPs(viewProjection, instances.data(), count);
+            double batchedMs = (nowMs() - start) / repeats;
+
+            float maxError = 0.0f;
+            for (size_t i = 0; i < count; ++i)
+                for (int c = 0; c < 4; ++c)
+                    for (int e = 0; e < 4; ++e)
+                        maxError = std::max(maxError, std::fabs(reference[i][c][e] - instances[i].mvp[c][e]));
+
+            printf("%10zu %12.3f %12.3f %10.2g\n", count, scalarMs, batchedMs, maxError);
+        }
+    }
+
+    // 1, 2, 4, ... threads and the number of hardware threads
+    inline std::vector<int> threadCounts()
+    {
+        int hardwareThreads = hardwareThreadCount();
+        std::vector<int> counts;
+        for (int threads = 1; threads < hardwareThreads; threads *= 2)
+            counts.push_back(threads);
+        counts.push_back(hardwareThreads);
+        return counts;
+    }
+
+    inline void benchmarkJobs()
+    {
+        JobSystem& jobs = sharedJobSystem();
+        printf("%d workers plus the submitting thread\n", jobs.threadCount() - 1);
+
+        // scheduling overhead: empty jobs from outside the system (injection queue)
+        // and from inside a job (the worker's own deque)
+        const int jobCount = 100000;
+        JobCounter counter;
+        double start = nowMs();
+        for (int i = 0; i < jobCount; ++i)
+            jobs.run([]() {}, &counter);
+        jobs.wait(counter);
+        double externalNs = (nowMs() - start) * 1000000.0 / jobCount;
+
+        start = nowMs();
+        jobs.run([&jobs, &counter]()
+        {
+            for (int i = 0; i < jobCount; ++i)
+                jobs.run([]() {}, &counter);
+        }, &counter);
+        jobs.wait(counter);
+        double spawnedNs = (nowMs() - start) * 1000000.0 / jobCount;
+        printf("%-28s %10.0f ns\n", "overhead per external job", externalNs);
+        printf("%-28s %10.0f ns\n", "overhead per spawned job", spawnedNs);
+
+        // scaling: the same parallelFor with 1 to N threads
+        std::vector<float> values(1 << 22);
+        for (size_t i = 0; i < values.size(); ++i)
+            values[i] = (float)i;
+        auto kernel = [&values](size_t begin, size_t end)
+        {
+            for (size_t i = begin; i < end; ++i)
+                values[i] = std::sqrt(values[i] * 1.0001f + std::sin(values[i]));
+        };
+
+        printf("%8s %12s %10s %12s\n", "threads", "ms", "speedup", "efficiency");
+        double singleMs = 0.0;
+        for (int threads : threadCounts())
+        {
+            JobSystem scaled(threads - 1);
+            scaled.parallelFor(values.size(), 4096, kernel);
+
+            const int repeats = 5;
+            start = nowMs();
+            for (int r = 0; r < repeats; ++r)
+                scaled.parallelFor(values.size(), 4096, kernel);
+            double ms = (nowMs() - start) / repeats;
+            if (threads == 1)
+                singleMs = ms;
+            printf("%8d %12.3f %10.2f %11.0f%%\n", threads, ms, singleMs / ms, 100.0 * singleMs / ms / threads);
+        }
+
+        // tail latency: small jobs submitted one at a time to a mostly idle system,
+        // measured from submission until the job starts. The submitter spins on the
+        // counter instead of calling wait(), which would run the job itself before a
+        // sleeping worker woke up, so that a worker has to pick every job up; the
+        // system has at least one even on a single core
+        JobSystem latencyJobs(std::max(1, jobs.threadCount() - 1));
+        const int samples = 10000;
+        std::vector<double> latencies(samples);
+        for (int i = 0; i < samples; ++i)
+        {
+            JobCounter single;
+            double submitted = nowMs();
+            double* latency = &latencies[i];
+            latencyJobs.run([submitted, latency]() { *latency = (nowMs() - submitted) * 1000.0; }, &single);
+            while (single.pending.load(std::memory_order_acquire) > 0)
+                std::this_thread::yield();
+        }
+        std::sort(latencies.begin(), latencies.end());
+        printf("%-28s p50 %.2f us, p99 %.2f us, p99.9 %.2f us, max %.2f us\n", "small job start latency",
+            latencies[samples / 2], latencies[samples * 99 / 100], latencies[samples * 999 / 1000], latencies[samples - 1]);
+    }
+
+    // unit cube with a normal and uvs per face
+    inline std::vector<RasterVertex> texturedCube()
+    {
+        std::vector<glm::vec3> cube = cubeTriangles();
+        std::vector<RasterVertex> vertices(cube.size());
+        for (size_t i = 0; i < cube.size(); i += 3)
+        {
+            glm::vec3 normal = glm::normalize(glm::cross(cube[i + 1] - cube[i], cube[i + 2] - cube[i]));
+            int axis = std::fabs(normal.x) > 0.5f ? 0 : (std::fabs(normal.y) > 0.5f ? 1 : 2);
+            for (size_t v = i; v < i + 3; ++v)
+            {
+                vertices[v].position = cube[v];
+                vertices[v].normal = normal;
+                vertices[v].uv = glm::vec2(cube[v][(axis + 1) % 3], cube[v][(axis + 2) % 3]) + 0.5f;
+            }
+        }
+        return vertices;
+    }
+
+    inline RasterTexture checkerTexture()
+    {
+        const int textureSize = 256;
+        std::vector<unsigned char> checker(textureSize * textureSize * 3);
+        for (int i = 0; i < textureSize * textureSize; ++i)
+        {
+            unsigned char value = ((i % textureSize) / 32 + (i / textureSize) / 32) % 2 ? 230 : 60;
+            checker[i * 3] = value;
+            checker[i * 3 + 1] = value;
+            checker[i * 3 + 2] = 200;
+        }
+        RasterTexture texture;
+        texture.assign(checker.data(), textureSize, textureSize, 3);
+        return texture;
+    }
+
+    // transforms of cubes scattered in front of a camera at (0, 0.5, 2) looking down -z
+    inline std::vector<glm::mat4> scatteredCubes(size_t count, unsigned seed)
+    {
+        std::mt19937 random(seed);
+        std::uniform_real_distribution<float> x(-30.0f, 30.0f), y(-3.0f, 3.0f), z(-60.0f, -2.0f), size(0.1f, 1.0f), angle(0.0f, 6.2831853f);
+        std::vector<glm::mat4> models(count);
+        for (glm::mat4& model : models)
+            model = glm::translate(glm::mat4(1.0f), glm::vec3(x(random), y(random), z(random))) *
+                glm::rotate(glm::mat4(1.0f), angle(random), glm::normalize(glm::vec3(0.3f, 1.0f, 0.2f))) *
+                glm::scale(glm::mat4(1.0f), glm::vec3(size(random)));
+        return models;
+    }
+
+    inline void benchmarkRaster()
+    {
+        std::vector<RasterVertex> vertices = texturedCube();
+        RasterTexture texture = checkerTexture();
+        std::vector<glm::mat4> models = scatteredCubes(20000, 4);
+
+        const int width = 1280, height = 720;
+        glm::mat4 viewProjection = glm::perspective(glm::radians(45.0f), (float)width / height, 0.1f, 100.0f) *
+            glm::lookAt(glm::vec3(0.0f, 0.5f, 2.0f), glm::vec3(0.0f, 0.0f, -10.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+        const RasterMaterial material = { 0.3f, 0.5f, 16.0f };
+        const RasterLighting lighting = { glm::vec3(0.0f, 10.0f, 0.0f), glm::vec3(1.0f), glm::vec3(0.0f, 0.5f, 2.0f), glm::vec2(1.0f) };
+
+        printf("%zu triangles, %dx%d\n", models.size() * vertices.size() / 3, width, height);
+        printf("%8s %12s %10s %10s %10s\n", "threads", "frame ms", "frames/s", "Mtri/s", "speedup");
+
+        double singleMs = 0.0;
+        const int repeats = 5;
+        for (int threads : threadCounts())
+        {
+            SoftwareRasterizer rasterizer;
+            rasterizer.resize(width, height);
+            rasterizer.setThreadCount(threads);
+            rasterizer.setMaterials(&material, 1);
+
+            double start = 0.0;
+            for (int r = 0; r <= repeats; ++r)
+            {
+                // the first frame warms the bins up and is not timed
+                if (r == 1)
+                    start = nowMs();
+
+                rasterizer.beginFrame(lighting);
+                for (const glm::mat4& model : models)
+                {
+                    RasterDraw draw = { vertices.data(), 0, (int)vertices.size(), &texture, viewProjection * model, model,
+                        glm::transpose(glm::inverse(glm::mat3(model))), 0 };
+                    rasterizer.addDraw(draw);
+                }
+                rasterizer.render();
+            }
+            double ms = (nowMs() - start) / repeats;
+            if (threads == 1)
+                singleMs = ms;
+            printf("%8d %12.3f %10.1f %10.2f %10.2f\n", threads, ms, 1000.0 / ms, rasterizer.triangleCount() / ms / 1000.0, singleMs / ms);
+        }
+    }
+
+    inline void benchmarkPathTracer()
+    {
+        // the cubes of the rasterizer benchmark over a floor, for light to bounce off
+        std::vector<RasterVertex> vertices = texturedCube();
+        RasterTexture texture = checkerTexture();
+        std::vector<glm::mat4> models = scatteredCubes(20000, 4);
+        models.push_back(glm::translate(glm::mat4(1.0f), glm::vec3(0.0f, -4.0f, -30.0f)) * glm::scale(glm::mat4(1.0f), glm::vec3(80.0f, 1.0f, 80.0f)));
+
+        const int width = 640, height = 360;
+        glm::mat4 viewProjection = glm::perspective(glm::radians(45.0f), (float)width / height, 0.1f, 100.0f) *
+            glm::lookAt(glm::vec3(0.0f, 0.5f, 2.0f), glm::vec3(0.0f, 0.0f, -10.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+        const RasterMaterial material = { 0.3f, 0.5f, 16.0f };
+        const RasterLighting lighting = { glm::vec3(0.0f, 10.0f, 0.0f), glm::vec3(1.0f), glm::vec3(0.0f, 0.5f, 2.0f), glm::vec2(1.0f) };
+
+        auto setup = [&](PathTracer& tracer, int threads)
+        {
+            tracer.resize(width, height);
+            tracer.setThreadCount(threads);
+            tracer.setMaterials(&material, 1);
+            tracer.beginScene(lighting, viewProjection);
+            for (const glm::mat4& model : models)
+            {
+                RasterDraw draw = { vertices.data(), 0, (int)vertices.size(), &texture, viewProjection * model, model,
+                    glm::transpose(glm::inverse(glm::mat3(model))), 0 };
+                tracer.addDraw(draw);
+            }
+            tracer.endScene();
+        };
+
+        // samples per second and rays per second of full paths, by thread count
+        const int samples = 4;
+        double singleMs = 0.0;
+        for (int threads : threadCounts())
+        {
+            PathTracer tracer;
+            double buildStart = nowMs();
+            setup(tracer, threads);
+            double buildMs = nowMs() - buildStart;
+            if (threads == 1)
+            {
+                printf("%zu triangles, %dx%d, BVH built in %.1f ms\n", tracer.triangleCount(), width, height, buildMs);
+                printf("%8s %12s %10s %10s %10s\n", "threads", "sample ms", "samples/s", "Mrays/s", "speedup");
+            }
+
+            // the first sample warms the caches up and is not timed
+            tracer.renderSample();
+            uint64_t rays = 0;
+            double start = nowMs();
+            for (int s = 0; s < samples; ++s)
+            {
+                tracer.renderSample();
+                rays += tracer.rayCount();
+            }
+            double ms = (nowMs() - start) / samples;
+            if (threads == 1)
+                singleMs = ms;
+            printf("%8d %12.3f %10.2f %10.2f %10.2f\n", threads, ms, 1000.0 / ms, rays / samples / ms / 1000.0, singleMs / ms);
+        }
+
+        // camera rays in packets against one at a time, direct light only so that they dominate
+        printf("%8s %12s %10s\n", "camera", "sample ms", "Mrays/s");
+        for (int isPacket = 1; isPacket >= 0; --isPacket)
+        {
+            PathTracer tracer;
+            setup(tracer, hardwareThreadCount());
+            tracer.setMaxBounces(0);
+            tracer.setPacketTracing(isPacket != 0);
+            tracer.renderSample();
+            uint64_t rays = 0;
+            double start = nowMs();
+            for (int s = 0; s < samples; ++s)
+            {
+                tracer.renderSample();
+                rays += tracer.rayCount();
+            }
+            double ms = (nowMs() - start) / samples;
+            printf("%8s %12.3f %10.2f\n", isPacket ? "packets" : "single", ms, rays / samples / ms / 1000.0);
+        }
+
+        // the same seed gives the same image whatever the threads do
+        int manyThreads = std::max(4, hardwareThreadCount());
+        PathTracer one, many;
+        setup(one, 1);
+        setup(many, manyThreads);
+        for (int s = 0; s < 2; ++s)
+        {
+            one.renderSample();
+            many.renderSample();
+        }
+        bool isIdentical = memcmp(one.pixels(), many.pixels(), (size_t)width * height * sizeof(uint32_t)) == 0;
+        printf("1 and %d threads give %s images\n", manyThreads, isIdentical ? "identical" : "DIFFERENT");
+    }
+
+    // returns false for an unknown benchmark name
+    inline bool run(const char* name)
+    {
+        bool runAll = strcmp(name, "all") == 0;
+        bool found = false;
+
+        if (runAll || strcmp(name, "bvh") == 0)
+        {
+            printf("== BVH build, refit and query ==\n");
+            benchmarkBVH();
+            found = true;
+        }
+
+        if (runAll || strcmp(name, "cull") == 0)
+        {
+            printf("== Frustum culling ==\n");
+            benchmarkCulling();
+            found = true;
+        }
+
+        if (runAll || strcmp(name, "occlusion") == 0)
+        {
+            printf("== Software occlusion culling ==\n");
+            benchmarkOcclusion();
+            found = true;
+        }
+
+        if (runAll || strcmp(name, "transforms") == 0)
+        {
+            printf("== Instance MVP transforms ==\n");
+            benchmarkTransforms();
+            found = true;
+        }
+
+        if (runAll || strcmp(name, "lights") == 0)
+        {
+            printf("== Clustered light binning ==\n");
+            benchmarkLights();
+            found = true;
+        }
+
+        if (runAll || strcmp(name, "raster") == 0)
+        {
+            printf("== Software rasterizer ==\n");
+            benchmarkRaster();
+            found = true;
+        }
+
+        if (runAll || strcmp(name, "pathtrace") == 0)
+        {
+            printf("== Path tracer ==\n");
+            benchmarkPathTracer();
+            found = true;
+        }
+
+        if (runAll || strcmp(name, "jobs") == 0)
+        {
+            printf("== Job system ==\n");
+            benchmarkJobs();
+            found = true;
+        }
+
+        return found;
+    }
+}
+
+#endif
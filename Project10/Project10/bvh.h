@@ -0,0 +1,642 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include "culling.h"
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cfloat>
+#include <vector>
+
+// Flattened BVH node, 32 bytes so that two siblings share a cache line.
+// Siblings are always stored next to each other: the children of an
+// interior node are nodes[leftFirst] and nodes[leftFirst + 1].
+struct BVHNode
+{
+    glm::vec3 boundsMin;
+    int leftFirst;      // first child for interior nodes, first primitive index for leaves
+    glm::vec3 boundsMax;
+    int count;          // number of primitives in a leaf, 0 for interior nodes
+
+    bool isLeaf() const { return count > 0; }
+};
+
+
+// Nodes left to visit in a traversal. A SAH tree stays well within the fixed
+// entries; the ones past them, of a degenerate tree or one that refits have
+// rotated deep, go to the heap rather than past the end.
+class BVHStack
+{
+public:
+    BVHStack() : size(0) {}
+
+    bool isEmpty() const
+    {
+        return size == 0;
+    }
+
+    void push(int node)
+    {
+        if (size < FIXED_SIZE)
+            fixed[size] = node;
+        else
+            overflow.push_back(node);
+        size++;
+    }
+
+    int pop()
+    {
+        if (--size < FIXED_SIZE)
+            return fixed[size];
+        int node = overflow.back();
+        overflow.pop_back();
+        return node;
+    }
+
+private:
+    static const int FIXED_SIZE = 256;
+
+    int fixed[FIXED_SIZE];
+    std::vector<int> overflow;
+    int size;
+};
+
+
+// Bounding volume hierarchy over primitive bounding boxes. Static content is
+// built top-down with a binned surface area heuristic; moving primitives are
+// handled by refitting the path to the root and rotating subtrees on the way
+// up so that the tree quality does not degrade as objects move.
+class BVH
+{
+public:
+    std::vector<BVHNode> nodes;
+    std::vector<int> primitiveIndices;  // leaves reference ranges of this array
+    std::vector<AABB> primitiveBounds;
+
+    BVH() : nodesUsed(0) {}
+
+    // SAH build over the given boxes; primitive ids are indices into bounds
+    void build(const std::vector<AABB>& bounds)
+    {
+        primitiveBounds = bounds;
+        size_t count = bounds.size();
+
+        primitiveIndices.resize(count);
+        centroids.resize(count);
+        for (size_t i = 0; i < count; ++i)
+        {
+            primitiveIndices[i] = (int)i;
+            centroids[i] = (bounds[i].min + bounds[i].max) * 0.5f;
+        }
+
+        nodes.assign(count > 0 ? count * 2 : 1, BVHNode());
+        parents.assign(nodes.size(), -1);
+        primitiveLeaf.assign(count, 0);
+
+        BVHNode& root = nodes[0];
+        root.leftFirst = 0;
+        root.count = (int)count;
+        nodesUsed = 1;
+        if (count == 0)
+        {
+            root.boundsMin = root.boundsMax = glm::vec3(0.0f);
+            return;
+        }
+
+        updateNodeBounds(0);
+        subdivide(0);
+        nodes.resize(nodesUsed);
+        parents.resize(nodesUsed);
+    }
+
+    // recompute every node from the current primitive bounds
+    void refit()
+    {
+        if (primitiveBounds.empty())
+            return;
+
+        // rotations move node records around, so children are not guaranteed
+        // to come after their parent; refit in post order from the root
+        refitNode(0);
+    }
+
+    // move one primitive and refit its path to the root, rotating where it pays off
+    void update(int primitive, const AABB& bounds)
+    {
+        primitiveBounds[primitive] = bounds;
+
+        int node = primitiveLeaf[primitive];
+        while (node >= 0)
+        {
+            updateNodeBounds(node);
+            if (!nodes[node].isLeaf())
+                rotate(node);
+            node = parents[node];
+        }
+    }
+
+    // every primitive whose box intersects the frustum
+    void queryFrustum(const Frustum& frustum, std::vector<int>& result) const
+    {
+        if (primitiveBounds.empty())
+            return;
+
+        BVHStack stack;
+        stack.push(0);
+
+        while (!stack.isEmpty())
+        {
+            const BVHNode& node = nodes[stack.pop()];
+
+            bool isInside = true;
+            if (!classify(frustum, node, isInside))
+                continue;
+
+            if (isInside)
+            {
+                // the whole subtree is visible, no further plane tests needed
+                collect(node, result);
+                continue;
+            }
+
+            if (node.isLeaf())
+            {
+                for (int i = 0; i < node.count; ++i)
+                {
+                    int primitive = primitiveIndices[node.leftFirst + i];
+                    if (isVisible(frustum, primitiveBounds[primitive]))
+                        result.push_back(primitive);
+                }
+                continue;
+            }
+
+            stack.push(node.leftFirst);
+            stack.push(node.leftFirst + 1);
+        }
+    }
+
+    // every primitive whose box overlaps the sphere
+    void queryProximity(const glm::vec3& center, float radius, std::vector<int>& result) const
+    {
+        if (primitiveBounds.empty())
+            return;
+
+        float radiusSquared = radius * radius;
+        BVHStack stack;
+        stack.push(0);
+
+        while (!stack.isEmpty())
+        {
+            const BVHNode& node = nodes[stack.pop()];
+            if (distanceSquared(center, node.boundsMin, node.boundsMax) > radiusSquared)
+                continue;
+
+            if (node.isLeaf())
+            {
+                for (int i = 0; i < node.count; ++i)
+                {
+                    int primitive = primitiveIndices[node.leftFirst + i];
+                    if (distanceSquared(center, primitiveBounds[primitive].min, primitiveBounds[primitive].max) <= radiusSquared)
+                        result.push_back(primitive);
+                }
+                continue;
+            }
+
+            stack.push(node.leftFirst);
+            stack.push(node.leftFirst + 1);
+        }
+    }
+
+    // closest primitive hit by the ray, or -1. intersect(primitive, origin, direction, tMax)
+    // returns the hit distance of the primitive or a negative value for a miss, so callers
+    // can refine the box hit to the actual geometry. tMax is updated to the closest hit.
+    template <class Intersect>
+    int raycast(const glm::vec3& origin, const glm::vec3& direction, float& tMax, Intersect intersect) const
+    {
+        if (primitiveBounds.empty())
+            return -1;
+
+        glm::vec3 inverseDirection(1.0f / direction.x, 1.0f / direction.y, 1.0f / direction.z);
+        int closest = -1;
+
+        BVHStack stack;
+        if (intersectBox(origin, inverseDirection, nodes[0].boundsMin, nodes[0].boundsMax, tMax) < FLT_MAX)
+            stack.push(0);
+
+        while (!stack.isEmpty())
+        {
+            const BVHNode& node = nodes[stack.pop()];
+
+            if (node.isLeaf())
+            {
+                for (int i = 0; i < node.count; ++i)
+                {
+                    int primitive = primitiveIndices[node.leftFirst + i];
+                    float t = intersect(primitive, origin, direction, tMax);
+                    if (t >= 0.0f && t < tMax)
+                    {
+                        tMax = t;
+                        closest = primitive;
+                    }
+                }
+                continue;
+            }
+
+            // visit the nearer child first so that far subtrees get rejected by tMax
+            int first = node.leftFirst;
+            int second = node.leftFirst + 1;
+            float tFirst = intersectBox(origin, inverseDirection, nodes[first].boundsMin, nodes[first].boundsMax, tMax);
+            float tSecond = intersectBox(origin, inverseDirection, nodes[second].boundsMin, nodes[second].boundsMax, tMax);
+            if (tFirst > tSecond)
+            {
+                std::swap(first, second);
+                std::swap(tFirst, tSecond);
+            }
+            if (tSecond < FLT_MAX)
+                stack.push(second);
+            if (tFirst < FLT_MAX)
+                stack.push(first);
+        }
+
+        return closest;
+    }
+
+    // whether the ray hits any primitive before tMax; isHit(primitive, origin, direction, tMax)
+    // tests the primitive itself, and the first one it accepts ends the traversal
+    template <class IsHit>
+    bool raycastAny(const glm::vec3& origin, const glm::vec3& direction, float tMax, IsHit isHit) const
+    {
+        if (primitiveBounds.empty())
+            return false;
+
+        glm::vec3 inverseDirection(1.0f / direction.x, 1.0f / direction.y, 1.0f / direction.z);
+        BVHStack stack;
+        stack.push(0);
+
+        while (!stack.isEmpty())
+        {
+            const BVHNode& node = nodes[stack.pop()];
+            if (intersectBox(origin, inverseDirection, node.boundsMin, node.boundsMax, tMax) == FLT_MAX)
+                continue;
+
+            if (node.isLeaf())
+            {
+                for (int i = 0; i < node.count; ++i)
+                {
+                    if (isHit(primitiveIndices[node.leftFirst + i], origin, direction, tMax))
+                        return true;
+                }
+                continue;
+            }
+
+            stack.push(node.leftFirst);
+            stack.push(node.leftFirst + 1);
+        }
+        return false;
+    }
+
+    // closest primitive box hit by the ray
+    int raycast(const glm::vec3& origin, const glm::vec3& direction, float& tMax) const
+    {
+        return raycast(origin, direction, tMax, [this](int primitive, const glm::vec3& o, const glm::vec3& d, float t) {
+            glm::vec3 inverseDirection(1.0f / d.x, 1.0f / d.y, 1.0f / d.z);
+            float hit = intersectBox(o, inverseDirection, primitiveBounds[primitive].min, primitiveBounds[primitive].max, t);
+            return hit < FLT_MAX ? hit : -1.0f;
+        });
+    }
+
+    // slab test, returns the entry distance or FLT_MAX for a miss
+    static float intersectBox(const glm::vec3& origin, const glm::vec3& inverseDirection, const glm::vec3& boxMin, const glm::vec3& boxMax, float tMax)
+    {
+        float tx1 = (boxMin.x - origin.x) * inverseDirection.x, tx2 = (boxMax.x - origin.x) * inverseDirection.x;
+        float tNear = std::min(tx1, tx2), tFar = std::max(tx1, tx2);
+        float ty1 = (boxMin.y - origin.y) * inverseDirection.y, ty2 = (boxMax.y - origin.y) * inverseDirection.y;
+        tNear = std::max(tNear, std::min(ty1, ty2)), tFar = std::min(tFar, std::max(ty1, ty2));
+        float tz1 = (boxMin.z - origin.z) * inverseDirection.z, tz2 = (boxMax.z - origin.z) * inverseDirection.z;
+        tNear = std::max(tNear, std::min(tz1, tz2)), tFar = std::min(tFar, std::max(tz1, tz2));
+        if (tFar >= tNear && tNear < tMax && tFar > 0.0f)
+            return std::max(tNear, 0.0f);
+        return FLT_MAX;
+    }
+
+    int nodeCount() const
+    {
+        return nodesUsed;
+    }
+
+    // sum of node surface areas relative to the root, lower is better
+    float cost() const
+    {
+        if (primitiveBounds.empty())
+            return 0.0f;
+
+        float total = 0.0f;
+        for (int i = 0; i < nodesUsed; ++i)
+            total += area(nodes[i].boundsMin, nodes[i].boundsMax) * (nodes[i].isLeaf() ? nodes[i].count : 1);
+        return total / area(nodes[0].boundsMin, nodes[0].boundsMax);
+    }
+
+private:
+    static const int BIN_COUNT = 12;
+    static const int MAX_LEAF_SIZE = 4;
+    static constexpr float TRAVERSAL_COST = 1.0f;
+
+    int nodesUsed;
+    std::vector<glm::vec3> centroids;
+    std::vector<int> parents;
+    std::vector<int> primitiveLeaf;
+
+    static float area(const glm::vec3& boxMin, const glm::vec3& boxMax)
+    {
+        glm::vec3 e = boxMax - boxMin;
+        return e.x * e.y + e.y * e.z + e.z * e.x;
+    }
+
+    static float distanceSquared(const glm::vec3& p, const glm::vec3& boxMin, const glm::vec3& boxMax)
+    {
+        glm::vec3 d = glm::max(glm::max(boxMin - p, p - boxMax), glm::vec3(0.0f));
+        return glm::dot(d, d);
+    }
+
+    // false if the node is outside; isInside is set when it is fully inside every plane
+    static bool classify(const Frustum& frustum, const BVHNode& node, bool& isInside)
+    {
+        glm::vec3 center = (node.boundsMin + node.boundsMax) * 0.5f;
+        glm::vec3 extent = (node.boundsMax - node.boundsMin) * 0.5f;
+        isInside = true;
+        for (int i = 0; i < 6; ++i)
+        {
+            glm::vec3 normal(frustum.planes[i]);
+            float distance = glm::dot(normal, center) + frustum.planes[i].w;
+            float radius = glm::dot(glm::abs(normal), extent);
+            if (distance + radius < 0.0f)
+                return false;
+            if (distance - radius < 0.0f)
+                isInside = false;
+        }
+        return true;
+    }
+
+    void collect(const BVHNode& node, std::vector<int>& result) const
+    {
+        if (node.isLeaf())
+        {
+            for (int i = 0; i < node.count; ++i)
+                result.push_back(primitiveIndices[node.leftFirst + i]);
+            return;
+        }
+        collect(nodes[node.leftFirst], result);
+        collect(nodes[node.leftFirst + 1], result);
+    }
+
+    void refitNode(int index)
+    {
+        if (!nodes[index].isLeaf())
+        {
+            refitNode(nodes[index].leftFirst);
+            refitNode(nodes[index].leftFirst + 1);
+        }
+        updateNodeBounds(index);
+    }
+
+    void updateNodeBounds(int index)
+    {
+        BVHNode& node = nodes[index];
+        if (node.isLeaf())
+        {
+            node.boundsMin = glm::vec3(FLT_MAX);
+            node.boundsMax = glm::vec3(-FLT_MAX);
+            for (int i = 0; i < node.count; ++i)
+            {
+                const AABB& box = primitiveBounds[primitiveIndices[node.leftFirst + i]];
+                node.boundsMin = glm::min(node.boundsMin, box.min);
+                node.boundsMax = glm::max(node.boundsMax, box.max);
+            }
+            return;
+        }
+
+        const BVHNode& left = nodes[node.leftFirst];
+        const BVHNode& right = nodes[node.leftFirst + 1];
+        node.boundsMin = glm::min(left.boundsMin, right.boundsMin);
+        node.boundsMax = glm::max(left.boundsMax, right.boundsMax);
+    }
+
+    // best binned SAH split of a node; returns its cost or FLT_MAX
+    float findBestSplit(const BVHNode& node, int& bestAxis, float& bestPosition) const
+    {
+        glm::vec3 centroidMin(FLT_MAX), centroidMax(-FLT_MAX);
+        for (int i = 0; i < node.count; ++i)
+        {
+            const glm::vec3& c = centroids[primitiveIndices[node.leftFirst + i]];
+            centroidMin = glm::min(centroidMin, c);
+            centroidMax = glm::max(centroidMax, c);
+        }
+
+        // bin all three axes in one pass, primitive data is fetched randomly
+        glm::vec3 binMin[3][BIN_COUNT], binMax[3][BIN_COUNT];
+        int binCount[3][BIN_COUNT] = {};
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            for (int b = 0; b < BIN_COUNT; ++b)
+            {
+                binMin[axis][b] = glm::vec3(FLT_MAX);
+                binMax[axis][b] = glm::vec3(-FLT_MAX);
+            }
+        }
+
+        glm::vec3 extent = centroidMax - centroidMin;
+        glm::vec3 scale(extent.x > 0.0f ? BIN_COUNT / extent.x : 0.0f, extent.y > 0.0f ? BIN_COUNT / extent.y : 0.0f, extent.z > 0.0f ? BIN_COUNT / extent.z : 0.0f);
+        for (int i = 0; i < node.count; ++i)
+        {
+            int primitive = primitiveIndices[node.leftFirst + i];
+            const AABB& box = primitiveBounds[primitive];
+            const glm::vec3& c = centroids[primitive];
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                int b = std::min(BIN_COUNT - 1, (int)((c[axis] - centroidMin[axis]) * scale[axis]));
+                binCount[axis][b]++;
+                binMin[axis][b] = glm::min(binMin[axis][b], box.min);
+                binMax[axis][b] = glm::max(binMax[axis][b], box.max);
+            }
+        }
+
+        float bestCost = FLT_MAX;
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            if (extent[axis] <= 0.0f)
+                continue;
+
+            // sweep from both sides to get the cost of every bin boundary
+            float leftArea[BIN_COUNT - 1], rightArea[BIN_COUNT - 1];
+            int leftCount[BIN_COUNT - 1], rightCount[BIN_COUNT - 1];
+            glm::vec3 leftMin(FLT_MAX), leftMax(-FLT_MAX), rightMin(FLT_MAX), rightMax(-FLT_MAX);
+            int leftSum = 0, rightSum = 0;
+            for (int b = 0; b < BIN_COUNT - 1; ++b)
+            {
+                leftSum += binCount[axis][b];
+                leftCount[b] = leftSum;
+                leftMin = glm::min(leftMin, binMin[axis][b]);
+                leftMax = glm::max(leftMax, binMax[axis][b]);
+                leftArea[b] = leftSum > 0 ? area(leftMin, leftMax) : 0.0f;
+
+                rightSum += binCount[axis][BIN_COUNT - 1 - b];
+                rightCount[BIN_COUNT - 2 - b] = rightSum;
+                rightMin = glm::min(rightMin, binMin[axis][BIN_COUNT - 1 - b]);
+                rightMax = glm::max(rightMax, binMax[axis][BIN_COUNT - 1 - b]);
+                rightArea[BIN_COUNT - 2 - b] = rightSum > 0 ? area(rightMin, rightMax) : 0.0f;
+            }
+
+            float binWidth = extent[axis] / BIN_COUNT;
+            for (int b = 0; b < BIN_COUNT - 1; ++b)
+            {
+                float cost = leftCount[b] * leftArea[b] + rightCount[b] * rightArea[b];
+                if (cost < bestCost)
+                {
+                    bestCost = cost;
+                    bestAxis = axis;
+                    bestPosition = centroidMin[axis] + binWidth * (b + 1);
+                }
+            }
+        }
+        return bestCost;
+    }
+
+    void subdivide(int index)
+    {
+        BVHNode& node = nodes[index];
+        if (node.count <= 1)
+        {
+            markLeaf(index);
+            return;
+        }
+
+        int axis = 0;
+        float position = 0.0f;
+        float splitCost = findBestSplit(node, axis, position);
+        // costs are relative to one primitive test; a split adds one traversal step
+        float nodeArea = area(node.boundsMin, node.boundsMax);
+        float leafCost = node.count * nodeArea;
+        if (splitCost < FLT_MAX)
+            splitCost += TRAVERSAL_COST * nodeArea;
+        if (splitCost >= leafCost && node.count <= MAX_LEAF_SIZE)
+        {
+            markLeaf(index);
+            return;
+        }
+
+        // partition the primitive range around the split plane
+        int i = node.leftFirst;
+        int j = i + node.count - 1;
+        if (splitCost < FLT_MAX)
+        {
+            while (i <= j)
+            {
+                if (centroids[primitiveIndices[i]][axis] < position)
+                    i++;
+                else
+                    std::swap(primitiveIndices[i], primitiveIndices[j--]);
+            }
+        }
+
+        // degenerate split (identical centroids): halve the range instead
+        int leftCount = i - node.leftFirst;
+        if (leftCount == 0 || leftCount == node.count)
+        {
+            if (node.count <= MAX_LEAF_SIZE)
+            {
+                markLeaf(index);
+                return;
+            }
+            leftCount = node.count / 2;
+        }
+
+        int leftChild = nodesUsed;
+        nodesUsed += 2;
+        nodes[leftChild].leftFirst = node.leftFirst;
+        nodes[leftChild].count = leftCount;
+        nodes[leftChild + 1].leftFirst = node.leftFirst + leftCount;
+        nodes[leftChild + 1].count = node.count - leftCount;
+        node.leftFirst = leftChild;
+        node.count = 0;
+        parents[leftChild] = index;
+        parents[leftChild + 1] = index;
+
+        updateNodeBounds(leftChild);
+        updateNodeBounds(leftChild + 1);
+        subdivide(leftChild);
+        subdivide(leftChild + 1);
+    }
+
+    void markLeaf(int index)
+    {
+        const BVHNode& node = nodes[index];
+        for (int i = 0; i < node.count; ++i)
+            primitiveLeaf[primitiveIndices[node.leftFirst + i]] = index;
+    }
+
+    // point parents/primitiveLeaf at a node record that was moved to index
+    void relink(int index)
+    {
+        const BVHNode& node = nodes[index];
+        if (node.isLeaf())
+        {
+            markLeaf(index);
+            return;
+        }
+        parents[node.leftFirst] = index;
+        parents[node.leftFirst + 1] = index;
+    }
+
+    // swap two node records that live in different subtrees
+    void swapNodes(int a, int b)
+    {
+        std::swap(nodes[a], nodes[b]);
+        relink(a);
+        relink(b);
+    }
+
+    // tree rotation (Kopta et al.): swap a child with a grandchild on the other
+    // side when that shrinks the surface area of the other child
+    void rotate(int index)
+    {
+        const BVHNode& node = nodes[index];
+        int children[2] = { node.leftFirst, node.leftFirst + 1 };
+
+        int bestChild = -1, bestGrandchild = -1;
+        float bestGain = 0.0f;
+        for (int side = 0; side < 2; ++side)
+        {
+            int child = children[side];
+            int other = children[1 - side];
+            if (nodes[other].isLeaf())
+                continue;
+
+            float otherArea = area(nodes[other].boundsMin, nodes[other].boundsMax);
+            for (int g = 0; g < 2; ++g)
+            {
+                int grandchild = nodes[other].leftFirst + g;
+                int sibling = nodes[other].leftFirst + 1 - g;
+                // after the swap, other contains child and sibling
+                glm::vec3 newMin = glm::min(nodes[child].boundsMin, nodes[sibling].boundsMin);
+                glm::vec3 newMax = glm::max(nodes[child].boundsMax, nodes[sibling].boundsMax);
+                float gain = otherArea - area(newMin, newMax);
+                if (gain > bestGain)
+                {
+                    bestGain = gain;
+                    bestChild = child;
+                    bestGrandchild = grandchild;
+                }
+            }
+        }
+
+        if (bestChild < 0)
+            return;
+
+        int other = parents[bestGrandchild];
+        swapNodes(bestChild, bestGrandchild);
+        updateNodeBounds(other);
+    }
+};
+
+#endif
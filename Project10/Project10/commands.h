@@ -0,0 +1,81 @@
+#ifndef COMMANDS_H
+#define COMMANDS_H
+
+#include <GL/glew.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+// Instanced draw recorded while a frame is built, possibly on another thread,
+// and issued later by the thread that owns the GL context
+struct DrawCommand
+{
+    uint64_t sortKey;
+    GLuint texture;
+    uint32_t features;      // shader variant of the draw, see ShaderPermutations
+    GLint first;            // vertex range of the mesh
+    GLsizei count;
+    GLuint baseInstance;    // instance range in the instance buffer
+    GLsizei instanceCount;
+};
+
+// orders draws by shader variant first, then by texture, so that replaying them
+// switches programs and binds textures as rarely as possible; the top 16 bits of
+// the variant id go in, a collision only costs an extra program switch
+inline uint64_t drawSortKey(uint64_t variantId, GLuint texture, int object)
+{
+    return (variantId & 0xFFFF000000000000ull) | ((uint64_t)texture << 16) | (uint16_t)object;
+}
+
+// Collects the lists recorded by every thread into one list sorted by key.
+// Draws of the same mesh range whose instances follow each other in the
+// instance buffer are merged into a single draw.
+inline void mergeCommandLists(const std::vector<std::vector<DrawCommand> >& lists, std::vector<DrawCommand>& merged)
+{
+    merged.clear();
+    for (size_t i = 0; i < lists.size(); ++i)
+        merged.insert(merged.end(), lists[i].begin(), lists[i].end());
+
+    // stable, so that the draws of one key keep the thread order
+    std::stable_sort(merged.begin(), merged.end(),
+        [](const DrawCommand& a, const DrawCommand& b) { return a.sortKey < b.sortKey; });
+
+    size_t count = 0;
+    for (size_t i = 0; i < merged.size(); ++i)
+    {
+        const DrawCommand& command = merged[i];
+        if (count > 0)
+        {
+            DrawCommand& last = merged[count - 1];
+            if (last.sortKey == command.sortKey && last.features == command.features && last.first == command.first && last.count == command.count &&
+                last.baseInstance + last.instanceCount == command.baseInstance)
+            {
+                last.instanceCount += command.instanceCount;
+                continue;
+            }
+        }
+        merged[count++] = command;
+    }
+    merged.resize(count);
+}
+
+// issues the draws in order; the mesh vao and the program must be bound
+inline void replayCommands(const DrawCommand* commands, size_t count)
+{
+    glActiveTexture(GL_TEXTURE0);
+    for (size_t i = 0; i < count; ++i)
+    {
+        const DrawCommand& command = commands[i];
+        if (i == 0 || command.texture != commands[i - 1].texture)
+            glBindTexture(GL_TEXTURE_2D, command.texture);
+        glDrawArraysInstancedBaseInstance(GL_TRIANGLES, command.first, command.count, command.instanceCount, command.baseInstance);
+    }
+}
+
+inline void replayCommands(const std::vector<DrawCommand>& commands)
+{
+    replayCommands(commands.data(), commands.size());
+}
+
+#endif
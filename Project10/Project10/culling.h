@@ -0,0 +1,236 @@
+#ifndef CULLING_H
+#define CULLING_H
+
+#include <glm/glm.hpp>
+
+#include <cmath>
+#include <cstddef>
+#include <vector>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#define CULLING_AVX
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define CULLING_SSE2
+#endif
+
+// Axis aligned bounding box
+struct AABB
+{
+    glm::vec3 min;
+    glm::vec3 max;
+};
+
+// Six normalized planes (xyz = normal pointing inside, w = distance)
+struct Frustum
+{
+    glm::vec4 planes[6];
+};
+
+
+// bounds of count interleaved vertices starting at first; position is the first 3 floats of each vertex
+inline AABB computeBounds(const float* vertices, int first, int count, int floatsPerVertex)
+{
+    AABB box;
+    box.min = glm::vec3(INFINITY);
+    box.max = glm::vec3(-INFINITY);
+    for (int i = first; i < first + count; ++i)
+    {
+        glm::vec3 p(vertices[i * floatsPerVertex], vertices[i * floatsPerVertex + 1], vertices[i * floatsPerVertex + 2]);
+        box.min = glm::min(box.min, p);
+        box.max = glm::max(box.max, p);
+    }
+    return box;
+}
+
+// bounds of a box after an affine transform (Arvo's method)
+inline AABB transformBounds(const AABB& box, const glm::mat4& m)
+{
+    AABB result;
+    result.min = glm::vec3(m[3]);
+    result.max = glm::vec3(m[3]);
+    for (int column = 0; column < 3; ++column)
+    {
+        glm::vec3 a = glm::vec3(m[column]) * box.min[column];
+        glm::vec3 b = glm::vec3(m[column]) * box.max[column];
+        result.min += glm::min(a, b);
+        result.max += glm::max(a, b);
+    }
+    return result;
+}
+
+inline AABB mergeBounds(const AABB& a, const AABB& b)
+{
+    AABB result;
+    result.min = glm::min(a.min, b.min);
+    result.max = glm::max(a.max, b.max);
+    return result;
+}
+
+// Gribb/Hartmann plane extraction from a projection * view matrix
+inline Frustum extractFrustum(const glm::mat4& viewProjection)
+{
+    glm::vec4 row0(viewProjection[0][0], viewProjection[1][0], viewProjection[2][0], viewProjection[3][0]);
+    glm::vec4 row1(viewProjection[0][1], viewProjection[1][1], viewProjection[2][1], viewProjection[3][1]);
+    glm::vec4 row2(viewProjection[0][2], viewProjection[1][2], viewProjection[2][2], viewProjection[3][2]);
+    glm::vec4 row3(viewProjection[0][3], viewProjection[1][3], viewProjection[2][3], viewProjection[3][3]);
+
+    Frustum frustum;
+    frustum.planes[0] = row3 + row0;  // left
+    frustum.planes[1] = row3 - row0;  // right
+    frustum.planes[2] = row3 + row1;  // bottom
+    frustum.planes[3] = row3 - row1;  // top
+    frustum.planes[4] = row3 + row2;  // near
+    frustum.planes[5] = row3 - row2;  // far
+
+    for (int i = 0; i < 6; ++i)
+        frustum.planes[i] /= glm::length(glm::vec3(frustum.planes[i]));
+
+    return frustum;
+}
+
+// single box test, used for the odd object that is not in a culler
+inline bool isVisible(const Frustum& frustum, const AABB& box)
+{
+    glm::vec3 center = (box.min + box.max) * 0.5f;
+    glm::vec3 extent = (box.max - box.min) * 0.5f;
+    for (int i = 0; i < 6; ++i)
+    {
+        glm::vec3 normal(frustum.planes[i]);
+        float distance = glm::dot(normal, center) + frustum.planes[i].w + glm::dot(glm::abs(normal), extent);
+        if (distance < 0.0f)
+            return false;
+    }
+    return true;
+}
+
+
+// Tests many boxes against a frustum. Boxes are kept as centers and extents
+// in structure-of-arrays form so that 4 (SSE) or 8 (AVX) boxes are tested
+// against a plane with a handful of vector instructions.
+class FrustumCuller
+{
+public:
+    void resize(size_t count)
+    {
+        centerX.resize(count);
+        centerY.resize(count);
+        centerZ.resize(count);
+        extentX.resize(count);
+        extentY.resize(count);
+        extentZ.resize(count);
+    }
+
+    size_t size() const
+    {
+        return centerX.size();
+    }
+
+    void setBounds(size_t index, const AABB& box)
+    {
+        centerX[index] = (box.min.x + box.max.x) * 0.5f;
+        centerY[index] = (box.min.y + box.max.y) * 0.5f;
+        centerZ[index] = (box.min.z + box.max.z) * 0.5f;
+        extentX[index] = (box.max.x - box.min.x) * 0.5f;
+        extentY[index] = (box.max.y - box.min.y) * 0.5f;
+        extentZ[index] = (box.max.z - box.min.z) * 0.5f;
+    }
+
+    // writes 1 for every box that intersects the frustum, 0 otherwise; returns the visible count
+    size_t cull(const Frustum& frustum, unsigned char* visible) const
+    {
+        return cull(frustum, visible, 0, size());
+    }
+
+    // same for the boxes in [begin, end) only, so that ranges can be culled by different threads
+    size_t cull(const Frustum& frustum, unsigned char* visible, size_t begin, size_t end) const
+    {
+        size_t count = end;
+        size_t i = begin;
+        size_t visibleCount = 0;
+
+#if defined(CULLING_AVX)
+        for (; i + 8 <= count; i += 8)
+        {
+            __m256 cx = _mm256_loadu_ps(&centerX[i]);
+            __m256 cy = _mm256_loadu_ps(&centerY[i]);
+            __m256 cz = _mm256_loadu_ps(&centerZ[i]);
+            __m256 ex = _mm256_loadu_ps(&extentX[i]);
+            __m256 ey = _mm256_loadu_ps(&extentY[i]);
+            __m256 ez = _mm256_loadu_ps(&extentZ[i]);
+
+            __m256 outside = _mm256_setzero_ps();
+            for (int p = 0; p < 6; ++p)
+            {
+                const glm::vec4& plane = frustum.planes[p];
+                __m256 distance = _mm256_add_ps(_mm256_set1_ps(plane.w),
+                    _mm256_add_ps(_mm256_mul_ps(cx, _mm256_set1_ps(plane.x)),
+                    _mm256_add_ps(_mm256_mul_ps(cy, _mm256_set1_ps(plane.y)), _mm256_mul_ps(cz, _mm256_set1_ps(plane.z)))));
+                __m256 radius = _mm256_add_ps(_mm256_mul_ps(ex, _mm256_set1_ps(std::fabs(plane.x))),
+                    _mm256_add_ps(_mm256_mul_ps(ey, _mm256_set1_ps(std::fabs(plane.y))), _mm256_mul_ps(ez, _mm256_set1_ps(std::fabs(plane.z)))));
+                outside = _mm256_or_ps(outside, _mm256_cmp_ps(_mm256_add_ps(distance, radius), _mm256_setzero_ps(), _CMP_LT_OQ));
+            }
+
+            int mask = _mm256_movemask_ps(outside);
+            for (int lane = 0; lane < 8; ++lane)
+            {
+                visible[i + lane] = (mask >> lane) & 1 ? 0 : 1;
+                visibleCount += visible[i + lane];
+            }
+        }
+#elif defined(CULLING_SSE2)
+        for (; i + 4 <= count; i += 4)
+        {
+            __m128 cx = _mm_loadu_ps(&centerX[i]);
+            __m128 cy = _mm_loadu_ps(&centerY[i]);
+            __m128 cz = _mm_loadu_ps(&centerZ[i]);
+            __m128 ex = _mm_loadu_ps(&extentX[i]);
+            __m128 ey = _mm_loadu_ps(&extentY[i]);
+            __m128 ez = _mm_loadu_ps(&extentZ[i]);
+
+            __m128 outside = _mm_setzero_ps();
+            for (int p = 0; p < 6; ++p)
+            {
+                const glm::vec4& plane = frustum.planes[p];
+                __m128 distance = _mm_add_ps(_mm_set1_ps(plane.w),
+                    _mm_add_ps(_mm_mul_ps(cx, _mm_set1_ps(plane.x)),
+                    _mm_add_ps(_mm_mul_ps(cy, _mm_set1_ps(plane.y)), _mm_mul_ps(cz, _mm_set1_ps(plane.z)))));
+                __m128 radius = _mm_add_ps(_mm_mul_ps(ex, _mm_set1_ps(std::fabs(plane.x))),
+                    _mm_add_ps(_mm_mul_ps(ey, _mm_set1_ps(std::fabs(plane.y))), _mm_mul_ps(ez, _mm_set1_ps(std::fabs(plane.z)))));
+                outside = _mm_or_ps(outside, _mm_cmplt_ps(_mm_add_ps(distance, radius), _mm_setzero_ps()));
+            }
+
+            int mask = _mm_movemask_ps(outside);
+            for (int lane = 0; lane < 4; ++lane)
+            {
+                visible[i + lane] = (mask >> lane) & 1 ? 0 : 1;
+                visibleCount += visible[i + lane];
+            }
+        }
+#endif
+
+        // scalar tail (and the whole range without SIMD support)
+        for (; i < count; ++i)
+        {
+            bool inside = true;
+            for (int p = 0; p < 6 && inside; ++p)
+            {
+                const glm::vec4& plane = frustum.planes[p];
+                float distance = plane.x * centerX[i] + plane.y * centerY[i] + plane.z * centerZ[i] + plane.w;
+                float radius = std::fabs(plane.x) * extentX[i] + std::fabs(plane.y) * extentY[i] + std::fabs(plane.z) * extentZ[i];
+                inside = distance + radius >= 0.0f;
+            }
+            visible[i] = inside ? 1 : 0;
+            visibleCount += visible[i];
+        }
+
+        return visibleCount;
+    }
+
+private:
+    std::vector<float> centerX, centerY, centerZ;
+    std::vector<float> extentX, extentY, extentZ;
+};
+
+#endif
@@ -0,0 +1,210 @@
+#ifndef DEFERRED_H
+#define DEFERRED_H
+
+#include <GL/glew.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+// G-buffer of the deferred shading path, 12 bytes per pixel:
+//   albedoMaterial  RGBA8         texture color, material id in alpha
+//   normal          RG16_SNORM    world space normal, octahedral encoded
+//   depth           DEPTH32F      world position is reconstructed from it
+// The lighting pass writes the lit image into a separate RGBA8 texture that
+// shares the depth buffer, so forward drawn objects like the lamp can be
+// depth tested against the scene before the result goes to the screen.
+//
+// The targets are allocated at the window size, but the scene can be drawn
+// into a smaller render area in their lower left corner (dynamic resolution),
+// which blitToScreen scales up to the window. The forward path uses the lit
+// framebuffer as its render target when the render area is in use.
+class GBuffer
+{
+public:
+    // texture units and image unit the lighting pass reads and writes
+    static const GLuint ALBEDO_MATERIAL_UNIT = 0;
+    static const GLuint NORMAL_UNIT = 1;
+    static const GLuint DEPTH_UNIT = 2;
+    static const GLuint LIT_IMAGE_UNIT = 0;
+
+    static const int BYTES_PER_PIXEL = 12;
+
+    GBuffer() : width(0), height(0), renderWidth(0), renderHeight(0), geometryFramebuffer(0), litFramebuffer(0)
+    {
+        albedoMaterial = normal = depth = lit = 0;
+    }
+
+    void setup(int frameWidth, int frameHeight)
+    {
+        glGenFramebuffers(1, &geometryFramebuffer);
+        glGenFramebuffers(1, &litFramebuffer);
+        resize(frameWidth, frameHeight);
+    }
+
+    void destroy()
+    {
+        deleteTextures();
+        glDeleteFramebuffers(1, &geometryFramebuffer);
+        glDeleteFramebuffers(1, &litFramebuffer);
+        geometryFramebuffer = litFramebuffer = 0;
+    }
+
+    // recreates every target at the new size
+    void resize(int frameWidth, int frameHeight)
+    {
+        if (frameWidth <= 0 || frameHeight <= 0 || (frameWidth == width && frameHeight == height))
+            return;
+
+        width = frameWidth;
+        height = frameHeight;
+        renderWidth = std::min(renderWidth, width);
+        renderHeight = std::min(renderHeight, height);
+        if (renderWidth == 0 || renderHeight == 0)
+            setRenderSize(width, height);
+        deleteTextures();
+
+        albedoMaterial = createTexture(GL_RGBA8);
+        normal = createTexture(GL_RG16_SNORM);
+        depth = createTexture(GL_DEPTH_COMPONENT32F);
+        lit = createTexture(GL_RGBA8);
+
+        glBindFramebuffer(GL_FRAMEBUFFER, geometryFramebuffer);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, albedoMaterial, 0);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, normal, 0);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depth, 0);
+        const GLenum drawBuffers[] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 };
+        glDrawBuffers(2, drawBuffers);
+
+        glBindFramebuffer(GL_FRAMEBUFFER, litFramebuffer);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, lit, 0);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depth, 0);
+
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    }
+
+    int getWidth() const
+    {
+        return width;
+    }
+
+    int getHeight() const
+    {
+        return height;
+    }
+
+    // area the scene is drawn into, at most the full size
+    void setRenderSize(int areaWidth, int areaHeight)
+    {
+        renderWidth = std::max(1, std::min(areaWidth, width));
+        renderHeight = std::max(1, std::min(areaHeight, height));
+    }
+
+    int getRenderWidth() const
+    {
+        return renderWidth;
+    }
+
+    int getRenderHeight() const
+    {
+        return renderHeight;
+    }
+
+    bool isScaled() const
+    {
+        return renderWidth != width || renderHeight != height;
+    }
+
+    // binds and clears the G-buffer for the geometry pass
+    void bindGeometry() const
+    {
+        glBindFramebuffer(GL_FRAMEBUFFER, geometryFramebuffer);
+        glViewport(0, 0, renderWidth, renderHeight);
+        glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    }
+
+    // binds and clears the lit image as the render target of the forward path
+    void bindForward() const
+    {
+        glBindFramebuffer(GL_FRAMEBUFFER, litFramebuffer);
+        glViewport(0, 0, renderWidth, renderHeight);
+        glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    }
+
+    // binds the G-buffer textures and the lit image for the lighting pass
+    void bindLighting() const
+    {
+        glActiveTexture(GL_TEXTURE0 + ALBEDO_MATERIAL_UNIT);
+        glBindTexture(GL_TEXTURE_2D, albedoMaterial);
+        glActiveTexture(GL_TEXTURE0 + NORMAL_UNIT);
+        glBindTexture(GL_TEXTURE_2D, normal);
+        glActiveTexture(GL_TEXTURE0 + DEPTH_UNIT);
+        glBindTexture(GL_TEXTURE_2D, depth);
+        glActiveTexture(GL_TEXTURE0);
+        glBindImageTexture(LIT_IMAGE_UNIT, lit, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA8);
+    }
+
+    // makes the lit image (with the scene depth) the render target, for forward drawn objects
+    void bindLit() const
+    {
+        glMemoryBarrier(GL_FRAMEBUFFER_BARRIER_BIT | GL_TEXTURE_FETCH_BARRIER_BIT);
+        glBindFramebuffer(GL_FRAMEBUFFER, litFramebuffer);
+    }
+
+    // replaces the lit image with RGBA8 pixels drawn on the CPU, bottom row first
+    void uploadLit(const void* pixels) const
+    {
+        glBindTexture(GL_TEXTURE_2D, lit);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+        glBindTexture(GL_TEXTURE_2D, 0);
+    }
+
+    // reads the render area of the lit image back as RGBA8, bottom row first
+    void readLit(std::vector<uint32_t>& pixels) const
+    {
+        pixels.resize((size_t)renderWidth * renderHeight);
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, litFramebuffer);
+        glPixelStorei(GL_PACK_ALIGNMENT, 4);
+        glReadPixels(0, 0, renderWidth, renderHeight, GL_RGBA, GL_UNSIGNED_BYTE, pixels.data());
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+    }
+
+    // copies the render area of the lit image to the window, scaled up if need be
+    void blitToScreen() const
+    {
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, litFramebuffer);
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+        glBlitFramebuffer(0, 0, renderWidth, renderHeight, 0, 0, width, height, GL_COLOR_BUFFER_BIT, isScaled() ? GL_LINEAR : GL_NEAREST);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        glViewport(0, 0, width, height);
+    }
+
+private:
+    int width, height;
+    int renderWidth, renderHeight;
+    GLuint geometryFramebuffer, litFramebuffer;
+    GLuint albedoMaterial, normal, depth, lit;
+
+    GLuint createTexture(GLenum format) const
+    {
+        GLuint texture;
+        glGenTextures(1, &texture);
+        glBindTexture(GL_TEXTURE_2D, texture);
+        glTexStorage2D(GL_TEXTURE_2D, 1, format, width, height);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glBindTexture(GL_TEXTURE_2D, 0);
+        return texture;
+    }
+
+    void deleteTextures()
+    {
+        GLuint textures[] = { albedoMaterial, normal, depth, lit };
+        glDeleteTextures(4, textures);
+        albedoMaterial = normal = depth = lit = 0;
+    }
+};
+
+#endif
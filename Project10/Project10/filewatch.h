@@ -0,0 +1,184 @@
+#ifndef FILEWATCH_H
+#define FILEWATCH_H
+
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#if defined(__linux__)
+#include <fcntl.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#define FILEWATCH_INOTIFY
+#endif
+
+
+// Files of one directory that are checked for changes once a frame.
+//
+// On Linux an inotify watch on the directory reports the files written or
+// moved into it, which catches editors that save through a temporary file and
+// a rename as well as those that write in place; the descriptor does not
+// block, so a frame without changes costs one read call. Elsewhere the
+// modification times of the files added with addFile are compared instead.
+class FileWatcher
+{
+public:
+    FileWatcher() : descriptor(-1) {}
+
+    ~FileWatcher()
+    {
+        destroy();
+    }
+
+    // false if the directory cannot be watched
+    bool watch(const std::string& watchedDirectory)
+    {
+        destroy();
+        directory = watchedDirectory;
+#if defined(FILEWATCH_INOTIFY)
+        descriptor = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (descriptor < 0)
+            return false;
+        if (inotify_add_watch(descriptor, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+        {
+            destroy();
+            return false;
+        }
+        return true;
+#else
+        struct stat status;
+        return stat(directory.c_str(), &status) == 0;
+#endif
+    }
+
+    void destroy()
+    {
+#if defined(FILEWATCH_INOTIFY)
+        if (descriptor >= 0)
+            close(descriptor);
+#endif
+        descriptor = -1;
+        files.clear();
+    }
+
+    // a file of the directory whose changes matter
+    void addFile(const std::string& name)
+    {
+        WatchedFile file = { name, modificationTime(name) };
+        files.push_back(file);
+    }
+
+    // names of the added files that changed since the last call, each once
+    std::vector<std::string> changedFiles()
+    {
+        std::vector<std::string> changed;
+#if defined(FILEWATCH_INOTIFY)
+        alignas(inotify_event) char buffer[4096];
+        for (;;)
+        {
+            ssize_t length = ::read(descriptor, buffer, sizeof(buffer));
+            if (length <= 0)
+                break;
+            for (ssize_t offset = 0; offset < length; )
+            {
+                const inotify_event* event = (const inotify_event*)(buffer + offset);
+                offset += sizeof(inotify_event) + event->len;
+                if (event->len == 0)
+                    continue;
+
+                std::string name(event->name);
+                bool isWatched = std::any_of(files.begin(), files.end(), [&](const WatchedFile& file) { return file.name == name; });
+                if (isWatched && std::find(changed.begin(), changed.end(), name) == changed.end())
+                    changed.push_back(name);
+            }
+        }
+#else
+        for (WatchedFile& file : files)
+        {
+            long long time = modificationTime(file.name);
+            if (time != file.time)
+            {
+                file.time = time;
+                changed.push_back(file.name);
+            }
+        }
+#endif
+        return changed;
+    }
+
+    std::string path(const std::string& name) const
+    {
+        return directory + "/" + name;
+    }
+
+    // the whole file, mapped rather than streamed where mmap is at hand; false if it
+    // cannot be read or is empty, as it is for a moment while some editors save
+    bool read(const std::string& name, std::string& text) const
+    {
+        std::string filename = path(name);
+#if defined(FILEWATCH_INOTIFY)
+        int file = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+        if (file < 0)
+            return false;
+        struct stat status;
+        if (fstat(file, &status) != 0 || status.st_size <= 0)
+        {
+            close(file);
+            return false;
+        }
+        void* mapped = mmap(NULL, (size_t)status.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+        close(file);
+        if (mapped == MAP_FAILED)
+            return false;
+        text.assign((const char*)mapped, (size_t)status.st_size);
+        munmap(mapped, (size_t)status.st_size);
+        return true;
+#else
+        std::ifstream file(filename, std::ios::binary);
+        if (!file)
+            return false;
+        // text stays as it was unless the whole file was read
+        std::stringstream contents;
+        contents << file.rdbuf();
+        std::string fileText = contents.str();
+        if (fileText.empty())
+            return false;
+        text.swap(fileText);
+        return true;
+#endif
+    }
+
+    bool write(const std::string& name, const std::string& text) const
+    {
+        std::ofstream file(path(name), std::ios::binary);
+        if (!file)
+            return false;
+        file << text;
+        file.close();
+        return !file.fail();
+    }
+
+private:
+    struct WatchedFile
+    {
+        std::string name;
+        long long time;     // modification time where the times are compared
+    };
+
+    std::string directory;
+    int descriptor;
+    std::vector<WatchedFile> files;
+
+    long long modificationTime(const std::string& name) const
+    {
+        struct stat status;
+        return stat(path(name).c_str(), &status) == 0 ? (long long)status.st_mtime : -1;
+    }
+};
+
+#endif
@@ -0,0 +1,84 @@
+#ifndef GPUTIMER_H
+#define GPUTIMER_H
+
+#include <GL/glew.h>
+
+// Measures GPU time between begin() and end() with GL_TIME_ELAPSED queries.
+// Results are read a few frames late from a ring of queries so that reading
+// them never waits for the GPU.
+class GpuTimer
+{
+public:
+    static const int QUERY_COUNT = 4;
+
+    GpuTimer() : next(0), pending(0), lastMs(0.0)
+    {
+        for (int i = 0; i < QUERY_COUNT; ++i)
+            queries[i] = 0;
+    }
+
+    void setup()
+    {
+        glGenQueries(QUERY_COUNT, queries);
+        next = 0;
+        pending = 0;
+    }
+
+    void destroy()
+    {
+        glDeleteQueries(QUERY_COUNT, queries);
+        for (int i = 0; i < QUERY_COUNT; ++i)
+            queries[i] = 0;
+        pending = 0;
+    }
+
+    void begin()
+    {
+        // the oldest query is reused, collect it first
+        if (pending == QUERY_COUNT)
+            collect(true);
+        glBeginQuery(GL_TIME_ELAPSED, queries[next]);
+    }
+
+    void end()
+    {
+        glEndQuery(GL_TIME_ELAPSED);
+        next = (next + 1) % QUERY_COUNT;
+        pending++;
+        collect(false);
+    }
+
+    // GPU time of the most recent finished measurement
+    double milliseconds() const
+    {
+        return lastMs;
+    }
+
+private:
+    GLuint queries[QUERY_COUNT];
+    int next;       // query used by the next begin()
+    int pending;    // queries issued but not read back
+    double lastMs;
+
+    // reads back finished queries, oldest first; waits for the oldest if asked to
+    void collect(bool wait)
+    {
+        while (pending > 0)
+        {
+            GLuint query = queries[(next - pending + QUERY_COUNT) % QUERY_COUNT];
+            GLint available = 0;
+            if (!wait)
+                glGetQueryObjectiv(query, GL_QUERY_RESULT_AVAILABLE, &available);
+            if (!wait && !available)
+                return;
+
+            GLuint64 nanoseconds = 0;
+            glGetQueryObjectui64v(query, GL_QUERY_RESULT, &nanoseconds);
+            lastMs = nanoseconds / 1000000.0;
+            pending--;
+            wait = false;
+        }
+    }
+};
+
+#endif
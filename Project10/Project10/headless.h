@@ -0,0 +1,225 @@
+#ifndef HEADLESS_H
+#define HEADLESS_H
+
+// Support for headless benchmark runs: a scripted camera flight, and the log
+// of frame timings and the image of the last frame written at the end of the run.
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+
+struct CameraKey
+{
+    glm::vec3 position;
+    float yaw, pitch;
+    float zoom;
+};
+
+// Keyframes of a camera flight, one per line of a text file:
+//   x y z yaw pitch [zoom]
+// Empty lines and lines starting with # are skipped. The keyframes are spread
+// evenly over the run and the camera moves linearly between them.
+class CameraPath
+{
+public:
+    // false if the file cannot be read or holds no keyframe
+    bool load(const char* filename)
+    {
+        keys.clear();
+        std::ifstream file(filename);
+        std::string line;
+        while (std::getline(file, line))
+        {
+            if (line.empty() || line[0] == '#')
+                continue;
+
+            std::istringstream fields(line);
+            CameraKey key;
+            if (!(fields >> key.position.x >> key.position.y >> key.position.z >> key.yaw >> key.pitch))
+                continue;
+            if (!(fields >> key.zoom))
+                key.zoom = 45.0f;
+            keys.push_back(key);
+        }
+        return !keys.empty();
+    }
+
+    bool empty() const
+    {
+        return keys.empty();
+    }
+
+    // camera at t in [0, 1], the first keyframe at 0 and the last at 1
+    CameraKey sample(float t) const
+    {
+        if (keys.size() == 1)
+            return keys[0];
+
+        float position = std::min(1.0f, std::max(0.0f, t)) * (keys.size() - 1);
+        size_t index = std::min((size_t)position, keys.size() - 2);
+        float f = position - index;
+        const CameraKey& a = keys[index];
+        const CameraKey& b = keys[index + 1];
+
+        CameraKey key;
+        key.position = glm::mix(a.position, b.position, f);
+        key.yaw = a.yaw + (b.yaw - a.yaw) * f;
+        key.pitch = a.pitch + (b.pitch - a.pitch) * f;
+        key.zoom = a.zoom + (b.zoom - a.zoom) * f;
+        return key;
+    }
+
+private:
+    std::vector<CameraKey> keys;
+};
+
+
+struct FrameTiming
+{
+    double frameMs;     // wall time since the previous frame
+    double buildMs;
+    double submitMs;
+    double gpuMs;       // shading GPU time, of a frame a few frames back
+};
+
+// Per-frame timings of a run, written out as JSON along with percentiles.
+// The percentiles leave out the first frames, which pay for shader compiles
+// and uploads.
+class FrameTimingLog
+{
+public:
+    static const size_t WARMUP_FRAMES = 5;
+
+    void add(const FrameTiming& timing)
+    {
+        frames.push_back(timing);
+    }
+
+    size_t size() const
+    {
+        return frames.size();
+    }
+
+    // median frame time after the warm-up, 0 without frames
+    double medianFrameMs() const
+    {
+        std::vector<double> values = steadyValues(&FrameTiming::frameMs);
+        return percentile(values, 0.5);
+    }
+
+    bool writeJson(const char* filename, const char* renderer, int width, int height) const
+    {
+        std::ofstream file(filename);
+        if (!file)
+            return false;
+
+        file << std::fixed << std::setprecision(3);
+        file << "{\n";
+        file << "  \"renderer\": \"" << escape(renderer) << "\",\n";
+        file << "  \"width\": " << width << ",\n  \"height\": " << height << ",\n";
+        file << "  \"frames\": " << frames.size() << ",\n  \"warmup_frames\": " << std::min((size_t)WARMUP_FRAMES, frames.size()) << ",\n";
+
+        file << "  \"summary\": {\n";
+        writeSummary(file, "frame_ms", &FrameTiming::frameMs, false);
+        writeSummary(file, "build_ms", &FrameTiming::buildMs, false);
+        writeSummary(file, "submit_ms", &FrameTiming::submitMs, false);
+        writeSummary(file, "gpu_ms", &FrameTiming::gpuMs, true);
+        file << "  },\n";
+
+        file << "  \"per_frame\": [\n";
+        for (size_t i = 0; i < frames.size(); ++i)
+        {
+            const FrameTiming& timing = frames[i];
+            file << "    { \"frame\": " << i << ", \"frame_ms\": " << timing.frameMs << ", \"build_ms\": " << timing.buildMs
+                << ", \"submit_ms\": " << timing.submitMs << ", \"gpu_ms\": " << timing.gpuMs << " }" << (i + 1 < frames.size() ? "," : "") << "\n";
+        }
+        file << "  ]\n}\n";
+
+        file.close();
+        return !file.fail();
+    }
+
+private:
+    std::vector<FrameTiming> frames;
+
+    std::vector<double> steadyValues(double FrameTiming::* field) const
+    {
+        // short runs keep every frame rather than none
+        size_t first = frames.size() > WARMUP_FRAMES ? WARMUP_FRAMES : 0;
+        std::vector<double> values;
+        for (size_t i = first; i < frames.size(); ++i)
+            values.push_back(frames[i].*field);
+        std::sort(values.begin(), values.end());
+        return values;
+    }
+
+    // nearest rank on sorted values
+    static double percentile(const std::vector<double>& values, double p)
+    {
+        if (values.empty())
+            return 0.0;
+        size_t rank = (size_t)(p * (values.size() - 1) + 0.5);
+        return values[std::min(rank, values.size() - 1)];
+    }
+
+    void writeSummary(std::ofstream& file, const char* name, double FrameTiming::* field, bool isLast) const
+    {
+        std::vector<double> values = steadyValues(field);
+        double sum = 0.0;
+        for (double value : values)
+            sum += value;
+        double mean = values.empty() ? 0.0 : sum / values.size();
+
+        file << "    \"" << name << "\": { \"mean\": " << mean << ", \"median\": " << percentile(values, 0.5)
+            << ", \"p95\": " << percentile(values, 0.95) << ", \"p99\": " << percentile(values, 0.99)
+            << ", \"min\": " << (values.empty() ? 0.0 : values.front()) << ", \"max\": " << (values.empty() ? 0.0 : values.back())
+            << " }" << (isLast ? "" : ",") << "\n";
+    }
+
+    static std::string escape(const char* text)
+    {
+        std::string escaped;
+        for (const char* c = text ? text : ""; *c; ++c)
+        {
+            if (*c == '"' || *c == '\\')
+                escaped += '\\';
+            if ((unsigned char)*c >= 0x20)
+                escaped += *c;
+        }
+        return escaped;
+    }
+};
+
+
+// writes RGBA8 pixels, bottom row first as GL reads them, to a binary PPM file
+inline bool writePpm(const char* filename, const uint32_t* pixels, int width, int height)
+{
+    std::ofstream file(filename, std::ios::binary);
+    if (!file)
+        return false;
+
+    file << "P6\n" << width << " " << height << "\n255\n";
+    std::vector<char> row((size_t)width * 3);
+    for (int y = height - 1; y >= 0; --y)
+    {
+        for (int x = 0; x < width; ++x)
+        {
+            uint32_t pixel = pixels[(size_t)y * width + x];
+            row[x * 3] = (char)(pixel & 0xFF);
+            row[x * 3 + 1] = (char)((pixel >> 8) & 0xFF);
+            row[x * 3 + 2] = (char)((pixel >> 16) & 0xFF);
+        }
+        file.write(row.data(), row.size());
+    }
+
+    file.close();
+    return !file.fail();
+}
+
+#endif
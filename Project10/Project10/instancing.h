@@ -0,0 +1,303 @@
+#ifndef INSTANCING_H
+#define INSTANCING_H
+
+#include <GL/glew.h>
+
+#include <glm/glm.hpp>
+
+#include <cstddef>
+#include <vector>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#define INSTANCING_AVX
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define INSTANCING_SSE2
+#endif
+
+// Per-instance vertex data streamed to the objects shader
+struct InstanceData
+{
+    glm::mat4 model;
+    GLuint materialId;
+    GLuint instanceId;          // order of addition since the last clear, for per-instance data
+    glm::mat4 mvp;              // projection * view * model, recomputed every frame
+    glm::vec4 normalMatrix[3];  // inverse transpose of the model 3x3, set with the model
+};
+
+
+#if defined(INSTANCING_AVX)
+// 4x4 transpose within each 128 bit half, like _MM_TRANSPOSE4_PS
+inline void transpose4(__m256 m[4])
+{
+    __m256 t0 = _mm256_shuffle_ps(m[0], m[1], 0x44);
+    __m256 t1 = _mm256_shuffle_ps(m[2], m[3], 0x44);
+    __m256 t2 = _mm256_shuffle_ps(m[0], m[1], 0xEE);
+    __m256 t3 = _mm256_shuffle_ps(m[2], m[3], 0xEE);
+    m[0] = _mm256_shuffle_ps(t0, t1, 0x88);
+    m[1] = _mm256_shuffle_ps(t0, t1, 0xDD);
+    m[2] = _mm256_shuffle_ps(t2, t3, 0x88);
+    m[3] = _mm256_shuffle_ps(t2, t3, 0xDD);
+}
+#endif
+
+// mvp = viewProjection * model for every instance. The matrix product is done
+// in structure-of-arrays form: one column of 4 (SSE) or 8 (AVX) models is
+// transposed so that every register holds the same element of all of them,
+// multiplied with the broadcast view projection elements and transposed back.
+inline void computeMVPs(const glm::mat4& viewProjection, InstanceData* instances, size_t count)
+{
+    size_t i = 0;
+
+#if defined(INSTANCING_AVX)
+    __m256 vp[4][4];
+    for (int k = 0; k < 4; ++k)
+        for (int r = 0; r < 4; ++r)
+            vp[k][r] = _mm256_set1_ps(viewProjection[k][r]);
+
+    for (; i + 8 <= count; i += 8)
+    {
+        for (int column = 0; column < 4; ++column)
+        {
+            // low lanes hold instances i..i+3, high lanes i+4..i+7
+            __m256 m[4];
+            for (int l = 0; l < 4; ++l)
+                m[l] = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(&instances[i + l].model[column][0])),
+                    _mm_loadu_ps(&instances[i + 4 + l].model[column][0]), 1);
+            transpose4(m);
+
+            __m256 out[4];
+            for (int r = 0; r < 4; ++r)
+                out[r] = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(vp[0][r], m[0]), _mm256_mul_ps(vp[1][r], m[1])),
+                    _mm256_add_ps(_mm256_mul_ps(vp[2][r], m[2]), _mm256_mul_ps(vp[3][r], m[3])));
+            transpose4(out);
+
+            for (int l = 0; l < 4; ++l)
+            {
+                _mm_storeu_ps(&instances[i + l].mvp[column][0], _mm256_castps256_ps128(out[l]));
+                _mm_storeu_ps(&instances[i + 4 + l].mvp[column][0], _mm256_extractf128_ps(out[l], 1));
+            }
+        }
+    }
+#elif defined(INSTANCING_SSE2)
+    __m128 vp[4][4];
+    for (int k = 0; k < 4; ++k)
+        for (int r = 0; r < 4; ++r)
+            vp[k][r] = _mm_set1_ps(viewProjection[k][r]);
+
+    for (; i + 4 <= count; i += 4)
+    {
+        for (int column = 0; column < 4; ++column)
+        {
+            __m128 m0 = _mm_loadu_ps(&instances[i].model[column][0]);
+            __m128 m1 = _mm_loadu_ps(&instances[i + 1].model[column][0]);
+            __m128 m2 = _mm_loadu_ps(&instances[i + 2].model[column][0]);
+            __m128 m3 = _mm_loadu_ps(&instances[i + 3].model[column][0]);
+            _MM_TRANSPOSE4_PS(m0, m1, m2, m3);
+
+            __m128 out0 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(vp[0][0], m0), _mm_mul_ps(vp[1][0], m1)), _mm_add_ps(_mm_mul_ps(vp[2][0], m2), _mm_mul_ps(vp[3][0], m3)));
+            __m128 out1 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(vp[0][1], m0), _mm_mul_ps(vp[1][1], m1)), _mm_add_ps(_mm_mul_ps(vp[2][1], m2), _mm_mul_ps(vp[3][1], m3)));
+            __m128 out2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(vp[0][2], m0), _mm_mul_ps(vp[1][2], m1)), _mm_add_ps(_mm_mul_ps(vp[2][2], m2), _mm_mul_ps(vp[3][2], m3)));
+            __m128 out3 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(vp[0][3], m0), _mm_mul_ps(vp[1][3], m1)), _mm_add_ps(_mm_mul_ps(vp[2][3], m2), _mm_mul_ps(vp[3][3], m3)));
+            _MM_TRANSPOSE4_PS(out0, out1, out2, out3);
+
+            _mm_storeu_ps(&instances[i].mvp[column][0], out0);
+            _mm_storeu_ps(&instances[i + 1].mvp[column][0], out1);
+            _mm_storeu_ps(&instances[i + 2].mvp[column][0], out2);
+            _mm_storeu_ps(&instances[i + 3].mvp[column][0], out3);
+        }
+    }
+#endif
+
+    // scalar tail (and the whole range without SIMD support)
+    for (; i < count; ++i)
+        instances[i].mvp = viewProjection * instances[i].model;
+}
+
+// A set of instances that all draw the same range of the mesh
+struct InstanceBatch
+{
+    std::vector<InstanceData> instances;
+    std::vector<unsigned char> visible;    // one flag per instance, set by culling
+    GLuint baseInstance;                    // offset of the compacted instances in the buffer
+    GLsizei visibleCount;
+};
+
+
+// Owns the instance buffer shared by every batch. Visible instances of all
+// batches are compacted into one contiguous array each frame so that a batch
+// is drawn with a single glDrawArraysInstancedBaseInstance call.
+class InstanceBuffer
+{
+public:
+    std::vector<InstanceBatch> batches;
+
+    InstanceBuffer() : vbo(0), capacity(0), nextInstanceId(0) {}
+
+    // creates the buffer and binds the instance attributes to the given vao
+    // (mat4 model at firstLocation..firstLocation+3, uvec2 material and id after it,
+    // then mat4 mvp and mat3 normal matrix)
+    void setup(GLuint vao, GLuint firstLocation)
+    {
+        glGenBuffers(1, &vbo);
+
+        glBindVertexArray(vao);
+        glBindBuffer(GL_ARRAY_BUFFER, vbo);
+
+        GLsizei stride = sizeof(InstanceData);
+        for (GLuint i = 0; i < 4; ++i)
+        {
+            glEnableVertexAttribArray(firstLocation + i);
+            glVertexAttribPointer(firstLocation + i, 4, GL_FLOAT, GL_FALSE, stride, (void*)(offsetof(InstanceData, model) + sizeof(glm::vec4) * i));
+            glVertexAttribDivisor(firstLocation + i, 1);
+        }
+
+        glEnableVertexAttribArray(firstLocation + 4);
+        glVertexAttribIPointer(firstLocation + 4, 2, GL_UNSIGNED_INT, stride, (void*)offsetof(InstanceData, materialId));
+        glVertexAttribDivisor(firstLocation + 4, 1);
+
+        for (GLuint i = 0; i < 4; ++i)
+        {
+            glEnableVertexAttribArray(firstLocation + 5 + i);
+            glVertexAttribPointer(firstLocation + 5 + i, 4, GL_FLOAT, GL_FALSE, stride, (void*)(offsetof(InstanceData, mvp) + sizeof(glm::vec4) * i));
+            glVertexAttribDivisor(firstLocation + 5 + i, 1);
+        }
+
+        for (GLuint i = 0; i < 3; ++i)
+        {
+            glEnableVertexAttribArray(firstLocation + 9 + i);
+            glVertexAttribPointer(firstLocation + 9 + i, 3, GL_FLOAT, GL_FALSE, stride, (void*)(offsetof(InstanceData, normalMatrix) + sizeof(glm::vec4) * i));
+            glVertexAttribDivisor(firstLocation + 9 + i, 1);
+        }
+
+        glBindVertexArray(0);
+    }
+
+    void destroy()
+    {
+        glDeleteBuffers(1, &vbo);
+        vbo = 0;
+        capacity = 0;
+    }
+
+    // returns the id of a new, empty batch
+    int addBatch()
+    {
+        batches.push_back(InstanceBatch());
+        batches.back().baseInstance = 0;
+        batches.back().visibleCount = 0;
+        return (int)batches.size() - 1;
+    }
+
+    void addInstance(int batch, const glm::mat4& model, GLuint materialId)
+    {
+        InstanceData instance;
+        instance.model = model;
+        instance.materialId = materialId;
+        instance.instanceId = nextInstanceId++;
+        instance.mvp = model;
+
+        // the model does not change after this, so neither does the normal matrix
+        glm::mat3 normalMatrix = glm::transpose(glm::inverse(glm::mat3(model)));
+        for (int i = 0; i < 3; ++i)
+            instance.normalMatrix[i] = glm::vec4(normalMatrix[i], 0.0f);
+        batches[batch].instances.push_back(instance);
+        batches[batch].visible.push_back(1);
+    }
+
+    // removes every instance but keeps the batches
+    void clearInstances()
+    {
+        for (size_t i = 0; i < batches.size(); ++i)
+        {
+            batches[i].instances.clear();
+            batches[i].visible.clear();
+            batches[i].visibleCount = 0;
+        }
+        nextInstanceId = 0;
+    }
+
+    // packs the visible instances of every batch into one array and uploads it
+    void compactAndUpload()
+    {
+        compact();
+        upload();
+    }
+
+    // packs the visible instances of every batch into one array
+    void compact()
+    {
+        compacted.clear();
+        for (size_t b = 0; b < batches.size(); ++b)
+        {
+            InstanceBatch& batch = batches[b];
+            batch.baseInstance = (GLuint)compacted.size();
+            for (size_t i = 0; i < batch.instances.size(); ++i)
+            {
+                if (batch.visible[i])
+                    compacted.push_back(batch.instances[i]);
+            }
+            batch.visibleCount = (GLsizei)(compacted.size() - batch.baseInstance);
+        }
+    }
+
+    // fills in the mvp of the compacted instances
+    void computeTransforms(const glm::mat4& viewProjection)
+    {
+        computeMVPs(viewProjection, compacted.data(), compacted.size());
+    }
+
+    void upload()
+    {
+        upload(compacted.data(), compacted.size());
+    }
+
+    // uploads instances packed elsewhere, like by the jobs that build a frame
+    void upload(const InstanceData* instances, size_t count)
+    {
+        if (count == 0)
+            return;
+
+        glBindBuffer(GL_ARRAY_BUFFER, vbo);
+        // grow geometrically so that culling changes do not reallocate every frame
+        if (count > capacity)
+            capacity = count * 2;
+
+        // orphan the old storage so the driver does not stall on the previous frame
+        glBufferData(GL_ARRAY_BUFFER, capacity * sizeof(InstanceData), NULL, GL_STREAM_DRAW);
+        glBufferSubData(GL_ARRAY_BUFFER, 0, count * sizeof(InstanceData), instances);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+
+    // draws the visible instances of a batch; the mesh vao must be bound
+    void draw(int batch, GLint first, GLsizei count) const
+    {
+        const InstanceBatch& b = batches[batch];
+        if (b.visibleCount == 0)
+            return;
+
+        glDrawArraysInstancedBaseInstance(GL_TRIANGLES, first, count, b.visibleCount, b.baseInstance);
+    }
+
+    size_t instanceCount() const
+    {
+        size_t total = 0;
+        for (size_t i = 0; i < batches.size(); ++i)
+            total += batches[i].instances.size();
+        return total;
+    }
+
+    size_t visibleInstanceCount() const
+    {
+        return compacted.size();
+    }
+
+private:
+    GLuint vbo;
+    size_t capacity;
+    GLuint nextInstanceId;
+    std::vector<InstanceData> compacted;
+};
+
+#endif
@@ -0,0 +1,321 @@
+#ifndef JOBS_H
+#define JOBS_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Number of jobs of a group that have not finished yet. A job may add child
+// jobs to the counter it runs under, so waiting on it waits for the whole tree.
+struct JobCounter
+{
+    std::atomic<int> pending;
+
+    JobCounter() : pending(0) {}
+};
+
+struct Job
+{
+    std::function<void()> fn;
+    JobCounter* counter;
+};
+
+
+// Chase-Lev deque of one worker. The owner pushes and pops at the bottom
+// without locking; other threads steal the oldest jobs from the top.
+class WorkStealingQueue
+{
+public:
+    static const int64_t CAPACITY = 4096;
+
+    WorkStealingQueue() : top(0), bottom(0)
+    {
+        for (int64_t i = 0; i < CAPACITY; ++i)
+            slots[i].store(nullptr, std::memory_order_relaxed);
+    }
+
+    // owner only; false when full
+    bool push(Job* job)
+    {
+        int64_t b = bottom.load(std::memory_order_relaxed);
+        int64_t t = top.load(std::memory_order_acquire);
+        if (b - t >= CAPACITY)
+            return false;
+
+        slots[b & (CAPACITY - 1)].store(job, std::memory_order_relaxed);
+        bottom.store(b + 1, std::memory_order_release);
+        return true;
+    }
+
+    // owner only, newest job first
+    Job* pop()
+    {
+        int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+        bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t t = top.load(std::memory_order_relaxed);
+
+        if (t > b)
+        {
+            bottom.store(b + 1, std::memory_order_relaxed);
+            return nullptr;
+        }
+
+        Job* job = slots[b & (CAPACITY - 1)].load(std::memory_order_relaxed);
+        if (t == b)
+        {
+            // last job, race the thieves for it
+            if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+                job = nullptr;
+            bottom.store(b + 1, std::memory_order_relaxed);
+        }
+        return job;
+    }
+
+    // any thread, oldest job first
+    Job* steal()
+    {
+        int64_t t = top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t b = bottom.load(std::memory_order_acquire);
+        if (t >= b)
+            return nullptr;
+
+        Job* job = slots[t & (CAPACITY - 1)].load(std::memory_order_relaxed);
+        if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+            return nullptr;
+        return job;
+    }
+
+private:
+    std::atomic<Job*> slots[CAPACITY];
+    std::atomic<int64_t> top, bottom;
+};
+
+
+// Work-stealing job scheduler. Every worker thread owns a deque; jobs submitted
+// by a worker go to its own deque, jobs submitted by any other thread go to a
+// shared injection queue. Idle workers steal from the others and sleep when
+// there is nothing left. A thread that waits on a counter runs jobs itself
+// until the counter drops to zero instead of blocking.
+class JobSystem
+{
+public:
+    // workerCount threads on top of the threads that submit and wait
+    explicit JobSystem(int workerCount) : queuedJobs(0), sleepingWorkers(0), isStopping(false)
+    {
+        for (int i = 0; i < workerCount; ++i)
+            queues.emplace_back(new WorkStealingQueue());
+        for (int i = 0; i < workerCount; ++i)
+            workers.emplace_back([this, i]() { workerLoop(i); });
+    }
+
+    ~JobSystem()
+    {
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+            isStopping = true;
+        }
+        wake.notify_all();
+        for (std::thread& worker : workers)
+            worker.join();
+        for (WorkStealingQueue* queue : queues)
+            delete queue;
+    }
+
+    // threads that run jobs while somebody waits: the workers plus the waiting thread
+    int threadCount() const
+    {
+        return (int)workers.size() + 1;
+    }
+
+    // queues fn; counter, if any, is raised now and lowered when fn has run
+    void run(std::function<void()> fn, JobCounter* counter)
+    {
+        if (counter)
+            counter->pending.fetch_add(1, std::memory_order_relaxed);
+
+        Job* job = new Job;
+        job->fn = std::move(fn);
+        job->counter = counter;
+
+        int index = currentWorker();
+        if (index >= 0)
+        {
+            // a full deque runs the job right away rather than growing
+            if (!queues[index]->push(job))
+            {
+                execute(job);
+                return;
+            }
+        }
+        else
+        {
+            std::lock_guard<std::mutex> lock(injectionMutex);
+            injection.push_back(job);
+        }
+
+        queuedJobs.fetch_add(1, std::memory_order_seq_cst);
+        if (sleepingWorkers.load(std::memory_order_seq_cst) > 0)
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+            wake.notify_one();
+        }
+    }
+
+    // runs jobs until every job of the counter has finished
+    void wait(JobCounter& counter)
+    {
+        int index = currentWorker();
+        while (counter.pending.load(std::memory_order_acquire) > 0)
+        {
+            Job* job = findJob(index);
+            if (job)
+                execute(job);
+            else
+                std::this_thread::yield();
+        }
+    }
+
+    // fn(begin, end) over [0, count). Ranges are split in half until they are down
+    // to the grain, the upper halves going to the deque where idle threads steal
+    // them, so the work balances itself. The grain adapts to the count: a handful
+    // of ranges per thread, but never fewer than minimumGrain items per range.
+    template <class Fn>
+    void parallelFor(size_t count, size_t minimumGrain, const Fn& fn)
+    {
+        if (count == 0)
+            return;
+
+        size_t grain = std::max(std::max((size_t)1, minimumGrain), count / (8 * threadCount()));
+        JobCounter counter;
+        splitRange(0, count, grain, fn, counter);
+        wait(counter);
+    }
+
+private:
+    std::vector<WorkStealingQueue*> queues;
+    std::vector<std::thread> workers;
+    std::mutex injectionMutex;
+    std::deque<Job*> injection;
+    std::atomic<int> queuedJobs;        // queued and not yet taken by any thread
+    std::atomic<int> sleepingWorkers;
+    std::mutex sleepMutex;
+    std::condition_variable wake;
+    bool isStopping;
+
+    // this system and worker index of the calling thread, for workers only
+    static JobSystem*& threadSystem()
+    {
+        static thread_local JobSystem* system = nullptr;
+        return system;
+    }
+
+    static int& threadWorker()
+    {
+        static thread_local int worker = -1;
+        return worker;
+    }
+
+    int currentWorker() const
+    {
+        return threadSystem() == this ? threadWorker() : -1;
+    }
+
+    template <class Fn>
+    void splitRange(size_t begin, size_t end, size_t grain, const Fn& fn, JobCounter& counter)
+    {
+        while (end - begin > grain)
+        {
+            size_t middle = begin + (end - begin) / 2;
+            run([this, middle, end, grain, &fn, &counter]() { splitRange(middle, end, grain, fn, counter); }, &counter);
+            end = middle;
+        }
+        fn(begin, end);
+    }
+
+    void execute(Job* job)
+    {
+        job->fn();
+        if (job->counter)
+            job->counter->pending.fetch_sub(1, std::memory_order_release);
+        delete job;
+    }
+
+    // own deque first, then the injection queue, then the other workers
+    Job* findJob(int index)
+    {
+        Job* job = index >= 0 ? queues[index]->pop() : nullptr;
+
+        if (!job)
+        {
+            std::lock_guard<std::mutex> lock(injectionMutex);
+            if (!injection.empty())
+            {
+                job = injection.front();
+                injection.pop_front();
+            }
+        }
+
+        size_t queueCount = queues.size();
+        size_t start = index >= 0 ? index + 1 : 0;
+        for (size_t i = 0; !job && i < queueCount; ++i)
+        {
+            size_t victim = (start + i) % queueCount;
+            if ((int)victim != index)
+                job = queues[victim]->steal();
+        }
+
+        if (job)
+            queuedJobs.fetch_sub(1, std::memory_order_relaxed);
+        return job;
+    }
+
+    void workerLoop(int index)
+    {
+        threadSystem() = this;
+        threadWorker() = index;
+
+        int idleRounds = 0;
+        for (;;)
+        {
+            Job* job = findJob(index);
+            if (job)
+            {
+                execute(job);
+                idleRounds = 0;
+                continue;
+            }
+
+            // spin a little before going to sleep, new jobs often follow shortly
+            if (++idleRounds < 64)
+            {
+                std::this_thread::yield();
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lock(sleepMutex);
+            sleepingWorkers.fetch_add(1, std::memory_order_seq_cst);
+            wake.wait(lock, [this]() { return isStopping || queuedJobs.load(std::memory_order_seq_cst) > 0; });
+            sleepingWorkers.fetch_sub(1, std::memory_order_relaxed);
+            if (isStopping)
+                return;
+            idleRounds = 0;
+        }
+    }
+};
+
+// the job system shared by the whole program, one worker per extra hardware thread
+inline JobSystem& sharedJobSystem()
+{
+    static JobSystem system(std::max(1, (int)std::thread::hardware_concurrency()) - 1);
+    return system;
+}
+
+#endif
@@ -0,0 +1,328 @@
+#ifndef LIGHTING_H
+#define LIGHTING_H
+
+#include "parallel.h"
+
+#include <GL/glew.h>
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <vector>
+
+// Point light as laid out in the shader storage buffer (std430)
+struct PointLight
+{
+    glm::vec4 positionRadius;   // world space position, xyz, and radius of influence, w
+    glm::vec4 color;
+};
+
+
+// Clustered forward lighting. The view frustum is cut into a grid of
+// clusters: screen tiles in x and y and exponentially spaced depth slices
+// in z. Every frame each light is assigned to the clusters its sphere
+// touches and the result is uploaded as one (offset, count) pair per cluster
+// plus a compact light index list, so a fragment only loops over the
+// lights of its own cluster.
+//
+// Binning is split over depth slices: each thread owns a range of slices,
+// writes their lists without locking, and the lists are joined afterwards.
+class ClusteredLights
+{
+public:
+    static const int GRID_X = 16;
+    static const int GRID_Y = 12;
+    static const int GRID_Z = 24;
+    static const int CLUSTER_COUNT = GRID_X * GRID_Y * GRID_Z;
+
+    // shader storage buffer bindings used by the objects shader
+    static const GLuint LIGHT_BINDING = 0;
+    static const GLuint CLUSTER_BINDING = 1;
+    static const GLuint INDEX_BINDING = 2;
+
+    std::vector<PointLight> lights;
+
+    ClusteredLights() : threadCount(1), nearPlane(0.1f), farPlane(100.0f), assignedCount(0)
+    {
+        buffers[0] = buffers[1] = buffers[2] = 0;
+        capacities[0] = capacities[1] = capacities[2] = 0;
+        clusters.resize(CLUSTER_COUNT * 2);
+    }
+
+    void setThreadCount(int count)
+    {
+        threadCount = std::max(1, count);
+    }
+
+    // symmetric perspective projection used by the camera
+    void setProjection(float fovY, float aspect, float nearDistance, float farDistance)
+    {
+        nearPlane = nearDistance;
+        farPlane = farDistance;
+        tanHalfY = std::tan(fovY * 0.5f);
+        tanHalfX = tanHalfY * aspect;
+
+        // view space bounds of every cluster
+        clusterMin.resize(CLUSTER_COUNT);
+        clusterMax.resize(CLUSTER_COUNT);
+        for (int z = 0; z < GRID_Z; ++z)
+        {
+            float sliceNear = sliceDepth(z), sliceFar = sliceDepth(z + 1);
+            for (int y = 0; y < GRID_Y; ++y)
+            {
+                for (int x = 0; x < GRID_X; ++x)
+                {
+                    float ndcX0 = -1.0f + 2.0f * x / GRID_X, ndcX1 = -1.0f + 2.0f * (x + 1) / GRID_X;
+                    float ndcY0 = -1.0f + 2.0f * y / GRID_Y, ndcY1 = -1.0f + 2.0f * (y + 1) / GRID_Y;
+
+                    // the tile is widest on the far side of the slice
+                    glm::vec3 boxMin(FLT_MAX), boxMax(-FLT_MAX);
+                    const float depths[2] = { sliceNear, sliceFar };
+                    for (float depth : depths)
+                    {
+                        glm::vec3 a(ndcX0 * tanHalfX * depth, ndcY0 * tanHalfY * depth, -depth);
+                        glm::vec3 b(ndcX1 * tanHalfX * depth, ndcY1 * tanHalfY * depth, -depth);
+                        boxMin = glm::min(boxMin, glm::min(a, b));
+                        boxMax = glm::max(boxMax, glm::max(a, b));
+                    }
+
+                    int index = clusterIndex(x, y, z);
+                    clusterMin[index] = boxMin;
+                    clusterMax[index] = boxMax;
+                }
+            }
+        }
+    }
+
+    // slice = log(depth) * scale + bias, used by the shader to find its cluster
+    glm::vec2 depthScaleBias() const
+    {
+        float scale = GRID_Z / std::log(farPlane / nearPlane);
+        return glm::vec2(scale, -std::log(nearPlane) * scale);
+    }
+
+    // assigns every light to the clusters it touches for the given view matrix
+    void assign(const glm::mat4& view)
+    {
+        viewLights.resize(lights.size());
+        for (size_t i = 0; i < lights.size(); ++i)
+        {
+            glm::vec4 position = view * glm::vec4(glm::vec3(lights[i].positionRadius), 1.0f);
+            viewLights[i] = glm::vec4(glm::vec3(position), lights[i].positionRadius.w);
+        }
+
+        int threads = std::min(threadCount, GRID_Z);
+        sliceIndices.resize(threads);
+        for (size_t t = 0; t < sliceIndices.size(); ++t)
+            sliceIndices[t].clear();
+
+        // contiguous slice ranges, the same split as parallelFor
+        parallelFor((size_t)GRID_Z, threads, [this, threads](size_t begin, size_t end) {
+            size_t chunk = (GRID_Z + threads - 1) / threads;
+            binSlices((int)begin, (int)end, sliceIndices[begin / chunk]);
+        });
+
+        // join the per-thread lists; their offsets become absolute
+        indices.clear();
+        size_t chunk = (GRID_Z + threads - 1) / threads;
+        for (int t = 0; t < threads; ++t)
+        {
+            GLuint base = (GLuint)indices.size();
+            int firstSlice = (int)(t * chunk);
+            int lastSlice = std::min(GRID_Z, (int)((t + 1) * chunk));
+            for (int c = clusterIndex(0, 0, firstSlice); c < clusterIndex(0, 0, lastSlice); ++c)
+                clusters[c * 2] += base;
+            indices.insert(indices.end(), sliceIndices[t].begin(), sliceIndices[t].end());
+        }
+        assignedCount = indices.size();
+    }
+
+    // total number of light references over all clusters
+    size_t assignmentCount() const
+    {
+        return assignedCount;
+    }
+
+    // number of lights in a cluster, for statistics and tests
+    GLuint clusterLightCount(int x, int y, int z) const
+    {
+        return clusters[clusterIndex(x, y, z) * 2 + 1];
+    }
+
+    void setup()
+    {
+        glGenBuffers(3, buffers);
+    }
+
+    void destroy()
+    {
+        glDeleteBuffers(3, buffers);
+        buffers[0] = buffers[1] = buffers[2] = 0;
+        capacities[0] = capacities[1] = capacities[2] = 0;
+    }
+
+    // uploads lights, cluster ranges and indices and binds them to their shader storage bindings
+    void upload()
+    {
+        uploadBuffer(0, LIGHT_BINDING, lights.data(), lights.size() * sizeof(PointLight));
+        uploadBuffer(1, CLUSTER_BINDING, clusters.data(), clusters.size() * sizeof(GLuint));
+        uploadBuffer(2, INDEX_BINDING, indices.data(), indices.size() * sizeof(GLuint));
+    }
+
+private:
+    int threadCount;
+    float nearPlane, farPlane;
+    float tanHalfX, tanHalfY;
+    std::vector<glm::vec3> clusterMin, clusterMax;
+    std::vector<glm::vec4> viewLights;              // view space position and radius
+    std::vector<GLuint> clusters;                   // offset and count per cluster
+    std::vector<GLuint> indices;
+    std::vector<std::vector<GLuint>> sliceIndices;  // light indices written by each thread
+    size_t assignedCount;
+    GLuint buffers[3];
+    size_t capacities[3];
+
+    static int clusterIndex(int x, int y, int z)
+    {
+        return (z * GRID_Y + y) * GRID_X + x;
+    }
+
+    float sliceDepth(int slice) const
+    {
+        return nearPlane * std::pow(farPlane / nearPlane, (float)slice / GRID_Z);
+    }
+
+    void binSlices(int firstSlice, int lastSlice, std::vector<GLuint>& out)
+    {
+        out.clear();
+
+        // lights that reach this range of slices, with their screen tile ranges
+        std::vector<int> candidates;
+        std::vector<glm::ivec4> tileRanges;
+        float firstDepth = sliceDepth(firstSlice), lastDepth = sliceDepth(lastSlice);
+        for (size_t i = 0; i < viewLights.size(); ++i)
+        {
+            const glm::vec4& light = viewLights[i];
+            float depth = -light.z;
+            if (depth + light.w < firstDepth || depth - light.w > lastDepth)
+                continue;
+
+            glm::ivec4 tiles;
+            if (!screenTiles(light, tiles))
+                continue;
+            candidates.push_back((int)i);
+            tileRanges.push_back(tiles);
+        }
+
+        for (int z = firstSlice; z < lastSlice; ++z)
+        {
+            float sliceNear = sliceDepth(z), sliceFar = sliceDepth(z + 1);
+            int first = clusterIndex(0, 0, z);
+            for (int c = first; c < clusterIndex(0, 0, z + 1); ++c)
+                clusters[c * 2 + 1] = 0;
+
+            for (size_t k = 0; k < candidates.size(); ++k)
+            {
+                const glm::vec4& light = viewLights[candidates[k]];
+                float depth = -light.z;
+                if (depth + light.w < sliceNear || depth - light.w > sliceFar)
+                    continue;
+
+                const glm::ivec4& tiles = tileRanges[k];
+                for (int y = tiles.y; y <= tiles.w; ++y)
+                {
+                    for (int x = tiles.x; x <= tiles.z; ++x)
+                    {
+                        int c = clusterIndex(x, y, z);
+                        if (sphereIntersectsBox(light, clusterMin[c], clusterMax[c]))
+                            clusters[c * 2 + 1]++;
+                    }
+                }
+            }
+
+            // prefix sum of the counts gives the offsets, then fill
+            GLuint offset = (GLuint)out.size();
+            for (int c = first; c < clusterIndex(0, 0, z + 1); ++c)
+            {
+                clusters[c * 2] = offset;
+                offset += clusters[c * 2 + 1];
+                clusters[c * 2 + 1] = 0;
+            }
+            out.resize(offset);
+
+            for (size_t k = 0; k < candidates.size(); ++k)
+            {
+                const glm::vec4& light = viewLights[candidates[k]];
+                float depth = -light.z;
+                if (depth + light.w < sliceNear || depth - light.w > sliceFar)
+                    continue;
+
+                const glm::ivec4& tiles = tileRanges[k];
+                for (int y = tiles.y; y <= tiles.w; ++y)
+                {
+                    for (int x = tiles.x; x <= tiles.z; ++x)
+                    {
+                        int c = clusterIndex(x, y, z);
+                        if (sphereIntersectsBox(light, clusterMin[c], clusterMax[c]))
+                            out[clusters[c * 2] + clusters[c * 2 + 1]++] = (GLuint)candidates[k];
+                    }
+                }
+            }
+        }
+    }
+
+    // conservative range of screen tiles covered by a view space sphere; false if it is behind the camera
+    bool screenTiles(const glm::vec4& light, glm::ivec4& tiles) const
+    {
+        float depth = -light.z;
+        float nearest = std::max(depth - light.w, nearPlane);
+        float farthest = depth + light.w;
+        if (farthest < nearPlane)
+            return false;
+
+        // extremes of x / depth and y / depth over the bounding box of the sphere
+        float minX = FLT_MAX, maxX = -FLT_MAX, minY = FLT_MAX, maxY = -FLT_MAX;
+        const float depths[2] = { nearest, farthest };
+        for (float d : depths)
+        {
+            float x0 = (light.x - light.w) / (d * tanHalfX), x1 = (light.x + light.w) / (d * tanHalfX);
+            float y0 = (light.y - light.w) / (d * tanHalfY), y1 = (light.y + light.w) / (d * tanHalfY);
+            minX = std::min(minX, std::min(x0, x1));
+            maxX = std::max(maxX, std::max(x0, x1));
+            minY = std::min(minY, std::min(y0, y1));
+            maxY = std::max(maxY, std::max(y0, y1));
+        }
+        if (maxX < -1.0f || minX > 1.0f || maxY < -1.0f || minY > 1.0f)
+            return false;
+
+        tiles.x = std::max(0, (int)std::floor((minX * 0.5f + 0.5f) * GRID_X));
+        tiles.z = std::min(GRID_X - 1, (int)std::floor((maxX * 0.5f + 0.5f) * GRID_X));
+        tiles.y = std::max(0, (int)std::floor((minY * 0.5f + 0.5f) * GRID_Y));
+        tiles.w = std::min(GRID_Y - 1, (int)std::floor((maxY * 0.5f + 0.5f) * GRID_Y));
+        return true;
+    }
+
+    static bool sphereIntersectsBox(const glm::vec4& sphere, const glm::vec3& boxMin, const glm::vec3& boxMax)
+    {
+        glm::vec3 center(sphere);
+        glm::vec3 d = glm::max(glm::max(boxMin - center, center - boxMax), glm::vec3(0.0f));
+        return glm::dot(d, d) <= sphere.w * sphere.w;
+    }
+
+    // grows the buffer geometrically and orphans it like the instance buffer does
+    void uploadBuffer(int buffer, GLuint binding, const void* data, size_t size)
+    {
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffers[buffer]);
+        if (size > capacities[buffer] || capacities[buffer] == 0)
+            capacities[buffer] = std::max(size * 2, (size_t)256);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, capacities[buffer], NULL, GL_STREAM_DRAW);
+        if (size > 0)
+            glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, size, data);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, binding, buffers[buffer]);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    }
+};
+
+#endif
@@ -0,0 +1,548 @@
+#ifndef LIGHTMAP_H
+#define LIGHTMAP_H
+
+#include "hash.h"
+#include "parallel.h"
+#include "pathtracer.h"
+#include "rasterizer.h"
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <vector>
+
+// range of the mesh drawn as one object
+struct LightmapObject
+{
+    int first, count;
+};
+
+// an instance of an object, in the order of the instance ids
+struct LightmapInstance
+{
+    int object;         // -1 for an instance that is lit at run time
+    glm::mat4 model;
+    glm::mat3 normalMatrix;
+};
+
+
+// Baked lamp light of static instances.
+//
+// Every object is cut into charts of connected, nearly coplanar triangles,
+// which are projected onto their plane and packed into a rectangle: the
+// second uv set of the mesh, one per object. Every instance gets its own copy
+// of that rectangle in the atlas, at a texel density picked so the atlas fits.
+//
+// Baking finds the texels whose centers the triangles cover and traces the
+// direct and bounced light arriving there with the path tracer, on the job
+// system. The result is smoothed within each chart to take the noise out and
+// spread past the chart borders so that bilinear filtering does not pull in
+// the black of unused texels.
+//
+// The atlas stores irradiance: the surface color is the texture times the
+// texel. Specular light depends on the view and is not baked.
+class Lightmap
+{
+public:
+    static constexpr float TEXELS_PER_UNIT = 64.0f;     // density before it is lowered to fit
+    static const int MAX_SIZE = 2048;                   // keeps the bake time of large scenes in bounds
+    static const int PADDING = 2;                       // texels around every chart
+    static const int SAMPLES = 64;                      // bounce directions per texel
+
+    Lightmap() : width(0), height(0), texelsPerUnit(TEXELS_PER_UNIT) {}
+
+    // charts and atlas layout: lightmap uvs of the mesh vertices and a rectangle per instance;
+    // false if the instances do not fit in the largest atlas even below a texel per unit
+    bool build(const RasterVertex* meshVertices, size_t vertexCount, const std::vector<LightmapObject>& objects,
+        const std::vector<LightmapInstance>& sceneInstances)
+    {
+        vertices = meshVertices;
+        instances = sceneInstances;
+        objectCharts.assign(objects.size(), std::vector<Chart>());
+        for (size_t o = 0; o < objects.size(); ++o)
+            makeCharts(objects[o], objectCharts[o]);
+
+        // halve the density until the atlas fits
+        for (texelsPerUnit = TEXELS_PER_UNIT; ; texelsPerUnit *= 0.5f)
+        {
+            packObjects(objects.size());
+            if (packInstances())
+                break;
+            if (texelsPerUnit < 1.0f)
+                return false;
+        }
+
+        // uvs of the mesh vertices within the rectangle of their object
+        uvs.assign(vertexCount, glm::vec2(0.0f));
+        for (size_t o = 0; o < objects.size(); ++o)
+        {
+            for (const Chart& chart : objectCharts[o])
+            {
+                for (size_t t = 0; t < chart.triangles.size(); ++t)
+                {
+                    for (int i = 0; i < 3; ++i)
+                    {
+                        glm::vec2 texel = glm::vec2(chart.position) + (float)PADDING + (chart.projected[t * 3 + i] - chart.projectedMin) * texelsPerUnit;
+                        uvs[chart.triangles[t] + i] = texel / glm::vec2(objectSizes[o]);
+                    }
+                }
+            }
+        }
+
+        rects.resize(instances.size());
+        for (size_t i = 0; i < instances.size(); ++i)
+        {
+            glm::vec2 atlasSize((float)width, (float)height);
+            if (instances[i].object < 0)
+                rects[i] = glm::vec4(-1.0f);
+            else
+            {
+                glm::vec2 offset = glm::vec2(instancePositions[i]) / atlasSize;
+                glm::vec2 size = glm::vec2(objectSizes[instances[i].object]) / atlasSize;
+                rects[i] = glm::vec4(offset.x, offset.y, size.x, size.y);
+            }
+        }
+        texels.assign((size_t)width * height, glm::vec3(0.0f));
+        return true;
+    }
+
+    // traces the light of every covered texel; the tracer must hold the scene and its lamp
+    void bake(const PathTracer& tracer, uint32_t seed, int threadCount)
+    {
+        std::vector<TexelSample> samples;
+        for (size_t i = 0; i < instances.size(); ++i)
+            coverInstance((int)i, samples);
+
+        coverage.assign((size_t)width * height, 0);
+        normals.assign((size_t)width * height, glm::vec3(0.0f));
+        texels.assign((size_t)width * height, glm::vec3(0.0f));
+
+        // a texel center on an edge that two triangles of a chart share, as on the diagonal
+        // of every square face, is covered by both; it keeps the first sample and is traced once
+        size_t kept = 0;
+        for (size_t s = 0; s < samples.size(); ++s)
+        {
+            if (coverage[samples[s].texel] != 0)
+                continue;
+            coverage[samples[s].texel] = samples[s].chart;
+            normals[samples[s].texel] = samples[s].normal;
+            samples[kept++] = samples[s];
+        }
+        samples.resize(kept);
+
+        // every job takes every n-th texel so that expensive regions are shared out
+        int jobCount = std::max(1, threadCount);
+        parallelFor((size_t)jobCount, jobCount, [&](size_t begin, size_t end)
+        {
+            for (size_t j = begin; j < end; ++j)
+            {
+                uint64_t rays = 0;
+                for (size_t s = j; s < samples.size(); s += jobCount)
+                {
+                    PathRandom random(seed, (uint32_t)samples[s].texel, 0);
+                    texels[samples[s].texel] = tracer.irradiance(samples[s].position, samples[s].normal, SAMPLES, random, rays);
+                }
+            }
+        });
+        coveredTexels = samples.size();
+
+        denoise();
+        dilate();
+    }
+
+    int getWidth() const { return width; }
+    int getHeight() const { return height; }
+    float getTexelsPerUnit() const { return texelsPerUnit; }
+    size_t getCoveredTexels() const { return coveredTexels; }
+
+    // RGB irradiance, width * height texels, bottom row first
+    const glm::vec3* data() const
+    {
+        return texels.data();
+    }
+
+    // per mesh vertex, within the rectangle of the instance
+    const std::vector<glm::vec2>& getUvs() const
+    {
+        return uvs;
+    }
+
+    // per instance id: atlas offset in xy and size in zw, as uv; all -1 for the instances not in the atlas
+    const std::vector<glm::vec4>& getRects() const
+    {
+        return rects;
+    }
+
+    // the texels with the key of the scene they were baked for
+    bool save(const char* filename, uint64_t key) const
+    {
+        std::ofstream file(filename, std::ios::binary);
+        if (!file)
+            return false;
+
+        file.write(magic(), MAGIC_SIZE);
+        file.write((const char*)&key, sizeof(key));
+        file.write((const char*)&width, sizeof(width));
+        file.write((const char*)&height, sizeof(height));
+        file.write((const char*)texels.data(), texels.size() * sizeof(glm::vec3));
+        file.close();
+        return !file.fail();
+    }
+
+    // false unless the file holds a bake of the same scene and layout; call after build()
+    bool load(const char* filename, uint64_t key)
+    {
+        std::ifstream file(filename, std::ios::binary);
+        char fileMagic[MAGIC_SIZE];
+        uint64_t fileKey = 0;
+        int fileWidth = 0, fileHeight = 0;
+        if (!file.read(fileMagic, MAGIC_SIZE) || memcmp(fileMagic, magic(), MAGIC_SIZE) != 0)
+            return false;
+        file.read((char*)&fileKey, sizeof(fileKey));
+        file.read((char*)&fileWidth, sizeof(fileWidth));
+        file.read((char*)&fileHeight, sizeof(fileHeight));
+        if (!file || fileKey != key || fileWidth != width || fileHeight != height)
+            return false;
+
+        std::vector<glm::vec3> loaded((size_t)width * height);
+        if (!file.read((char*)loaded.data(), loaded.size() * sizeof(glm::vec3)))
+            return false;
+        texels.swap(loaded);
+        return true;
+    }
+
+private:
+    static const int MAGIC_SIZE = 8;
+    static const char* magic() { return "LMAP0001"; }
+    static constexpr float COPLANAR = 0.9f;     // cosine between normals of triangles in one chart
+
+    // connected, nearly coplanar triangles projected onto a plane
+    struct Chart
+    {
+        std::vector<int> triangles;             // mesh index of the first vertex of each
+        std::vector<glm::vec2> projected;       // 3 per triangle, model units
+        glm::vec2 projectedMin;
+        glm::ivec2 size;                        // texels, with the padding
+        glm::ivec2 position;                    // texels, within the object rectangle
+    };
+
+    struct TexelSample
+    {
+        size_t texel;
+        int chart;                              // 1 based, unique over the atlas
+        glm::vec3 position;
+        glm::vec3 normal;
+    };
+
+    const RasterVertex* vertices;
+    std::vector<LightmapInstance> instances;
+    std::vector<std::vector<Chart> > objectCharts;
+    std::vector<glm::ivec2> objectSizes;
+    std::vector<glm::ivec2> instancePositions;
+    int width, height;
+    float texelsPerUnit;
+    size_t coveredTexels;
+    std::vector<glm::vec2> uvs;
+    std::vector<glm::vec4> rects;
+    std::vector<glm::vec3> texels;
+    std::vector<glm::vec3> normals;
+    std::vector<int> coverage;                  // chart of every texel, 0 for none
+
+    static bool sharesEdge(const RasterVertex* a, const RasterVertex* b)
+    {
+        int shared = 0;
+        for (int i = 0; i < 3; ++i)
+            for (int j = 0; j < 3; ++j)
+                shared += glm::length(a[i].position - b[j].position) < 1e-5f ? 1 : 0;
+        return shared >= 2;
+    }
+
+    void makeCharts(const LightmapObject& object, std::vector<Chart>& charts) const
+    {
+        int triangleCount = object.count / 3;
+        std::vector<glm::vec3> faceNormals(triangleCount);
+        for (int t = 0; t < triangleCount; ++t)
+        {
+            const RasterVertex* v = vertices + object.first + t * 3;
+            glm::vec3 n = glm::cross(v[1].position - v[0].position, v[2].position - v[0].position);
+            float length = glm::length(n);
+            faceNormals[t] = length > 0.0f ? n / length : v[0].normal;
+        }
+
+        // flood fill over shared edges from every triangle not yet in a chart
+        std::vector<bool> isCharted(triangleCount, false);
+        for (int seed = 0; seed < triangleCount; ++seed)
+        {
+            if (isCharted[seed])
+                continue;
+
+            glm::vec3 normal = faceNormals[seed];
+            std::vector<int> members(1, seed);
+            isCharted[seed] = true;
+            for (size_t m = 0; m < members.size(); ++m)
+            {
+                const RasterVertex* a = vertices + object.first + members[m] * 3;
+                for (int t = 0; t < triangleCount; ++t)
+                {
+                    if (!isCharted[t] && glm::dot(faceNormals[t], normal) > COPLANAR && sharesEdge(a, vertices + object.first + t * 3))
+                    {
+                        isCharted[t] = true;
+                        members.push_back(t);
+                    }
+                }
+            }
+
+            // project onto the plane of the seed triangle
+            glm::vec3 tangent, bitangent;
+            orthonormalBasis(normal, tangent, bitangent);
+
+            Chart chart;
+            chart.projectedMin = glm::vec2(FLT_MAX);
+            for (int t : members)
+            {
+                chart.triangles.push_back(object.first + t * 3);
+                for (int i = 0; i < 3; ++i)
+                {
+                    const glm::vec3& p = vertices[object.first + t * 3 + i].position;
+                    glm::vec2 projected(glm::dot(p, tangent), glm::dot(p, bitangent));
+                    chart.projected.push_back(projected);
+                    chart.projectedMin = glm::min(chart.projectedMin, projected);
+                }
+            }
+            charts.push_back(chart);
+        }
+    }
+
+    // shelf packing: tallest first, left to right in rows of the given width; returns the height used
+    static int packShelves(const std::vector<glm::ivec2>& sizes, int rowWidth, std::vector<glm::ivec2>& positions)
+    {
+        std::vector<int> order(sizes.size());
+        for (size_t i = 0; i < order.size(); ++i)
+            order[i] = (int)i;
+        std::stable_sort(order.begin(), order.end(), [&sizes](int a, int b) { return sizes[a].y > sizes[b].y; });
+
+        positions.assign(sizes.size(), glm::ivec2(0));
+        int x = 0, y = 0, shelfHeight = 0;
+        for (int i : order)
+        {
+            if (x > 0 && x + sizes[i].x > rowWidth)
+            {
+                x = 0;
+                y += shelfHeight;
+                shelfHeight = 0;
+            }
+            positions[i] = glm::ivec2(x, y);
+            x += sizes[i].x;
+            shelfHeight = std::max(shelfHeight, sizes[i].y);
+        }
+        return y + shelfHeight;
+    }
+
+    // the charts of every object into one rectangle at the current density
+    void packObjects(size_t objectCount)
+    {
+        objectSizes.assign(objectCount, glm::ivec2(1));
+        for (size_t o = 0; o < objectCount; ++o)
+        {
+            std::vector<Chart>& charts = objectCharts[o];
+            std::vector<glm::ivec2> sizes;
+            int area = 0;
+            for (Chart& chart : charts)
+            {
+                glm::vec2 extent(0.0f);
+                for (const glm::vec2& p : chart.projected)
+                    extent = glm::max(extent, p - chart.projectedMin);
+                int border = 1 + 2 * PADDING;
+                chart.size = glm::ivec2((int)std::ceil(extent.x * texelsPerUnit) + border, (int)std::ceil(extent.y * texelsPerUnit) + border);
+                sizes.push_back(chart.size);
+                area += chart.size.x * chart.size.y;
+            }
+
+            // roughly square, but never narrower than the widest chart
+            int rowWidth = (int)std::ceil(std::sqrt((float)area) * 1.2f);
+            for (const glm::ivec2& size : sizes)
+                rowWidth = std::max(rowWidth, size.x);
+
+            std::vector<glm::ivec2> positions;
+            int rowHeight = packShelves(sizes, rowWidth, positions);
+            int usedWidth = 1;
+            for (size_t c = 0; c < charts.size(); ++c)
+            {
+                charts[c].position = positions[c];
+                usedWidth = std::max(usedWidth, positions[c].x + sizes[c].x);
+            }
+            objectSizes[o] = glm::ivec2(usedWidth, std::max(1, rowHeight));
+        }
+    }
+
+    // a rectangle per instance; false if they do not fit in the largest atlas
+    bool packInstances()
+    {
+        std::vector<glm::ivec2> sizes;
+        size_t area = 0;
+        for (const LightmapInstance& instance : instances)
+        {
+            sizes.push_back(instance.object < 0 ? glm::ivec2(0) : objectSizes[instance.object]);
+            area += (size_t)sizes.back().x * sizes.back().y;
+        }
+
+        // wide enough for the area and for the widest rectangle
+        int widest = 0;
+        for (const glm::ivec2& size : sizes)
+            widest = std::max(widest, size.x);
+        width = 64;
+        while (width < MAX_SIZE && ((size_t)width * width < area * 5 / 4 || width < widest))
+            width *= 2;
+        if (widest > width)
+            return false;
+
+        int usedHeight = packShelves(sizes, width, instancePositions);
+        height = std::max(4, (usedHeight + 3) & ~3);
+        return height <= MAX_SIZE;
+    }
+
+    // texels whose centers are inside the triangles of an instance
+    void coverInstance(int index, std::vector<TexelSample>& samples) const
+    {
+        const LightmapInstance& instance = instances[index];
+        if (instance.object < 0)
+            return;
+        glm::vec2 origin(instancePositions[index]);
+        glm::vec2 size(objectSizes[instance.object]);
+
+        int chartBase = 0;
+        for (int i = 0; i < index; ++i)
+            chartBase += instances[i].object < 0 ? 0 : (int)objectCharts[instances[i].object].size();
+
+        const std::vector<Chart>& charts = objectCharts[instance.object];
+        for (size_t c = 0; c < charts.size(); ++c)
+        {
+            for (int first : charts[c].triangles)
+            {
+                const RasterVertex* v = vertices + first;
+                glm::vec2 p[3];
+                for (int i = 0; i < 3; ++i)
+                    p[i] = origin + uvs[first + i] * size;
+
+                float area = (p[1].x - p[0].x) * (p[2].y - p[0].y) - (p[2].x - p[0].x) * (p[1].y - p[0].y);
+                if (std::fabs(area) < 1e-8f)
+                    continue;
+
+                int minX = std::max(0, (int)std::floor(std::min(p[0].x, std::min(p[1].x, p[2].x))));
+                int maxX = std::min(width - 1, (int)std::ceil(std::max(p[0].x, std::max(p[1].x, p[2].x))));
+                int minY = std::max(0, (int)std::floor(std::min(p[0].y, std::min(p[1].y, p[2].y))));
+                int maxY = std::min(height - 1, (int)std::ceil(std::max(p[0].y, std::max(p[1].y, p[2].y))));
+                for (int y = minY; y <= maxY; ++y)
+                {
+                    for (int x = minX; x <= maxX; ++x)
+                    {
+                        glm::vec2 center(x + 0.5f, y + 0.5f);
+                        float b1 = ((center.x - p[0].x) * (p[2].y - p[0].y) - (p[2].x - p[0].x) * (center.y - p[0].y)) / area;
+                        float b2 = ((p[1].x - p[0].x) * (center.y - p[0].y) - (center.x - p[0].x) * (p[1].y - p[0].y)) / area;
+                        float b0 = 1.0f - b1 - b2;
+                        if (b0 < 0.0f || b1 < 0.0f || b2 < 0.0f)
+                            continue;
+
+                        glm::vec3 position = v[0].position * b0 + v[1].position * b1 + v[2].position * b2;
+                        glm::vec3 normal = v[0].normal * b0 + v[1].normal * b1 + v[2].normal * b2;
+
+                        TexelSample sample;
+                        sample.texel = (size_t)y * width + x;
+                        sample.chart = chartBase + (int)c + 1;
+                        sample.position = glm::vec3(instance.model * glm::vec4(position, 1.0f));
+                        sample.normal = glm::normalize(instance.normalMatrix * normal);
+                        samples.push_back(sample);
+                    }
+                }
+            }
+        }
+    }
+
+    // edge aware blur: only texels of the same chart facing the same way are averaged
+    void denoise()
+    {
+        const int radius = 2;
+        std::vector<glm::vec3> filtered(texels);
+        parallelFor((size_t)height, hardwareThreadCount(), [&](size_t begin, size_t end)
+        {
+            for (int y = (int)begin; y < (int)end; ++y)
+            {
+                for (int x = 0; x < width; ++x)
+                {
+                    size_t center = (size_t)y * width + x;
+                    if (coverage[center] == 0)
+                        continue;
+
+                    glm::vec3 sum(0.0f);
+                    float weightSum = 0.0f;
+                    for (int dy = -radius; dy <= radius; ++dy)
+                    {
+                        for (int dx = -radius; dx <= radius; ++dx)
+                        {
+                            int sx = x + dx, sy = y + dy;
+                            if (sx < 0 || sy < 0 || sx >= width || sy >= height)
+                                continue;
+                            size_t s = (size_t)sy * width + sx;
+                            if (coverage[s] != coverage[center] || glm::dot(normals[s], normals[center]) < COPLANAR)
+                                continue;
+
+                            float weight = std::exp(-(dx * dx + dy * dy) / (2.0f * radius));
+                            sum += texels[s] * weight;
+                            weightSum += weight;
+                        }
+                    }
+                    filtered[center] = sum / weightSum;
+                }
+            }
+        });
+        texels.swap(filtered);
+    }
+
+    // grows every chart into the padding around it, a texel per pass
+    void dilate()
+    {
+        for (int pass = 0; pass < PADDING; ++pass)
+        {
+            std::vector<int> grown(coverage);
+            std::vector<glm::vec3> result(texels);
+            for (int y = 0; y < height; ++y)
+            {
+                for (int x = 0; x < width; ++x)
+                {
+                    size_t center = (size_t)y * width + x;
+                    if (coverage[center] != 0)
+                        continue;
+
+                    glm::vec3 sum(0.0f);
+                    int count = 0, chart = 0;
+                    for (int dy = -1; dy <= 1; ++dy)
+                    {
+                        for (int dx = -1; dx <= 1; ++dx)
+                        {
+                            int sx = x + dx, sy = y + dy;
+                            if (sx < 0 || sy < 0 || sx >= width || sy >= height || coverage[(size_t)sy * width + sx] == 0)
+                                continue;
+                            sum += texels[(size_t)sy * width + sx];
+                            chart = coverage[(size_t)sy * width + sx];
+                            count++;
+                        }
+                    }
+                    if (count > 0)
+                    {
+                        result[center] = sum / (float)count;
+                        grown[center] = chart;
+                    }
+                }
+            }
+            coverage.swap(grown);
+            texels.swap(result);
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,616 @@
+#ifndef OCCLUSION_H
+#define OCCLUSION_H
+
+#include "culling.h"
+#include "parallel.h"
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cfloat>
+#include <cmath>
+#include <vector>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define OCCLUSION_AVX2
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define OCCLUSION_SSE2
+#endif
+
+
+// Software occlusion culling. Large occluder meshes are rasterized into a
+// low resolution depth buffer on the CPU, then the screen rectangle of each
+// occludee box is compared against it. The screen is split into horizontal
+// bands of 8x8 tiles and every band is rasterized by its own thread, so no
+// locking is needed. A second, per-tile level holding the farthest depth of
+// each tile rejects most boxes without touching the pixels.
+//
+// Depth is stored as 1 / w (the reciprocal of the view distance), which is
+// linear in screen space and keeps its precision far from the camera so that
+// nearly coplanar surfaces like the screen on the monitor are not culled.
+// Larger values are nearer, 0 is infinitely far away.
+class OcclusionCuller
+{
+public:
+    static const int TILE_SIZE = 8;
+
+    OcclusionCuller() : width(0), height(0), tilesX(0), tilesY(0), threadCount(1), triangleTotal(0) {}
+
+    // the width and height are rounded up to whole tiles
+    void resize(int newWidth, int newHeight)
+    {
+        tilesX = (newWidth + TILE_SIZE - 1) / TILE_SIZE;
+        tilesY = (newHeight + TILE_SIZE - 1) / TILE_SIZE;
+        width = tilesX * TILE_SIZE;
+        height = tilesY * TILE_SIZE;
+        rasterized.assign((size_t)width * height, 0.0f);
+        depth.assign((size_t)width * height, 0.0f);
+        tileFarthest.assign((size_t)tilesX * tilesY, 0.0f);
+    }
+
+    // threads used by render() and cull(), at most one per tile row
+    void setThreadCount(int count)
+    {
+        threadCount = std::max(1, count);
+    }
+
+    int getWidth() const { return width; }
+    int getHeight() const { return height; }
+
+    // starts a new frame: forgets the occluders of the previous one
+    void beginFrame(const glm::mat4& viewProjection)
+    {
+        this->viewProjection = viewProjection;
+        occluders.clear();
+        triangleTotal = 0;
+    }
+
+    // model space triangle list (3 positions per triangle) drawn with the given model matrix.
+    // The vertices are not copied and must stay alive until render() returns.
+    void addOccluder(const glm::vec3* vertices, int vertexCount, const glm::mat4& model)
+    {
+        Occluder occluder;
+        occluder.vertices = vertices;
+        occluder.model = model;
+        occluder.firstTriangle = triangleTotal;
+        occluder.triangleCount = vertexCount / 3;
+        occluders.push_back(occluder);
+        triangleTotal += occluder.triangleCount;
+    }
+
+    size_t triangleCount() const
+    {
+        return triangleTotal;
+    }
+
+    // transforms and rasterizes every occluder, then builds the tile level
+    void render()
+    {
+        triangles.resize(triangleTotal);
+
+        // triangle setup, split evenly over the threads
+        parallelFor(triangleTotal, threadCount, [this](size_t begin, size_t end) { setupTriangles(begin, end); });
+
+        // one band of tile rows per thread
+        parallelFor((size_t)tilesY, threadCount, [this](size_t begin, size_t end) { rasterizeBand((int)begin, (int)end); });
+
+        // erosion reads the neighbouring bands, so it runs once all of them are done
+        parallelFor((size_t)tilesY, threadCount, [this](size_t begin, size_t end) { erodeBand((int)begin, (int)end); });
+    }
+
+    // true when the box is completely hidden behind the rendered occluders
+    bool isOccluded(const AABB& box) const
+    {
+        BoxRect rect;
+        projectBox(box, rect);
+        return isRectOccluded(rect);
+    }
+
+    // clears the flag of every visible box that is occluded; returns how many were cleared.
+    // The visible boxes are projected BOX_BATCH at a time
+    size_t cull(const AABB* boxes, size_t count, unsigned char* visible) const
+    {
+        std::atomic<size_t> hidden(0);
+        parallelFor(count, threadCount, [&](size_t begin, size_t end) {
+            size_t n = 0;
+            size_t batch[BOX_BATCH];
+            int batchSize = 0;
+            for (size_t i = begin; i <= end; ++i)
+            {
+                // the last batch of the range may be short
+                if (i < end && visible[i])
+                    batch[batchSize++] = i;
+                if (batchSize == 0 || (batchSize < BOX_BATCH && i < end))
+                    continue;
+
+                BoxRect rects[BOX_BATCH];
+                projectBoxes(boxes, batch, batchSize, rects);
+                for (int b = 0; b < batchSize; ++b)
+                {
+                    if (isRectOccluded(rects[b]))
+                    {
+                        visible[batch[b]] = 0;
+                        n++;
+                    }
+                }
+                batchSize = 0;
+            }
+            hidden += n;
+        });
+        return hidden;
+    }
+
+    // depth of a pixel, for debugging and tests
+    float depthAt(int x, int y) const
+    {
+        return depth[(size_t)y * width + x];
+    }
+
+private:
+    // clip w below which a vertex is considered behind the camera
+    static constexpr float NEAR_W = 1e-4f;
+
+    // boxes whose corners are projected together, one per SIMD lane
+#if defined(OCCLUSION_AVX2)
+    static const int BOX_BATCH = 8;
+#elif defined(OCCLUSION_SSE2)
+    static const int BOX_BATCH = 4;
+#else
+    static const int BOX_BATCH = 1;
+#endif
+
+    // screen rectangle and nearest depth of a box
+    struct BoxRect
+    {
+        float minX, minY, maxX, maxY;
+        float nearest;
+        bool isCrossingNear;            // a corner is behind the near plane, the box counts as visible
+    };
+
+    struct Occluder
+    {
+        const glm::vec3* vertices;
+        glm::mat4 model;
+        size_t firstTriangle;
+        size_t triangleCount;
+    };
+
+    // edge functions and depth plane of a screen space triangle, e(x, y) = a * x + b * y + c
+    struct ScreenTriangle
+    {
+        float edgeA[3], edgeB[3], edgeC[3];
+        float depthA, depthB, depthC;
+        int minX, maxX, minY, maxY;    // pixel bounds, minX > maxX for culled triangles
+    };
+
+    int width, height;
+    int tilesX, tilesY;
+    int threadCount;
+    glm::mat4 viewProjection;
+    std::vector<float> rasterized;      // occluder depth sampled at pixel centers
+    std::vector<float> depth;           // rasterized depth after erosion, used by the tests
+    std::vector<float> tileFarthest;
+    std::vector<Occluder> occluders;
+    std::vector<ScreenTriangle> triangles;
+    size_t triangleTotal;
+
+    void projectBox(const AABB& box, BoxRect& rect) const
+    {
+        rect.minX = rect.minY = FLT_MAX;
+        rect.maxX = rect.maxY = -FLT_MAX;
+        rect.nearest = 0.0f;
+        rect.isCrossingNear = false;
+        for (int i = 0; i < 8; ++i)
+        {
+            glm::vec4 corner(i & 1 ? box.max.x : box.min.x, i & 2 ? box.max.y : box.min.y, i & 4 ? box.max.z : box.min.z, 1.0f);
+            glm::vec4 clip = viewProjection * corner;
+            if (clip.w <= NEAR_W)
+            {
+                rect.isCrossingNear = true;
+                return;
+            }
+
+            float invW = 1.0f / clip.w;
+            float x = (clip.x * invW * 0.5f + 0.5f) * width;
+            float y = (clip.y * invW * 0.5f + 0.5f) * height;
+            rect.minX = std::min(rect.minX, x);
+            rect.maxX = std::max(rect.maxX, x);
+            rect.minY = std::min(rect.minY, y);
+            rect.maxY = std::max(rect.maxY, y);
+            rect.nearest = std::max(rect.nearest, invW);
+        }
+    }
+
+    // projectBox for the boxes of up to BOX_BATCH indices at once. The bounds go into
+    // structure-of-arrays form, and since the corners only pick the minimum or the
+    // maximum per axis, the matrix is applied to those six values once per lane
+    void projectBoxes(const AABB* boxes, const size_t* indices, int count, BoxRect* rects) const
+    {
+#if defined(OCCLUSION_AVX2) || defined(OCCLUSION_SSE2)
+        // lanes past count repeat the first box
+        float bounds[6][BOX_BATCH];
+        for (int lane = 0; lane < BOX_BATCH; ++lane)
+        {
+            const AABB& box = boxes[indices[lane < count ? lane : 0]];
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                bounds[axis][lane] = box.min[axis];
+                bounds[3 + axis][lane] = box.max[axis];
+            }
+        }
+
+        float minX[BOX_BATCH], minY[BOX_BATCH], maxX[BOX_BATCH], maxY[BOX_BATCH], nearest[BOX_BATCH];
+        int crossingMask;
+        const int clipRows[3] = { 0, 1, 3 };    // x, y and w of the clip position
+#endif
+#if defined(OCCLUSION_AVX2)
+        // terms[row][axis][0 for the minimum, 1 for the maximum]
+        __m256 terms[3][3][2], translation[3];
+        for (int r = 0; r < 3; ++r)
+        {
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                __m256 m = _mm256_set1_ps(viewProjection[axis][clipRows[r]]);
+                terms[r][axis][0] = _mm256_mul_ps(m, _mm256_loadu_ps(bounds[axis]));
+                terms[r][axis][1] = _mm256_mul_ps(m, _mm256_loadu_ps(bounds[3 + axis]));
+            }
+            translation[r] = _mm256_set1_ps(viewProjection[3][clipRows[r]]);
+        }
+
+        __m256 one = _mm256_set1_ps(1.0f), half = _mm256_set1_ps(0.5f), nearW = _mm256_set1_ps(NEAR_W);
+        __m256 screenWidth = _mm256_set1_ps((float)width), screenHeight = _mm256_set1_ps((float)height);
+        __m256 rectMinX = _mm256_set1_ps(FLT_MAX), rectMinY = rectMinX;
+        __m256 rectMaxX = _mm256_set1_ps(-FLT_MAX), rectMaxY = rectMaxX;
+        __m256 rectNearest = _mm256_setzero_ps(), crossing = _mm256_setzero_ps();
+        for (int i = 0; i < 8; ++i)
+        {
+            __m256 clip[3];
+            for (int r = 0; r < 3; ++r)
+                clip[r] = _mm256_add_ps(_mm256_add_ps(terms[r][0][i & 1], terms[r][1][(i >> 1) & 1]), _mm256_add_ps(terms[r][2][i >> 2], translation[r]));
+            crossing = _mm256_or_ps(crossing, _mm256_cmp_ps(clip[2], nearW, _CMP_LE_OQ));
+
+            __m256 invW = _mm256_div_ps(one, clip[2]);
+            __m256 x = _mm256_mul_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_mul_ps(clip[0], invW), half), half), screenWidth);
+            __m256 y = _mm256_mul_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_mul_ps(clip[1], invW), half), half), screenHeight);
+            rectMinX = _mm256_min_ps(rectMinX, x);
+            rectMaxX = _mm256_max_ps(rectMaxX, x);
+            rectMinY = _mm256_min_ps(rectMinY, y);
+            rectMaxY = _mm256_max_ps(rectMaxY, y);
+            rectNearest = _mm256_max_ps(rectNearest, invW);
+        }
+        _mm256_storeu_ps(minX, rectMinX);
+        _mm256_storeu_ps(maxX, rectMaxX);
+        _mm256_storeu_ps(minY, rectMinY);
+        _mm256_storeu_ps(maxY, rectMaxY);
+        _mm256_storeu_ps(nearest, rectNearest);
+        crossingMask = _mm256_movemask_ps(crossing);
+#elif defined(OCCLUSION_SSE2)
+        __m128 terms[3][3][2], translation[3];
+        for (int r = 0; r < 3; ++r)
+        {
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                __m128 m = _mm_set1_ps(viewProjection[axis][clipRows[r]]);
+                terms[r][axis][0] = _mm_mul_ps(m, _mm_loadu_ps(bounds[axis]));
+                terms[r][axis][1] = _mm_mul_ps(m, _mm_loadu_ps(bounds[3 + axis]));
+            }
+            translation[r] = _mm_set1_ps(viewProjection[3][clipRows[r]]);
+        }
+
+        __m128 one = _mm_set1_ps(1.0f), half = _mm_set1_ps(0.5f), nearW = _mm_set1_ps(NEAR_W);
+        __m128 screenWidth = _mm_set1_ps((float)width), screenHeight = _mm_set1_ps((float)height);
+        __m128 rectMinX = _mm_set1_ps(FLT_MAX), rectMinY = rectMinX;
+        __m128 rectMaxX = _mm_set1_ps(-FLT_MAX), rectMaxY = rectMaxX;
+        __m128 rectNearest = _mm_setzero_ps(), crossing = _mm_setzero_ps();
+        for (int i = 0; i < 8; ++i)
+        {
+            __m128 clip[3];
+            for (int r = 0; r < 3; ++r)
+                clip[r] = _mm_add_ps(_mm_add_ps(terms[r][0][i & 1], terms[r][1][(i >> 1) & 1]), _mm_add_ps(terms[r][2][i >> 2], translation[r]));
+            crossing = _mm_or_ps(crossing, _mm_cmple_ps(clip[2], nearW));
+
+            __m128 invW = _mm_div_ps(one, clip[2]);
+            __m128 x = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(_mm_mul_ps(clip[0], invW), half), half), screenWidth);
+            __m128 y = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(_mm_mul_ps(clip[1], invW), half), half), screenHeight);
+            rectMinX = _mm_min_ps(rectMinX, x);
+            rectMaxX = _mm_max_ps(rectMaxX, x);
+            rectMinY = _mm_min_ps(rectMinY, y);
+            rectMaxY = _mm_max_ps(rectMaxY, y);
+            rectNearest = _mm_max_ps(rectNearest, invW);
+        }
+        _mm_storeu_ps(minX, rectMinX);
+        _mm_storeu_ps(maxX, rectMaxX);
+        _mm_storeu_ps(minY, rectMinY);
+        _mm_storeu_ps(maxY, rectMaxY);
+        _mm_storeu_ps(nearest, rectNearest);
+        crossingMask = _mm_movemask_ps(crossing);
+#endif
+#if defined(OCCLUSION_AVX2) || defined(OCCLUSION_SSE2)
+        for (int lane = 0; lane < count; ++lane)
+        {
+            rects[lane].minX = minX[lane];
+            rects[lane].minY = minY[lane];
+            rects[lane].maxX = maxX[lane];
+            rects[lane].maxY = maxY[lane];
+            rects[lane].nearest = nearest[lane];
+            rects[lane].isCrossingNear = (crossingMask & (1 << lane)) != 0;
+        }
+#else
+        for (int b = 0; b < count; ++b)
+            projectBox(boxes[indices[b]], rects[b]);
+#endif
+    }
+
+    // the depth test of a projected box against the tiles and pixels it touches
+    bool isRectOccluded(const BoxRect& rect) const
+    {
+        if (rect.isCrossingNear)
+            return false;
+        if (rect.maxX < 0.0f || rect.minX > width || rect.maxY < 0.0f || rect.minY > height)
+            return false;
+
+        // every pixel the rectangle touches
+        int x0 = std::max(0, (int)std::floor(rect.minX));
+        int x1 = std::min(width - 1, (int)std::floor(rect.maxX));
+        int y0 = std::max(0, (int)std::floor(rect.minY));
+        int y1 = std::min(height - 1, (int)std::floor(rect.maxY));
+
+        for (int tileY = y0 / TILE_SIZE; tileY <= y1 / TILE_SIZE; ++tileY)
+        {
+            for (int tileX = x0 / TILE_SIZE; tileX <= x1 / TILE_SIZE; ++tileX)
+            {
+                // the whole tile is in front of the box
+                if (tileFarthest[tileY * tilesX + tileX] >= rect.nearest)
+                    continue;
+
+                if (isTileVisible(tileX, tileY, x0, x1, y0, y1, rect.nearest))
+                    return false;
+            }
+        }
+        return true;
+    }
+
+    void setupTriangles(size_t begin, size_t end)
+    {
+        // find the occluder that holds the first triangle of the range
+        size_t o = 0;
+        while (o + 1 < occluders.size() && occluders[o + 1].firstTriangle <= begin)
+            o++;
+
+        glm::mat4 transform;
+        size_t transformOccluder = (size_t)-1;
+        for (size_t t = begin; t < end; ++t)
+        {
+            while (t >= occluders[o].firstTriangle + occluders[o].triangleCount)
+                o++;
+            if (transformOccluder != o)
+            {
+                transform = viewProjection * occluders[o].model;
+                transformOccluder = o;
+            }
+
+            const glm::vec3* v = occluders[o].vertices + (t - occluders[o].firstTriangle) * 3;
+            setupTriangle(transform * glm::vec4(v[0], 1.0f), transform * glm::vec4(v[1], 1.0f), transform * glm::vec4(v[2], 1.0f), triangles[t]);
+        }
+    }
+
+    void setupTriangle(const glm::vec4& c0, const glm::vec4& c1, const glm::vec4& c2, ScreenTriangle& triangle) const
+    {
+        triangle.minX = 1;
+        triangle.maxX = 0;
+
+        // triangles crossing the near plane are skipped, which only makes the culler less aggressive
+        if (c0.w <= NEAR_W || c1.w <= NEAR_W || c2.w <= NEAR_W)
+            return;
+
+        float x[3], y[3], z[3];
+        const glm::vec4* clip[3] = { &c0, &c1, &c2 };
+        for (int i = 0; i < 3; ++i)
+        {
+            float invW = 1.0f / clip[i]->w;
+            x[i] = (clip[i]->x * invW * 0.5f + 0.5f) * width;
+            y[i] = (clip[i]->y * invW * 0.5f + 0.5f) * height;
+            z[i] = invW;
+        }
+
+        float area = (x[1] - x[0]) * (y[2] - y[0]) - (x[2] - x[0]) * (y[1] - y[0]);
+        if (std::fabs(area) < 1e-6f)
+            return;
+
+        // both windings are rasterized, reorder to counter clockwise
+        if (area < 0.0f)
+        {
+            std::swap(x[1], x[2]);
+            std::swap(y[1], y[2]);
+            std::swap(z[1], z[2]);
+            area = -area;
+        }
+
+        triangle.minX = std::max(0, (int)std::floor(std::min(x[0], std::min(x[1], x[2]))));
+        triangle.maxX = std::min(width - 1, (int)std::ceil(std::max(x[0], std::max(x[1], x[2]))));
+        triangle.minY = std::max(0, (int)std::floor(std::min(y[0], std::min(y[1], y[2]))));
+        triangle.maxY = std::min(height - 1, (int)std::ceil(std::max(y[0], std::max(y[1], y[2]))));
+
+        // edge i goes from vertex i to vertex i + 1, positive inside
+        for (int i = 0; i < 3; ++i)
+        {
+            int j = (i + 1) % 3;
+            triangle.edgeA[i] = y[i] - y[j];
+            triangle.edgeB[i] = x[j] - x[i];
+            triangle.edgeC[i] = x[i] * y[j] - x[j] * y[i];
+        }
+
+        // barycentric weight of vertex i is the edge opposite to it over the area
+        float invArea = 1.0f / area;
+        triangle.depthA = (triangle.edgeA[1] * z[0] + triangle.edgeA[2] * z[1] + triangle.edgeA[0] * z[2]) * invArea;
+        triangle.depthB = (triangle.edgeB[1] * z[0] + triangle.edgeB[2] * z[1] + triangle.edgeB[0] * z[2]) * invArea;
+        triangle.depthC = (triangle.edgeC[1] * z[0] + triangle.edgeC[2] * z[1] + triangle.edgeC[0] * z[2]) * invArea;
+
+        // store the farthest depth of the plane within each pixel, not the depth at its center
+        triangle.depthC -= 0.5f * (std::fabs(triangle.depthA) + std::fabs(triangle.depthB));
+    }
+
+    void rasterizeBand(int firstTileRow, int lastTileRow)
+    {
+        int bandMinY = firstTileRow * TILE_SIZE;
+        int bandMaxY = lastTileRow * TILE_SIZE - 1;
+        std::fill(rasterized.begin() + (size_t)bandMinY * width, rasterized.begin() + (size_t)(bandMaxY + 1) * width, 0.0f);
+
+        for (size_t t = 0; t < triangles.size(); ++t)
+        {
+            const ScreenTriangle& triangle = triangles[t];
+            if (triangle.minX > triangle.maxX || triangle.maxY < bandMinY || triangle.minY > bandMaxY)
+                continue;
+
+            int minY = std::max(triangle.minY, bandMinY);
+            int maxY = std::min(triangle.maxY, bandMaxY);
+            for (int y = minY; y <= maxY; ++y)
+                rasterizeRow(triangle, y);
+        }
+    }
+
+    // A pixel whose center is covered can still be partly uncovered near a
+    // silhouette. Taking the farthest depth of the 3x3 neighbourhood shrinks
+    // every silhouette by one pixel so that slivers seen past the edge of an
+    // occluder, or through a gap between two, are not culled. Gaps narrower
+    // than a pixel of this buffer can still hide what is behind them.
+    void erodeBand(int firstTileRow, int lastTileRow)
+    {
+        std::vector<float> column(width);
+        for (int y = firstTileRow * TILE_SIZE; y < lastTileRow * TILE_SIZE; ++y)
+        {
+            const float* above = &rasterized[(size_t)std::max(0, y - 1) * width];
+            const float* center = &rasterized[(size_t)y * width];
+            const float* below = &rasterized[(size_t)std::min(height - 1, y + 1) * width];
+            for (int x = 0; x < width; ++x)
+                column[x] = std::min(center[x], std::min(above[x], below[x]));
+
+            float* row = &depth[(size_t)y * width];
+            row[0] = std::min(column[0], column[1]);
+            for (int x = 1; x < width - 1; ++x)
+                row[x] = std::min(column[x], std::min(column[x - 1], column[x + 1]));
+            row[width - 1] = std::min(column[width - 2], column[width - 1]);
+        }
+
+        for (int tileY = firstTileRow; tileY < lastTileRow; ++tileY)
+        {
+            for (int tileX = 0; tileX < tilesX; ++tileX)
+            {
+                float farthest = FLT_MAX;
+                for (int y = tileY * TILE_SIZE; y < (tileY + 1) * TILE_SIZE; ++y)
+                {
+                    const float* row = &depth[(size_t)y * width + tileX * TILE_SIZE];
+                    for (int x = 0; x < TILE_SIZE; ++x)
+                        farthest = std::min(farthest, row[x]);
+                }
+                tileFarthest[tileY * tilesX + tileX] = farthest;
+            }
+        }
+    }
+
+    // depth test and write of the pixels of one row covered by a triangle
+    void rasterizeRow(const ScreenTriangle& triangle, int y)
+    {
+        float py = y + 0.5f;
+        float rowEdge[3];
+        for (int i = 0; i < 3; ++i)
+            rowEdge[i] = triangle.edgeB[i] * py + triangle.edgeC[i];
+        float rowDepth = triangle.depthB * py + triangle.depthC;
+        float* row = &rasterized[(size_t)y * width];
+
+        int x = triangle.minX & ~7;
+#if defined(OCCLUSION_AVX2)
+        const __m256 laneOffsets = _mm256_setr_ps(0.5f, 1.5f, 2.5f, 3.5f, 4.5f, 5.5f, 6.5f, 7.5f);
+        __m256 a0 = _mm256_set1_ps(triangle.edgeA[0]), a1 = _mm256_set1_ps(triangle.edgeA[1]), a2 = _mm256_set1_ps(triangle.edgeA[2]);
+        __m256 r0 = _mm256_set1_ps(rowEdge[0]), r1 = _mm256_set1_ps(rowEdge[1]), r2 = _mm256_set1_ps(rowEdge[2]);
+        __m256 depthA = _mm256_set1_ps(triangle.depthA), depthRow = _mm256_set1_ps(rowDepth);
+        __m256 zero = _mm256_setzero_ps();
+        for (; x <= triangle.maxX; x += 8)
+        {
+            __m256 px = _mm256_add_ps(_mm256_set1_ps((float)x), laneOffsets);
+            __m256 e0 = _mm256_add_ps(_mm256_mul_ps(a0, px), r0);
+            __m256 e1 = _mm256_add_ps(_mm256_mul_ps(a1, px), r1);
+            __m256 e2 = _mm256_add_ps(_mm256_mul_ps(a2, px), r2);
+            __m256 inside = _mm256_and_ps(_mm256_cmp_ps(e0, zero, _CMP_GE_OQ),
+                _mm256_and_ps(_mm256_cmp_ps(e1, zero, _CMP_GE_OQ), _mm256_cmp_ps(e2, zero, _CMP_GE_OQ)));
+            if (_mm256_movemask_ps(inside) == 0)
+                continue;
+
+            __m256 z = _mm256_add_ps(_mm256_mul_ps(depthA, px), depthRow);
+            __m256 old = _mm256_loadu_ps(row + x);
+            _mm256_storeu_ps(row + x, _mm256_blendv_ps(old, _mm256_max_ps(old, z), inside));
+        }
+#elif defined(OCCLUSION_SSE2)
+        const __m128 laneOffsets = _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f);
+        __m128 a0 = _mm_set1_ps(triangle.edgeA[0]), a1 = _mm_set1_ps(triangle.edgeA[1]), a2 = _mm_set1_ps(triangle.edgeA[2]);
+        __m128 r0 = _mm_set1_ps(rowEdge[0]), r1 = _mm_set1_ps(rowEdge[1]), r2 = _mm_set1_ps(rowEdge[2]);
+        __m128 depthA = _mm_set1_ps(triangle.depthA), depthRow = _mm_set1_ps(rowDepth);
+        __m128 zero = _mm_setzero_ps();
+        for (; x <= triangle.maxX; x += 4)
+        {
+            __m128 px = _mm_add_ps(_mm_set1_ps((float)x), laneOffsets);
+            __m128 e0 = _mm_add_ps(_mm_mul_ps(a0, px), r0);
+            __m128 e1 = _mm_add_ps(_mm_mul_ps(a1, px), r1);
+            __m128 e2 = _mm_add_ps(_mm_mul_ps(a2, px), r2);
+            __m128 inside = _mm_and_ps(_mm_cmpge_ps(e0, zero), _mm_and_ps(_mm_cmpge_ps(e1, zero), _mm_cmpge_ps(e2, zero)));
+            if (_mm_movemask_ps(inside) == 0)
+                continue;
+
+            __m128 z = _mm_add_ps(_mm_mul_ps(depthA, px), depthRow);
+            __m128 old = _mm_loadu_ps(row + x);
+            __m128 nearer = _mm_max_ps(old, z);
+            _mm_storeu_ps(row + x, _mm_or_ps(_mm_and_ps(inside, nearer), _mm_andnot_ps(inside, old)));
+        }
+#endif
+
+        // scalar path (the row is padded to whole tiles, so SIMD never leaves a tail)
+        for (; x <= triangle.maxX; ++x)
+        {
+            float px = x + 0.5f;
+            if (triangle.edgeA[0] * px + rowEdge[0] < 0.0f || triangle.edgeA[1] * px + rowEdge[1] < 0.0f || triangle.edgeA[2] * px + rowEdge[2] < 0.0f)
+                continue;
+
+            float z = triangle.depthA * px + rowDepth;
+            row[x] = std::max(row[x], z);
+        }
+    }
+
+    // true if a pixel of the tile inside the rectangle is farther than depth z
+    bool isTileVisible(int tileX, int tileY, int x0, int x1, int y0, int y1, float z) const
+    {
+        int firstX = std::max(x0, tileX * TILE_SIZE), lastX = std::min(x1, tileX * TILE_SIZE + TILE_SIZE - 1);
+        int firstY = std::max(y0, tileY * TILE_SIZE), lastY = std::min(y1, tileY * TILE_SIZE + TILE_SIZE - 1);
+
+#if defined(OCCLUSION_AVX2)
+        // one tile row is exactly one 8 wide vector; lanes outside the rectangle are masked off
+        __m256 lanes = _mm256_setr_ps(0.0f, 1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f, 7.0f);
+        __m256 first = _mm256_set1_ps((float)(firstX - tileX * TILE_SIZE));
+        __m256 last = _mm256_set1_ps((float)(lastX - tileX * TILE_SIZE));
+        __m256 columns = _mm256_and_ps(_mm256_cmp_ps(lanes, first, _CMP_GE_OQ), _mm256_cmp_ps(lanes, last, _CMP_LE_OQ));
+        __m256 boxDepth = _mm256_set1_ps(z);
+        for (int y = firstY; y <= lastY; ++y)
+        {
+            __m256 row = _mm256_loadu_ps(&depth[(size_t)y * width + tileX * TILE_SIZE]);
+            if (_mm256_movemask_ps(_mm256_and_ps(columns, _mm256_cmp_ps(row, boxDepth, _CMP_LT_OQ))) != 0)
+                return true;
+        }
+        return false;
+#else
+        for (int y = firstY; y <= lastY; ++y)
+        {
+            const float* row = &depth[(size_t)y * width];
+            for (int x = firstX; x <= lastX; ++x)
+            {
+                if (row[x] < z)
+                    return true;
+            }
+        }
+        return false;
+#endif
+    }
+};
+
+#endif
@@ -0,0 +1,141 @@
+#ifndef PACING_H
+#define PACING_H
+
+#include <GL/glew.h>
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+// Frame pacing: an optional frame rate limit, and a cap on the number of
+// frames the GPU may have queued, enforced with a fence after every swap.
+// Letting the CPU run several frames ahead of the GPU only adds input
+// latency, so by default at most two frames are in flight.
+//
+// Input latency is measured from the moment the input of a frame was sampled
+// to the moment its fence signals, i.e. when the GPU finished the frame.
+class FramePacer
+{
+public:
+    static const int MAX_FRAMES_IN_FLIGHT = 4;
+
+    FramePacer() : targetFrameRate(0.0), maxFramesInFlight(2), oldest(0), inFlight(0), nextFrameTime(0.0),
+        inputTime(0.0), latencySum(0.0), latencyMax(0.0), latencyCount(0) {}
+
+    void destroy()
+    {
+        while (inFlight > 0)
+            retire(true);
+    }
+
+    // frames per second to stay at or below, 0 for no limit
+    void setTargetFrameRate(double framesPerSecond)
+    {
+        targetFrameRate = std::max(0.0, framesPerSecond);
+    }
+
+    void setMaxFramesInFlight(int count)
+    {
+        maxFramesInFlight = std::min(MAX_FRAMES_IN_FLIGHT, std::max(1, count));
+    }
+
+    // waits until the frame limit allows a new frame and the GPU queue has room for it;
+    // sample input after this, not before, so that the wait does not add to the latency
+    void beginFrame()
+    {
+        while (inFlight > 0 && retire(false))
+            ;
+        while (inFlight >= maxFramesInFlight)
+            retire(true);
+
+        if (targetFrameRate <= 0.0)
+            return;
+
+        double period = 1.0 / targetFrameRate;
+        double now = seconds();
+        if (now < nextFrameTime)
+        {
+            // sleep most of the way, the scheduler is not precise enough for the rest
+            double remaining = nextFrameTime - now;
+            if (remaining > 0.002)
+                std::this_thread::sleep_for(std::chrono::duration<double>(remaining - 0.002));
+            while (seconds() < nextFrameTime)
+                std::this_thread::yield();
+            nextFrameTime += period;
+        }
+        else
+        {
+            // too late for the slot, start the schedule over instead of rushing to catch up
+            nextFrameTime = now + period;
+        }
+    }
+
+    // the input that the next submitted frame is drawn with was sampled now
+    void markInput()
+    {
+        inputTime = seconds();
+    }
+
+    // fences the frame that was just swapped
+    void endFrame()
+    {
+        int slot = (oldest + inFlight) % MAX_FRAMES_IN_FLIGHT;
+        frames[slot].fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        frames[slot].inputTime = inputTime;
+        inFlight++;
+    }
+
+    // average and worst input to GPU completion latency since the last call, in milliseconds
+    void takeLatency(double& averageMs, double& maxMs)
+    {
+        averageMs = latencyCount > 0 ? latencySum / latencyCount * 1000.0 : 0.0;
+        maxMs = latencyMax * 1000.0;
+        latencySum = latencyMax = 0.0;
+        latencyCount = 0;
+    }
+
+private:
+    struct InFlightFrame
+    {
+        GLsync fence;
+        double inputTime;
+    };
+
+    double targetFrameRate;
+    int maxFramesInFlight;
+    InFlightFrame frames[MAX_FRAMES_IN_FLIGHT];
+    int oldest, inFlight;
+    double nextFrameTime;
+    double inputTime;
+    double latencySum, latencyMax;
+    int latencyCount;
+
+    static double seconds()
+    {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // releases the oldest frame if the GPU finished it, waiting for that if asked to;
+    // returns whether it was released
+    bool retire(bool wait)
+    {
+        InFlightFrame& frame = frames[oldest];
+        GLuint64 timeout = wait ? 1000000000 : 0;
+        GLenum status = glClientWaitSync(frame.fence, GL_SYNC_FLUSH_COMMANDS_BIT, timeout);
+        if (status == GL_TIMEOUT_EXPIRED && !wait)
+            return false;
+
+        // a failed or timed out wait gives the frame up rather than blocking forever
+        double latency = seconds() - frame.inputTime;
+        latencySum += latency;
+        latencyMax = std::max(latencyMax, latency);
+        latencyCount++;
+
+        glDeleteSync(frame.fence);
+        oldest = (oldest + 1) % MAX_FRAMES_IN_FLIGHT;
+        inFlight--;
+        return true;
+    }
+};
+
+#endif
@@ -0,0 +1,121 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <algorithm>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "jobs.h"
+
+// runs fn(begin, end) over [0, count) split into one contiguous range per thread,
+// as jobs of the shared job system; the calling thread takes the first range
+template <class Fn>
+void parallelFor(size_t count, int threadCount, Fn fn)
+{
+    size_t threads = std::min((size_t)std::max(1, threadCount), count);
+    if (threads <= 1)
+    {
+        fn((size_t)0, count);
+        return;
+    }
+
+    JobSystem& jobs = sharedJobSystem();
+    JobCounter counter;
+    size_t chunk = (count + threads - 1) / threads;
+    for (size_t t = 1; t < threads; ++t)
+    {
+        size_t begin = t * chunk;
+        size_t end = std::min(count, begin + chunk);
+        if (begin < end)
+            jobs.run([begin, end, &fn]() { fn(begin, end); }, &counter);
+    }
+    fn((size_t)0, std::min(count, chunk));
+
+    jobs.wait(counter);
+}
+
+// number of threads worth using for parallel work on this machine
+inline int hardwareThreadCount()
+{
+    return std::max(1, (int)std::thread::hardware_concurrency());
+}
+
+// number of jobs to split count items into so that no job gets fewer than
+// minimumJobSize of them, at most one per hardware thread
+inline int jobCountFor(size_t count, size_t minimumJobSize)
+{
+    return (int)std::min((size_t)hardwareThreadCount(), count / minimumJobSize + 1);
+}
+
+// Runs one task at a time on a thread of its own so that it overlaps whatever
+// the caller does next. The thread is started by the first run() and kept for
+// the following ones.
+class BackgroundWorker
+{
+public:
+    BackgroundWorker() : hasTask(false), isStopping(false) {}
+
+    ~BackgroundWorker()
+    {
+        if (!thread.joinable())
+            return;
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            isStopping = true;
+        }
+        taskReady.notify_one();
+        thread.join();
+    }
+
+    // starts fn on the worker; the previous task must have been waited for
+    void run(std::function<void()> fn)
+    {
+        if (!thread.joinable())
+            thread = std::thread([this]() { loop(); });
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            task = fn;
+            hasTask = true;
+        }
+        taskReady.notify_one();
+    }
+
+    // blocks until the task started by run() has finished
+    void wait()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        taskDone.wait(lock, [this]() { return !hasTask; });
+    }
+
+private:
+    std::mutex mutex;
+    std::condition_variable taskReady, taskDone;
+    std::function<void()> task;
+    bool hasTask, isStopping;
+    std::thread thread;
+
+    void loop()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;)
+        {
+            taskReady.wait(lock, [this]() { return hasTask || isStopping; });
+            if (!hasTask)
+                return;
+
+            lock.unlock();
+            task();
+            lock.lock();
+
+            hasTask = false;
+            taskDone.notify_all();
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,695 @@
+#ifndef PATHTRACER_H
+#define PATHTRACER_H
+
+#include "bvh.h"
+#include "parallel.h"
+#include "rasterizer.h"
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define PATHTRACER_SSE2
+#endif
+
+
+// Random numbers of one path. The sequence only depends on the seed, the pixel
+// and the sample index, so an image does not change with the thread count or
+// the order the tiles are rendered in.
+struct PathRandom
+{
+    uint32_t state;
+
+    PathRandom() : state(0) {}
+    PathRandom(uint32_t seed, uint32_t pixel, uint32_t sample) : state(hash(hash(seed + hash(sample)) + pixel)) {}
+
+    // uniform in [0, 1)
+    float next()
+    {
+        state = hash(state);
+        return (state >> 8) * (1.0f / 16777216.0f);
+    }
+
+    // PCG output permutation (Jarzynski and Olano)
+    static uint32_t hash(uint32_t value)
+    {
+        uint32_t s = value * 747796405u + 2891336453u;
+        uint32_t word = ((s >> ((s >> 28) + 4)) ^ s) * 277803737u;
+        return (word >> 22) ^ word;
+    }
+};
+
+
+// Orthonormal basis around a unit normal, without branches (Duff et al.)
+inline void orthonormalBasis(const glm::vec3& normal, glm::vec3& tangent, glm::vec3& bitangent)
+{
+    float sign = std::copysign(1.0f, normal.z);
+    float a = -1.0f / (sign + normal.z);
+    float b = normal.x * normal.y * a;
+    tangent = glm::vec3(1.0f + sign * normal.x * normal.x * a, sign * b, -sign * normal.x);
+    bitangent = glm::vec3(b, sign + normal.y * normal.y * a, -normal.y);
+}
+
+// Direction around a unit normal with a density proportional to the cosine
+inline glm::vec3 cosineDirection(const glm::vec3& normal, float u1, float u2)
+{
+    glm::vec3 tangent, bitangent;
+    orthonormalBasis(normal, tangent, bitangent);
+
+    float phi = 6.2831853f * u1;
+    float r = std::sqrt(u2);
+    return tangent * (r * std::cos(phi)) + bitangent * (r * std::sin(phi)) + normal * std::sqrt(std::max(0.0f, 1.0f - u2));
+}
+
+// Triangle as the ray tests take it, the first vertex and the two edges from it
+struct RayTriangle
+{
+    glm::vec3 v0, edge1, edge2;
+};
+
+// Moller-Trumbore, both sides; the hit distance between tMin and tMax, or -1, with the
+// barycentric weights of vertices 1 and 2 in u and v
+inline float intersectTriangle(const RayTriangle& triangle, const glm::vec3& origin, const glm::vec3& direction, float tMin, float tMax, float& u, float& v)
+{
+    glm::vec3 p = glm::cross(direction, triangle.edge2);
+    float determinant = glm::dot(triangle.edge1, p);
+    if (std::fabs(determinant) < 1e-12f)
+        return -1.0f;
+
+    float inverseDeterminant = 1.0f / determinant;
+    glm::vec3 s = origin - triangle.v0;
+    u = glm::dot(s, p) * inverseDeterminant;
+    glm::vec3 q = glm::cross(s, triangle.edge1);
+    v = glm::dot(direction, q) * inverseDeterminant;
+    float t = glm::dot(triangle.edge2, q) * inverseDeterminant;
+    if (u < 0.0f || v < 0.0f || u + v > 1.0f || t <= tMin || t >= tMax)
+        return -1.0f;
+    return t;
+}
+
+
+// Reference renderer of the scene: the triangles, textures and lamp of the
+// software rasterizer, path traced for a ground truth to compare the Phong
+// shading of the rasterizers against.
+//
+// The lamp is a point light without falloff, as in the objects shader. Every
+// hit takes its diffuse and specular terms with a shadow ray, and the light
+// bounces diffusely off the textures up to a number of times, which replaces
+// the constant ambient term of the shader. The lamp geometry shows as unlit
+// white to the camera but neither casts shadows nor adds light of its own.
+//
+// The scene triangles go into a SAH BVH in world space. Camera rays are traced
+// in 2x2 pixel packets that traverse the tree together (SSE2), the incoherent
+// shadow and bounce rays one at a time. Tiles of the image are spread over the
+// job system, and every renderSample() adds one sample per pixel to the
+// accumulated image until the scene or the view changes.
+class PathTracer
+{
+public:
+    static const int TILE_SIZE = 16;    // even, tiles are made of 2x2 packets
+
+    PathTracer() : width(0), height(0), tilesX(0), tilesY(0), threadCount(1), maxBounces(3), seed(1), isPacketTracing(true),
+        sampleCount(0), rayTotal(0), viewProjection(1.0f), inverseViewProjection(1.0f) {}
+
+    void resize(int newWidth, int newHeight)
+    {
+        if (newWidth == width && newHeight == height)
+            return;
+
+        width = newWidth;
+        height = newHeight;
+        tilesX = (width + TILE_SIZE - 1) / TILE_SIZE;
+        tilesY = (height + TILE_SIZE - 1) / TILE_SIZE;
+        color.assign((size_t)width * height, 0xFF000000u);
+        accumulation.assign((size_t)width * height, glm::vec3(0.0f));
+        sampleCount = 0;
+    }
+
+    void setThreadCount(int count)
+    {
+        threadCount = std::max(1, count);
+    }
+
+    void setMaterials(const RasterMaterial* newMaterials, int count)
+    {
+        materials.assign(newMaterials, newMaterials + count);
+        reset();
+    }
+
+    // bounces after the first hit, 0 for direct light only
+    void setMaxBounces(int bounces)
+    {
+        maxBounces = std::max(0, bounces);
+        reset();
+    }
+
+    void setSeed(uint32_t newSeed)
+    {
+        seed = newSeed;
+        reset();
+    }
+
+    // camera rays in packets of four, or one at a time like the other rays
+    void setPacketTracing(bool isEnabled)
+    {
+        isPacketTracing = isEnabled;
+    }
+
+    // starts the scene of a frame; viewProjection is the one the rasterizers draw with
+    void beginScene(const RasterLighting& frameLighting, const glm::mat4& frameViewProjection)
+    {
+        nextLighting = frameLighting;
+        nextViewProjection = frameViewProjection;
+        nextDraws.clear();
+    }
+
+    // the vertices and texture are not copied and must stay alive while the scene is in use
+    void addDraw(const RasterDraw& draw)
+    {
+        nextDraws.push_back(draw);
+    }
+
+    // rebuilds the BVH if the draws changed; any change to the scene, the lamp or
+    // the camera starts the accumulation over
+    void endScene()
+    {
+        bool isSameScene = nextDraws.size() == draws.size();
+        for (size_t i = 0; isSameScene && i < draws.size(); ++i)
+            isSameScene = isSameDraw(draws[i], nextDraws[i]);
+
+        if (!isSameScene)
+        {
+            draws.swap(nextDraws);
+            buildScene();
+            reset();
+        }
+
+        bool isSameView = nextViewProjection == viewProjection && nextLighting.lightPosition == lighting.lightPosition &&
+            nextLighting.lightColor == lighting.lightColor && nextLighting.viewPosition == lighting.viewPosition && nextLighting.uvScale == lighting.uvScale;
+        if (!isSameView)
+        {
+            lighting = nextLighting;
+            viewProjection = nextViewProjection;
+            inverseViewProjection = glm::inverse(viewProjection);
+            reset();
+        }
+    }
+
+    // forgets the accumulated samples
+    void reset()
+    {
+        std::fill(accumulation.begin(), accumulation.end(), glm::vec3(0.0f));
+        sampleCount = 0;
+    }
+
+    // adds one sample to every pixel
+    void renderSample()
+    {
+        if (width == 0 || height == 0)
+            return;
+
+        sampleCount++;
+        int tileCount = tilesX * tilesY;
+        int jobCount = std::min(threadCount, tileCount);
+        jobRays.assign(jobCount, 0);
+        parallelFor((size_t)jobCount, jobCount, [this, jobCount, tileCount](size_t begin, size_t end)
+        {
+            for (size_t j = begin; j < end; ++j)
+            {
+                uint64_t rays = 0;
+                for (int tile = (int)j; tile < tileCount; tile += jobCount)
+                    renderTile(tile, rays);
+                jobRays[j] = rays;
+            }
+        });
+
+        rayTotal = 0;
+        for (uint64_t rays : jobRays)
+            rayTotal += rays;
+    }
+
+    int getSampleCount() const
+    {
+        return sampleCount;
+    }
+
+    size_t triangleCount() const
+    {
+        return triangles.size();
+    }
+
+    // camera, shadow and bounce rays of the last renderSample()
+    uint64_t rayCount() const
+    {
+        return rayTotal;
+    }
+
+    // average of the samples as RGBA8, width * height of them, bottom row first
+    const uint32_t* pixels() const
+    {
+        return color.data();
+    }
+
+    // light of the lamp arriving at a surface point, direct and bounced, such that the
+    // diffuse light the surface reflects is its albedo times this; what lightmaps store
+    glm::vec3 irradiance(const glm::vec3& position, const glm::vec3& normal, int samples, PathRandom& random, uint64_t& rays) const
+    {
+        glm::vec3 surface = position + normal * RAY_OFFSET;
+        glm::vec3 result(0.0f);
+
+        glm::vec3 toLight = lighting.lightPosition - position;
+        float lightDistance = glm::length(toLight);
+        glm::vec3 lightDirection = toLight / lightDistance;
+        float diffuse = glm::dot(normal, lightDirection);
+        if (diffuse > 0.0f)
+        {
+            rays++;
+            if (!isOccluded(surface, lightDirection, lightDistance))
+                result += diffuse * lighting.lightColor;
+        }
+
+        // cosine weighted directions, so the average radiance is the bounced light
+        glm::vec3 bounced(0.0f);
+        for (int s = 0; s < samples; ++s)
+            bounced += incomingRadiance(surface, cosineDirection(normal, random.next(), random.next()), random, rays);
+        return result + bounced / (float)std::max(1, samples);
+    }
+
+    // light arriving at a point from a direction after at least one bounce, the lamp
+    // itself left out; for light that is baked on top of the direct lamp light
+    glm::vec3 incomingRadiance(const glm::vec3& origin, const glm::vec3& direction, PathRandom& random, uint64_t& rays) const
+    {
+        Ray ray;
+        ray.origin = origin;
+        ray.direction = direction;
+        ray.tMax = FLT_MAX;
+        rays++;
+        return radiance(ray, intersect(ray), random, rays, 1);
+    }
+
+private:
+    static constexpr float MIN_DISTANCE = 1e-4f;    // hits closer than this are the surface the ray left
+    static constexpr float RAY_OFFSET = 1e-4f;      // secondary rays start this far off the surface
+
+    // attributes interpolated at a hit
+    struct TriangleShading
+    {
+        glm::vec3 normal[3];
+        glm::vec2 uv[3];
+        int draw;
+    };
+
+    struct Ray
+    {
+        glm::vec3 origin;
+        glm::vec3 direction;
+        float tMax;
+    };
+
+    struct Hit
+    {
+        float t, u, v;      // distance and the barycentric weights of vertices 1 and 2
+        int triangle;       // -1 for a miss
+    };
+
+    int width, height;
+    int tilesX, tilesY;
+    int threadCount;
+    int maxBounces;
+    uint32_t seed;
+    bool isPacketTracing;
+    int sampleCount;
+    uint64_t rayTotal;
+    std::vector<uint64_t> jobRays;
+
+    std::vector<RasterMaterial> materials;
+    RasterLighting lighting, nextLighting;
+    glm::mat4 viewProjection, nextViewProjection, inverseViewProjection;
+    std::vector<RasterDraw> draws, nextDraws;
+    std::vector<RayTriangle> triangles;
+    std::vector<TriangleShading> shadings;
+    BVH bvh;
+
+    std::vector<glm::vec3> accumulation;
+    std::vector<uint32_t> color;
+
+    static bool isSameDraw(const RasterDraw& a, const RasterDraw& b)
+    {
+        return a.vertices == b.vertices && a.first == b.first && a.count == b.count && a.texture == b.texture &&
+            a.material == b.material && a.model == b.model;
+    }
+
+    // the draws in world space, and the BVH over them
+    void buildScene()
+    {
+        triangles.clear();
+        shadings.clear();
+        std::vector<AABB> bounds;
+        for (size_t d = 0; d < draws.size(); ++d)
+        {
+            const RasterDraw& draw = draws[d];
+            for (int t = 0; t + 2 < draw.count; t += 3)
+            {
+                const RasterVertex* v = draw.vertices + draw.first + t;
+                glm::vec3 p[3];
+                TriangleShading shading;
+                for (int i = 0; i < 3; ++i)
+                {
+                    p[i] = glm::vec3(draw.model * glm::vec4(v[i].position, 1.0f));
+                    shading.normal[i] = draw.normalMatrix * v[i].normal;
+                    shading.uv[i] = v[i].uv;
+                }
+                shading.draw = (int)d;
+
+                RayTriangle triangle = { p[0], p[1] - p[0], p[2] - p[0] };
+                triangles.push_back(triangle);
+                shadings.push_back(shading);
+
+                AABB box;
+                box.min = glm::min(p[0], glm::min(p[1], p[2]));
+                box.max = glm::max(p[0], glm::max(p[1], p[2]));
+                bounds.push_back(box);
+            }
+        }
+        bvh.build(bounds);
+    }
+
+    // the ray through a point of the image, from the near to the far plane
+    Ray cameraRay(float x, float y) const
+    {
+        glm::vec2 ndc(x / width * 2.0f - 1.0f, y / height * 2.0f - 1.0f);
+        glm::vec4 nearPoint = inverseViewProjection * glm::vec4(ndc.x, ndc.y, -1.0f, 1.0f);
+        glm::vec4 farPoint = inverseViewProjection * glm::vec4(ndc.x, ndc.y, 1.0f, 1.0f);
+        glm::vec3 origin = glm::vec3(nearPoint) / nearPoint.w;
+        glm::vec3 segment = glm::vec3(farPoint) / farPoint.w - origin;
+
+        Ray ray;
+        ray.origin = origin;
+        ray.tMax = glm::length(segment);
+        ray.direction = segment / ray.tMax;
+        return ray;
+    }
+
+    void renderTile(int tile, uint64_t& rays)
+    {
+        int x0 = (tile % tilesX) * TILE_SIZE, y0 = (tile / tilesX) * TILE_SIZE;
+        int x1 = std::min(width, x0 + TILE_SIZE), y1 = std::min(height, y0 + TILE_SIZE);
+
+        for (int y = y0; y < y1; y += 2)
+        {
+            for (int x = x0; x < x1; x += 2)
+            {
+                // lanes outside the image trace the edge pixel and are dropped
+                Ray packet[4];
+                PathRandom random[4];
+                for (int lane = 0; lane < 4; ++lane)
+                {
+                    int px = std::min(x + (lane & 1), width - 1), py = std::min(y + (lane >> 1), height - 1);
+                    random[lane] = PathRandom(seed, (uint32_t)(py * width + px), (uint32_t)sampleCount);
+                    float jitterX = random[lane].next(), jitterY = random[lane].next();
+                    packet[lane] = cameraRay(px + jitterX, py + jitterY);
+                }
+
+                Hit hits[4];
+                if (isPacketTracing)
+                    intersectPacket(packet, hits);
+                else
+                {
+                    for (int lane = 0; lane < 4; ++lane)
+                        hits[lane] = intersect(packet[lane]);
+                }
+
+                for (int lane = 0; lane < 4; ++lane)
+                {
+                    int px = x + (lane & 1), py = y + (lane >> 1);
+                    if (px >= x1 || py >= y1)
+                        continue;
+
+                    rays++;
+                    size_t pixel = (size_t)py * width + px;
+                    accumulation[pixel] += radiance(packet[lane], hits[lane], random[lane], rays);
+
+                    glm::vec3 average = glm::clamp(accumulation[pixel] / (float)sampleCount, 0.0f, 1.0f) * 255.0f + 0.5f;
+                    color[pixel] = (uint32_t)average.r | ((uint32_t)average.g << 8) | ((uint32_t)average.b << 16) | 0xFF000000u;
+                }
+            }
+        }
+    }
+
+    // light arriving along a ray whose first hit is known; firstBounce is 0 for camera rays
+    glm::vec3 radiance(Ray ray, Hit hit, PathRandom& random, uint64_t& rays, int firstBounce = 0) const
+    {
+        glm::vec3 result(0.0f), throughput(1.0f);
+        for (int bounce = firstBounce; hit.triangle >= 0; ++bounce)
+        {
+            const TriangleShading& shading = shadings[hit.triangle];
+            const RasterDraw& draw = draws[shading.draw];
+            if (!draw.texture)
+            {
+                if (bounce == 0)
+                    result += throughput;
+                break;
+            }
+
+            float w = 1.0f - hit.u - hit.v;
+            glm::vec3 position = ray.origin + ray.direction * hit.t;
+            glm::vec3 normal = glm::normalize(shading.normal[0] * w + shading.normal[1] * hit.u + shading.normal[2] * hit.v);
+            glm::vec2 uv = shading.uv[0] * w + shading.uv[1] * hit.u + shading.uv[2] * hit.v;
+
+            // both sides are drawn, light the one the ray arrived at
+            const RayTriangle& triangle = triangles[hit.triangle];
+            glm::vec3 geometricNormal = glm::normalize(glm::cross(triangle.edge1, triangle.edge2));
+            if (glm::dot(geometricNormal, ray.direction) > 0.0f)
+                geometricNormal = -geometricNormal;
+            if (glm::dot(normal, geometricNormal) < 0.0f)
+                normal = -normal;
+            glm::vec3 surface = position + geometricNormal * RAY_OFFSET;
+
+            glm::vec3 albedo = draw.texture->sample(uv * lighting.uvScale);
+            const RasterMaterial& material = materials[std::min((size_t)draw.material, materials.size() - 1)];
+
+            // the diffuse and specular terms of the objects shader, if the lamp is in sight
+            glm::vec3 toLight = lighting.lightPosition - position;
+            float lightDistance = glm::length(toLight);
+            glm::vec3 lightDirection = toLight / lightDistance;
+            float diffuse = glm::dot(normal, lightDirection);
+            if (diffuse > 0.0f && glm::dot(geometricNormal, lightDirection) > 0.0f)
+            {
+                rays++;
+                if (!isOccluded(surface, lightDirection, lightDistance))
+                {
+                    glm::vec3 reflectDir = glm::reflect(-lightDirection, normal);
+                    float specular = material.specularIntensity * std::pow(std::max(glm::dot(-ray.direction, reflectDir), 0.0f), material.highlightSize);
+                    result += throughput * albedo * (diffuse + specular) * lighting.lightColor;
+                }
+            }
+
+            if (bounce >= maxBounces)
+                break;
+
+            // cosine weighted diffuse bounce: the throughput only picks up the albedo
+            throughput *= albedo;
+            if (bounce > 0)
+            {
+                // Russian roulette keeps the estimate unbiased while cutting dim paths short
+                float survival = std::min(0.95f, std::max(throughput.r, std::max(throughput.g, throughput.b)));
+                if (random.next() >= survival)
+                    break;
+                throughput /= survival;
+            }
+
+            ray.origin = surface;
+            ray.direction = cosineDirection(normal, random.next(), random.next());
+            ray.tMax = FLT_MAX;
+            if (glm::dot(ray.direction, geometricNormal) <= 0.0f)
+                break;
+
+            rays++;
+            hit = intersect(ray);
+        }
+        return result;
+    }
+
+    // closest hit of a single ray
+    Hit intersect(const Ray& ray) const
+    {
+        Hit hit;
+        hit.t = ray.tMax;
+        hit.triangle = bvh.raycast(ray.origin, ray.direction, hit.t, [this](int primitive, const glm::vec3& o, const glm::vec3& d, float tMax) {
+            float u, v;
+            return intersectTriangle(triangles[primitive], o, d, MIN_DISTANCE, tMax, u, v);
+        });
+        hit.u = hit.v = 0.0f;
+        if (hit.triangle >= 0)
+            intersectTriangle(triangles[hit.triangle], ray.origin, ray.direction, MIN_DISTANCE, FLT_MAX, hit.u, hit.v);
+        return hit;
+    }
+
+    // whether anything but the lamp is in the way; stops at the first hit found
+    bool isOccluded(const glm::vec3& origin, const glm::vec3& direction, float distance) const
+    {
+        return bvh.raycastAny(origin, direction, distance, [this](int primitive, const glm::vec3& o, const glm::vec3& d, float tMax) {
+            float u, v;
+            return draws[shadings[primitive].draw].texture && intersectTriangle(triangles[primitive], o, d, MIN_DISTANCE, tMax, u, v) >= 0.0f;
+        });
+    }
+
+    // closest hits of four rays; with SSE2 they traverse the BVH together, a node is
+    // entered when any of them hits it, and every triangle is tested against all four
+    void intersectPacket(const Ray* packet, Hit* hits) const
+    {
+#if defined(PATHTRACER_SSE2)
+        for (int lane = 0; lane < 4; ++lane)
+        {
+            hits[lane].triangle = -1;
+            hits[lane].t = packet[lane].tMax;
+            hits[lane].u = hits[lane].v = 0.0f;
+        }
+        if (triangles.empty())
+            return;
+
+        __m128 origin[3], direction[3], inverseDirection[3];
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            origin[axis] = _mm_setr_ps(packet[0].origin[axis], packet[1].origin[axis], packet[2].origin[axis], packet[3].origin[axis]);
+            direction[axis] = _mm_setr_ps(packet[0].direction[axis], packet[1].direction[axis], packet[2].direction[axis], packet[3].direction[axis]);
+            inverseDirection[axis] = _mm_div_ps(_mm_set1_ps(1.0f), direction[axis]);
+        }
+        __m128 tMax = _mm_setr_ps(packet[0].tMax, packet[1].tMax, packet[2].tMax, packet[3].tMax);
+        __m128 hitU = _mm_setzero_ps(), hitV = _mm_setzero_ps();
+        __m128i hitTriangle = _mm_set1_epi32(-1);
+
+        BVHStack stack;
+        __m128 tNear;
+        if (intersectBox4(bvh.nodes[0], origin, inverseDirection, tMax, tNear) != 0)
+            stack.push(0);
+
+        while (!stack.isEmpty())
+        {
+            const BVHNode& node = bvh.nodes[stack.pop()];
+            if (node.isLeaf())
+            {
+                for (int i = 0; i < node.count; ++i)
+                {
+                    int primitive = bvh.primitiveIndices[node.leftFirst + i];
+                    intersectTriangle4(triangles[primitive], primitive, origin, direction, tMax, hitU, hitV, hitTriangle);
+                }
+                continue;
+            }
+
+            // visit the child the rays reach first, its hits may cull the other
+            int first = node.leftFirst, second = node.leftFirst + 1;
+            __m128 nearFirst, nearSecond;
+            int maskFirst = intersectBox4(bvh.nodes[first], origin, inverseDirection, tMax, nearFirst);
+            int maskSecond = intersectBox4(bvh.nodes[second], origin, inverseDirection, tMax, nearSecond);
+            if (maskFirst != 0 && maskSecond != 0 && nearest(nearSecond, maskSecond) < nearest(nearFirst, maskFirst))
+            {
+                std::swap(first, second);
+                std::swap(maskFirst, maskSecond);
+            }
+            if (maskSecond != 0)
+                stack.push(second);
+            if (maskFirst != 0)
+                stack.push(first);
+        }
+
+        float t[4], u[4], v[4];
+        int triangle[4];
+        _mm_storeu_ps(t, tMax);
+        _mm_storeu_ps(u, hitU);
+        _mm_storeu_ps(v, hitV);
+        _mm_storeu_si128((__m128i*)triangle, hitTriangle);
+        for (int lane = 0; lane < 4; ++lane)
+        {
+            hits[lane].triangle = triangle[lane];
+            if (triangle[lane] >= 0)
+            {
+                hits[lane].t = t[lane];
+                hits[lane].u = u[lane];
+                hits[lane].v = v[lane];
+            }
+        }
+#else
+        for (int lane = 0; lane < 4; ++lane)
+            hits[lane] = intersect(packet[lane]);
+#endif
+    }
+
+#if defined(PATHTRACER_SSE2)
+    // slab test of four rays against a node; returns the mask of the rays that hit it
+    static int intersectBox4(const BVHNode& node, const __m128* origin, const __m128* inverseDirection, __m128 tMax, __m128& tNear)
+    {
+        __m128 tFar = tMax;
+        tNear = _mm_setzero_ps();
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.boundsMin[axis]), origin[axis]), inverseDirection[axis]);
+            __m128 t2 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.boundsMax[axis]), origin[axis]), inverseDirection[axis]);
+            tNear = _mm_max_ps(tNear, _mm_min_ps(t1, t2));
+            tFar = _mm_min_ps(tFar, _mm_max_ps(t1, t2));
+        }
+        return _mm_movemask_ps(_mm_cmple_ps(tNear, tFar));
+    }
+
+    // smallest entry distance of the lanes in the mask
+    static float nearest(__m128 tNear, int mask)
+    {
+        float t[4];
+        _mm_storeu_ps(t, tNear);
+        float result = FLT_MAX;
+        for (int lane = 0; lane < 4; ++lane)
+        {
+            if (mask & (1 << lane))
+                result = std::min(result, t[lane]);
+        }
+        return result;
+    }
+
+    // intersectTriangle for four rays, keeping the closer hits
+    static void intersectTriangle4(const RayTriangle& triangle, int index, const __m128* origin, const __m128* direction,
+        __m128& tMax, __m128& hitU, __m128& hitV, __m128i& hitTriangle)
+    {
+        __m128 e1x = _mm_set1_ps(triangle.edge1.x), e1y = _mm_set1_ps(triangle.edge1.y), e1z = _mm_set1_ps(triangle.edge1.z);
+        __m128 e2x = _mm_set1_ps(triangle.edge2.x), e2y = _mm_set1_ps(triangle.edge2.y), e2z = _mm_set1_ps(triangle.edge2.z);
+
+        __m128 px = _mm_sub_ps(_mm_mul_ps(direction[1], e2z), _mm_mul_ps(direction[2], e2y));
+        __m128 py = _mm_sub_ps(_mm_mul_ps(direction[2], e2x), _mm_mul_ps(direction[0], e2z));
+        __m128 pz = _mm_sub_ps(_mm_mul_ps(direction[0], e2y), _mm_mul_ps(direction[1], e2x));
+        __m128 determinant = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+        __m128 inverseDeterminant = _mm_div_ps(_mm_set1_ps(1.0f), determinant);
+
+        __m128 sx = _mm_sub_ps(origin[0], _mm_set1_ps(triangle.v0.x));
+        __m128 sy = _mm_sub_ps(origin[1], _mm_set1_ps(triangle.v0.y));
+        __m128 sz = _mm_sub_ps(origin[2], _mm_set1_ps(triangle.v0.z));
+        __m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, px), _mm_mul_ps(sy, py)), _mm_mul_ps(sz, pz)), inverseDeterminant);
+
+        __m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(sz, e1y));
+        __m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(sx, e1z));
+        __m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(sy, e1x));
+        __m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(direction[0], qx), _mm_mul_ps(direction[1], qy)), _mm_mul_ps(direction[2], qz)), inverseDeterminant);
+        __m128 t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), inverseDeterminant);
+
+        __m128 absDeterminant = _mm_andnot_ps(_mm_set1_ps(-0.0f), determinant);
+        __m128 zero = _mm_setzero_ps();
+        __m128 isHit = _mm_and_ps(_mm_cmpge_ps(absDeterminant, _mm_set1_ps(1e-12f)), _mm_and_ps(_mm_cmpge_ps(u, zero), _mm_cmpge_ps(v, zero)));
+        isHit = _mm_and_ps(isHit, _mm_cmple_ps(_mm_add_ps(u, v), _mm_set1_ps(1.0f)));
+        isHit = _mm_and_ps(isHit, _mm_and_ps(_mm_cmpgt_ps(t, _mm_set1_ps(MIN_DISTANCE)), _mm_cmplt_ps(t, tMax)));
+        if (_mm_movemask_ps(isHit) == 0)
+            return;
+
+        tMax = _mm_or_ps(_mm_and_ps(isHit, t), _mm_andnot_ps(isHit, tMax));
+        hitU = _mm_or_ps(_mm_and_ps(isHit, u), _mm_andnot_ps(isHit, hitU));
+        hitV = _mm_or_ps(_mm_and_ps(isHit, v), _mm_andnot_ps(isHit, hitV));
+        __m128i mask = _mm_castps_si128(isHit);
+        hitTriangle = _mm_or_si128(_mm_and_si128(mask, _mm_set1_epi32(index)), _mm_andnot_si128(mask, hitTriangle));
+    }
+#endif
+};
+
+#endif
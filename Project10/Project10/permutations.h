@@ -0,0 +1,151 @@
+#ifndef PERMUTATIONS_H
+#define PERMUTATIONS_H
+
+#include <GL/glew.h>
+
+#include "hash.h"
+#include "programbuilder.h"
+#include "programpipeline.h"
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+
+// What a shader variant computes; the ones a draw does not need are compiled out
+enum ShaderFeature
+{
+    FEATURE_TEXTURE = 1 << 0,       // samples the texture of the object, white without
+    FEATURE_SPECULAR = 1 << 1,      // highlights of the lamp and the point lights
+    FEATURE_LIGHTMAP = 1 << 2,      // baked lamp light where the instance has it
+    FEATURE_SHADOWS = 1 << 3,       // cascaded shadow maps of the lamp
+    FEATURE_POINT_LIGHTS = 1 << 4,  // the clustered point lights
+    FEATURE_PROBES = 1 << 5,        // irradiance probes for the ambient light
+};
+
+// Variants of one program, one per set of ShaderFeature bits.
+//
+// Every variant is the same source with a #define per feature inserted after
+// the #version line, true or false, which the shader tests in plain ifs; the
+// compiler folds those and drops the code of the features a variant leaves
+// out. The draw features (texture, specular) come from the object and its
+// material, the frame features from what is switched on, and a draw uses the
+// variant of both. Variants are built through the ProgramBuilder, ahead of time
+// with prepare() or on first use, and pipeline() returns NULL until one is ready.
+//
+// The stages are separable programs put together in a ProgramPipeline. The
+// vertex stage only depends on a few features, and the variants that differ
+// in the others share its program, which is compiled and linked once.
+//
+// variantId() is a hash of the defines, the same in every run and build, for
+// render queues to group the draws of a variant by.
+class ShaderPermutations
+{
+public:
+    static const int FEATURE_COUNT = 6;
+
+    ShaderPermutations() : builder(NULL), vertexSource(NULL), fragmentSource(NULL), vertexFeatures(0) {}
+
+    // ready sets up every stage program once it is built, as for a single program;
+    // vertexFeaturesMask holds the features the vertex stage tests
+    void setup(ProgramBuilder* programBuilder, const char* vertex, const char* fragment, uint32_t vertexFeaturesMask,
+        const ProgramBuilder::ReadyFunction& ready)
+    {
+        builder = programBuilder;
+        vertexSource = vertex;
+        fragmentSource = fragment;
+        vertexFeatures = vertexFeaturesMask;
+        readyFunction = ready;
+    }
+
+    void destroy()
+    {
+        for (auto& pipeline : pipelines)
+            pipeline.second.destroy();
+        for (auto& variant : vertexVariants)
+            glDeleteProgram(variant.second);
+        for (auto& variant : fragmentVariants)
+            glDeleteProgram(variant.second);
+        pipelines.clear();
+        vertexVariants.clear();
+        fragmentVariants.clear();
+    }
+
+    // starts building the stages of the variant unless they are built or building
+    void prepare(uint32_t features)
+    {
+        vertexStage(features);
+        if (fragmentVariants.count(features))
+            return;
+
+        // the builder keeps a pointer to the program; elements of an unordered_map do not move
+        GLuint& program = fragmentVariants[features];
+        builder->addStage(GL_FRAGMENT_SHADER, fragmentSource, program, readyFunction, defines(features).c_str());
+    }
+
+    // rebuilds every stage from new sources; each keeps its old program until the new one is ready
+    void rebuild(const char* vertex, const char* fragment)
+    {
+        vertexSource = vertex;
+        fragmentSource = fragment;
+        for (auto& variant : vertexVariants)
+            builder->addStage(GL_VERTEX_SHADER, vertexSource, variant.second, readyFunction, defines(variant.first).c_str());
+        for (auto& variant : fragmentVariants)
+            builder->addStage(GL_FRAGMENT_SHADER, fragmentSource, variant.second, readyFunction, defines(variant.first).c_str());
+    }
+
+    // the pipeline of a variant, NULL while it builds; one not asked for before starts building
+    const ProgramPipeline* pipeline(uint32_t features)
+    {
+        prepare(features);
+        ProgramPipeline& variantPipeline = pipelines[features];
+        bool isReady = variantPipeline.update(vertexVariants[features & vertexFeatures], fragmentVariants[features], builder->rebuildCount());
+        return isReady ? &variantPipeline : NULL;
+    }
+
+    // the vertex stage program of the features, 0 while it builds, for pipelines of other
+    // fragment stages; one not asked for before starts building
+    GLuint vertexStage(uint32_t features)
+    {
+        uint32_t vertexKey = features & vertexFeatures;
+        auto found = vertexVariants.find(vertexKey);
+        if (found != vertexVariants.end())
+            return found->second;
+
+        GLuint& program = vertexVariants[vertexKey];
+        builder->addStage(GL_VERTEX_SHADER, vertexSource, program, readyFunction, defines(vertexKey).c_str());
+        return program;
+    }
+
+    size_t variantCount() const
+    {
+        return fragmentVariants.size();
+    }
+
+    // the lines inserted after #version
+    static std::string defines(uint32_t features)
+    {
+        static const char* names[FEATURE_COUNT] = { "HAS_TEXTURE", "HAS_SPECULAR", "HAS_LIGHTMAP", "HAS_SHADOWS", "HAS_POINT_LIGHTS", "HAS_PROBES" };
+        std::string text;
+        for (int i = 0; i < FEATURE_COUNT; ++i)
+            text += std::string("#define ") + names[i] + ((features & (1u << i)) ? " true\n" : " false\n");
+        return text;
+    }
+
+    static uint64_t variantId(uint32_t features)
+    {
+        std::string text = defines(features);
+        return hashBytes(text.data(), text.size());
+    }
+
+private:
+    ProgramBuilder* builder;
+    const char* vertexSource;
+    const char* fragmentSource;
+    uint32_t vertexFeatures;
+    ProgramBuilder::ReadyFunction readyFunction;
+    std::unordered_map<uint32_t, GLuint> vertexVariants;
+    std::unordered_map<uint32_t, GLuint> fragmentVariants;
+    std::unordered_map<uint32_t, ProgramPipeline> pipelines;
+};
+
+#endif
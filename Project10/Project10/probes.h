@@ -0,0 +1,197 @@
+#ifndef PROBES_H
+#define PROBES_H
+
+#include <GL/glew.h>
+
+#include "culling.h"
+#include "parallel.h"
+#include "pathtracer.h"
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+// Grid of irradiance probes over the scene for the ambient light.
+//
+// Every probe holds the light arriving at its position from all directions as
+// order 2 spherical harmonics: 9 RGB coefficients, convolved with the cosine
+// lobe and divided by pi so that evaluating them for a normal gives what the
+// shader multiplies the texture color with. They are baked by tracing rays
+// into the scene on the job system and stored in one 3D texture, the 7 RGBA
+// texels of a probe side by side along x in 7 blocks of the grid width, so the
+// shader gets the 8 probes around a point blended by the texture filtering.
+//
+// A grid is placed over the scene, and placed again when the scene changes,
+// and baked in full. After that the probes are marked dirty when the light
+// moves and are rebaked a few per frame within a budget, so a change spreads
+// over frames instead of stalling one.
+class IrradianceProbes
+{
+public:
+    static const int TEXELS_PER_PROBE = 7;      // 27 floats in RGBA texels
+    static const int MAX_PROBES_PER_AXIS = 32;
+    static const int RAYS_PER_PROBE = 256;
+
+    IrradianceProbes() : texture(0), size(0), spacing(1.0f), gridMin(0.0f), seed(1), nextProbe(0) {}
+
+    void setup()
+    {
+        glGenTextures(1, &texture);
+    }
+
+    void destroy()
+    {
+        glDeleteTextures(1, &texture);
+        texture = 0;
+    }
+
+    // lays out probes over the bounds at most maximumSpacing apart, fewer if
+    // that needs more than MAX_PROBES_PER_AXIS; every probe starts out dirty
+    void place(const AABB& bounds, float maximumSpacing)
+    {
+        glm::vec3 extent = glm::max(bounds.max - bounds.min, glm::vec3(0.0f));
+        spacing = std::max(maximumSpacing, std::max(extent.x, std::max(extent.y, extent.z)) / (MAX_PROBES_PER_AXIS - 1));
+        for (int axis = 0; axis < 3; ++axis)
+            size[axis] = std::max(2, (int)std::ceil(extent[axis] / spacing) + 1);
+
+        // centered on the bounds, which the grid covers
+        glm::vec3 gridExtent((size.x - 1) * spacing, (size.y - 1) * spacing, (size.z - 1) * spacing);
+        gridMin = (bounds.min + bounds.max - gridExtent) * 0.5f;
+
+        texels.assign(probeCount() * TEXELS_PER_PROBE, glm::vec4(0.0f));
+        dirty.assign(probeCount(), 1);
+        nextProbe = 0;
+
+        glBindTexture(GL_TEXTURE_3D, texture);
+        glTexImage3D(GL_TEXTURE_3D, 0, GL_RGBA16F, size.x * TEXELS_PER_PROBE, size.y, size.z, 0, GL_RGBA, GL_FLOAT, texels.data());
+        glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+        glBindTexture(GL_TEXTURE_3D, 0);
+    }
+
+    void markAllDirty()
+    {
+        std::fill(dirty.begin(), dirty.end(), (unsigned char)1);
+    }
+
+    // rebakes up to budget dirty probes, picking up where the last update stopped,
+    // and uploads them; the tracer must hold the scene and the lamp
+    int update(const PathTracer& tracer, int budget, int threadCount)
+    {
+        std::vector<size_t> baked;
+        for (size_t n = 0; n < dirty.size() && (int)baked.size() < budget; ++n)
+        {
+            size_t probe = (nextProbe + n) % dirty.size();
+            if (dirty[probe])
+                baked.push_back(probe);
+        }
+        if (baked.empty())
+            return 0;
+        nextProbe = (baked.back() + 1) % dirty.size();
+
+        parallelFor(baked.size(), std::min(threadCount, (int)baked.size()), [&](size_t begin, size_t end)
+        {
+            for (size_t i = begin; i < end; ++i)
+                bake(tracer, baked[i]);
+        });
+        for (size_t probe : baked)
+            dirty[probe] = 0;
+
+        glBindTexture(GL_TEXTURE_3D, texture);
+        glTexSubImage3D(GL_TEXTURE_3D, 0, 0, 0, 0, size.x * TEXELS_PER_PROBE, size.y, size.z, GL_RGBA, GL_FLOAT, texels.data());
+        glBindTexture(GL_TEXTURE_3D, 0);
+        return (int)baked.size();
+    }
+
+    size_t probeCount() const
+    {
+        return (size_t)size.x * size.y * size.z;
+    }
+
+    size_t dirtyCount() const
+    {
+        return (size_t)std::count(dirty.begin(), dirty.end(), (unsigned char)1);
+    }
+
+    void bind(GLuint unit) const
+    {
+        glActiveTexture(GL_TEXTURE0 + unit);
+        glBindTexture(GL_TEXTURE_3D, texture);
+        glActiveTexture(GL_TEXTURE0);
+    }
+
+    // position of the first probe, distance between probes and probes per axis, for the shader
+    glm::vec3 getGridMin() const { return gridMin; }
+    float getSpacing() const { return spacing; }
+    glm::ivec3 getSize() const { return size; }
+
+private:
+    GLuint texture;
+    glm::ivec3 size;
+    float spacing;
+    glm::vec3 gridMin;
+    uint32_t seed;
+    size_t nextProbe;
+    std::vector<glm::vec4> texels;
+    std::vector<unsigned char> dirty;
+
+    // uniform directions over the sphere, projected onto the basis
+    void bake(const PathTracer& tracer, size_t probe)
+    {
+        glm::ivec3 cell((int)(probe % size.x), (int)(probe / size.x % size.y), (int)(probe / ((size_t)size.x * size.y)));
+        glm::vec3 position = gridMin + glm::vec3(cell) * spacing;
+
+        glm::vec3 coefficients[9] = {};
+        PathRandom random(seed, (uint32_t)probe, 0);
+        uint64_t rays = 0;
+        for (int r = 0; r < RAYS_PER_PROBE; ++r)
+        {
+            float z = 1.0f - 2.0f * random.next();
+            float phi = 6.2831853f * random.next();
+            float radius = std::sqrt(std::max(0.0f, 1.0f - z * z));
+            glm::vec3 direction(radius * std::cos(phi), radius * std::sin(phi), z);
+
+            glm::vec3 light = tracer.incomingRadiance(position, direction, random, rays);
+            float basis[9];
+            evaluateBasis(direction, basis);
+            for (int i = 0; i < 9; ++i)
+                coefficients[i] += light * basis[i];
+        }
+
+        // Monte Carlo weight 4 pi / rays, then the cosine lobe over pi per band
+        const float band[9] = { 1.0f, 2.0f / 3.0f, 2.0f / 3.0f, 2.0f / 3.0f, 0.25f, 0.25f, 0.25f, 0.25f, 0.25f };
+        float weight = 4.0f * 3.14159265f / RAYS_PER_PROBE;
+        float packed[TEXELS_PER_PROBE * 4] = {};
+        for (int i = 0; i < 9; ++i)
+        {
+            for (int c = 0; c < 3; ++c)
+                packed[i * 3 + c] = coefficients[i][c] * weight * band[i];
+        }
+
+        size_t row = (size_t)cell.z * size.y + cell.y;
+        for (int t = 0; t < TEXELS_PER_PROBE; ++t)
+            texels[row * size.x * TEXELS_PER_PROBE + (size_t)t * size.x + cell.x] = glm::vec4(packed[t * 4], packed[t * 4 + 1], packed[t * 4 + 2], packed[t * 4 + 3]);
+    }
+
+    // real spherical harmonics up to order 2
+    static void evaluateBasis(const glm::vec3& n, float basis[9])
+    {
+        basis[0] = 0.282095f;
+        basis[1] = 0.488603f * n.y;
+        basis[2] = 0.488603f * n.z;
+        basis[3] = 0.488603f * n.x;
+        basis[4] = 1.092548f * n.x * n.y;
+        basis[5] = 1.092548f * n.y * n.z;
+        basis[6] = 0.315392f * (3.0f * n.z * n.z - 1.0f);
+        basis[7] = 1.092548f * n.x * n.z;
+        basis[8] = 0.546274f * (n.x * n.x - n.y * n.y);
+    }
+};
+
+#endif
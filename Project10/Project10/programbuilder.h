@@ -0,0 +1,428 @@
+#ifndef PROGRAMBUILDER_H
+#define PROGRAMBUILDER_H
+
+#include <GL/glew.h>
+
+#include "programcache.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Shader programs built in the background while the first frames are drawn.
+//
+// Every program is submitted up front and handed to its target GLuint once it
+// has linked; until then the target stays 0 and the renderer draws with what
+// it has. A target that already holds a program is a rebuild: it keeps the old
+// program until the new one links, and for good if it does not. So is every
+// build submitted after endStartup(), whose errors only go to the rebuild log.
+// A build submitted for a target that has one pending supersedes it, and only
+// the newest one is handed out, in whatever order the builds finish.
+//
+// Drivers with KHR_parallel_shader_compile (or the ARB version) compile on
+// threads of their own: the compile and link calls return at once and
+// GL_COMPLETION_STATUS_KHR is polled every frame. Other drivers get a
+// worker thread with a context that shares objects with the main one, which
+// builds the programs one after another and finishes each with glFinish so the
+// main context sees it whole. Without such a context the programs are built on
+// the spot, as before.
+//
+// Defines given with a program go right after the #version line of every stage.
+// addStage builds a separable program of a single stage, for a ProgramPipeline.
+//
+// Programs found in the ProgramCache skip all of this, and the ones built from
+// source are stored in it once they are ready. The driver does not say when a
+// parallel compile finished, only that it has by the time it is polled, so the
+// build time stored with those is an upper bound.
+class ProgramBuilder
+{
+public:
+    enum Mode { BLOCKING, PARALLEL_COMPILE, WORKER_THREAD };
+
+    // called on the main thread with the linked program right before its target is set
+    typedef std::function<void(GLuint)> ReadyFunction;
+
+    // binds the shared context on the calling thread, or unbinds it with false
+    typedef std::function<void(bool)> BindContextFunction;
+
+    ProgramBuilder() : mode(BLOCKING), cache(NULL), rebuilds(0), submitCount(0), isStartupOver(false), isStopping(false) {}
+
+    ~ProgramBuilder()
+    {
+        destroy();
+    }
+
+    static bool isParallelCompileSupported()
+    {
+        return GLEW_KHR_parallel_shader_compile || GLEW_ARB_parallel_shader_compile;
+    }
+
+    // WORKER_THREAD needs bindContext
+    void setup(ProgramCache* programCache, Mode buildMode, const BindContextFunction& bindContext = BindContextFunction())
+    {
+        cache = programCache;
+        mode = buildMode;
+        if (mode == PARALLEL_COMPILE)
+        {
+            // as many driver threads as it likes
+            if (GLEW_KHR_parallel_shader_compile)
+                glMaxShaderCompilerThreadsKHR(0xFFFFFFFF);
+            else
+                glMaxShaderCompilerThreadsARB(0xFFFFFFFF);
+        }
+        else if (mode == WORKER_THREAD)
+        {
+            bindWorkerContext = bindContext;
+            worker = std::thread([this]() { loop(); });
+        }
+    }
+
+    void destroy()
+    {
+        if (!worker.joinable())
+            return;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            isStopping = true;
+        }
+        wake.notify_all();
+        worker.join();
+    }
+
+    Mode getMode() const
+    {
+        return mode;
+    }
+
+    void add(const char* vertexSource, const char* fragmentSource, GLuint& target, const ReadyFunction& ready = ReadyFunction(),
+        const char* defines = "")
+    {
+        const char* sources[] = { vertexSource, fragmentSource };
+        const GLenum types[] = { GL_VERTEX_SHADER, GL_FRAGMENT_SHADER };
+        submit(sources, types, 2, defines, false, target, ready);
+    }
+
+    // a separable program of one stage
+    void addStage(GLenum type, const char* source, GLuint& target, const ReadyFunction& ready = ReadyFunction(), const char* defines = "")
+    {
+        submit(&source, &type, 1, defines, true, target, ready);
+    }
+
+    void addCompute(const char* computeSource, GLuint& target, const ReadyFunction& ready = ReadyFunction(), const char* defines = "")
+    {
+        const GLenum type = GL_COMPUTE_SHADER;
+        submit(&computeSource, &type, 1, defines, false, target, ready);
+    }
+
+    // hands out the programs that are done; false if one of them failed, see errors()
+    bool poll()
+    {
+        size_t kept = 0;
+        for (size_t i = 0; i < builds.size(); ++i)
+        {
+            Build& build = *builds[i];
+            if (!isDone(build))
+            {
+                if (kept != i)
+                    builds[kept] = std::move(builds[i]);
+                kept++;
+                continue;
+            }
+            if (mode == PARALLEL_COMPILE)
+            {
+                build.buildMs = now() - build.startMs;
+                check(build);
+            }
+            deliver(build);
+        }
+        builds.resize(kept);
+        return errorLog.empty();
+    }
+
+    // waits for every program; false if one of them failed
+    bool finish()
+    {
+        for (std::unique_ptr<Build>& build : builds)
+        {
+            if (mode == WORKER_THREAD)
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                done.wait(lock, [&]() { return build->isDone; });
+            }
+            else if (mode == PARALLEL_COMPILE)
+            {
+                // the status queries wait for the driver
+                check(*build);
+                build->buildMs = now() - build->startMs;
+            }
+            deliver(*build);
+        }
+        builds.clear();
+        return errorLog.empty();
+    }
+
+    bool isFinished() const
+    {
+        return builds.empty();
+    }
+
+    size_t pendingCount() const
+    {
+        return builds.size();
+    }
+
+    // compile and link logs of the programs that failed
+    const std::string& errors() const
+    {
+        return errorLog;
+    }
+
+    // the programs submitted so far were the ones a failure of which is fatal, see errors()
+    void endStartup()
+    {
+        isStartupOver = true;
+    }
+
+    // rebuilt programs handed out so far; each one deleted the program it replaced
+    uint32_t rebuildCount() const
+    {
+        return rebuilds;
+    }
+
+    // logs of the rebuilds that failed since the last call, which kept their old programs
+    std::string takeRebuildErrors()
+    {
+        std::string log;
+        log.swap(rebuildErrorLog);
+        return log;
+    }
+
+private:
+    struct Build
+    {
+        std::string sources[2];     // with the defines
+        GLenum types[2];
+        int stageCount;
+        uint64_t key;
+        GLuint* target;
+        ReadyFunction ready;
+        GLuint program;
+        GLuint shaders[2];
+        bool isDone;        // worker thread builds, under the mutex
+        bool isLinked;
+        bool isCached;
+        bool isRebuild;
+        bool isSeparable;
+        uint64_t submission;    // number of the build among all submitted
+        double startMs, buildMs;
+        std::string log;
+    };
+
+    Mode mode;
+    ProgramCache* cache;
+    std::vector<std::unique_ptr<Build>> builds;
+    std::string errorLog;
+    std::string rebuildErrorLog;
+    uint32_t rebuilds;
+    uint64_t submitCount;
+    std::unordered_map<GLuint*, uint64_t> newestBuilds;     // submission of the build each target waits for
+    bool isStartupOver;
+
+    std::thread worker;
+    BindContextFunction bindWorkerContext;
+    std::deque<Build*> queue;
+    std::mutex mutex;
+    std::condition_variable wake, done;
+    bool isStopping;
+
+    void submit(const char* const* sources, const GLenum* types, int stageCount, const char* defines, bool isSeparable,
+        GLuint& target, const ReadyFunction& ready)
+    {
+        std::unique_ptr<Build> build(new Build());
+        for (int i = 0; i < stageCount; ++i)
+        {
+            build->sources[i] = sources[i];
+            size_t versionEnd = build->sources[i].find('\n');
+            build->sources[i].insert(versionEnd == std::string::npos ? build->sources[i].size() : versionEnd + 1, defines);
+            build->types[i] = types[i];
+        }
+        build->stageCount = stageCount;
+        build->key = cache->key(sources, stageCount, defines, isSeparable);
+        build->target = &target;
+        build->ready = ready;
+        build->isDone = false;
+        build->isLinked = false;
+        build->isCached = false;
+        build->isRebuild = target != 0 || isStartupOver;
+        build->isSeparable = isSeparable;
+        build->submission = ++submitCount;
+        newestBuilds[&target] = build->submission;
+        build->startMs = now();
+        build->buildMs = 0.0;
+
+        build->program = cache->restore(build->key, isSeparable);
+        if (build->program != 0)
+        {
+            build->isLinked = true;
+            build->isCached = true;
+            deliver(*build);
+            return;
+        }
+
+        if (mode == BLOCKING)
+        {
+            start(*build);
+            check(*build);
+            build->buildMs = now() - build->startMs;
+            deliver(*build);
+            return;
+        }
+
+        if (mode == PARALLEL_COMPILE)
+            start(*build);
+        else
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            queue.push_back(build.get());
+        }
+        wake.notify_one();
+        builds.push_back(std::move(build));
+    }
+
+    // compile and link calls, which return at once with parallel compiling
+    void start(Build& build)
+    {
+        build.program = glCreateProgram();
+        cache->prepare(build.program);
+        if (build.isSeparable)
+            glProgramParameteri(build.program, GL_PROGRAM_SEPARABLE, GL_TRUE);
+        for (int i = 0; i < build.stageCount; ++i)
+        {
+            const char* source = build.sources[i].c_str();
+            build.shaders[i] = glCreateShader(build.types[i]);
+            glShaderSource(build.shaders[i], 1, &source, NULL);
+            glCompileShader(build.shaders[i]);
+            glAttachShader(build.program, build.shaders[i]);
+        }
+        glLinkProgram(build.program);
+    }
+
+    // status and logs of a started build, which wait for it to complete
+    void check(Build& build)
+    {
+        char infoLog[512];
+        int success = 0;
+        for (int i = 0; i < build.stageCount; ++i)
+        {
+            glGetShaderiv(build.shaders[i], GL_COMPILE_STATUS, &success);
+            if (!success)
+            {
+                glGetShaderInfoLog(build.shaders[i], sizeof(infoLog), NULL, infoLog);
+                build.log += std::string("ERROR::SHADER::") + stageName(build.types[i]) + "::COMPILATION_FAILED\n" + infoLog + "\n";
+            }
+            glDetachShader(build.program, build.shaders[i]);
+            glDeleteShader(build.shaders[i]);
+        }
+
+        glGetProgramiv(build.program, GL_LINK_STATUS, &success);
+        build.isLinked = success != 0;
+        if (!build.isLinked && build.log.empty())
+        {
+            glGetProgramInfoLog(build.program, sizeof(infoLog), NULL, infoLog);
+            build.log += std::string("ERROR::SHADER::PROGRAM::LINKING_FAILED\n") + infoLog + "\n";
+        }
+    }
+
+    bool isDone(Build& build)
+    {
+        if (mode == WORKER_THREAD)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            return build.isDone;
+        }
+
+        GLint isComplete = 0;
+        glGetProgramiv(build.program, GL_COMPLETION_STATUS_KHR, &isComplete);
+        return isComplete != 0;
+    }
+
+    // main thread: the program to its target, or its log to the errors; this is the
+    // frame boundary at which a rebuilt program takes the place of the old one
+    void deliver(Build& build)
+    {
+        // a newer build of the target was submitted, or has already been handed out
+        auto newest = newestBuilds.find(build.target);
+        if (newest == newestBuilds.end() || newest->second != build.submission)
+        {
+            glDeleteProgram(build.program);
+            return;
+        }
+        newestBuilds.erase(newest);
+
+        if (!build.isLinked)
+        {
+            (build.isRebuild ? rebuildErrorLog : errorLog) += build.log;
+            glDeleteProgram(build.program);
+            return;
+        }
+
+        if (!build.isCached)
+            cache->store(build.key, build.program, build.buildMs);
+        if (build.ready)
+            build.ready(build.program);
+        if (*build.target != 0)
+        {
+            glDeleteProgram(*build.target);
+            rebuilds++;
+        }
+        *build.target = build.program;
+    }
+
+    void loop()
+    {
+        bindWorkerContext(true);
+        for (;;)
+        {
+            Build* build;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [this]() { return isStopping || !queue.empty(); });
+                if (queue.empty())
+                    break;
+                build = queue.front();
+                queue.pop_front();
+            }
+
+            double startMs = now();
+            start(*build);
+            check(*build);
+            glFinish();
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                build->buildMs = now() - startMs;
+                build->isDone = true;
+            }
+            done.notify_all();
+        }
+        bindWorkerContext(false);
+    }
+
+    static const char* stageName(GLenum type)
+    {
+        return type == GL_VERTEX_SHADER ? "VERTEX" : type == GL_FRAGMENT_SHADER ? "FRAGMENT" : "COMPUTE";
+    }
+
+    static double now()
+    {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+};
+
+#endif
@@ -0,0 +1,241 @@
+#ifndef PROGRAMCACHE_H
+#define PROGRAMCACHE_H
+
+#include <GL/glew.h>
+
+#include "hash.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <unordered_map>
+#include <vector>
+
+// Linked shader programs kept on disk between runs.
+//
+// A program is found by a key hashed from the sources of its stages, the
+// defines they are built with and the vendor, renderer and version strings of
+// the driver, so a new driver or an edited shader simply misses. A hit hands
+// the stored glGetProgramBinary blob back to glProgramBinary; the driver may
+// still refuse it (the format is its own and can change with any update), and
+// then the caller compiles from source as before and stores the new binary.
+//
+// The time every program took to build from source is stored with it, which
+// gives an estimate of the startup time a hit saves.
+class ProgramCache
+{
+public:
+    ProgramCache() : isEnabled(false), isChanged(false), driverKey(0), hitCount(0), missCount(0), compileMs(0.0), savedMs(0.0) {}
+
+    // call with the context current; a driver without binary formats leaves the cache off
+    void setup()
+    {
+        GLint formatCount = 0;
+        glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formatCount);
+        isEnabled = formatCount > 0;
+
+        const GLenum names[] = { GL_VENDOR, GL_RENDERER, GL_VERSION };
+        driverKey = hashBytes(NULL, 0);
+        for (GLenum name : names)
+        {
+            const char* text = (const char*)glGetString(name);
+            if (text)
+                driverKey = hashBytes(text, strlen(text) + 1, driverKey);
+        }
+    }
+
+    void disable()
+    {
+        isEnabled = false;
+    }
+
+    bool enabled() const
+    {
+        return isEnabled;
+    }
+
+    // the binaries a previous run stored; false if there are none
+    bool load(const char* filename)
+    {
+        entries.clear();
+        if (!isEnabled)
+            return false;
+
+        std::ifstream file(filename, std::ios::binary);
+        char fileMagic[MAGIC_SIZE];
+        uint32_t count = 0;
+        if (!file.read(fileMagic, MAGIC_SIZE) || memcmp(fileMagic, magic(), MAGIC_SIZE) != 0)
+            return false;
+        if (!file.read((char*)&count, sizeof(count)))
+            return false;
+
+        for (uint32_t i = 0; i < count; ++i)
+        {
+            uint64_t key = 0;
+            uint32_t size = 0;
+            Entry entry;
+            file.read((char*)&key, sizeof(key));
+            file.read((char*)&entry.format, sizeof(entry.format));
+            file.read((char*)&entry.compileMs, sizeof(entry.compileMs));
+            file.read((char*)&size, sizeof(size));
+            if (!file)
+                break;
+            entry.binary.resize(size);
+            if (!file.read(entry.binary.data(), size))
+                break;
+            entries[key] = entry;
+        }
+        return !entries.empty();
+    }
+
+    // writes the binaries this run used if any of them is new; those it did not
+    // use are dropped, which keeps the binaries of old drivers and sources out
+    bool save(const char* filename)
+    {
+        if (!isEnabled || !isChanged)
+            return true;
+
+        uint32_t count = 0;
+        for (const auto& keyEntry : entries)
+            count += keyEntry.second.isUsed ? 1 : 0;
+
+        std::ofstream file(filename, std::ios::binary);
+        if (!file)
+            return false;
+        file.write(magic(), MAGIC_SIZE);
+        file.write((const char*)&count, sizeof(count));
+        for (const auto& keyEntry : entries)
+        {
+            const Entry& entry = keyEntry.second;
+            if (!entry.isUsed)
+                continue;
+            uint32_t size = (uint32_t)entry.binary.size();
+            file.write((const char*)&keyEntry.first, sizeof(keyEntry.first));
+            file.write((const char*)&entry.format, sizeof(entry.format));
+            file.write((const char*)&entry.compileMs, sizeof(entry.compileMs));
+            file.write((const char*)&size, sizeof(size));
+            file.write(entry.binary.data(), size);
+        }
+        file.close();
+        isChanged = false;
+        return !file.fail();
+    }
+
+    // key of a program from the sources of its stages, in order, the defines they are built with and
+    // whether it is a separable program
+    uint64_t key(const char* const* sources, int count, const char* defines = "", bool isSeparable = false) const
+    {
+        uint64_t hash = hashBytes(defines, strlen(defines) + 1, driverKey);
+        for (int i = 0; i < count; ++i)
+            hash = hashBytes(sources[i], strlen(sources[i]) + 1, hash);
+        if (isSeparable)
+            hash = hashBytes("separable", 9, hash);
+        return hash;
+    }
+
+    // a linked program from the stored binary, 0 if there is none or the driver refuses it
+    GLuint restore(uint64_t key, bool isSeparable = false)
+    {
+        auto found = entries.find(key);
+        if (!isEnabled || found == entries.end())
+        {
+            missCount++;
+            return 0;
+        }
+
+        double start = now();
+        Entry& entry = found->second;
+        GLuint program = glCreateProgram();
+        if (isSeparable)
+            glProgramParameteri(program, GL_PROGRAM_SEPARABLE, GL_TRUE);
+        glProgramBinary(program, entry.format, entry.binary.data(), (GLsizei)entry.binary.size());
+
+        GLint isLinked = 0;
+        glGetProgramiv(program, GL_LINK_STATUS, &isLinked);
+        if (!isLinked)
+        {
+            // another format or a driver that changed without changing its strings
+            glDeleteProgram(program);
+            entries.erase(found);
+            isChanged = true;
+            missCount++;
+            return 0;
+        }
+
+        entry.isUsed = true;
+        hitCount++;
+        savedMs += std::max(0.0, entry.compileMs - (now() - start));
+        return program;
+    }
+
+    // call before linking a program that is to be stored
+    void prepare(GLuint program) const
+    {
+        if (isEnabled)
+            glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    }
+
+    // keeps the binary of a program linked from source, which took buildMs
+    void store(uint64_t key, GLuint program, double buildMs)
+    {
+        compileMs += buildMs;
+        if (!isEnabled)
+            return;
+
+        GLint size = 0;
+        glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &size);
+        if (size <= 0)
+            return;
+
+        Entry entry;
+        entry.binary.resize(size);
+        GLsizei written = 0;
+        glGetProgramBinary(program, size, &written, &entry.format, entry.binary.data());
+        if (written <= 0)
+            return;
+        entry.binary.resize(written);
+        entry.compileMs = buildMs;
+        entry.isUsed = true;
+        entries[key] = entry;
+        isChanged = true;
+    }
+
+    int hits() const { return hitCount; }
+    int misses() const { return missCount; }
+
+    // time spent building programs from source, and the estimate of what the hits saved
+    double compileMilliseconds() const { return compileMs; }
+    double savedMilliseconds() const { return savedMs; }
+
+private:
+    static const int MAGIC_SIZE = 8;
+    static const char* magic() { return "PGMC0001"; }
+
+    struct Entry
+    {
+        Entry() : format(0), compileMs(0.0), isUsed(false) {}
+
+        GLenum format;
+        double compileMs;
+        std::vector<char> binary;
+        bool isUsed;
+    };
+
+    std::unordered_map<uint64_t, Entry> entries;
+    bool isEnabled;
+    bool isChanged;
+    uint64_t driverKey;
+    int hitCount;
+    int missCount;
+    double compileMs;
+    double savedMs;
+
+    static double now()
+    {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+};
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef PROGRAMPIPELINE_H
+#define PROGRAMPIPELINE_H
+
+#include <GL/glew.h>
+
+#include <cstdint>
+
+// A program pipeline object of a vertex and a fragment stage that are built
+// as separable programs of their own, so that one vertex stage serves any
+// number of fragment stages without being compiled and linked with each.
+//
+// Uniforms belong to the stage programs; with the pipeline bound and no
+// program in use, glActiveShaderProgram picks the one glUniform goes to.
+class ProgramPipeline
+{
+public:
+    ProgramPipeline() : pipeline(0), vertexProgram(0), fragmentProgram(0), rebuildCount(0) {}
+
+    void destroy()
+    {
+        if (pipeline != 0)
+            glDeleteProgramPipelines(1, &pipeline);
+        pipeline = 0;
+        vertexProgram = 0;
+        fragmentProgram = 0;
+    }
+
+    // false while either stage is still building. Stages are attached again when they
+    // change, and after any rebuild, since a program built after one was deleted may
+    // get the same name (see ProgramBuilder::rebuildCount)
+    bool update(GLuint vertex, GLuint fragment, uint32_t rebuilds)
+    {
+        if (vertex == 0 || fragment == 0)
+            return false;
+        if (pipeline == 0)
+            glGenProgramPipelines(1, &pipeline);
+        if (vertex != vertexProgram || fragment != fragmentProgram || rebuilds != rebuildCount)
+        {
+            glUseProgramStages(pipeline, GL_VERTEX_SHADER_BIT, vertex);
+            glUseProgramStages(pipeline, GL_FRAGMENT_SHADER_BIT, fragment);
+            vertexProgram = vertex;
+            fragmentProgram = fragment;
+            rebuildCount = rebuilds;
+        }
+        return true;
+    }
+
+    GLuint getId() const { return pipeline; }
+    GLuint getVertexProgram() const { return vertexProgram; }
+    GLuint getFragmentProgram() const { return fragmentProgram; }
+
+private:
+    GLuint pipeline;
+    GLuint vertexProgram;
+    GLuint fragmentProgram;
+    uint32_t rebuildCount;
+};
+
+#endif
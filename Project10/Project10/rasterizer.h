@@ -0,0 +1,564 @@
+#ifndef RASTERIZER_H
+#define RASTERIZER_H
+
+#include "parallel.h"
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#define RASTERIZER_AVX
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define RASTERIZER_SSE2
+#endif
+
+
+// Vertex of a triangle list, laid out like the vertices of the GL mesh
+struct RasterVertex
+{
+    glm::vec3 position;
+    glm::vec3 normal;
+    glm::vec2 uv;
+};
+
+// RGBA8 texture sampled like GL_LINEAR with GL_REPEAT, rows from the bottom up
+// like the images uploaded to GL
+struct RasterTexture
+{
+    int width, height;
+    std::vector<uint32_t> texels;
+
+    RasterTexture() : width(0), height(0) {}
+
+    void assign(const unsigned char* pixels, int imageWidth, int imageHeight, int channels)
+    {
+        width = imageWidth;
+        height = imageHeight;
+        texels.resize((size_t)width * height);
+        for (size_t i = 0; i < texels.size(); ++i)
+        {
+            const unsigned char* p = pixels + i * channels;
+            unsigned char alpha = channels == 4 ? p[3] : 255;
+            texels[i] = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)alpha << 24);
+        }
+    }
+
+    glm::vec3 sample(const glm::vec2& uv) const
+    {
+        // texel centers are at half integers
+        float x = uv.x * width - 0.5f;
+        float y = uv.y * height - 0.5f;
+        float fx = std::floor(x), fy = std::floor(y);
+        float tx = x - fx, ty = y - fy;
+        int x0 = wrap((int)fx, width), x1 = wrap((int)fx + 1, width);
+        int y0 = wrap((int)fy, height), y1 = wrap((int)fy + 1, height);
+
+        glm::vec3 bottom = glm::mix(texel(x0, y0), texel(x1, y0), tx);
+        glm::vec3 top = glm::mix(texel(x0, y1), texel(x1, y1), tx);
+        return glm::mix(bottom, top, ty);
+    }
+
+private:
+    static int wrap(int i, int size)
+    {
+        i %= size;
+        return i < 0 ? i + size : i;
+    }
+
+    glm::vec3 texel(int x, int y) const
+    {
+        uint32_t t = texels[(size_t)y * width + x];
+        return glm::vec3(t & 0xFF, (t >> 8) & 0xFF, (t >> 16) & 0xFF) * (1.0f / 255.0f);
+    }
+};
+
+struct RasterMaterial
+{
+    float ambientStrength;
+    float specularIntensity;
+    float highlightSize;
+};
+
+// the lamp and camera of a frame, as set on the objects shader
+struct RasterLighting
+{
+    glm::vec3 lightPosition;
+    glm::vec3 lightColor;
+    glm::vec3 viewPosition;
+    glm::vec2 uvScale;
+};
+
+// one instance of a range of a triangle list
+struct RasterDraw
+{
+    const RasterVertex* vertices;
+    int first, count;
+    const RasterTexture* texture;   // none for the unlit white of the lamp
+    glm::mat4 mvp;
+    glm::mat4 model;
+    glm::mat3 normalMatrix;
+    int material;
+};
+
+
+// CPU renderer of the scene: the same triangles, textures and single light
+// Phong shading as the objects shader, without the shadows and point lights.
+//
+// Rendering is sort-middle. The triangles are transformed, clipped against
+// the near and far planes and set up in parallel ranges, and every range bins
+// its triangles into the 64x64 tiles their bounds touch. The tiles are then
+// rasterized independently, each thread taking every n-th tile so that busy
+// and empty screen regions even out. Within a tile the edge functions and the
+// depth test run 8 (AVX) or 4 (SSE2) pixels at a time into a tile local depth
+// and triangle id buffer, and every pixel is shaded once at the end with
+// perspective correct attributes. Bins are walked in submission order, so the
+// nearest triangle wins and ties go to the first one drawn, as with GL_LESS.
+//
+// Depth is 1 / w, like in the occlusion culler: linear in screen space, larger
+// is nearer. The color buffer is RGBA8 with rows from the bottom up, ready for
+// glTexSubImage2D.
+class SoftwareRasterizer
+{
+public:
+    static const int TILE_SIZE = 64;
+
+    SoftwareRasterizer() : width(0), height(0), tilesX(0), tilesY(0), threadCount(1), triangleTotal(0) {}
+
+    void resize(int newWidth, int newHeight)
+    {
+        if (newWidth == width && newHeight == height)
+            return;
+
+        width = newWidth;
+        height = newHeight;
+        tilesX = (width + TILE_SIZE - 1) / TILE_SIZE;
+        tilesY = (height + TILE_SIZE - 1) / TILE_SIZE;
+        color.assign((size_t)width * height, 0);
+        setupJobs.clear();
+    }
+
+    // threads used by render(), every one sets up a range of triangles and rasterizes a share of the tiles
+    void setThreadCount(int count)
+    {
+        threadCount = std::max(1, std::min(count, (int)MAX_JOBS));
+    }
+
+    void setMaterials(const RasterMaterial* newMaterials, int count)
+    {
+        materials.assign(newMaterials, newMaterials + count);
+    }
+
+    int getWidth() const { return width; }
+    int getHeight() const { return height; }
+
+    // starts a new frame: forgets the draws of the previous one
+    void beginFrame(const RasterLighting& frameLighting)
+    {
+        lighting = frameLighting;
+        draws.clear();
+        drawFirstTriangle.clear();
+        triangleTotal = 0;
+    }
+
+    // the vertices and texture are not copied and must stay alive until render() returns;
+    // a frame holds at most MAX_JOBS * MAX_RANGE_TRIANGLES triangles
+    void addDraw(const RasterDraw& draw)
+    {
+        draws.push_back(draw);
+        drawFirstTriangle.push_back(triangleTotal);
+        triangleTotal += draw.count / 3;
+        assert(triangleTotal <= (size_t)MAX_JOBS * MAX_RANGE_TRIANGLES);
+    }
+
+    size_t triangleCount() const
+    {
+        return triangleTotal;
+    }
+
+    void render()
+    {
+        if (width == 0 || height == 0)
+            return;
+
+        // a range per thread, more if a range would hold more triangles than the ids count
+        size_t rangeCount = std::max((size_t)1, std::min((size_t)threadCount, triangleTotal));
+        rangeCount = std::max(rangeCount, (triangleTotal + MAX_RANGE_TRIANGLES - 1) / MAX_RANGE_TRIANGLES);
+        setupJobs.resize(rangeCount);
+        for (SetupJob& job : setupJobs)
+        {
+            job.triangles.clear();
+            job.bins.resize((size_t)tilesX * tilesY);
+            for (std::vector<uint32_t>& bin : job.bins)
+                bin.clear();
+        }
+
+        // setup and binning, one contiguous triangle range per setup job
+        parallelFor(rangeCount, threadCount, [this, rangeCount](size_t begin, size_t end)
+        {
+            for (size_t j = begin; j < end; ++j)
+                setupTriangles((int)j, triangleTotal * j / rangeCount, triangleTotal * (j + 1) / rangeCount);
+        });
+
+        // rasterization and shading, every job takes every n-th tile
+        int tileCount = tilesX * tilesY;
+        int rasterJobs = std::min(threadCount, tileCount);
+        parallelFor((size_t)rasterJobs, rasterJobs, [this, rasterJobs, tileCount](size_t begin, size_t end)
+        {
+            for (size_t j = begin; j < end; ++j)
+                for (int tile = (int)j; tile < tileCount; tile += rasterJobs)
+                    renderTile(tile);
+        });
+    }
+
+    // RGBA8 pixels, width * height of them, bottom row first
+    const uint32_t* pixels() const
+    {
+        return color.data();
+    }
+
+private:
+    static const int MAX_JOBS = 256;                // job index goes to the top byte of a triangle id
+    static const uint32_t NO_TRIANGLE = 0xFFFFFFFFu;
+
+    // the index in the job goes to the low 24 bits, all ones being NO_TRIANGLE in the last
+    // job; clipping by both planes sets a triangle up as three
+    static const size_t MAX_RANGE_TRIANGLES = ((1u << 24) - 1) / 3;
+
+    // vertex after the model view projection, with the attributes the shading needs
+    struct ClipVertex
+    {
+        glm::vec4 clip;
+        glm::vec3 world;
+        glm::vec3 normal;
+        glm::vec2 uv;
+    };
+
+    // screen space triangle, e(x, y) = a * x + b * y + c per edge, positive inside
+    struct ScreenTriangle
+    {
+        float edgeA[3], edgeB[3], edgeC[3];
+        float depthA, depthB, depthC;   // plane of 1 / w
+        float invArea;
+        float invW[3];
+        glm::vec3 worldOverW[3];        // attributes divided by w interpolate linearly on screen
+        glm::vec3 normalOverW[3];
+        glm::vec2 uvOverW[3];
+        int draw;
+        int minX, maxX, minY, maxY;
+    };
+
+    // triangles set up by one job and the tiles they touch, indices into triangles
+    struct SetupJob
+    {
+        std::vector<ScreenTriangle> triangles;
+        std::vector<std::vector<uint32_t> > bins;
+    };
+
+    int width, height;
+    int tilesX, tilesY;
+    int threadCount;
+    RasterLighting lighting;
+    std::vector<RasterMaterial> materials;
+    std::vector<RasterDraw> draws;
+    std::vector<size_t> drawFirstTriangle;
+    size_t triangleTotal;
+    std::vector<SetupJob> setupJobs;
+    std::vector<uint32_t> color;
+
+    void setupTriangles(int jobIndex, size_t begin, size_t end)
+    {
+        if (begin >= end)
+            return;
+
+        // draw that holds the first triangle of the range
+        size_t d = std::upper_bound(drawFirstTriangle.begin(), drawFirstTriangle.end(), begin) - drawFirstTriangle.begin() - 1;
+
+        for (size_t t = begin; t < end; ++t)
+        {
+            while (t >= drawFirstTriangle[d] + draws[d].count / 3)
+                d++;
+
+            const RasterDraw& draw = draws[d];
+            const RasterVertex* v = draw.vertices + draw.first + (t - drawFirstTriangle[d]) * 3;
+            ClipVertex polygon[5];
+            for (int i = 0; i < 3; ++i)
+            {
+                glm::vec4 position(v[i].position, 1.0f);
+                polygon[i].clip = draw.mvp * position;
+                polygon[i].world = glm::vec3(draw.model * position);
+                polygon[i].normal = draw.normalMatrix * v[i].normal;
+                polygon[i].uv = v[i].uv;
+            }
+
+            // near plane z >= -w and far plane z <= w, as GL clips them
+            int count = clipPolygon(polygon, 3, 1.0f);
+            count = clipPolygon(polygon, count, -1.0f);
+
+            for (int i = 1; i + 1 < count; ++i)
+                setupTriangle(jobIndex, (int)d, polygon[0], polygon[i], polygon[i + 1]);
+        }
+    }
+
+    // clips a convex polygon against the plane w + side * z >= 0; a triangle grows by at most one vertex per plane
+    static int clipPolygon(ClipVertex* polygon, int count, float side)
+    {
+        bool isInside = true;
+        for (int i = 0; i < count; ++i)
+            isInside = isInside && polygon[i].clip.w + side * polygon[i].clip.z >= 0.0f;
+        if (isInside || count == 0)
+            return count;
+
+        ClipVertex input[5];
+        std::copy(polygon, polygon + count, input);
+        int output = 0;
+        for (int i = 0; i < count; ++i)
+        {
+            const ClipVertex& a = input[i];
+            const ClipVertex& b = input[(i + 1) % count];
+            float da = a.clip.w + side * a.clip.z;
+            float db = b.clip.w + side * b.clip.z;
+            if (da >= 0.0f)
+                polygon[output++] = a;
+            if ((da >= 0.0f) != (db >= 0.0f))
+            {
+                float t = da / (da - db);
+                ClipVertex& v = polygon[output++];
+                v.clip = glm::mix(a.clip, b.clip, t);
+                v.world = glm::mix(a.world, b.world, t);
+                v.normal = glm::mix(a.normal, b.normal, t);
+                v.uv = glm::mix(a.uv, b.uv, t);
+            }
+        }
+        return output;
+    }
+
+    void setupTriangle(int jobIndex, int draw, const ClipVertex& v0, const ClipVertex& v1, const ClipVertex& v2)
+    {
+        const ClipVertex* vertex[3] = { &v0, &v1, &v2 };
+        float x[3], y[3], invW[3];
+        for (int i = 0; i < 3; ++i)
+        {
+            invW[i] = 1.0f / vertex[i]->clip.w;
+            x[i] = (vertex[i]->clip.x * invW[i] * 0.5f + 0.5f) * width;
+            y[i] = (vertex[i]->clip.y * invW[i] * 0.5f + 0.5f) * height;
+        }
+
+        float area = (x[1] - x[0]) * (y[2] - y[0]) - (x[2] - x[0]) * (y[1] - y[0]);
+        if (std::fabs(area) < 1e-8f)
+            return;
+
+        // both windings are drawn, reorder to counter clockwise
+        if (area < 0.0f)
+        {
+            std::swap(x[1], x[2]);
+            std::swap(y[1], y[2]);
+            std::swap(invW[1], invW[2]);
+            std::swap(vertex[1], vertex[2]);
+            area = -area;
+        }
+
+        // pixels whose center is inside the bounds
+        ScreenTriangle triangle;
+        triangle.minX = std::max(0, (int)std::ceil(std::min(x[0], std::min(x[1], x[2])) - 0.5f));
+        triangle.maxX = std::min(width - 1, (int)std::floor(std::max(x[0], std::max(x[1], x[2])) - 0.5f));
+        triangle.minY = std::max(0, (int)std::ceil(std::min(y[0], std::min(y[1], y[2])) - 0.5f));
+        triangle.maxY = std::min(height - 1, (int)std::floor(std::max(y[0], std::max(y[1], y[2])) - 0.5f));
+        if (triangle.minX > triangle.maxX || triangle.minY > triangle.maxY)
+            return;
+
+        // edge i goes from vertex i to vertex i + 1
+        for (int i = 0; i < 3; ++i)
+        {
+            int j = (i + 1) % 3;
+            triangle.edgeA[i] = y[i] - y[j];
+            triangle.edgeB[i] = x[j] - x[i];
+            triangle.edgeC[i] = x[i] * y[j] - x[j] * y[i];
+        }
+
+        // barycentric weight of vertex i is the edge opposite to it over the area
+        triangle.invArea = 1.0f / area;
+        triangle.depthA = (triangle.edgeA[1] * invW[0] + triangle.edgeA[2] * invW[1] + triangle.edgeA[0] * invW[2]) * triangle.invArea;
+        triangle.depthB = (triangle.edgeB[1] * invW[0] + triangle.edgeB[2] * invW[1] + triangle.edgeB[0] * invW[2]) * triangle.invArea;
+        triangle.depthC = (triangle.edgeC[1] * invW[0] + triangle.edgeC[2] * invW[1] + triangle.edgeC[0] * invW[2]) * triangle.invArea;
+
+        for (int i = 0; i < 3; ++i)
+        {
+            triangle.invW[i] = invW[i];
+            triangle.worldOverW[i] = vertex[i]->world * invW[i];
+            triangle.normalOverW[i] = vertex[i]->normal * invW[i];
+            triangle.uvOverW[i] = vertex[i]->uv * invW[i];
+        }
+        triangle.draw = draw;
+
+        SetupJob& job = setupJobs[jobIndex];
+        uint32_t id = ((uint32_t)jobIndex << 24) | (uint32_t)job.triangles.size();
+        job.triangles.push_back(triangle);
+
+        for (int tileY = triangle.minY / TILE_SIZE; tileY <= triangle.maxY / TILE_SIZE; ++tileY)
+            for (int tileX = triangle.minX / TILE_SIZE; tileX <= triangle.maxX / TILE_SIZE; ++tileX)
+                job.bins[tileY * tilesX + tileX].push_back(id);
+    }
+
+    const ScreenTriangle& triangleById(uint32_t id) const
+    {
+        return setupJobs[id >> 24].triangles[id & 0xFFFFFF];
+    }
+
+    void renderTile(int tile)
+    {
+        int tileX = tile % tilesX, tileY = tile / tilesX;
+        int x0 = tileX * TILE_SIZE, y0 = tileY * TILE_SIZE;
+        int x1 = std::min(width, x0 + TILE_SIZE) - 1, y1 = std::min(height, y0 + TILE_SIZE) - 1;
+
+        // tile local depth and the nearest triangle of every pixel
+        float depth[TILE_SIZE * TILE_SIZE];
+        uint32_t ids[TILE_SIZE * TILE_SIZE];
+        std::fill(depth, depth + TILE_SIZE * TILE_SIZE, 0.0f);
+        std::fill(ids, ids + TILE_SIZE * TILE_SIZE, NO_TRIANGLE);
+
+        for (const SetupJob& job : setupJobs)
+        {
+            for (uint32_t id : job.bins[tile])
+            {
+                const ScreenTriangle& triangle = triangleById(id);
+                int minY = std::max(triangle.minY, y0), maxY = std::min(triangle.maxY, y1);
+                int minX = std::max(triangle.minX, x0), maxX = std::min(triangle.maxX, x1);
+                for (int y = minY; y <= maxY; ++y)
+                    rasterizeRow(triangle, id, y, minX, maxX, x0, &depth[(y - y0) * TILE_SIZE], &ids[(y - y0) * TILE_SIZE]);
+            }
+        }
+
+        for (int y = y0; y <= y1; ++y)
+        {
+            uint32_t* row = &color[(size_t)y * width];
+            const uint32_t* idRow = &ids[(y - y0) * TILE_SIZE];
+            for (int x = x0; x <= x1; ++x)
+            {
+                uint32_t id = idRow[x - x0];
+                row[x] = id == NO_TRIANGLE ? 0xFF000000u : shade(triangleById(id), x + 0.5f, y + 0.5f);
+            }
+        }
+    }
+
+    // depth test and write of the pixels of one tile row covered by a triangle
+    static void rasterizeRow(const ScreenTriangle& triangle, uint32_t id, int y, int minX, int maxX, int tileX0, float* depthRow, uint32_t* idRow)
+    {
+        float py = y + 0.5f;
+        float rowEdge[3];
+        for (int i = 0; i < 3; ++i)
+            rowEdge[i] = triangle.edgeB[i] * py + triangle.edgeC[i];
+        float rowDepth = triangle.depthB * py + triangle.depthC;
+
+        // whole vectors from the aligned start; the tile is a multiple of the width, so no lane leaves it
+        int x = tileX0 + ((minX - tileX0) & ~7);
+#if defined(RASTERIZER_AVX)
+        const __m256 laneOffsets = _mm256_setr_ps(0.5f, 1.5f, 2.5f, 3.5f, 4.5f, 5.5f, 6.5f, 7.5f);
+        __m256 a0 = _mm256_set1_ps(triangle.edgeA[0]), a1 = _mm256_set1_ps(triangle.edgeA[1]), a2 = _mm256_set1_ps(triangle.edgeA[2]);
+        __m256 r0 = _mm256_set1_ps(rowEdge[0]), r1 = _mm256_set1_ps(rowEdge[1]), r2 = _mm256_set1_ps(rowEdge[2]);
+        __m256 depthA = _mm256_set1_ps(triangle.depthA), depthRowPlane = _mm256_set1_ps(rowDepth);
+        __m256 triangleId = _mm256_castsi256_ps(_mm256_set1_epi32((int)id));
+        __m256 zero = _mm256_setzero_ps();
+        for (; x <= maxX; x += 8)
+        {
+            __m256 px = _mm256_add_ps(_mm256_set1_ps((float)x), laneOffsets);
+            __m256 e0 = _mm256_add_ps(_mm256_mul_ps(a0, px), r0);
+            __m256 e1 = _mm256_add_ps(_mm256_mul_ps(a1, px), r1);
+            __m256 e2 = _mm256_add_ps(_mm256_mul_ps(a2, px), r2);
+            __m256 inside = _mm256_and_ps(_mm256_cmp_ps(e0, zero, _CMP_GE_OQ),
+                _mm256_and_ps(_mm256_cmp_ps(e1, zero, _CMP_GE_OQ), _mm256_cmp_ps(e2, zero, _CMP_GE_OQ)));
+            if (_mm256_movemask_ps(inside) == 0)
+                continue;
+
+            float* d = depthRow + (x - tileX0);
+            float* i = (float*)(idRow + (x - tileX0));
+            __m256 z = _mm256_add_ps(_mm256_mul_ps(depthA, px), depthRowPlane);
+            __m256 old = _mm256_loadu_ps(d);
+            __m256 pass = _mm256_and_ps(inside, _mm256_cmp_ps(z, old, _CMP_GT_OQ));
+            _mm256_storeu_ps(d, _mm256_blendv_ps(old, z, pass));
+            _mm256_storeu_ps(i, _mm256_blendv_ps(_mm256_loadu_ps(i), triangleId, pass));
+        }
+#elif defined(RASTERIZER_SSE2)
+        const __m128 laneOffsets = _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f);
+        __m128 a0 = _mm_set1_ps(triangle.edgeA[0]), a1 = _mm_set1_ps(triangle.edgeA[1]), a2 = _mm_set1_ps(triangle.edgeA[2]);
+        __m128 r0 = _mm_set1_ps(rowEdge[0]), r1 = _mm_set1_ps(rowEdge[1]), r2 = _mm_set1_ps(rowEdge[2]);
+        __m128 depthA = _mm_set1_ps(triangle.depthA), depthRowPlane = _mm_set1_ps(rowDepth);
+        __m128 triangleId = _mm_castsi128_ps(_mm_set1_epi32((int)id));
+        __m128 zero = _mm_setzero_ps();
+        for (; x <= maxX; x += 4)
+        {
+            __m128 px = _mm_add_ps(_mm_set1_ps((float)x), laneOffsets);
+            __m128 e0 = _mm_add_ps(_mm_mul_ps(a0, px), r0);
+            __m128 e1 = _mm_add_ps(_mm_mul_ps(a1, px), r1);
+            __m128 e2 = _mm_add_ps(_mm_mul_ps(a2, px), r2);
+            __m128 inside = _mm_and_ps(_mm_cmpge_ps(e0, zero), _mm_and_ps(_mm_cmpge_ps(e1, zero), _mm_cmpge_ps(e2, zero)));
+            if (_mm_movemask_ps(inside) == 0)
+                continue;
+
+            float* d = depthRow + (x - tileX0);
+            float* i = (float*)(idRow + (x - tileX0));
+            __m128 z = _mm_add_ps(_mm_mul_ps(depthA, px), depthRowPlane);
+            __m128 old = _mm_loadu_ps(d);
+            __m128 pass = _mm_and_ps(inside, _mm_cmpgt_ps(z, old));
+            _mm_storeu_ps(d, _mm_or_ps(_mm_and_ps(pass, z), _mm_andnot_ps(pass, old)));
+            _mm_storeu_ps(i, _mm_or_ps(_mm_and_ps(pass, triangleId), _mm_andnot_ps(pass, _mm_loadu_ps(i))));
+        }
+#endif
+
+        // scalar path, and the lanes the vectors did not reach
+        for (; x <= maxX; ++x)
+        {
+            float px = x + 0.5f;
+            if (triangle.edgeA[0] * px + rowEdge[0] < 0.0f || triangle.edgeA[1] * px + rowEdge[1] < 0.0f || triangle.edgeA[2] * px + rowEdge[2] < 0.0f)
+                continue;
+
+            float z = triangle.depthA * px + rowDepth;
+            if (z > depthRow[x - tileX0])
+            {
+                depthRow[x - tileX0] = z;
+                idRow[x - tileX0] = id;
+            }
+        }
+    }
+
+    // Phong lighting of the objects fragment shader at a pixel center
+    uint32_t shade(const ScreenTriangle& triangle, float px, float py) const
+    {
+        float b0 = (triangle.edgeA[1] * px + triangle.edgeB[1] * py + triangle.edgeC[1]) * triangle.invArea;
+        float b1 = (triangle.edgeA[2] * px + triangle.edgeB[2] * py + triangle.edgeC[2]) * triangle.invArea;
+        float b2 = 1.0f - b0 - b1;
+        float w = 1.0f / (b0 * triangle.invW[0] + b1 * triangle.invW[1] + b2 * triangle.invW[2]);
+
+        const RasterDraw& draw = draws[triangle.draw];
+        if (!draw.texture)
+            return 0xFFFFFFFFu;
+
+        glm::vec3 fragmentPos = (triangle.worldOverW[0] * b0 + triangle.worldOverW[1] * b1 + triangle.worldOverW[2] * b2) * w;
+        glm::vec3 normal = (triangle.normalOverW[0] * b0 + triangle.normalOverW[1] * b1 + triangle.normalOverW[2] * b2) * w;
+        glm::vec2 uv = (triangle.uvOverW[0] * b0 + triangle.uvOverW[1] * b1 + triangle.uvOverW[2] * b2) * w;
+
+        const RasterMaterial& material = materials[std::min((size_t)draw.material, materials.size() - 1)];
+        glm::vec3 ambient = material.ambientStrength * lighting.lightColor;
+
+        glm::vec3 norm = glm::normalize(normal);
+        glm::vec3 lightDirection = glm::normalize(lighting.lightPosition - fragmentPos);
+        glm::vec3 diffuse = std::max(glm::dot(norm, lightDirection), 0.0f) * lighting.lightColor;
+
+        glm::vec3 viewDir = glm::normalize(lighting.viewPosition - fragmentPos);
+        glm::vec3 reflectDir = glm::reflect(-lightDirection, norm);
+        float specularComponent = std::pow(std::max(glm::dot(viewDir, reflectDir), 0.0f), material.highlightSize);
+        glm::vec3 specular = material.specularIntensity * specularComponent * lighting.lightColor;
+
+        glm::vec3 phong = (ambient + diffuse + specular) * draw.texture->sample(uv * lighting.uvScale);
+        phong = glm::clamp(phong, 0.0f, 1.0f) * 255.0f + 0.5f;
+        return (uint32_t)phong.r | ((uint32_t)phong.g << 8) | ((uint32_t)phong.b << 16) | 0xFF000000u;
+    }
+};
+
+#endif
@@ -0,0 +1,95 @@
+#ifndef RESOLUTION_H
+#define RESOLUTION_H
+
+#include <algorithm>
+#include <cmath>
+
+// Picks the fraction of the window resolution the scene is rendered at so
+// that the measured GPU time stays at a target. GPU time is taken to grow
+// with the pixel count, the square of the scale. To keep the scale from
+// oscillating:
+//   - the measurements are smoothed,
+//   - nothing changes while the time is within a band around the target,
+//   - each step is bounded and snapped to a grid,
+//   - after a change the controller waits until the timer results
+//     reflect it, as they arrive a few frames late,
+//   - the first frames, slowed down by shader compiles and uploads, are ignored.
+class DynamicResolution
+{
+public:
+    DynamicResolution() : targetMs(16.0), minScale(0.5f), maxScale(1.0f), scale(1.0f), smoothedMs(0.0), settleFrames(0), warmupFrames(WARMUP_FRAMES) {}
+
+    void setTargetMs(double milliseconds)
+    {
+        targetMs = std::max(0.1, milliseconds);
+    }
+
+    void setLimits(float minimum, float maximum)
+    {
+        minScale = std::max(0.1f, std::min(minimum, maximum));
+        maxScale = std::min(1.0f, std::max(minimum, maximum));
+        scale = std::min(maxScale, std::max(minScale, scale));
+    }
+
+    // feeds the GPU time of the latest measured frame; measurementDelay is how
+    // many frames late the measurements arrive
+    void update(double gpuMs, int measurementDelay)
+    {
+        // no result yet, or one of the warm-up frames
+        if (gpuMs <= 0.0)
+            return;
+        if (warmupFrames > 0)
+        {
+            warmupFrames--;
+            return;
+        }
+
+        // the first measurement seeds the average
+        smoothedMs = smoothedMs == 0.0 ? gpuMs : smoothedMs * 0.8 + gpuMs * 0.2;
+
+        if (settleFrames > 0)
+        {
+            settleFrames--;
+            return;
+        }
+
+        // hysteresis: only leave the band around the target
+        if (smoothedMs <= targetMs * 1.05 && smoothedMs >= targetMs * 0.85)
+            return;
+
+        float wanted = scale * (float)std::sqrt(targetMs / std::max(smoothedMs, 0.01));
+        wanted = std::min(scale * 1.1f, std::max(scale * 0.9f, wanted));
+        wanted = std::min(maxScale, std::max(minScale, std::round(wanted * STEPS) / STEPS));
+        if (wanted == scale)
+            return;
+
+        // the old time no longer applies, expect the change in proportion to the pixels
+        smoothedMs *= (wanted * wanted) / (scale * scale);
+        scale = wanted;
+        settleFrames = measurementDelay + 2;
+    }
+
+    float getScale() const
+    {
+        return scale;
+    }
+
+    // render target size for a window size, never below one pixel
+    int scaledSize(int size) const
+    {
+        return std::max(1, (int)(size * scale + 0.5f));
+    }
+
+private:
+    static constexpr float STEPS = 32.0f;   // scales are multiples of 1/STEPS
+    static const int WARMUP_FRAMES = 8;
+
+    double targetMs;
+    float minScale, maxScale;
+    float scale;
+    double smoothedMs;
+    int settleFrames;
+    int warmupFrames;
+};
+
+#endif
@@ -0,0 +1,222 @@
+#ifndef SHADERPREPROCESSOR_H
+#define SHADERPREPROCESSOR_H
+
+#include "hash.h"
+
+#include <cctype>
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// #include for GLSL, which drivers only have with ARB_shading_language_include.
+//
+// Sources are registered by name, and a line #include "name" in one of them
+// is replaced by the named source, itself expanded. A source goes into an
+// expansion once, where it is first included, so the sources need no guards
+// of their own and an include cycle simply ends. Every file that goes in
+// starts with a #line directive giving its number as the source string, and
+// the line after an #include gets one back to the file that included it, so
+// compile logs count the lines of the files themselves; annotate() puts the
+// file names in place of the numbers.
+//
+// Expansions are cached with the content hash of every source they took in
+// and are only expanded again once one of those changed, which is also how
+// staleSources() tells the programs a changed file affects.
+class ShaderPreprocessor
+{
+public:
+    struct Expansion
+    {
+        std::string text;
+        std::vector<std::pair<int, uint64_t>> files;    // indices and hashes of the sources taken in
+        std::string error;      // a missing include, the text then stays that of the last expansion that worked
+    };
+
+    // adds a source, or replaces the text of the one of that name
+    void setSource(const std::string& name, const std::string& text)
+    {
+        auto found = indices.find(name);
+        if (found == indices.end())
+        {
+            found = indices.emplace(name, (int)sources.size()).first;
+            sources.push_back(Source());
+            sources.back().name = name;
+        }
+        Source& source = sources[found->second];
+        source.text = text;
+        source.hash = hashBytes(text.data(), text.size());
+    }
+
+    // the source with its includes expanded; the text stays in place until the expansion changes
+    const Expansion& expand(const std::string& name)
+    {
+        Expansion& expansion = expansions[name];
+        if (isCurrent(expansion))
+            return expansion;
+
+        // a failed expansion takes in nothing, which keeps it stale until it works
+        auto found = indices.find(name);
+        std::string text;
+        std::vector<std::pair<int, uint64_t>> files;
+        expansion.error.clear();
+        expansion.files.clear();
+        if (found == indices.end())
+            expansion.error = "ERROR::SHADER::PREPROCESSOR::NO_SOURCE " + name + "\n";
+        else if (append(found->second, text, files, expansion.error))
+        {
+            expansion.text.swap(text);
+            expansion.files.swap(files);
+        }
+        return expansion;
+    }
+
+    // names of the sources that were never expanded or took in a source that changed since
+    std::vector<std::string> staleSources() const
+    {
+        std::vector<std::string> stale;
+        for (const Source& source : sources)
+        {
+            auto found = expansions.find(source.name);
+            if (found == expansions.end() || !isCurrent(found->second))
+                stale.push_back(source.name);
+        }
+        return stale;
+    }
+
+    // a compile log with file names in place of the source string numbers of the #line directives
+    std::string annotate(const std::string& log) const
+    {
+        std::string annotated;
+        size_t lineStart = 0;
+        while (lineStart < log.size())
+        {
+            size_t lineEnd = log.find('\n', lineStart);
+            lineEnd = lineEnd == std::string::npos ? log.size() : lineEnd + 1;
+            std::string line = log.substr(lineStart, lineEnd - lineStart);
+            lineStart = lineEnd;
+
+            // "2:14(5): error" (Mesa), "2(14) : error" (NVIDIA), "ERROR: 2:14:" (AMD, Intel)
+            size_t start = line.compare(0, 7, "ERROR: ") == 0 ? 7 : (line.compare(0, 9, "WARNING: ") == 0 ? 9 : 0);
+            size_t end = start;
+            while (end < line.size() && isdigit((unsigned char)line[end]))
+                end++;
+            if (end > start && end < line.size() && (line[end] == ':' || line[end] == '('))
+            {
+                // 0 is the string as given, before the first #line
+                int number = atoi(line.c_str() + start);
+                if (number > 0 && number <= (int)sources.size())
+                    line.replace(start, end - start, sources[number - 1].name);
+            }
+            annotated += line;
+        }
+        return annotated;
+    }
+
+private:
+    struct Source
+    {
+        std::string name;
+        std::string text;
+        uint64_t hash;
+    };
+
+    std::vector<Source> sources;
+    std::unordered_map<std::string, int> indices;
+    std::unordered_map<std::string, Expansion> expansions;
+
+    bool isCurrent(const Expansion& expansion) const
+    {
+        if (expansion.files.empty())
+            return false;
+        for (const auto& file : expansion.files)
+        {
+            if (sources[file.first].hash != file.second)
+                return false;
+        }
+        return true;
+    }
+
+    // source string number of a source in the #line directives
+    static std::string number(int index)
+    {
+        return std::to_string(index + 1);
+    }
+
+    // appends a source, with the ones it includes that are not in yet; false if one is missing
+    bool append(int index, std::string& text, std::vector<std::pair<int, uint64_t>>& files, std::string& error) const
+    {
+        const Source& source = sources[index];
+        bool isIncluded = !files.empty();
+        files.emplace_back(index, source.hash);
+        if (isIncluded)
+            text += "#line 1 " + number(index) + "\n";
+
+        int line = 1;
+        for (size_t lineStart = 0; lineStart < source.text.size(); ++line)
+        {
+            size_t lineEnd = source.text.find('\n', lineStart);
+            if (lineEnd == std::string::npos)
+                lineEnd = source.text.size();
+
+            std::string includedName;
+            if (!parseInclude(source.text, lineStart, lineEnd, includedName))
+            {
+                text.append(source.text, lineStart, lineEnd - lineStart);
+                text += '\n';
+
+                // #line must not come before #version, the first line of the string as given
+                if (!isIncluded && source.text.compare(lineStart, 8, "#version") == 0)
+                    text += "#line " + std::to_string(line + 1) + " " + number(index) + "\n";
+            }
+            else
+            {
+                auto found = indices.find(includedName);
+                if (found == indices.end())
+                {
+                    error = "ERROR::SHADER::PREPROCESSOR::NO_INCLUDE " + source.name + ":" + std::to_string(line) + ": " + includedName + "\n";
+                    return false;
+                }
+                bool isTaken = false;
+                for (const auto& file : files)
+                    isTaken = isTaken || file.first == found->second;
+                if (!isTaken && !append(found->second, text, files, error))
+                    return false;
+                text += "#line " + std::to_string(line + 1) + " " + number(index) + "\n";
+            }
+            lineStart = lineEnd + 1;
+        }
+        return true;
+    }
+
+    // the name of #include "name" or #include <name> on a line
+    static bool parseInclude(const std::string& text, size_t position, size_t end, std::string& name)
+    {
+        static const char directive[] = "include";
+        while (position < end && isspace((unsigned char)text[position]))
+            position++;
+        if (position >= end || text[position] != '#')
+            return false;
+        position++;
+        while (position < end && isspace((unsigned char)text[position]))
+            position++;
+        if (text.compare(position, sizeof(directive) - 1, directive) != 0)
+            return false;
+        position += sizeof(directive) - 1;
+        while (position < end && isspace((unsigned char)text[position]))
+            position++;
+        if (position >= end || (text[position] != '"' && text[position] != '<'))
+            return false;
+
+        char closing = text[position] == '"' ? '"' : '>';
+        size_t nameEnd = text.find(closing, position + 1);
+        if (nameEnd == std::string::npos || nameEnd >= end)
+            return false;
+        name = text.substr(position + 1, nameEnd - position - 1);
+        return true;
+    }
+};
+
+#endif
@@ -0,0 +1,239 @@
+#ifndef SHADOWS_H
+#define SHADOWS_H
+
+#include <GL/glew.h>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include <algorithm>
+#include <cmath>
+
+// Cascaded shadow maps for the lamp. The lamp is a point light, so every
+// cascade is a perspective projection from the lamp that just encloses the
+// bounding sphere of one slice of the camera frustum.
+//
+// Static casters are rendered into a cached map that is only redrawn when
+// its cascade changes: the lamp moved, or the camera moved far enough for the
+// snapped slice sphere to change. Dynamic casters are drawn on top of a copy
+// of the cached map, and only when they or the cached map changed, so a still
+// scene costs no shadow rendering at all.
+class CascadedShadowMaps
+{
+public:
+    static const int CASCADE_COUNT = 3;
+    static const int SIZE = 1024;
+
+    CascadedShadowMaps() : staticMap(0), compositeMap(0), framebuffer(0), renderCount(0), isRendering(false)
+    {
+        invalidate();
+    }
+
+    void setup()
+    {
+        staticMap = createMap();
+        compositeMap = createMap();
+        glGenFramebuffers(1, &framebuffer);
+        invalidate();
+    }
+
+    void destroy()
+    {
+        glDeleteTextures(1, &staticMap);
+        glDeleteTextures(1, &compositeMap);
+        glDeleteFramebuffers(1, &framebuffer);
+        staticMap = compositeMap = framebuffer = 0;
+    }
+
+    // forces every cascade to be redrawn, after static casters were added or moved
+    void invalidate()
+    {
+        for (int c = 0; c < CASCADE_COUNT; ++c)
+            cascades[c].radius = 0.0f;
+    }
+
+    // fits the cascades to the camera frustum up to shadowDistance; returns a mask of the
+    // cascades whose cached static map is out of date and has to be redrawn
+    int update(const glm::mat4& view, float fovY, float aspect, float nearDistance, float shadowDistance, const glm::vec3& lightPosition)
+    {
+        glm::mat4 inverseView = glm::inverse(view);
+        float tanHalfY = std::tan(fovY * 0.5f);
+        float tanHalfX = tanHalfY * aspect;
+
+        int dirtyMask = 0;
+        float sliceNear = nearDistance;
+        for (int c = 0; c < CASCADE_COUNT; ++c)
+        {
+            // practical split scheme: mostly logarithmic, blended with uniform
+            float t = (float)(c + 1) / CASCADE_COUNT;
+            float logarithmic = nearDistance * std::pow(shadowDistance / nearDistance, t);
+            float uniform = nearDistance + (shadowDistance - nearDistance) * t;
+            float sliceFar = 0.75f * logarithmic + 0.25f * uniform;
+            splitDepths[c] = sliceFar;
+
+            // bounding sphere of the slice corners
+            glm::vec3 corners[8];
+            glm::vec3 center(0.0f);
+            for (int i = 0; i < 8; ++i)
+            {
+                float depth = i & 4 ? sliceFar : sliceNear;
+                glm::vec4 viewCorner((i & 1 ? 1.0f : -1.0f) * tanHalfX * depth, (i & 2 ? 1.0f : -1.0f) * tanHalfY * depth, -depth, 1.0f);
+                corners[i] = glm::vec3(inverseView * viewCorner);
+                center += corners[i] / 8.0f;
+            }
+            float radius = 0.0f;
+            for (int i = 0; i < 8; ++i)
+                radius = std::max(radius, glm::length(corners[i] - center));
+
+            // quantize radius and center so that small camera moves keep the cached cascade;
+            // the margin covers the center moving by up to half a grid cell
+            float snappedRadius = std::pow(2.0f, std::ceil(std::log2(radius) * 4.0f) / 4.0f);
+            float grid = snappedRadius / 8.0f;
+            glm::vec3 snappedCenter = glm::floor(center / grid + 0.5f) * grid;
+            snappedRadius *= 1.25f;
+
+            Cascade& cascade = cascades[c];
+            if (snappedRadius != cascade.radius || snappedCenter != cascade.center || lightPosition != cascade.lightPosition)
+            {
+                cascade.radius = snappedRadius;
+                cascade.center = snappedCenter;
+                cascade.lightPosition = lightPosition;
+                cascade.viewProjection = lightViewProjection(lightPosition, snappedCenter, snappedRadius);
+                dirtyMask |= 1 << c;
+            }
+
+            sliceNear = sliceFar;
+        }
+        return dirtyMask;
+    }
+
+    // render target for the static casters of a cascade, cleared
+    void beginStatic(int cascade)
+    {
+        begin(staticMap, cascade);
+        glClear(GL_DEPTH_BUFFER_BIT);
+        renderCount++;
+    }
+
+    // copies the cached static maps into the maps the scene samples
+    void copyStatic()
+    {
+        glCopyImageSubData(staticMap, GL_TEXTURE_2D_ARRAY, 0, 0, 0, 0, compositeMap, GL_TEXTURE_2D_ARRAY, 0, 0, 0, 0, SIZE, SIZE, CASCADE_COUNT);
+    }
+
+    // render target for the dynamic casters of a cascade, on top of the static ones
+    void beginDynamic(int cascade)
+    {
+        begin(compositeMap, cascade);
+    }
+
+    // restores the framebuffer and viewport that were bound before the first begin
+    void end()
+    {
+        glDisable(GL_POLYGON_OFFSET_FILL);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        glViewport(savedViewport[0], savedViewport[1], savedViewport[2], savedViewport[3]);
+        isRendering = false;
+    }
+
+    void bindForSampling(GLuint unit) const
+    {
+        glActiveTexture(GL_TEXTURE0 + unit);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, compositeMap);
+        glActiveTexture(GL_TEXTURE0);
+    }
+
+    const glm::mat4& viewProjection(int cascade) const
+    {
+        return cascades[cascade].viewProjection;
+    }
+
+    // light clip space to shadow map texture coordinates and depth
+    glm::mat4 shadowMatrix(int cascade) const
+    {
+        glm::mat4 bias = glm::translate(glm::mat4(1.0f), glm::vec3(0.5f)) * glm::scale(glm::mat4(1.0f), glm::vec3(0.5f));
+        return bias * cascades[cascade].viewProjection;
+    }
+
+    // far end of each cascade as distance along the view direction
+    glm::vec4 splits() const
+    {
+        return glm::vec4(splitDepths[0], splitDepths[1], splitDepths[2], 0.0f);
+    }
+
+    // number of cascades redrawn since the last call
+    int takeRenderCount()
+    {
+        int count = renderCount;
+        renderCount = 0;
+        return count;
+    }
+
+private:
+    struct Cascade
+    {
+        glm::vec3 center;
+        float radius;
+        glm::vec3 lightPosition;
+        glm::mat4 viewProjection;
+    };
+
+    Cascade cascades[CASCADE_COUNT];
+    float splitDepths[CASCADE_COUNT];
+    GLuint staticMap, compositeMap;
+    GLuint framebuffer;
+    int renderCount;
+    bool isRendering;
+    GLint savedViewport[4];
+
+    static GLuint createMap()
+    {
+        GLuint texture;
+        glGenTextures(1, &texture);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, texture);
+        glTexStorage3D(GL_TEXTURE_2D_ARRAY, 1, GL_DEPTH_COMPONENT32F, SIZE, SIZE, CASCADE_COUNT);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+        return texture;
+    }
+
+    void begin(GLuint map, int cascade)
+    {
+        if (!isRendering)
+        {
+            glGetIntegerv(GL_VIEWPORT, savedViewport);
+            isRendering = true;
+        }
+
+        glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+        glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, map, 0, cascade);
+        glDrawBuffer(GL_NONE);
+        glViewport(0, 0, SIZE, SIZE);
+
+        // slope scaled bias against shadow acne
+        glEnable(GL_POLYGON_OFFSET_FILL);
+        glPolygonOffset(2.0f, 4.0f);
+    }
+
+    // perspective projection from the light that just encloses the sphere
+    static glm::mat4 lightViewProjection(const glm::vec3& lightPosition, const glm::vec3& center, float radius)
+    {
+        glm::vec3 toCenter = center - lightPosition;
+        float distance = glm::length(toCenter);
+
+        // with the light inside the sphere a wide cone is the best there is
+        float fov = distance > radius * 1.02f ? 2.0f * std::asin(radius / distance) : glm::radians(160.0f);
+        glm::vec3 up = std::fabs(toCenter.y) > 0.99f * distance ? glm::vec3(1.0f, 0.0f, 0.0f) : glm::vec3(0.0f, 1.0f, 0.0f);
+
+        glm::mat4 lightView = glm::lookAt(lightPosition, center, up);
+        glm::mat4 lightProjection = glm::perspective(fov, 1.0f, 0.05f, distance + radius);
+        return lightProjection * lightView;
+    }
+};
+
+#endif